@@ -0,0 +1,848 @@
+/*++
+
+Description:
+
+    This module implements batch mode, which encrypts many input files to
+    many output files in one process. The pairs come from a manifest, or
+    from the command line after "--". The key is read and expanded once, and
+    one pool of N threads works through every file.
+
+    Each file is encrypted as a stream of its own, starting at stream offset
+    zero, or at --offset if one is given. Files are cut into blocks, and a
+    thread claims the first unclaimed block of the earliest file that has
+    one, so a large file is spread over every free thread, while small files,
+    which are only a block or two, each go to a different thread and run
+    side by side. Blocks are read with pread() and written with pwrite(), so
+    blocks of the same file complete in any order with no reordering.
+
+    Opening and closing files is done by the thread that finds them next in
+    line, outside the batch lock, so other threads carry on with blocks in
+    the meantime.
+
+    A failure only fails its own file. The error is reported on stderr with
+    the file's name, the partial output is removed, and the rest of the batch
+    carries on. The process exits non-zero if any file failed.
+
+    Inputs must be regular files. Outputs are created or truncated, and must
+    be seekable.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "homework.h"
+
+typedef enum _BATCH_STATE {
+    BATCH_PENDING,
+    BATCH_OPENING,
+    BATCH_OPEN,
+    BATCH_CLOSED
+} BATCH_STATE;
+
+typedef struct _BATCH_FILE {
+    char const * InputName;
+    char const * OutputName;
+    int InputFd;
+    int OutputFd;
+    uint64_t Length;
+    uint64_t NextOffset;
+    uint64_t Outstanding;
+    int Error;
+    char const * Failure;
+    int RemoveOnFailure;
+    BATCH_STATE State;
+    DIGEST * Digest;
+} BATCH_FILE;
+
+typedef struct _BATCH {
+    pthread_mutex_t Lock;
+    pthread_cond_t Opened;
+    BATCH_FILE * Files;
+    size_t FileCount;
+    size_t Cursor;
+    size_t Failures;
+    WORKER_CONTEXT * WorkerContext;
+    _Atomic int NextWorker;
+} BATCH;
+
+typedef enum _BATCH_CLAIM {
+    CLAIM_NONE,
+    CLAIM_OPEN,
+    CLAIM_BLOCK
+} BATCH_CLAIM;
+
+static
+int
+ReadManifest(
+    char const * FileName,
+    BATCH * Batch
+    )
+
+/*++
+
+Description:
+
+    This routine reads a manifest of input and output file names, one pair
+    per line. The names are separated by a tab, or if the line has no tab,
+    by spaces. Blank lines and lines starting with '#' are skipped.
+
+Arguments:
+
+    FileName - Supplies the manifest file name, or "-" for stdin.
+
+    Batch - Supplies the batch, whose file list is extended.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the manifest can't be read or
+    has a line without two names.
+
+--*/
+
+{
+
+    size_t Capacity;
+    char * Input;
+    size_t Length;
+    char * Line;
+    size_t LineCapacity;
+    unsigned long LineNumber;
+    char * Output;
+    int Result;
+    FILE * Stream;
+
+    Stream = stdin;
+    if (strcmp(FileName, "-") != 0) {
+        Stream = fopen(FileName, "r");
+        if (Stream == NULL) {
+            fprintf(stderr,
+                    "Cannot open manifest %s: %s\n",
+                    FileName,
+                    strerror(errno));
+
+            return 1;
+        }
+    }
+
+    Capacity = Batch->FileCount;
+    Line = NULL;
+    LineCapacity = 0;
+    LineNumber = 0;
+    Result = 0;
+    while (getline(&Line, &LineCapacity, Stream) >= 0) {
+        LineNumber += 1;
+        Length = strcspn(Line, "\r\n");
+        Line[Length] = '\0';
+        if ((Line[0] == '\0') || (Line[0] == '#')) {
+            continue;
+        }
+
+        Input = Line;
+        Output = strchr(Line, '\t');
+        if (Output == NULL) {
+            Output = strchr(Line, ' ');
+        }
+
+        if (Output != NULL) {
+            *Output = '\0';
+            Output += 1;
+            Output += strspn(Output, " \t");
+        }
+
+        if ((Output == NULL) || (*Input == '\0') || (*Output == '\0')) {
+            fprintf(stderr,
+                    "Manifest line %lu doesn't name an input and an "
+                    "output\n",
+                    LineNumber);
+
+            Result = 1;
+            break;
+        }
+
+        if (Batch->FileCount == Capacity) {
+            Capacity = (Capacity == 0) ? 64 : Capacity * 2;
+            Batch->Files = realloc(Batch->Files,
+                                   Capacity * sizeof(BATCH_FILE));
+
+            if (Batch->Files == NULL) {
+                ErrorExit(errno, "Failure allocating the batch\n");
+            }
+        }
+
+        memset(&Batch->Files[Batch->FileCount], 0, sizeof(BATCH_FILE));
+        Batch->Files[Batch->FileCount].InputName = strdup(Input);
+        Batch->Files[Batch->FileCount].OutputName = strdup(Output);
+        if ((Batch->Files[Batch->FileCount].InputName == NULL) ||
+            (Batch->Files[Batch->FileCount].OutputName == NULL)) {
+
+            ErrorExit(errno, "Failure allocating the batch\n");
+        }
+
+        Batch->FileCount += 1;
+    }
+
+    if (ferror(Stream)) {
+        fprintf(stderr, "Failure reading manifest %s\n", FileName);
+        Result = 1;
+    }
+
+    free(Line);
+    if (Stream != stdin) {
+        fclose(Stream);
+    }
+
+    return Result;
+}
+
+static
+void
+FailBatchFile(
+    BATCH_FILE * File,
+    int Error,
+    char const * Failure
+    )
+
+/*++
+
+Description:
+
+    This routine records a file's first failure. The caller holds the batch
+    lock, or is the only thread that can see the file.
+
+Arguments:
+
+    File - Supplies the file.
+
+    Error - Supplies the error number.
+
+    Failure - Supplies a description of what failed.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if (File->Error == 0) {
+        File->Error = Error;
+        File->Failure = Failure;
+    }
+}
+
+static
+void
+OpenBatchFile(
+    BATCH * Batch,
+    BATCH_FILE * File
+    )
+
+/*++
+
+Description:
+
+    This routine opens a file's input and output, and sizes the output to
+    match the range to be encrypted. It runs outside the batch lock, on the
+    one thread that claimed the opening. Failures are recorded in the file.
+
+Arguments:
+
+    Batch - Supplies the batch.
+
+    File - Supplies the file to open.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    struct stat InputStats;
+    OPTIONS const * Options;
+    struct stat OutputStats;
+
+    Options = Batch->WorkerContext->Options;
+    File->OutputFd = -1;
+    File->InputFd = open(File->InputName, O_RDONLY);
+    if (File->InputFd < 0) {
+        FailBatchFile(File, errno, "cannot open input");
+        return;
+    }
+
+    if (fstat(File->InputFd, &InputStats) != 0) {
+        FailBatchFile(File, errno, "cannot read input");
+        return;
+    }
+
+    if (!S_ISREG(InputStats.st_mode)) {
+        FailBatchFile(File, EINVAL, "input isn't a regular file");
+        return;
+    }
+
+    //
+    // Look at the output before truncating it, so that an output that is the
+    // input itself isn't destroyed.
+    //
+
+    File->OutputFd = open(File->OutputName, O_WRONLY | O_CREAT, 0666);
+    if (File->OutputFd < 0) {
+        FailBatchFile(File, errno, "cannot open output");
+        return;
+    }
+
+    if (fstat(File->OutputFd, &OutputStats) != 0) {
+        FailBatchFile(File, errno, "cannot read output");
+        return;
+    }
+
+    if ((InputStats.st_dev == OutputStats.st_dev) &&
+        (InputStats.st_ino == OutputStats.st_ino)) {
+
+        close(File->OutputFd);
+        File->OutputFd = -1;
+        FailBatchFile(File, EINVAL, "output is the input; use -i");
+        return;
+    }
+
+    //
+    // The range starts at --offset in every file, and runs to the end of the
+    // file or for --length bytes.
+    //
+
+    File->Length = 0;
+    if ((uint64_t)InputStats.st_size > Options->RangeOffset) {
+        File->Length = InputStats.st_size - Options->RangeOffset;
+    }
+
+    if (File->Length > Options->RangeLength) {
+        File->Length = Options->RangeLength;
+    }
+
+    //
+    // Sizing a regular output up front lets blocks land in any order without
+    // extending the file each time.
+    //
+
+    if (S_ISREG(OutputStats.st_mode)) {
+        File->RemoveOnFailure = 1;
+        if (ftruncate(File->OutputFd, File->Length) != 0) {
+            FailBatchFile(File, errno, "cannot size output");
+            return;
+        }
+    }
+}
+
+static
+void
+CloseBatchFile(
+    BATCH * Batch,
+    BATCH_FILE * File
+    )
+
+/*++
+
+Description:
+
+    This routine closes a file once its last block is done, and reports it if
+    it failed. It runs outside the batch lock, on the thread that finished
+    the file.
+
+Arguments:
+
+    Batch - Supplies the batch.
+
+    File - Supplies the file.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if ((File->OutputFd >= 0) && (close(File->OutputFd) != 0)) {
+        FailBatchFile(File, errno, "cannot close output");
+    }
+
+    if (File->InputFd >= 0) {
+        close(File->InputFd);
+    }
+
+    if (File->Error == 0) {
+        return;
+    }
+
+    //
+    // Don't leave a partial output file behind to be mistaken for a whole
+    // one.
+    //
+
+    if (File->RemoveOnFailure != 0) {
+        unlink(File->OutputName);
+    }
+
+    fprintf(stderr,
+            "%s: %s: %s\n",
+            File->InputName,
+            File->Failure,
+            strerror(File->Error));
+
+    pthread_mutex_lock(&Batch->Lock);
+    Batch->Failures += 1;
+    pthread_mutex_unlock(&Batch->Lock);
+}
+
+static
+int
+IsBatchFileClaimed(
+    BATCH_FILE const * File
+    )
+
+/*++
+
+Description:
+
+    This routine determines whether a file has nothing left to claim.
+
+Arguments:
+
+    File - Supplies the file.
+
+Return Value:
+
+    Returns non-zero if every block of the file is claimed, or the file has
+    failed or been closed.
+
+--*/
+
+{
+
+    if (File->State == BATCH_CLOSED) {
+        return 1;
+    }
+
+    if (File->State != BATCH_OPEN) {
+        return 0;
+    }
+
+    return (File->Error != 0) || (File->NextOffset >= File->Length);
+}
+
+static
+BATCH_CLAIM
+ClaimBatchWork(
+    BATCH * Batch,
+    BATCH_FILE ** File,
+    uint64_t * Offset
+    )
+
+/*++
+
+Description:
+
+    This routine finds the calling thread's next piece of work: the first
+    unclaimed block of the earliest file that has one, or else the opening
+    of the next file not yet opened. If other threads are still opening the
+    only files left, it waits for them. The caller holds the batch lock.
+
+Arguments:
+
+    Batch - Supplies the batch.
+
+    File - Supplies a pointer to memory that receives the file to work on.
+
+    Offset - Supplies a pointer to memory that receives the offset of the
+        claimed block within the range.
+
+Return Value:
+
+    Returns CLAIM_BLOCK for a block, CLAIM_OPEN for a file to open, or
+    CLAIM_NONE once the whole batch is claimed.
+
+--*/
+
+{
+
+    BATCH_FILE * Candidate;
+    size_t Index;
+    int Opening;
+
+    for (;;) {
+        while ((Batch->Cursor < Batch->FileCount) &&
+               (IsBatchFileClaimed(&Batch->Files[Batch->Cursor]) != 0)) {
+
+            Batch->Cursor += 1;
+        }
+
+        Opening = 0;
+        for (Index = Batch->Cursor; Index < Batch->FileCount; ++Index) {
+            Candidate = &Batch->Files[Index];
+            if (Candidate->State == BATCH_PENDING) {
+                Candidate->State = BATCH_OPENING;
+                *File = Candidate;
+                return CLAIM_OPEN;
+            }
+
+            if (Candidate->State == BATCH_OPENING) {
+                Opening = 1;
+                continue;
+            }
+
+            if (IsBatchFileClaimed(Candidate) == 0) {
+                *File = Candidate;
+                *Offset = Candidate->NextOffset;
+                Candidate->NextOffset +=
+                    Batch->WorkerContext->Options->BlockSize;
+
+                Candidate->Outstanding += 1;
+                return CLAIM_BLOCK;
+            }
+        }
+
+        if (Opening == 0) {
+            return CLAIM_NONE;
+        }
+
+        pthread_cond_wait(&Batch->Opened, &Batch->Lock);
+    }
+}
+
+static
+int
+EncryptBatchBlock(
+    BATCH * Batch,
+    BATCH_FILE * File,
+    uint64_t Offset,
+    byte * Buffer,
+    KEY_TABLE const * KeyTable
+    )
+
+/*++
+
+Description:
+
+    This routine reads, encrypts, and writes one block of a file.
+
+Arguments:
+
+    Batch - Supplies the batch.
+
+    File - Supplies the file.
+
+    Offset - Supplies the offset of the block within the file's range.
+
+    Buffer - Supplies the calling thread's block buffer.
+
+    KeyTable - Supplies the key table to encrypt with.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the file failed. The failure
+    is recorded in the file.
+
+--*/
+
+{
+
+    size_t BytesRead;
+    OPTIONS const * Options;
+    uint64_t ReadTime;
+    int Result;
+    uint64_t Start;
+    size_t Wanted;
+
+    Options = Batch->WorkerContext->Options;
+    Wanted = Options->BlockSize;
+    if (Wanted > File->Length - Offset) {
+        Wanted = File->Length - Offset;
+    }
+
+    ReadTime = StartStatsTimer();
+    Result = ReadPositioned(File->InputFd,
+                            Buffer,
+                            Wanted,
+                            Options->RangeOffset + Offset,
+                            &BytesRead);
+
+    StopStatsTimer(STAT_READ, ReadTime);
+    if ((Result == 0) && (BytesRead < Wanted)) {
+        Result = ENODATA;
+    }
+
+    if (Result != 0) {
+        pthread_mutex_lock(&Batch->Lock);
+        FailBatchFile(File, Result, "cannot read input");
+        pthread_mutex_unlock(&Batch->Lock);
+        return 1;
+    }
+
+    Start = StartStatsTimer();
+    if (EncryptAndDigest(File->Digest,
+                         Buffer,
+                         Buffer,
+                         BytesRead,
+                         Options->RangeOffset + Offset,
+                         KeyTable) != 0) {
+
+        exit(1);
+    }
+
+    StopStatsTimer(STAT_ENCRYPT, Start);
+    Start = StartStatsTimer();
+    Result = WritePositioned(File->OutputFd, Buffer, BytesRead, Offset);
+    StopStatsTimer(STAT_WRITE, Start);
+    if (Result != 0) {
+        pthread_mutex_lock(&Batch->Lock);
+        FailBatchFile(File, Result, "cannot write output");
+        pthread_mutex_unlock(&Batch->Lock);
+        return 1;
+    }
+
+    RecordStatsLatency(ReadTime, StartStatsTimer());
+    CountStat(STAT_BLOCKS, 1);
+    CountStat(STAT_BYTES, BytesRead);
+    return 0;
+}
+
+static
+void *
+BatchWorkerRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine is one thread of the batch's pool. It opens files, encrypts
+    blocks, and closes files, whichever comes next, until the batch is done.
+
+Arguments:
+
+    Context - Supplies the batch.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    BATCH * Batch;
+    byte * Buffer;
+    BATCH_CLAIM Claim;
+    BATCH_FILE * File;
+    KEY_TABLE const * KeyTable;
+    uint64_t Offset;
+    int Worker;
+
+    Batch = (BATCH *)Context;
+    Worker = atomic_fetch_add(&Batch->NextWorker, 1);
+    KeyTable = PlaceWorkerThread(Batch->WorkerContext, Worker);
+    AttachStatsThread("batch", Worker);
+    Buffer = TakePoolBuffer(Batch->WorkerContext->BufferPool);
+
+    pthread_mutex_lock(&Batch->Lock);
+    for (;;) {
+        Claim = ClaimBatchWork(Batch, &File, &Offset);
+        if (Claim == CLAIM_NONE) {
+            break;
+        }
+
+        pthread_mutex_unlock(&Batch->Lock);
+        if (Claim == CLAIM_OPEN) {
+            OpenBatchFile(Batch, File);
+            pthread_mutex_lock(&Batch->Lock);
+            File->State = BATCH_OPEN;
+            pthread_cond_broadcast(&Batch->Opened);
+
+        } else {
+            EncryptBatchBlock(Batch, File, Offset, Buffer, KeyTable);
+            pthread_mutex_lock(&Batch->Lock);
+            File->Outstanding -= 1;
+        }
+
+        //
+        // Whoever leaves a file with nothing claimed and nothing outstanding
+        // closes it.
+        //
+
+        if ((File->Outstanding == 0) && (IsBatchFileClaimed(File) != 0)) {
+            File->State = BATCH_CLOSED;
+            pthread_mutex_unlock(&Batch->Lock);
+            CloseBatchFile(Batch, File);
+            pthread_mutex_lock(&Batch->Lock);
+        }
+    }
+
+    pthread_mutex_unlock(&Batch->Lock);
+    DetachStatsThread();
+    ReturnPoolBuffer(Batch->WorkerContext->BufferPool, Buffer);
+    return NULL;
+}
+
+int
+RunBatch(
+    WORKER_CONTEXT * WorkerContext
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts every file of the batch named by the options, on a
+    pool of N threads including the calling thread.
+
+Arguments:
+
+    WorkerContext - Supplies the context holding the options and key.
+
+Return Value:
+
+    Returns zero (0) if every file was encrypted, or non-zero if the manifest
+    couldn't be read or any file failed.
+
+--*/
+
+{
+
+    BATCH Batch;
+    size_t BufferCount;
+    DIGEST * Digests;
+    size_t FileIndex;
+    int Index;
+    OPTIONS const * Options;
+    int Result;
+    pthread_t * WorkerThreads;
+
+    Options = WorkerContext->Options;
+    BufferCount = Options->ThreadCount;
+    if (PrepareBufferPool(WorkerContext->BufferPool,
+                          Options->BlockSize,
+                          &BufferCount,
+                          BufferCount) != 0) {
+
+        return 1;
+    }
+
+    memset(&Batch, 0, sizeof(Batch));
+    Batch.WorkerContext = WorkerContext;
+    atomic_init(&Batch.NextWorker, 0);
+    if ((Options->ManifestFileName != NULL) &&
+        (ReadManifest(Options->ManifestFileName, &Batch) != 0)) {
+
+        free(Batch.Files);
+        return 1;
+    }
+
+    Batch.Files = realloc(Batch.Files,
+                          (Batch.FileCount + Options->BatchPairCount + 1) *
+                          sizeof(BATCH_FILE));
+
+    if (Batch.Files == NULL) {
+        ErrorExit(errno, "Failure allocating the batch\n");
+    }
+
+    for (Index = 0; Index < Options->BatchPairCount; ++Index) {
+        memset(&Batch.Files[Batch.FileCount], 0, sizeof(BATCH_FILE));
+        Batch.Files[Batch.FileCount].InputName =
+            strdup(Options->BatchNames[2 * Index]);
+
+        Batch.Files[Batch.FileCount].OutputName =
+            strdup(Options->BatchNames[(2 * Index) + 1]);
+
+        if ((Batch.Files[Batch.FileCount].InputName == NULL) ||
+            (Batch.Files[Batch.FileCount].OutputName == NULL)) {
+
+            ErrorExit(errno, "Failure allocating the batch\n");
+        }
+
+        Batch.FileCount += 1;
+    }
+
+    //
+    // Each file gets its own digest, reported in the order of the batch.
+    //
+
+    Digests = NULL;
+    if (WorkerContext->Digest != NULL) {
+        Digests = calloc(Batch.FileCount + 1, sizeof(DIGEST));
+        if (Digests == NULL) {
+            ErrorExit(errno, "Failure allocating the batch\n");
+        }
+
+        for (FileIndex = 0; FileIndex < Batch.FileCount; ++FileIndex) {
+            InitializeDigest(&Digests[FileIndex],
+                             WorkerContext->Digest->Table,
+                             Options->RangeOffset,
+                             DIGEST_STREAM,
+                             0);
+
+            Batch.Files[FileIndex].Digest = &Digests[FileIndex];
+        }
+    }
+
+    pthread_mutex_init(&Batch.Lock, NULL);
+    pthread_cond_init(&Batch.Opened, NULL);
+    WorkerThreads = calloc(Options->ThreadCount, sizeof(pthread_t));
+    if (WorkerThreads == NULL) {
+        ErrorExit(errno, "Failure allocating thread array.\n");
+    }
+
+    for (Index = 1; Index < Options->ThreadCount; ++Index) {
+        Result = pthread_create(&WorkerThreads[Index],
+                                NULL,
+                                BatchWorkerRoutine,
+                                &Batch);
+
+        if (Result != 0) {
+            ErrorExit(Result, "Failed creating thread\n");
+        }
+    }
+
+    BatchWorkerRoutine(&Batch);
+    for (Index = 1; Index < Options->ThreadCount; ++Index) {
+        pthread_join(WorkerThreads[Index], NULL);
+    }
+
+    if (Batch.Failures != 0) {
+        fprintf(stderr,
+                "%zu of %zu files failed\n",
+                Batch.Failures,
+                Batch.FileCount);
+    }
+
+    for (FileIndex = 0; FileIndex < Batch.FileCount; ++FileIndex) {
+        if ((Digests != NULL) && (Batch.Files[FileIndex].Error == 0)) {
+            ReportDigest(WorkerContext->DigestStream,
+                         &Digests[FileIndex],
+                         Batch.Files[FileIndex].InputName,
+                         Batch.Files[FileIndex].OutputName);
+        }
+
+        free((char *)Batch.Files[FileIndex].InputName);
+        free((char *)Batch.Files[FileIndex].OutputName);
+    }
+
+    free(WorkerThreads);
+    free(Digests);
+    free(Batch.Files);
+    pthread_mutex_destroy(&Batch.Lock);
+    pthread_cond_destroy(&Batch.Opened);
+    return Batch.Failures != 0;
+}
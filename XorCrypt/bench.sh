@@ -0,0 +1,278 @@
+#!/bin/bash
+#
+# bench.sh - End-to-end XorCrypt benchmark suite, run by "make bench".
+#
+# Generates random inputs and keys, then runs XorCryptRef and XorCrypt over a
+# matrix of input sources, outputs, input sizes, key sizes, engines, thread
+# counts, and block sizes. Every run's output is checked against the
+# reference implementation's by checksum, and marked verified "yes" or "no"
+# (or "reference" for the reference run itself). Engines that can't run with
+# a source or output, such as mmap on a pipe or splice to a file, are not
+# run, and are marked "skipped". Each run is measured by BenchRun, and
+# written as a line of bench.csv:
+#
+#   tool,engine,source,output,size,key,threads,block,bytes,wall_s,mb_s,
+#   user_s,sys_s,cpu_s,voluntary_cs,involuntary_cs,verified
+#
+# The output is written to a file directly, or through a pipe into one.
+# A summary of the fastest configuration for each input and output follows
+# on stdout.
+#
+# The matrix is set by these environment variables, shown with defaults:
+#
+#   BENCH_DIR       ${TMPDIR:-/tmp}/xorcrypt-bench   (inputs and results)
+#   BENCH_SIZES     "1M 64M 1G"     (add 10G for the large case)
+#   BENCH_KEYS      "1 13 4K 1M"
+#   BENCH_SOURCES   "file pipe zero"
+#   BENCH_OUTPUTS   "file pipe"
+#   BENCH_ENGINES   "auto stream pipeline mmap pread uring splice"
+#   BENCH_THREADS   "1 4"
+#   BENCH_BLOCKS    "64K 1M"
+#
+# Sizes take the suffixes understood by both head -c and XorCrypt -b.
+#
+
+set -u
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+XORCRYPT=$HERE/XorCrypt
+REFERENCE=$HERE/XorCryptRef
+BENCHRUN=$HERE/BenchRun
+
+BENCH_DIR=${BENCH_DIR:-${TMPDIR:-/tmp}/xorcrypt-bench}
+BENCH_SIZES=${BENCH_SIZES:-"1M 64M 1G"}
+BENCH_KEYS=${BENCH_KEYS:-"1 13 4K 1M"}
+BENCH_SOURCES=${BENCH_SOURCES:-"file pipe zero"}
+BENCH_OUTPUTS=${BENCH_OUTPUTS:-"file pipe"}
+BENCH_ENGINES=${BENCH_ENGINES:-"auto stream pipeline mmap pread uring splice"}
+BENCH_THREADS=${BENCH_THREADS:-"1 4"}
+BENCH_BLOCKS=${BENCH_BLOCKS:-"64K 1M"}
+
+CSV=$BENCH_DIR/bench.csv
+OUTPUT=$BENCH_DIR/output.bin
+
+mkdir -p "$BENCH_DIR" || exit 1
+
+#
+# Generate each input and key once. Inputs are kept between runs of the
+# suite, since the large ones take a while to make.
+#
+
+for Size in $BENCH_SIZES; do
+    if [ ! -f "$BENCH_DIR/input.$Size" ]; then
+        echo "Generating $Size input" >&2
+        head -c "$Size" /dev/urandom > "$BENCH_DIR/input.$Size" || exit 1
+    fi
+done
+
+for Key in $BENCH_KEYS; do
+    if [ ! -f "$BENCH_DIR/key.$Key" ]; then
+        head -c "$Key" /dev/urandom > "$BENCH_DIR/key.$Key" || exit 1
+    fi
+done
+
+#
+# Applies succeeds if an engine can run with a source and output. The mmap
+# engine needs regular files, the pread engine seekable streams, and the
+# splice engine a pipe for its output. The others run with anything.
+#
+# Applies <engine> <source> <output>
+#
+
+Applies() {
+    case $1 in
+    mmap)
+        [ "$2" = file ] && [ "$3" = file ]
+        ;;
+
+    pread)
+        [ "$2" != pipe ] && [ "$3" = file ]
+        ;;
+
+    splice)
+        [ "$3" = pipe ]
+        ;;
+
+    *)
+        true
+        ;;
+    esac
+}
+
+#
+# Run runs BenchRun with the output file as the command's output, or with
+# a pipe into it, and waits for the pipe to drain.
+#
+# Run <output> <input> <command...>
+#
+
+Run() {
+    local Output=$1 Input=$2
+    shift 2
+
+    if [ "$Output" = pipe ]; then
+        "$BENCHRUN" "$Input" >(cat > "$OUTPUT") "$@"
+        wait $!
+    else
+        "$BENCHRUN" "$Input" "$OUTPUT" "$@"
+    fi
+}
+
+#
+# Measure runs one command over an input source and output, appending its
+# line to the CSV. The checksum of its output is left in $Checksum.
+#
+# Measure <tool> <engine> <source> <output> <size> <key> <threads> <block>
+#     <command...>
+#
+
+Measure() {
+    local Tool=$1 Engine=$2 Source=$3 Output=$4 Size=$5 Key=$6 Threads=$7
+    local Block=$8
+    local Bytes Result Wall MegabytesPerSecond User System Cpu
+    local Voluntary Involuntary Status
+    shift 8
+
+    Bytes=$(stat -c %s "$BENCH_DIR/input.$Size")
+    if ! Applies "$Engine" "$Source" "$Output"; then
+        printf '%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,,,,,,,skipped\n' \
+            "$Tool" "$Engine" "$Source" "$Output" "$Size" "$Key" \
+            "$Threads" "$Block" "$Bytes" >> "$CSV"
+
+        return
+    fi
+
+    case $Source in
+    file)
+        Result=$(Run "$Output" "$BENCH_DIR/input.$Size" "$@")
+        ;;
+
+    pipe)
+        Result=$(cat "$BENCH_DIR/input.$Size" | Run "$Output" - "$@")
+        ;;
+
+    zero)
+        Result=$(Run "$Output" /dev/zero "$@" --length "$Bytes")
+        ;;
+    esac
+
+    IFS=, read -r Wall User System Voluntary Involuntary Status <<< "$Result"
+    Checksum=$(cksum < "$OUTPUT" | cut -d' ' -f1,2)
+    if [ "$Status" != 0 ]; then
+        Checksum="exit $Status"
+    fi
+
+    if [ -z "$Expected" ]; then
+        Verified=reference
+    elif [ "$Checksum" = "$Expected" ]; then
+        Verified=yes
+    else
+        Verified=no
+    fi
+
+    MegabytesPerSecond=$(awk -v B="$Bytes" -v W="$Wall" \
+                         'BEGIN { printf "%.1f", (W > 0) ? B / W / 1e6 : 0 }')
+
+    Cpu=$(awk -v U="$User" -v S="$System" 'BEGIN { printf "%.6f", U + S }')
+    printf '%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n' \
+        "$Tool" "$Engine" "$Source" "$Output" "$Size" "$Key" "$Threads" \
+        "$Block" "$Bytes" "$Wall" "$MegabytesPerSecond" "$User" "$System" \
+        "$Cpu" "$Voluntary" "$Involuntary" "$Verified" >> "$CSV"
+
+    if [ "$Verified" = no ]; then
+        echo "MISMATCH: $Tool -e $Engine $Source to $Output $Size key $Key" \
+             "-n $Threads -b $Block" >&2
+
+        Failures=$((Failures + 1))
+    fi
+}
+
+Header=tool,engine,source,output,size,key,threads,block,bytes,wall_s,mb_s
+Header=$Header,user_s,sys_s,cpu_s,voluntary_cs,involuntary_cs,verified
+echo "$Header" > "$CSV"
+
+Failures=0
+for Source in $BENCH_SOURCES; do
+    for Output in $BENCH_OUTPUTS; do
+        for Size in $BENCH_SIZES; do
+            for Key in $BENCH_KEYS; do
+                KeyFile=$BENCH_DIR/key.$Key
+                echo "Running $Source to $Output $Size key $Key" >&2
+
+                #
+                # The reference run sets the expected output for the rest.
+                #
+
+                Expected=
+                Measure XorCryptRef - "$Source" "$Output" "$Size" "$Key" \
+                    1 - "$REFERENCE" -k "$KeyFile" -n 1
+
+                Expected=$Checksum
+                for Engine in $BENCH_ENGINES; do
+                    for Threads in $BENCH_THREADS; do
+                        for Block in $BENCH_BLOCKS; do
+                            Measure XorCrypt "$Engine" "$Source" "$Output" \
+                                "$Size" "$Key" "$Threads" "$Block" \
+                                "$XORCRYPT" -k "$KeyFile" -n "$Threads" \
+                                -e "$Engine" -b "$Block"
+                        done
+                    done
+                done
+            done
+        done
+    done
+done
+
+rm -f "$OUTPUT"
+
+#
+# Summarize the fastest XorCrypt configuration for each input and output
+# against the reference.
+#
+
+echo
+echo "Results: $CSV"
+echo
+awk -F, '
+    NR == 1 { next }
+    {
+        Input = $3 "," $4 "," $5 "," $6
+        if (!(Input in Seen)) {
+            Seen[Input] = 1
+            Order[++Count] = Input
+        }
+
+        if ($1 == "XorCryptRef") {
+            Reference[Input] = $11
+        } else if ($17 == "yes" && $11 > Best[Input]) {
+            Best[Input] = $11
+            Config[Input] = "-e " $2 " -n " $7 " -b " $8
+            Cpu[Input] = $14
+        }
+    }
+
+    END {
+        printf "%-6s %-6s %-6s %-6s %10s %10s %8s  %s\n",
+               "source", "output", "size", "key", "ref MB/s", "best MB/s",
+               "speedup", "configuration (cpu s)"
+
+        for (Index = 1; Index <= Count; ++Index) {
+            Input = Order[Index]
+            split(Input, Field, ",")
+            Speedup = 0
+            if (Reference[Input] > 0) {
+                Speedup = Best[Input] / Reference[Input]
+            }
+
+            printf "%-6s %-6s %-6s %-6s %10.1f %10.1f %7.1fx  %s (%s)\n",
+                   Field[1], Field[2], Field[3], Field[4], Reference[Input],
+                   Best[Input], Speedup, Config[Input], Cpu[Input]
+        }
+    }' "$CSV"
+
+if [ "$Failures" != 0 ]; then
+    echo "$Failures runs produced the wrong output" >&2
+    exit 1
+fi
+
+exit 0
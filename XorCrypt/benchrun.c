@@ -0,0 +1,197 @@
+/*++
+
+Description:
+
+    This module implements BenchRun, the measuring half of the benchmark
+    suite. It runs one command with its standard input and output redirected,
+    waits for it with wait4(), and prints what the command cost as a line of
+    comma separated values:
+
+        wall_s,user_s,sys_s,voluntary_cs,involuntary_cs,exit_status
+
+    Only the command itself is measured, not whatever feeds its input or
+    consumes its output. bench.sh drives it over the benchmark matrix.
+
+    Usage: BenchRun <input> <output> <command> [arguments...]
+
+    Either file name may be "-" to leave that stream as it was inherited.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static
+double
+Seconds(
+    struct timeval const * Time
+    )
+
+/*++
+
+Description:
+
+    This routine converts a time value to seconds.
+
+Arguments:
+
+    Time - Supplies the time value.
+
+Return Value:
+
+    Returns the number of seconds.
+
+--*/
+
+{
+
+    return Time->tv_sec + (Time->tv_usec / 1000000.0);
+}
+
+static
+int
+Redirect(
+    char const * FileName,
+    int Flags,
+    int Target
+    )
+
+/*++
+
+Description:
+
+    This routine opens a file onto one of the standard descriptors.
+
+Arguments:
+
+    FileName - Supplies the file name, or "-" to leave the descriptor alone.
+
+    Flags - Supplies the flags to open the file with.
+
+    Target - Supplies the descriptor to replace.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero on failure.
+
+--*/
+
+{
+
+    int FileDescriptor;
+
+    if (strcmp(FileName, "-") == 0) {
+        return 0;
+    }
+
+    FileDescriptor = open(FileName, Flags, 0644);
+    if (FileDescriptor < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", FileName, strerror(errno));
+        return 1;
+    }
+
+    if (dup2(FileDescriptor, Target) < 0) {
+        fprintf(stderr, "Cannot redirect %s: %s\n", FileName, strerror(errno));
+        return 1;
+    }
+
+    close(FileDescriptor);
+    return 0;
+}
+
+int
+main(
+    int argc,
+    char* argv[]
+    )
+
+/*++
+
+Description:
+
+    This is the main routine for BenchRun.
+
+Arguments:
+
+    argc - Supplies the count of arguments.
+
+    argv - Supplies the input file name, the output file name, and the
+        command to run with its arguments.
+
+Return Value:
+
+    Returns zero (0) if the measurement was taken, whatever the command's
+    exit status, or non-zero if the command couldn't be run.
+
+--*/
+
+{
+
+    pid_t Child;
+    struct timespec End;
+    int ExitStatus;
+    struct rusage Usage;
+    struct timespec Start;
+    int Status;
+
+    if (argc < 4) {
+        fprintf(stderr,
+                "Usage: BenchRun <input> <output> <command> "
+                "[arguments...]\n");
+
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    Child = fork();
+    if (Child < 0) {
+        fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (Child == 0) {
+        if ((Redirect(argv[1], O_RDONLY, STDIN_FILENO) != 0) ||
+            (Redirect(argv[2],
+                      O_WRONLY | O_CREAT | O_TRUNC,
+                      STDOUT_FILENO) != 0)) {
+
+            _exit(127);
+        }
+
+        execv(argv[3], &argv[3]);
+        fprintf(stderr, "Cannot run %s: %s\n", argv[3], strerror(errno));
+        _exit(127);
+    }
+
+    while (wait4(Child, &Status, 0, &Usage) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "Cannot wait: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &End);
+    ExitStatus = -1;
+    if (WIFEXITED(Status)) {
+        ExitStatus = WEXITSTATUS(Status);
+    }
+
+    printf("%.6f,%.6f,%.6f,%ld,%ld,%d\n",
+           (End.tv_sec - Start.tv_sec) +
+           ((End.tv_nsec - Start.tv_nsec) / 1000000000.0),
+           Seconds(&Usage.ru_utime),
+           Seconds(&Usage.ru_stime),
+           Usage.ru_nvcsw,
+           Usage.ru_nivcsw,
+           ExitStatus);
+
+    return 0;
+}
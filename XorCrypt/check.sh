@@ -0,0 +1,309 @@
+#!/bin/bash
+#
+# check.sh - End-to-end XorCrypt checks, run by "make check".
+#
+# Generates inputs and keys, encrypts each input with XorCryptRef, and then
+# runs XorCrypt over a matrix of engines, input sources, outputs, thread
+# counts, and block sizes, comparing every output with the reference's byte
+# for byte. Inputs include an empty one, and keys run from a single byte to
+# longer than a key table holds. Engines that can't run with a source or
+# output, such as mmap on a pipe, are skipped. Batches of every input are
+# checked the same way, given by a manifest file, a manifest on stdin, or
+# pairs after --, and with a missing input that must fail alone.
+#
+# The matrix is set by these environment variables, shown with defaults:
+#
+#   CHECK_DIR       ${TMPDIR:-/tmp}/xorcrypt-check   (inputs and outputs)
+#   CHECK_SIZES     "0 1 100003 3145745"
+#   CHECK_KEYS      "1 13 4099 1048577"
+#   CHECK_SOURCES   "file pipe zero"
+#   CHECK_OUTPUTS   "file pipe"
+#   CHECK_ENGINES   "auto mmap pipeline stream pread uring splice"
+#   CHECK_THREADS   "1 3 8"
+#   CHECK_BLOCKS    "128 64K 1M"
+#
+# The script exits with a non-zero status if any output differs.
+#
+
+set -u
+set -o pipefail
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+XORCRYPT=$HERE/XorCrypt
+REFERENCE=$HERE/XorCryptRef
+
+CHECK_DIR=${CHECK_DIR:-${TMPDIR:-/tmp}/xorcrypt-check}
+CHECK_SIZES=${CHECK_SIZES:-"0 1 100003 3145745"}
+CHECK_KEYS=${CHECK_KEYS:-"1 13 4099 1048577"}
+CHECK_SOURCES=${CHECK_SOURCES:-"file pipe zero"}
+CHECK_OUTPUTS=${CHECK_OUTPUTS:-"file pipe"}
+CHECK_ENGINES=${CHECK_ENGINES:-"auto mmap pipeline stream pread uring splice"}
+CHECK_THREADS=${CHECK_THREADS:-"1 3 8"}
+CHECK_BLOCKS=${CHECK_BLOCKS:-"128 64K 1M"}
+
+OUTPUT=$CHECK_DIR/output.bin
+
+mkdir -p "$CHECK_DIR" || exit 1
+
+#
+# Generate each input and key once.
+#
+
+for Size in $CHECK_SIZES; do
+    if [ ! -f "$CHECK_DIR/input.$Size" ]; then
+        head -c "$Size" /dev/urandom > "$CHECK_DIR/input.$Size" || exit 1
+    fi
+done
+
+for Key in $CHECK_KEYS; do
+    if [ ! -f "$CHECK_DIR/key.$Key" ]; then
+        head -c "$Key" /dev/urandom > "$CHECK_DIR/key.$Key" || exit 1
+    fi
+done
+
+#
+# Applies succeeds if an engine can run with a source and output. The mmap
+# engine needs regular files, the pread engine seekable streams, and the
+# splice engine a pipe for its output. The others run with anything.
+#
+# Applies <engine> <source> <output>
+#
+
+Applies() {
+    case $1 in
+    mmap)
+        [ "$2" = file ] && [ "$3" = file ]
+        ;;
+
+    pread)
+        [ "$2" != pipe ] && [ "$3" = file ]
+        ;;
+
+    splice)
+        [ "$3" = pipe ]
+        ;;
+
+    *)
+        true
+        ;;
+    esac
+}
+
+#
+# Run runs a command over an input source, writing the output file
+# directly or through a pipe.
+#
+# Run <source> <output> <size> <command...>
+#
+
+Run() {
+    local Source=$1 Output=$2 Size=$3 Input
+    shift 3
+
+    case $Source in
+    file)
+        Input=$CHECK_DIR/input.$Size
+        ;;
+
+    pipe)
+        Input=-
+        ;;
+
+    zero)
+        Input=/dev/zero
+        set -- "$@" --length "$Size"
+        ;;
+    esac
+
+    if [ "$Input" = - ]; then
+        cat "$CHECK_DIR/input.$Size" | Write "$Output" "$@"
+    else
+        Write "$Output" "$@" < "$Input"
+    fi
+}
+
+#
+# Write runs a command with the output file as its output, or with a pipe
+# into it.
+#
+# Write <output> <command...>
+#
+
+Write() {
+    local Output=$1
+    shift
+
+    if [ "$Output" = pipe ]; then
+        "$@" | cat > "$OUTPUT"
+    else
+        "$@" > "$OUTPUT"
+    fi
+}
+
+#
+# Check runs XorCrypt and compares its output with the expected file.
+#
+# Check <expected> <description> <source> <output> <size> <arguments...>
+#
+
+Check() {
+    local Expected=$1 Description=$2 Source=$3 Output=$4 Size=$5 Status
+    shift 5
+
+    Runs=$((Runs + 1))
+    rm -f "$OUTPUT"
+    Run "$Source" "$Output" "$Size" "$XORCRYPT" "$@" 2> "$CHECK_DIR/error"
+    Status=$?
+    if [ "$Status" != 0 ]; then
+        echo "FAILED with status $Status: $Description" >&2
+        cat "$CHECK_DIR/error" >&2
+        Failures=$((Failures + 1))
+
+    elif ! cmp -s "$OUTPUT" "$Expected"; then
+        echo "MISMATCH: $Description" >&2
+        Failures=$((Failures + 1))
+    fi
+}
+
+#
+# CheckBatch runs a batch of every input and compares each output with the
+# expected file for its size. A missing input is added to the batch when
+# the last argument is "missing", and the batch must then fail, with every
+# other output still right.
+#
+# CheckBatch <form> <key file> <threads> <block> <missing>
+#
+
+CheckBatch() {
+    local Form=$1 KeyFile=$2 Threads=$3 Block=$4 Missing=$5
+    local Description Manifest Size Status
+    local Pairs=()
+
+    Description="batch by $Form -n $Threads -b $Block, key ${KeyFile##*.}"
+    Manifest=$CHECK_DIR/manifest
+    Runs=$((Runs + 1))
+    : > "$Manifest"
+    for Size in $CHECK_SIZES; do
+        rm -f "$CHECK_DIR/batch.$Size"
+        Pairs+=("$CHECK_DIR/input.$Size" "$CHECK_DIR/batch.$Size")
+    done
+
+    if [ "$Missing" = missing ]; then
+        Description="$Description, with a missing input"
+        Pairs+=("$CHECK_DIR/missing" "$CHECK_DIR/batch.missing")
+    fi
+
+    printf '%s\t%s\n' "${Pairs[@]}" > "$Manifest"
+    case $Form in
+    manifest)
+        "$XORCRYPT" -k "$KeyFile" -n "$Threads" -b "$Block" \
+            --manifest "$Manifest" 2> "$CHECK_DIR/error"
+        ;;
+
+    stdin)
+        "$XORCRYPT" -k "$KeyFile" -n "$Threads" -b "$Block" \
+            --manifest - < "$Manifest" 2> "$CHECK_DIR/error"
+        ;;
+
+    pairs)
+        "$XORCRYPT" -k "$KeyFile" -n "$Threads" -b "$Block" \
+            -- "${Pairs[@]}" 2> "$CHECK_DIR/error"
+        ;;
+    esac
+
+    Status=$?
+    if [ "$Missing" = missing ] && [ "$Status" = 0 ]; then
+        echo "SUCCEEDED: $Description" >&2
+        Failures=$((Failures + 1))
+        return
+
+    elif [ "$Missing" != missing ] && [ "$Status" != 0 ]; then
+        echo "FAILED with status $Status: $Description" >&2
+        cat "$CHECK_DIR/error" >&2
+        Failures=$((Failures + 1))
+        return
+    fi
+
+    for Size in $CHECK_SIZES; do
+        if ! cmp -s "$CHECK_DIR/batch.$Size" "$CHECK_DIR/expected.$Size"; then
+            echo "MISMATCH: $Description, $Size bytes" >&2
+            Failures=$((Failures + 1))
+            return
+        fi
+    done
+}
+
+Failures=0
+Runs=0
+for Size in $CHECK_SIZES; do
+    for Key in $CHECK_KEYS; do
+        KeyFile=$CHECK_DIR/key.$Key
+        echo "Checking $Size bytes, key $Key" >&2
+
+        #
+        # The reference output of the file and the zero source.
+        #
+
+        "$REFERENCE" -k "$KeyFile" -n 1 < "$CHECK_DIR/input.$Size" \
+            > "$CHECK_DIR/expected.file" || exit 1
+
+        "$REFERENCE" -k "$KeyFile" -n 1 --length "$Size" < /dev/zero \
+            > "$CHECK_DIR/expected.zero" || exit 1
+
+        for Source in $CHECK_SOURCES; do
+            Expected=$CHECK_DIR/expected.file
+            if [ "$Source" = zero ]; then
+                Expected=$CHECK_DIR/expected.zero
+            fi
+
+            for Output in $CHECK_OUTPUTS; do
+                for Engine in $CHECK_ENGINES; do
+                    if ! Applies "$Engine" "$Source" "$Output"; then
+                        continue
+                    fi
+
+                    for Threads in $CHECK_THREADS; do
+                        for Block in $CHECK_BLOCKS; do
+                            Description="-e $Engine -n $Threads -b $Block,"
+                            Description="$Description $Source to $Output,"
+                            Description="$Description $Size bytes, key $Key"
+                            Check "$Expected" "$Description" \
+                                "$Source" "$Output" "$Size" \
+                                -k "$KeyFile" -n "$Threads" -e "$Engine" \
+                                -b "$Block"
+                        done
+                    done
+                done
+            done
+        done
+    done
+done
+
+for Key in $CHECK_KEYS; do
+    KeyFile=$CHECK_DIR/key.$Key
+    echo "Checking batches, key $Key" >&2
+    for Size in $CHECK_SIZES; do
+        "$REFERENCE" -k "$KeyFile" -n 1 < "$CHECK_DIR/input.$Size" \
+            > "$CHECK_DIR/expected.$Size" || exit 1
+    done
+
+    for Form in manifest stdin pairs; do
+        for Threads in $CHECK_THREADS; do
+            for Block in $CHECK_BLOCKS; do
+                CheckBatch "$Form" "$KeyFile" "$Threads" "$Block" all
+            done
+        done
+    done
+
+    CheckBatch manifest "$KeyFile" 3 64K missing
+done
+
+rm -f "$OUTPUT" "$CHECK_DIR/error" "$CHECK_DIR"/expected.* \
+    "$CHECK_DIR"/batch.* "$CHECK_DIR/manifest"
+if [ "$Failures" != 0 ]; then
+    echo "$Failures of $Runs checks failed" >&2
+    exit 1
+fi
+
+echo "All $Runs checks passed"
+exit 0
@@ -0,0 +1,622 @@
+/*++
+
+Description:
+
+    This module implements checkpoints, which let an interrupted run carry on
+    from where it stopped rather than starting again from the beginning.
+
+    With --checkpoint, a thread wakes every few seconds, measures how much
+    of the output has been written front to back, flushes the output file,
+    and then records that much in the checkpoint file. The checkpoint is
+    replaced with a rename, so a crash leaves either the old checkpoint or
+    the new one, and whatever a checkpoint claims is already on disk.
+
+    The writers never wait for the checkpoint thread. The stream and
+    pipeline engines advance the write offset as they write, which the
+    thread reads atomically, and the positional engine is measured the way
+    the in-place progress marker measures it. The mapped and io_uring
+    engines finish the output in no particular order, so the automatic
+    choice skips them while checkpointing.
+
+    With --resume, the checkpoint is read back and the range moved past what
+    it records. The input is skipped, the key picks up at the new stream
+    offset, and the output is positioned to match. A checkpoint written for
+    another key or range is refused. The output must be opened without
+    truncating it, with 1<> rather than >, or the work recorded is lost.
+
+    The checkpoint is removed once the whole range has been flushed.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "homework.h"
+
+#define CHECKPOINT_TEMPORARY_SUFFIX ".tmp"
+#define CHECKPOINT_INTERVAL_SECONDS 5
+#define CHECKPOINT_MAXIMUM 512
+
+static
+int
+FormatCheckpoint(
+    CHECKPOINT const * Checkpoint,
+    uint64_t Completed,
+    char * Buffer,
+    size_t BufferLength
+    )
+
+/*++
+
+Description:
+
+    This routine formats the contents of the checkpoint.
+
+Arguments:
+
+    Checkpoint - Supplies the checkpoint.
+
+    Completed - Supplies the number of bytes of the range known to be written
+        and flushed.
+
+    Buffer - Supplies the buffer that receives the text.
+
+    BufferLength - Supplies the size of the buffer.
+
+Return Value:
+
+    Returns the length of the text.
+
+--*/
+
+{
+
+    return snprintf(Buffer,
+                    BufferLength,
+                    "offset %llu\n"
+                    "length %llu\n"
+                    "output %llu\n"
+                    "key %08x\n"
+                    "completed %llu\n",
+                    (unsigned long long)Checkpoint->StreamOffset,
+                    (unsigned long long)Checkpoint->Length,
+                    (unsigned long long)Checkpoint->OutputPosition,
+                    Checkpoint->KeyFingerprint,
+                    (unsigned long long)Completed);
+}
+
+static
+void
+RecordCheckpoint(
+    CHECKPOINT * Checkpoint,
+    uint64_t Written
+    )
+
+/*++
+
+Description:
+
+    This routine replaces the checkpoint with one recording the given
+    progress. The output must already be flushed that far.
+
+Arguments:
+
+    Checkpoint - Supplies the checkpoint.
+
+    Written - Supplies the stream offset the output is flushed up to.
+
+Return Value:
+
+    None. Failures are fatal.
+
+--*/
+
+{
+
+    int Length;
+    char Text[CHECKPOINT_MAXIMUM];
+
+    Length = FormatCheckpoint(Checkpoint,
+                              Written - Checkpoint->StreamOffset,
+                              Text,
+                              sizeof(Text));
+
+    WriteMarker(Checkpoint->TemporaryName, O_TRUNC, Text, Length);
+    if (rename(Checkpoint->TemporaryName, Checkpoint->FileName) != 0) {
+        ErrorExit(errno, "Failure updating %s\n", Checkpoint->FileName);
+    }
+
+    Checkpoint->Recorded = Written;
+}
+
+static
+void
+UpdateCheckpoint(
+    CHECKPOINT * Checkpoint
+    )
+
+/*++
+
+Description:
+
+    This routine flushes the output, then records how far it is written, if
+    that has moved on since the last checkpoint.
+
+Arguments:
+
+    Checkpoint - Supplies the checkpoint.
+
+Return Value:
+
+    None. Failures are fatal.
+
+--*/
+
+{
+
+    uint64_t Written;
+
+    //
+    // Measure first, then flush. Everything measured has been written, so it
+    // is on disk by the time the checkpoint claims it. The lock only keeps
+    // a positional engine from going away while it is measured.
+    //
+
+    pthread_mutex_lock(&Checkpoint->Lock);
+    if (Checkpoint->Engine != NULL) {
+        Written = Checkpoint->Engine->StreamOffset +
+                  GetPositionalProgress(Checkpoint->Engine);
+
+    } else {
+        Written = atomic_load(&Checkpoint->WorkerContext->IoSyncBlock->
+                              WriteOffset);
+    }
+
+    pthread_mutex_unlock(&Checkpoint->Lock);
+    if (Written <= Checkpoint->Recorded) {
+        return;
+    }
+
+    if (fdatasync(Checkpoint->OutputFd) != 0) {
+        ErrorExit(errno, "Failure flushing the output\n");
+    }
+
+    RecordCheckpoint(Checkpoint, Written);
+}
+
+static
+void *
+CheckpointRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine updates the checkpoint periodically until the run is done.
+
+Arguments:
+
+    Context - Supplies the checkpoint.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    CHECKPOINT * Checkpoint;
+    struct timespec Deadline;
+
+    Checkpoint = (CHECKPOINT *)Context;
+    pthread_mutex_lock(&Checkpoint->Lock);
+    while (Checkpoint->Done == 0) {
+        clock_gettime(CLOCK_REALTIME, &Deadline);
+        Deadline.tv_sec += CHECKPOINT_INTERVAL_SECONDS;
+        pthread_cond_timedwait(&Checkpoint->Event,
+                               &Checkpoint->Lock,
+                               &Deadline);
+
+        if (Checkpoint->Done != 0) {
+            break;
+        }
+
+        pthread_mutex_unlock(&Checkpoint->Lock);
+        UpdateCheckpoint(Checkpoint);
+        pthread_mutex_lock(&Checkpoint->Lock);
+    }
+
+    pthread_mutex_unlock(&Checkpoint->Lock);
+    return NULL;
+}
+
+static
+int
+ReadCheckpoint(
+    CHECKPOINT * Checkpoint,
+    uint64_t * Completed
+    )
+
+/*++
+
+Description:
+
+    This routine reads back a checkpoint, and checks that it was written for
+    the same key and range.
+
+Arguments:
+
+    Checkpoint - Supplies the checkpoint, describing this run. The output
+        position is replaced with the one recorded.
+
+    Completed - Supplies a pointer that receives the number of bytes of the
+        range recorded as written.
+
+Return Value:
+
+    Returns zero (0) on success, ENOENT if there is no checkpoint, or another
+    non-zero value if it can't be used.
+
+--*/
+
+{
+
+    unsigned long long Done;
+    int FileDescriptor;
+    unsigned int Fingerprint;
+    unsigned long long Length;
+    unsigned long long Offset;
+    unsigned long long OutputPosition;
+    ssize_t Size;
+    char Text[CHECKPOINT_MAXIMUM];
+
+    FileDescriptor = open(Checkpoint->FileName, O_RDONLY);
+    if (FileDescriptor < 0) {
+        if (errno == ENOENT) {
+            return ENOENT;
+        }
+
+        fprintf(stderr,
+                "Cannot open %s: %s\n",
+                Checkpoint->FileName,
+                strerror(errno));
+
+        return 1;
+    }
+
+    Size = read(FileDescriptor, Text, sizeof(Text) - 1);
+    close(FileDescriptor);
+    if (Size < 0) {
+        Size = 0;
+    }
+
+    Text[Size] = '\0';
+    if (sscanf(Text,
+               "offset %llu length %llu output %llu key %x completed %llu",
+               &Offset,
+               &Length,
+               &OutputPosition,
+               &Fingerprint,
+               &Done) != 5) {
+
+        fprintf(stderr, "%s is not a checkpoint\n", Checkpoint->FileName);
+        return 1;
+    }
+
+    if ((Offset != Checkpoint->StreamOffset) ||
+        (Length != Checkpoint->Length) ||
+        (Fingerprint != Checkpoint->KeyFingerprint) ||
+        (Done > Length)) {
+
+        fprintf(stderr,
+                "The checkpoint %s was written for another key or range\n",
+                Checkpoint->FileName);
+
+        return 1;
+    }
+
+    Checkpoint->OutputPosition = OutputPosition;
+    *Completed = Done;
+    return 0;
+}
+
+int
+OpenCheckpoint(
+    CHECKPOINT * Checkpoint,
+    OPTIONS * Options,
+    byte const * Key,
+    size_t KeyLength,
+    FILE * OutputStream
+    )
+
+/*++
+
+Description:
+
+    This routine sets up the checkpoint for a run, and writes its first
+    record. If resuming, it reads the checkpoint left by the interrupted run,
+    moves the range past the part already written, and positions the output
+    to match. This must be called before the input is positioned.
+
+Arguments:
+
+    Checkpoint - Supplies the checkpoint to set up.
+
+    Options - Supplies the options, naming the checkpoint file. The range is
+        updated when resuming.
+
+    Key - Supplies the key, whose fingerprint is recorded.
+
+    KeyLength - Supplies the length of the key.
+
+    OutputStream - Supplies the output stream, which must be a regular file.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero on failure.
+
+--*/
+
+{
+
+    uint64_t Completed;
+    CRC_TABLE * CrcTable;
+    int Flags;
+    struct stat OutputStats;
+    int Result;
+
+    memset(Checkpoint, 0, sizeof(CHECKPOINT));
+    Checkpoint->FileName = Options->CheckpointFileName;
+    Checkpoint->OutputFd = fileno(OutputStream);
+    Flags = fcntl(Checkpoint->OutputFd, F_GETFL);
+    if ((Flags < 0) ||
+        ((Flags & O_APPEND) != 0) ||
+        (fstat(Checkpoint->OutputFd, &OutputStats) != 0) ||
+        !S_ISREG(OutputStats.st_mode)) {
+
+        fprintf(stderr,
+                "--checkpoint needs a regular file as output, not opened "
+                "for append\n");
+
+        return 1;
+    }
+
+    Checkpoint->OutputPosition = lseek(Checkpoint->OutputFd, 0, SEEK_CUR);
+    Checkpoint->StreamOffset = Options->RangeOffset;
+    Checkpoint->Length = Options->RangeLength;
+    CrcTable = malloc(sizeof(CRC_TABLE));
+    Checkpoint->TemporaryName = malloc(strlen(Checkpoint->FileName) +
+                                       sizeof(CHECKPOINT_TEMPORARY_SUFFIX));
+
+    if ((CrcTable == NULL) || (Checkpoint->TemporaryName == NULL)) {
+        ErrorExit(errno, "Failure allocating the checkpoint\n");
+    }
+
+    strcpy(Checkpoint->TemporaryName, Checkpoint->FileName);
+    strcat(Checkpoint->TemporaryName, CHECKPOINT_TEMPORARY_SUFFIX);
+    BuildCrcTable(CrcTable);
+    Checkpoint->KeyFingerprint = UpdateCrc32c(CrcTable, 0, Key, KeyLength);
+    free(CrcTable);
+
+    //
+    // Without a checkpoint to resume from, start from the beginning.
+    //
+
+    Completed = 0;
+    if (Options->Resume != 0) {
+        Result = ReadCheckpoint(Checkpoint, &Completed);
+        if ((Result != 0) && (Result != ENOENT)) {
+            return 1;
+        }
+
+        if ((Result == ENOENT) && (Options->Verbose != 0)) {
+            fprintf(stderr,
+                    "There is no checkpoint %s, so starting from the "
+                    "beginning\n",
+                    Checkpoint->FileName);
+        }
+
+        if ((uint64_t)OutputStats.st_size <
+            Checkpoint->OutputPosition + Completed) {
+
+            fprintf(stderr,
+                    "The output is shorter than the checkpoint records. "
+                    "Open it with 1<> rather\nthan > to resume, so that it "
+                    "isn't truncated.\n");
+
+            return 1;
+        }
+
+        if (lseek(Checkpoint->OutputFd,
+                  Checkpoint->OutputPosition + Completed,
+                  SEEK_SET) < 0) {
+
+            ErrorExit(errno, "Failure positioning the output\n");
+        }
+
+        Options->RangeOffset += Completed;
+        if (Options->RangeLength != UINT64_MAX) {
+            Options->RangeLength -= Completed;
+        }
+
+        if (Options->Verbose != 0) {
+            fprintf(stderr,
+                    "Resuming at stream offset %llu\n",
+                    (unsigned long long)Options->RangeOffset);
+        }
+    }
+
+    RecordCheckpoint(Checkpoint, Checkpoint->StreamOffset + Completed);
+    SyncParentDirectory(Checkpoint->FileName);
+    return 0;
+}
+
+void
+StartCheckpoint(
+    CHECKPOINT * Checkpoint,
+    WORKER_CONTEXT * WorkerContext
+    )
+
+/*++
+
+Description:
+
+    This routine starts the thread that keeps the checkpoint up to date.
+
+Arguments:
+
+    Checkpoint - Supplies the checkpoint set up by OpenCheckpoint.
+
+    WorkerContext - Supplies the context describing the streams, whose write
+        offset the thread follows.
+
+Return Value:
+
+    None. Failures are fatal.
+
+--*/
+
+{
+
+    int Result;
+
+    Checkpoint->WorkerContext = WorkerContext;
+    Checkpoint->Engine = NULL;
+    Checkpoint->Done = 0;
+    pthread_mutex_init(&Checkpoint->Lock, NULL);
+    pthread_cond_init(&Checkpoint->Event, NULL);
+    Result = pthread_create(&Checkpoint->Thread,
+                            NULL,
+                            CheckpointRoutine,
+                            Checkpoint);
+
+    if (Result != 0) {
+        ErrorExit(Result, "Failed creating thread\n");
+    }
+}
+
+void
+AttachCheckpoint(
+    CHECKPOINT * Checkpoint,
+    POSITIONAL_ENGINE * Engine
+    )
+
+/*++
+
+Description:
+
+    This routine has the checkpoint follow a positional engine, which only
+    advances the write offset once it is done, until it is detached.
+
+Arguments:
+
+    Checkpoint - Supplies the checkpoint, or NULL if there is none.
+
+    Engine - Supplies the engine about to run.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if (Checkpoint == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&Checkpoint->Lock);
+    Checkpoint->Engine = Engine;
+    pthread_mutex_unlock(&Checkpoint->Lock);
+}
+
+void
+DetachCheckpoint(
+    CHECKPOINT * Checkpoint
+    )
+
+/*++
+
+Description:
+
+    This routine has the checkpoint go back to following the write offset.
+    The engine attached may be freed once this returns.
+
+Arguments:
+
+    Checkpoint - Supplies the checkpoint, or NULL if there is none.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    AttachCheckpoint(Checkpoint, NULL);
+}
+
+void
+FinishCheckpoint(
+    CHECKPOINT * Checkpoint,
+    int Result
+    )
+
+/*++
+
+Description:
+
+    This routine stops the checkpoint thread. After a successful run the
+    output is flushed and the checkpoint removed. After a failed one the
+    checkpoint records as much of the output as was written.
+
+Arguments:
+
+    Checkpoint - Supplies the checkpoint.
+
+    Result - Supplies the result of the run.
+
+Return Value:
+
+    None. Failures are fatal.
+
+--*/
+
+{
+
+    pthread_mutex_lock(&Checkpoint->Lock);
+    Checkpoint->Done = 1;
+    pthread_cond_signal(&Checkpoint->Event);
+    pthread_mutex_unlock(&Checkpoint->Lock);
+    pthread_join(Checkpoint->Thread, NULL);
+    if (Result == 0) {
+        if (fsync(Checkpoint->OutputFd) != 0) {
+            ErrorExit(errno, "Failure flushing the output\n");
+        }
+
+        unlink(Checkpoint->FileName);
+        SyncParentDirectory(Checkpoint->FileName);
+
+    } else {
+        UpdateCheckpoint(Checkpoint);
+    }
+
+    pthread_cond_destroy(&Checkpoint->Event);
+    pthread_mutex_destroy(&Checkpoint->Lock);
+    free(Checkpoint->TemporaryName);
+}
@@ -0,0 +1,731 @@
+/*++
+
+Description:
+
+    This module implements the container format, written by --container, and
+    --extract, which decrypts a range of a container without reading the rest
+    of it.
+
+    A container frames the encrypted stream so a reader can find and check
+    any part of it on its own. It is laid out as
+
+        Header, 64 bytes:
+            0   8   "XORCRYPT"
+            8   4   Format version, 1
+            12  4   Header size, 64
+            16  8   Chunk size
+            24  8   Stream offset of the first byte, where --offset began
+            32  4   Key fingerprint, the CRC32C of the key
+            36  24  Reserved, zero
+            60  4   CRC32C of the bytes above
+
+        Chunks, each the chunk size but the last, which may be shorter.
+
+        Index, one 16 byte entry per chunk:
+            0   8   Offset of the chunk from the start of the container
+            8   4   Length of the chunk
+            12  4   CRC32C of the chunk, as stored
+
+        Trailer, 32 bytes, at the end of the file:
+            0   8   "XORINDEX"
+            8   8   Offset of the index from the start of the container
+            16  8   Number of chunks
+            24  4   CRC32C of the index
+            28  4   CRC32C of the bytes above
+
+    Integers are little endian. The chunks are the encrypted stream, back to
+    back, so a chunk is decrypted with the key at its stream offset alone.
+    The chunk CRCs are gathered by the digest as the blocks are encrypted, so
+    writing a container costs no extra pass over the data. The fingerprint
+    is there to catch the wrong key, not to authenticate anything.
+
+    Extraction reads only the header, the trailer, and the index entries and
+    chunks that cover the range. Each thread checks and decrypts whole
+    chunks, and the pieces are written in order, so the output may be a pipe.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "homework.h"
+
+#define CONTAINER_MAGIC "XORCRYPT"
+#define CONTAINER_INDEX_MAGIC "XORINDEX"
+#define CONTAINER_MAGIC_SIZE 8
+
+//
+// The index is written this many entries at a time.
+//
+
+#define CONTAINER_INDEX_BATCH 4096
+
+typedef struct _EXTRACT {
+    WORKER_CONTEXT * WorkerContext;
+    CONTAINER * Container;
+    int InputFd;
+    off_t InputPosition;
+    uint64_t Start;
+    uint64_t End;
+    uint64_t FirstChunk;
+    uint64_t EndChunk;
+    byte * Entries;
+    _Atomic uint64_t NextChunk;
+    _Atomic int NextWorker;
+    pthread_mutex_t Lock;
+    pthread_cond_t Written;
+    uint64_t NextWrite;
+} EXTRACT;
+
+static
+void
+StoreLittle(
+    byte * Destination,
+    uint64_t Value,
+    int Size
+    )
+
+/*++
+
+Description:
+
+    This routine stores an integer little endian.
+
+Arguments:
+
+    Destination - Supplies where to store it.
+
+    Value - Supplies the integer.
+
+    Size - Supplies the number of bytes to store.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    int Index;
+
+    for (Index = 0; Index < Size; ++Index) {
+        Destination[Index] = (byte)(Value >> (8 * Index));
+    }
+}
+
+static
+uint64_t
+LoadLittle(
+    byte const * Source,
+    int Size
+    )
+
+/*++
+
+Description:
+
+    This routine loads a little endian integer.
+
+Arguments:
+
+    Source - Supplies where to load it from.
+
+    Size - Supplies the number of bytes to load.
+
+Return Value:
+
+    Returns the integer.
+
+--*/
+
+{
+
+    int Index;
+    uint64_t Value;
+
+    Value = 0;
+    for (Index = 0; Index < Size; ++Index) {
+        Value |= (uint64_t)Source[Index] << (8 * Index);
+    }
+
+    return Value;
+}
+
+int
+WriteContainerHeader(
+    CONTAINER const * Container,
+    FILE * Stream
+    )
+
+/*++
+
+Description:
+
+    This routine writes a container's header, ahead of its chunks.
+
+Arguments:
+
+    Container - Supplies the container, with its chunk size, stream offset,
+        and key fingerprint.
+
+    Stream - Supplies the output stream.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the header couldn't be
+    written.
+
+--*/
+
+{
+
+    byte Header[CONTAINER_HEADER_SIZE];
+
+    memset(Header, 0, sizeof(Header));
+    memcpy(Header, CONTAINER_MAGIC, CONTAINER_MAGIC_SIZE);
+    StoreLittle(Header + 8, CONTAINER_VERSION, 4);
+    StoreLittle(Header + 12, CONTAINER_HEADER_SIZE, 4);
+    StoreLittle(Header + 16, Container->ChunkSize, 8);
+    StoreLittle(Header + 24, Container->StreamOffset, 8);
+    StoreLittle(Header + 32, Container->KeyFingerprint, 4);
+    StoreLittle(Header + 60,
+                UpdateCrc32c(Container->Table, 0, Header, 60),
+                4);
+
+    if ((fwrite(Header, 1, sizeof(Header), Stream) != sizeof(Header)) ||
+        (fflush(Stream) != 0)) {
+
+        fprintf(stderr, "Failure writing the container header\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int
+WriteContainerIndex(
+    CONTAINER * Container,
+    DIGEST * Digest,
+    FILE * Stream
+    )
+
+/*++
+
+Description:
+
+    This routine writes a container's index and trailer, after its chunks.
+
+Arguments:
+
+    Container - Supplies the container. Its length and chunk count are set.
+
+    Digest - Supplies the digest that gathered the chunk CRCs as the stream
+        was encrypted.
+
+    Stream - Supplies the output stream, positioned after the last chunk.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the index couldn't be
+    written.
+
+--*/
+
+{
+
+    uint64_t Chunk;
+    uint32_t Crc;
+    byte * Entries;
+    byte * Entry;
+    size_t Filled;
+    uint64_t Length;
+    byte Trailer[CONTAINER_TRAILER_SIZE];
+
+    Container->Length = atomic_load(&Digest->Length);
+    Container->ChunkCount = (Container->Length + Container->ChunkSize - 1) /
+                            Container->ChunkSize;
+
+    Entries = malloc(CONTAINER_INDEX_BATCH * CONTAINER_ENTRY_SIZE);
+    if (Entries == NULL) {
+        fprintf(stderr, "Memory allocation failure for the container index\n");
+        return 1;
+    }
+
+    Crc = 0;
+    Entry = Entries;
+    for (Chunk = 0; Chunk < Container->ChunkCount; ++Chunk) {
+        Length = Container->Length - (Chunk * Container->ChunkSize);
+        if (Length > Container->ChunkSize) {
+            Length = Container->ChunkSize;
+        }
+
+        StoreLittle(Entry,
+                    CONTAINER_HEADER_SIZE + (Chunk * Container->ChunkSize),
+                    8);
+
+        StoreLittle(Entry + 8, Length, 4);
+        StoreLittle(Entry + 12, GetChunkChecksum(Digest, Chunk), 4);
+        Entry += CONTAINER_ENTRY_SIZE;
+        Filled = Entry - Entries;
+        if ((Filled == CONTAINER_INDEX_BATCH * CONTAINER_ENTRY_SIZE) ||
+            (Chunk + 1 == Container->ChunkCount)) {
+
+            Crc = UpdateCrc32c(Container->Table, Crc, Entries, Filled);
+            if (fwrite(Entries, 1, Filled, Stream) != Filled) {
+
+                free(Entries);
+                fprintf(stderr, "Failure writing the container index\n");
+                return 1;
+            }
+
+            Entry = Entries;
+        }
+    }
+
+    free(Entries);
+    memset(Trailer, 0, sizeof(Trailer));
+    memcpy(Trailer, CONTAINER_INDEX_MAGIC, CONTAINER_MAGIC_SIZE);
+    StoreLittle(Trailer + 8, CONTAINER_HEADER_SIZE + Container->Length, 8);
+    StoreLittle(Trailer + 16, Container->ChunkCount, 8);
+    StoreLittle(Trailer + 24, Crc, 4);
+    StoreLittle(Trailer + 28,
+                UpdateCrc32c(Container->Table, 0, Trailer, 28),
+                4);
+
+    if ((fwrite(Trailer, 1, sizeof(Trailer), Stream) != sizeof(Trailer)) ||
+        (fflush(Stream) != 0)) {
+
+        fprintf(stderr, "Failure writing the container index\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static
+int
+ReadContainer(
+    CONTAINER * Container,
+    int FileDescriptor,
+    off_t Position
+    )
+
+/*++
+
+Description:
+
+    This routine reads and checks a container's header and trailer.
+
+Arguments:
+
+    Container - Supplies the container, with its CRC table and the key
+        fingerprint to expect. The rest is filled in.
+
+    FileDescriptor - Supplies the file holding the container, which ends at
+        the end of the file.
+
+    Position - Supplies the file position at which the container starts.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the file isn't a container
+    this version understands, or was written with another key.
+
+--*/
+
+{
+
+    byte Header[CONTAINER_HEADER_SIZE];
+    uint64_t IndexOffset;
+    struct stat Stats;
+    byte Trailer[CONTAINER_TRAILER_SIZE];
+
+    if ((fstat(FileDescriptor, &Stats) != 0) ||
+        (Stats.st_size < Position + CONTAINER_HEADER_SIZE +
+                         CONTAINER_TRAILER_SIZE)) {
+
+        fprintf(stderr, "The input is not a container\n");
+        return 1;
+    }
+
+    if ((ReadFully(FileDescriptor, Header, sizeof(Header), Position) !=
+         sizeof(Header)) ||
+        (memcmp(Header, CONTAINER_MAGIC, CONTAINER_MAGIC_SIZE) != 0) ||
+        (LoadLittle(Header + 60, 4) !=
+         UpdateCrc32c(Container->Table, 0, Header, 60))) {
+
+        fprintf(stderr, "The input is not a container\n");
+        return 1;
+    }
+
+    if ((LoadLittle(Header + 8, 4) != CONTAINER_VERSION) ||
+        (LoadLittle(Header + 12, 4) != CONTAINER_HEADER_SIZE)) {
+
+        fprintf(stderr,
+                "The container is version %u, which isn't supported\n",
+                (unsigned int)LoadLittle(Header + 8, 4));
+
+        return 1;
+    }
+
+    if (LoadLittle(Header + 32, 4) != Container->KeyFingerprint) {
+        fprintf(stderr, "The container was written with another key\n");
+        return 1;
+    }
+
+    Container->ChunkSize = LoadLittle(Header + 16, 8);
+    Container->StreamOffset = LoadLittle(Header + 24, 8);
+    if ((ReadFully(FileDescriptor,
+                   Trailer,
+                   sizeof(Trailer),
+                   Stats.st_size - CONTAINER_TRAILER_SIZE) !=
+         sizeof(Trailer)) ||
+        (memcmp(Trailer, CONTAINER_INDEX_MAGIC, CONTAINER_MAGIC_SIZE) != 0) ||
+        (LoadLittle(Trailer + 28, 4) !=
+         UpdateCrc32c(Container->Table, 0, Trailer, 28))) {
+
+        fprintf(stderr, "The container has no index\n");
+        return 1;
+    }
+
+    //
+    // Every chunk but the last is whole, so the index must follow the data,
+    // and fill the file up to the trailer.
+    //
+
+    IndexOffset = LoadLittle(Trailer + 8, 8);
+    Container->ChunkCount = LoadLittle(Trailer + 16, 8);
+    Container->Length = IndexOffset - CONTAINER_HEADER_SIZE;
+    if ((Container->ChunkSize == 0) ||
+        (Container->ChunkSize > MAXIMUM_BLOCKSIZE) ||
+        (IndexOffset < CONTAINER_HEADER_SIZE) ||
+        (IndexOffset > (uint64_t)Stats.st_size) ||
+        (Container->ChunkCount !=
+         (Container->Length + Container->ChunkSize - 1) /
+         Container->ChunkSize) ||
+        (Container->ChunkCount > (uint64_t)Stats.st_size /
+                                 CONTAINER_ENTRY_SIZE) ||
+        (Position + IndexOffset +
+         (Container->ChunkCount * CONTAINER_ENTRY_SIZE) +
+         CONTAINER_TRAILER_SIZE != (uint64_t)Stats.st_size)) {
+
+        fprintf(stderr, "The container index is damaged\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static
+void *
+ExtractWorkerRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine checks and decrypts chunks of the range until none are left,
+    writing each piece once the pieces before it are written.
+
+Arguments:
+
+    Context - Supplies the extraction.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    byte * Buffer;
+    uint64_t Chunk;
+    uint64_t ChunkStart;
+    CONTAINER * Container;
+    byte const * Entry;
+    EXTRACT * Extract;
+    uint64_t From;
+    KEY_TABLE const * KeyTable;
+    uint64_t Length;
+    uint64_t Start;
+    uint64_t To;
+    int Worker;
+
+    Extract = (EXTRACT *)Context;
+    Container = Extract->Container;
+    Worker = atomic_fetch_add(&Extract->NextWorker, 1);
+    KeyTable = PlaceWorkerThread(Extract->WorkerContext, Worker);
+    AttachStatsThread("extract", Worker);
+    Buffer = TakePoolBuffer(Extract->WorkerContext->BufferPool);
+    for (;;) {
+        Chunk = atomic_fetch_add(&Extract->NextChunk, 1);
+        if (Chunk >= Extract->EndChunk) {
+            break;
+        }
+
+        Entry = Extract->Entries +
+                ((Chunk - Extract->FirstChunk) * CONTAINER_ENTRY_SIZE);
+
+        Length = LoadLittle(Entry + 8, 4);
+        ChunkStart = Container->StreamOffset + (Chunk * Container->ChunkSize);
+        if ((LoadLittle(Entry, 8) !=
+             CONTAINER_HEADER_SIZE + (Chunk * Container->ChunkSize)) ||
+            (Length > Container->ChunkSize) ||
+            ((Length < Container->ChunkSize) &&
+             (Chunk + 1 != Container->ChunkCount))) {
+
+            fprintf(stderr, "The container index is damaged\n");
+            exit(1);
+        }
+
+        Start = StartStatsTimer();
+        if (ReadFully(Extract->InputFd,
+                      Buffer,
+                      Length,
+                      Extract->InputPosition + LoadLittle(Entry, 8)) !=
+            Length) {
+
+            fprintf(stderr, "The container is truncated\n");
+            exit(1);
+        }
+
+        StopStatsTimer(STAT_READ, Start);
+
+        //
+        // The whole chunk is checked, though only part of it may be needed.
+        //
+
+        Start = StartStatsTimer();
+        if (UpdateCrc32c(Container->Table, 0, Buffer, Length) !=
+            LoadLittle(Entry + 12, 4)) {
+
+            fprintf(stderr,
+                    "Chunk %llu of the container is damaged\n",
+                    (unsigned long long)Chunk);
+
+            exit(1);
+        }
+
+        From = ChunkStart;
+        if (From < Extract->Start) {
+            From = Extract->Start;
+        }
+
+        To = ChunkStart + Length;
+        if (To > Extract->End) {
+            To = Extract->End;
+        }
+
+        if (Encrypt(Buffer + (From - ChunkStart),
+                    To - From,
+                    From,
+                    KeyTable) != 0) {
+
+            exit(1);
+        }
+
+        StopStatsTimer(STAT_ENCRYPT, Start);
+        CountStat(STAT_BLOCKS, 1);
+        CountStat(STAT_BYTES, To - From);
+
+        //
+        // Write the pieces in order.
+        //
+
+        Start = StartStatsTimer();
+        pthread_mutex_lock(&Extract->Lock);
+        while (Extract->NextWrite != Chunk) {
+            pthread_cond_wait(&Extract->Written, &Extract->Lock);
+        }
+
+        pthread_mutex_unlock(&Extract->Lock);
+        if (fwrite(Buffer + (From - ChunkStart),
+                   1,
+                   To - From,
+                   Extract->WorkerContext->IoSyncBlock->OutputStream) !=
+            To - From) {
+
+            ErrorExit(errno, "Stream write failed\n");
+        }
+
+        pthread_mutex_lock(&Extract->Lock);
+        Extract->NextWrite += 1;
+        pthread_cond_broadcast(&Extract->Written);
+        pthread_mutex_unlock(&Extract->Lock);
+        StopStatsTimer(STAT_WRITE, Start);
+    }
+
+    ReturnPoolBuffer(Extract->WorkerContext->BufferPool, Buffer);
+    DetachStatsThread();
+    return NULL;
+}
+
+int
+RunExtract(
+    WORKER_CONTEXT * WorkerContext
+    )
+
+/*++
+
+Description:
+
+    This routine decrypts the range named by the options from the container
+    on stdin to stdout, on N threads including the calling thread.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key, and the container, with its CRC table and key fingerprint.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero on failure.
+
+--*/
+
+{
+
+    size_t BufferCount;
+    CONTAINER * Container;
+    size_t EntriesLength;
+    EXTRACT Extract;
+    int Index;
+    OPTIONS const * Options;
+    int Result;
+    pthread_t * WorkerThreads;
+
+    Options = WorkerContext->Options;
+    Container = WorkerContext->Container;
+    memset(&Extract, 0, sizeof(Extract));
+    Extract.WorkerContext = WorkerContext;
+    Extract.Container = Container;
+    Extract.InputFd = fileno(WorkerContext->IoSyncBlock->InputStream);
+    Extract.InputPosition = lseek(Extract.InputFd, 0, SEEK_CUR);
+    if (Extract.InputPosition < 0) {
+        fprintf(stderr, "--extract needs a container file as input\n");
+        return 1;
+    }
+
+    if (ReadContainer(Container, Extract.InputFd, Extract.InputPosition) != 0) {
+        return 1;
+    }
+
+    //
+    // Clip the range to the stream the container holds.
+    //
+
+    Extract.Start = Options->RangeOffset;
+    Extract.End = Options->RangeOffset + Options->RangeLength;
+    if ((Extract.End < Extract.Start) ||
+        (Extract.End > Container->StreamOffset + Container->Length)) {
+
+        Extract.End = Container->StreamOffset + Container->Length;
+    }
+
+    if ((Extract.Start < Container->StreamOffset) ||
+        (Extract.Start > Extract.End)) {
+
+        fprintf(stderr,
+                "The container holds stream offsets %llu to %llu\n",
+                (unsigned long long)Container->StreamOffset,
+                (unsigned long long)(Container->StreamOffset +
+                                     Container->Length));
+
+        return 1;
+    }
+
+    if (Extract.Start == Extract.End) {
+        return 0;
+    }
+
+    Extract.FirstChunk = (Extract.Start - Container->StreamOffset) /
+                         Container->ChunkSize;
+
+    Extract.EndChunk = (Extract.End - Container->StreamOffset +
+                        Container->ChunkSize - 1) /
+                       Container->ChunkSize;
+
+    //
+    // Only the index entries for the range are read.
+    //
+
+    EntriesLength = (Extract.EndChunk - Extract.FirstChunk) *
+                    CONTAINER_ENTRY_SIZE;
+
+    Extract.Entries = malloc(EntriesLength);
+    if (Extract.Entries == NULL) {
+        ErrorExit(errno, "Failure allocating the container index\n");
+    }
+
+    if (ReadFully(Extract.InputFd,
+                  Extract.Entries,
+                  EntriesLength,
+                  Extract.InputPosition + CONTAINER_HEADER_SIZE +
+                  Container->Length +
+                  (Extract.FirstChunk * CONTAINER_ENTRY_SIZE)) !=
+        EntriesLength) {
+
+        fprintf(stderr, "The container is truncated\n");
+        free(Extract.Entries);
+        return 1;
+    }
+
+    BufferCount = Options->ThreadCount;
+    if (PrepareBufferPool(WorkerContext->BufferPool,
+                          Container->ChunkSize,
+                          &BufferCount,
+                          BufferCount) != 0) {
+
+        free(Extract.Entries);
+        return 1;
+    }
+
+    atomic_init(&Extract.NextChunk, Extract.FirstChunk);
+    atomic_init(&Extract.NextWorker, 0);
+    Extract.NextWrite = Extract.FirstChunk;
+    pthread_mutex_init(&Extract.Lock, NULL);
+    pthread_cond_init(&Extract.Written, NULL);
+    WorkerThreads = calloc(Options->ThreadCount, sizeof(pthread_t));
+    if (WorkerThreads == NULL) {
+        ErrorExit(errno, "Failure allocating thread array.\n");
+    }
+
+    for (Index = 1; Index < Options->ThreadCount; ++Index) {
+        Result = pthread_create(&WorkerThreads[Index],
+                                NULL,
+                                ExtractWorkerRoutine,
+                                &Extract);
+
+        if (Result != 0) {
+            ErrorExit(Result, "Failed creating thread\n");
+        }
+    }
+
+    ExtractWorkerRoutine(&Extract);
+    for (Index = 1; Index < Options->ThreadCount; ++Index) {
+        pthread_join(WorkerThreads[Index], NULL);
+    }
+
+    free(WorkerThreads);
+    free(Extract.Entries);
+    pthread_mutex_destroy(&Extract.Lock);
+    pthread_cond_destroy(&Extract.Written);
+    if (fflush(WorkerContext->IoSyncBlock->OutputStream) != 0) {
+        ErrorExit(errno, "Stream write failed\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,873 @@
+/*++
+
+Description:
+
+    This module implements --digest, which checksums the input and the
+    output of a run as it goes, so that neither file has to be read again to
+    check it. Each block is checksummed before and after it is encrypted,
+    a chunk at a time, while the chunk is still in cache.
+
+    The checksum is CRC32C, as computed by the SSE4.2 crc32 instruction, with
+    a slicing-by-8 kernel for other processors. The instruction takes three
+    cycles to produce a result but can start one every cycle, so the
+    hardware kernel runs three independent lanes, and joins them with table
+    lookups that shift one lane's CRC past the next lane's bytes.
+
+    Blocks finish in whatever order the threads get to them. CRCs of adjacent
+    pieces combine as
+
+        CRC(A B) = CRC(A) * x^(8 * |B|) + CRC(B)
+
+    modulo the polynomial, so a whole stream's CRC is the sum of its blocks'
+    CRCs, each shifted forward by the bytes after it. Those aren't known until
+    the stream ends, so each block instead adds its CRC shifted back by the
+    offset of its end, and the sum is shifted forward by the offset of the
+    stream's end once at the finish. Addition is XOR, which doesn't care about
+    order, so the result is the same however the blocks were scheduled, and
+    equals the CRC of the stream read front to back.
+
+    Containers index the CRC of each fixed size chunk of the output. Blocks
+    are cut where chunks end, and each piece adds its CRC to its chunk's in
+    the same way, so chunks needn't line up with blocks.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+#define CRC_KERNELS_X86
+
+#endif
+
+#include "homework.h"
+
+//
+// The Castagnoli polynomial, bit reversed, as the CRC32C registers hold it.
+// In that form the top bit is the coefficient of x^0.
+//
+
+#define CRC32C_POLYNOMIAL 0x82f63b78
+#define CRC_X0 0x80000000U
+#define CRC_X1 0x40000000U
+
+//
+// x^-1 is the polynomial less its x^32 term, divided by x.
+//
+
+#define CRC_X_INVERSE ((uint32_t)(CRC32C_POLYNOMIAL << 1) | 1)
+
+static
+uint32_t
+MultiplyCrc(
+    uint32_t Left,
+    uint32_t Right
+    )
+
+/*++
+
+Description:
+
+    This routine multiplies two polynomials modulo the CRC polynomial.
+
+Arguments:
+
+    Left - Supplies the first polynomial.
+
+    Right - Supplies the second polynomial.
+
+Return Value:
+
+    Returns the product.
+
+--*/
+
+{
+
+    uint32_t Mask;
+    uint32_t Product;
+
+    Product = 0;
+    for (Mask = CRC_X0; Mask != 0; Mask >>= 1) {
+        if ((Left & Mask) != 0) {
+            Product ^= Right;
+            if ((Left & (Mask - 1)) == 0) {
+                break;
+            }
+        }
+
+        Right = (Right >> 1) ^ ((Right & 1) * CRC32C_POLYNOMIAL);
+    }
+
+    return Product;
+}
+
+static
+uint32_t
+RaisePower(
+    uint32_t const * Powers,
+    uint64_t Bytes
+    )
+
+/*++
+
+Description:
+
+    This routine finds x to the power of 8 times a byte count, or of minus 8
+    times it, from a table of powers.
+
+Arguments:
+
+    Powers - Supplies the table's Powers or InversePowers.
+
+    Bytes - Supplies the byte count.
+
+Return Value:
+
+    Returns the power of x.
+
+--*/
+
+{
+
+    int Bit;
+    uint32_t Power;
+
+    Power = CRC_X0;
+    for (Bit = 0; Bytes != 0; ++Bit, Bytes >>= 1) {
+        if ((Bytes & 1) != 0) {
+            Power = MultiplyCrc(Power, Powers[Bit]);
+        }
+    }
+
+    return Power;
+}
+
+uint32_t
+UpdateCrc32cScalar(
+    CRC_TABLE const * Table,
+    uint32_t Crc,
+    byte const * Data,
+    size_t Length
+    )
+{
+    uint32_t High;
+    uint32_t Low;
+
+    Crc = ~Crc;
+    while ((Length != 0) && (((uintptr_t)Data & 7) != 0)) {
+        Crc = (Crc >> 8) ^ Table->Bytes[0][(Crc ^ *Data) & 0xff];
+        Data += 1;
+        Length -= 1;
+    }
+
+    //
+    // Assembling the words a byte at a time keeps the kernel correct on any
+    // byte order, and compiles to plain loads on little endian machines.
+    //
+
+    while (Length >= 8) {
+        Low = Crc ^ (Data[0] | (Data[1] << 8) | (Data[2] << 16) |
+                     ((uint32_t)Data[3] << 24));
+
+        High = Data[4] | (Data[5] << 8) | (Data[6] << 16) |
+               ((uint32_t)Data[7] << 24);
+
+        Crc = Table->Bytes[7][Low & 0xff] ^
+              Table->Bytes[6][(Low >> 8) & 0xff] ^
+              Table->Bytes[5][(Low >> 16) & 0xff] ^
+              Table->Bytes[4][Low >> 24] ^
+              Table->Bytes[3][High & 0xff] ^
+              Table->Bytes[2][(High >> 8) & 0xff] ^
+              Table->Bytes[1][(High >> 16) & 0xff] ^
+              Table->Bytes[0][High >> 24];
+
+        Data += 8;
+        Length -= 8;
+    }
+
+    while (Length != 0) {
+        Crc = (Crc >> 8) ^ Table->Bytes[0][(Crc ^ *Data) & 0xff];
+        Data += 1;
+        Length -= 1;
+    }
+
+    return ~Crc;
+}
+
+int
+IsCrcScalarSupported(
+    void
+    )
+{
+    return 1;
+}
+
+#if defined(CRC_KERNELS_X86)
+
+__attribute__((target("sse4.2")))
+uint32_t
+UpdateCrc32cSse42(
+    CRC_TABLE const * Table,
+    uint32_t Crc,
+    byte const * Data,
+    size_t Length
+    )
+{
+    uint64_t First;
+    size_t Index;
+    uint64_t Second;
+    uint64_t Third;
+    uint64_t Word;
+
+    First = (uint32_t)~Crc;
+    while ((Length != 0) && (((uintptr_t)Data & 7) != 0)) {
+        First = _mm_crc32_u8(First, *Data);
+        Data += 1;
+        Length -= 1;
+    }
+
+    //
+    // The second and third lanes start from zero. Shifting a lane's CRC past
+    // the next lane's bytes and adding the next lane's CRC gives the CRC of
+    // both.
+    //
+
+    while (Length >= 3 * CRC_LANE) {
+        Second = 0;
+        Third = 0;
+        for (Index = 0; Index < CRC_LANE; Index += sizeof(Word)) {
+            memcpy(&Word, Data + Index, sizeof(Word));
+            First = _mm_crc32_u64(First, Word);
+            memcpy(&Word, Data + CRC_LANE + Index, sizeof(Word));
+            Second = _mm_crc32_u64(Second, Word);
+            memcpy(&Word, Data + (2 * CRC_LANE) + Index, sizeof(Word));
+            Third = _mm_crc32_u64(Third, Word);
+        }
+
+        First = Table->LaneShift[0][First & 0xff] ^
+                Table->LaneShift[1][(First >> 8) & 0xff] ^
+                Table->LaneShift[2][(First >> 16) & 0xff] ^
+                Table->LaneShift[3][(First >> 24) & 0xff] ^
+                Second;
+
+        First = Table->LaneShift[0][First & 0xff] ^
+                Table->LaneShift[1][(First >> 8) & 0xff] ^
+                Table->LaneShift[2][(First >> 16) & 0xff] ^
+                Table->LaneShift[3][(First >> 24) & 0xff] ^
+                Third;
+
+        Data += 3 * CRC_LANE;
+        Length -= 3 * CRC_LANE;
+    }
+
+    while (Length >= sizeof(Word)) {
+        memcpy(&Word, Data, sizeof(Word));
+        First = _mm_crc32_u64(First, Word);
+        Data += sizeof(Word);
+        Length -= sizeof(Word);
+    }
+
+    while (Length != 0) {
+        First = _mm_crc32_u8(First, *Data);
+        Data += 1;
+        Length -= 1;
+    }
+
+    return ~(uint32_t)First;
+}
+
+int
+IsCrcSse42Supported(
+    void
+    )
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#endif
+
+CRC_KERNEL const CrcKernels[] = {
+
+#if defined(CRC_KERNELS_X86)
+
+    {"sse4.2", IsCrcSse42Supported, UpdateCrc32cSse42},
+
+#endif
+
+    {"scalar", IsCrcScalarSupported, UpdateCrc32cScalar}
+};
+
+int const CrcKernelCount = sizeof(CrcKernels) / sizeof(CrcKernels[0]);
+
+void
+BuildCrcTable(
+    CRC_TABLE * Table
+    )
+
+/*++
+
+Description:
+
+    This routine builds the tables the CRC kernels and digests work from, and
+    selects the most preferred kernel the processor supports.
+
+Arguments:
+
+    Table - Supplies the table to build.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    int Bit;
+    uint32_t Crc;
+    int Index;
+    uint32_t LaneShift;
+    int Slice;
+    uint32_t Value;
+
+    for (Value = 0; Value < 256; ++Value) {
+        Crc = Value;
+        for (Bit = 0; Bit < 8; ++Bit) {
+            Crc = (Crc >> 1) ^ ((Crc & 1) * CRC32C_POLYNOMIAL);
+        }
+
+        Table->Bytes[0][Value] = Crc;
+    }
+
+    for (Slice = 1; Slice < 8; ++Slice) {
+        for (Value = 0; Value < 256; ++Value) {
+            Crc = Table->Bytes[Slice - 1][Value];
+            Table->Bytes[Slice][Value] =
+                (Crc >> 8) ^ Table->Bytes[0][Crc & 0xff];
+        }
+    }
+
+    //
+    // Each power is the square of the one before.
+    //
+
+    Table->Powers[0] = MultiplyCrc(CRC_X1, CRC_X1);
+    Table->Powers[0] = MultiplyCrc(Table->Powers[0], Table->Powers[0]);
+    Table->Powers[0] = MultiplyCrc(Table->Powers[0], Table->Powers[0]);
+    Table->InversePowers[0] = MultiplyCrc(CRC_X_INVERSE, CRC_X_INVERSE);
+    Table->InversePowers[0] = MultiplyCrc(Table->InversePowers[0],
+                                          Table->InversePowers[0]);
+
+    Table->InversePowers[0] = MultiplyCrc(Table->InversePowers[0],
+                                          Table->InversePowers[0]);
+
+    for (Index = 1; Index < 64; ++Index) {
+        Table->Powers[Index] = MultiplyCrc(Table->Powers[Index - 1],
+                                           Table->Powers[Index - 1]);
+
+        Table->InversePowers[Index] =
+            MultiplyCrc(Table->InversePowers[Index - 1],
+                        Table->InversePowers[Index - 1]);
+    }
+
+    //
+    // Shifting is linear, so a CRC is shifted a byte at a time, and the
+    // shifted bytes added.
+    //
+
+    LaneShift = RaisePower(Table->Powers, CRC_LANE);
+    for (Slice = 0; Slice < 4; ++Slice) {
+        for (Value = 0; Value < 256; ++Value) {
+            Table->LaneShift[Slice][Value] =
+                MultiplyCrc(LaneShift, Value << (8 * Slice));
+        }
+    }
+
+    for (Index = 0; Index < CrcKernelCount - 1; ++Index) {
+        if (CrcKernels[Index].IsSupported() != 0) {
+            break;
+        }
+    }
+
+    Table->Update = CrcKernels[Index].Update;
+}
+
+uint32_t
+UpdateCrc32c(
+    CRC_TABLE const * Table,
+    uint32_t Crc,
+    void const * Data,
+    size_t Length
+    )
+
+/*++
+
+Description:
+
+    This routine continues a CRC32C over more bytes.
+
+Arguments:
+
+    Table - Supplies the CRC table.
+
+    Crc - Supplies the CRC of the bytes so far, which is zero (0) for none.
+
+    Data - Supplies the bytes to add.
+
+    Length - Supplies the number of bytes to add.
+
+Return Value:
+
+    Returns the CRC of the bytes so far and the new ones.
+
+--*/
+
+{
+
+    return Table->Update(Table, Crc, Data, Length);
+}
+
+uint32_t
+CombineCrc32c(
+    CRC_TABLE const * Table,
+    uint32_t First,
+    uint32_t Second,
+    uint64_t SecondLength
+    )
+
+/*++
+
+Description:
+
+    This routine finds the CRC32C of two runs of bytes, one after the other,
+    from the CRCs of each.
+
+Arguments:
+
+    Table - Supplies the CRC table.
+
+    First - Supplies the CRC of the first run.
+
+    Second - Supplies the CRC of the second run.
+
+    SecondLength - Supplies the length of the second run.
+
+Return Value:
+
+    Returns the CRC of both runs.
+
+--*/
+
+{
+
+    return MultiplyCrc(First, RaisePower(Table->Powers, SecondLength)) ^
+           Second;
+}
+
+int
+InitializeDigest(
+    DIGEST * Digest,
+    CRC_TABLE const * Table,
+    uint64_t Start,
+    int Flags,
+    uint64_t ChunkSize
+    )
+
+/*++
+
+Description:
+
+    This routine initializes a digest of a stream with nothing in it yet.
+
+Arguments:
+
+    Digest - Supplies the digest to initialize.
+
+    Table - Supplies the CRC table, which must outlive the digest.
+
+    Start - Supplies the stream offset of the first byte of the stream.
+
+    Flags - Supplies DIGEST_STREAM to digest the whole input and output, and
+        DIGEST_CHUNKS to checksum each chunk of the output.
+
+    ChunkSize - Supplies the size of a chunk, if chunks are checksummed.
+        Chunks start at the start of the stream.
+
+Return Value:
+
+    Returns zero (0) on success, or ENOMEM.
+
+--*/
+
+{
+
+    Digest->Table = Table;
+    Digest->Start = Start;
+    Digest->Flags = Flags;
+    Digest->ChunkSize = ChunkSize;
+    Digest->Segments = NULL;
+    atomic_init(&Digest->Length, 0);
+    atomic_init(&Digest->Input, 0);
+    atomic_init(&Digest->Output, 0);
+    if ((Flags & DIGEST_CHUNKS) != 0) {
+        Digest->Segments = calloc(DIGEST_SEGMENTS, sizeof(Digest->Segments[0]));
+        if (Digest->Segments == NULL) {
+            return ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+void
+FreeDigest(
+    DIGEST * Digest
+    )
+
+/*++
+
+Description:
+
+    This routine frees a digest's chunk checksums.
+
+Arguments:
+
+    Digest - Supplies the digest.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    size_t Index;
+
+    if (Digest->Segments != NULL) {
+        for (Index = 0; Index < DIGEST_SEGMENTS; ++Index) {
+            free(atomic_load(&Digest->Segments[Index]));
+        }
+
+        free(Digest->Segments);
+        Digest->Segments = NULL;
+    }
+}
+
+static
+_Atomic uint32_t *
+GetChunkSlot(
+    DIGEST * Digest,
+    uint64_t Chunk
+    )
+
+/*++
+
+Description:
+
+    This routine finds where a chunk's checksum is gathered, allocating its
+    segment if no thread has yet.
+
+Arguments:
+
+    Digest - Supplies the digest.
+
+    Chunk - Supplies the index of the chunk.
+
+Return Value:
+
+    Returns the chunk's slot. Failures are fatal.
+
+--*/
+
+{
+
+    uint64_t Index;
+    _Atomic uint32_t * Segment;
+    _Atomic uint32_t * Winner;
+
+    Index = Chunk / DIGEST_SEGMENT_CHUNKS;
+    if (Index >= DIGEST_SEGMENTS) {
+        ErrorExit(EFBIG, "The stream has too many chunks to index\n");
+    }
+
+    Segment = atomic_load_explicit(&Digest->Segments[Index],
+                                   memory_order_acquire);
+
+    if (Segment == NULL) {
+        Segment = calloc(DIGEST_SEGMENT_CHUNKS, sizeof(Segment[0]));
+        if (Segment == NULL) {
+            ErrorExit(errno, "Failure allocating chunk checksums\n");
+        }
+
+        Winner = NULL;
+        if (atomic_compare_exchange_strong(&Digest->Segments[Index],
+                                           &Winner,
+                                           Segment) == 0) {
+
+            free(Segment);
+            Segment = Winner;
+        }
+    }
+
+    return &Segment[Chunk % DIGEST_SEGMENT_CHUNKS];
+}
+
+int
+EncryptAndDigest(
+    DIGEST * Digest,
+    byte * Destination,
+    byte const * Source,
+    size_t Length,
+    uint64_t Offset,
+    KEY_TABLE const * KeyTable
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts a block, and adds it to the digest of the stream.
+    Every byte of the stream must be added exactly once, in any order.
+
+Arguments:
+
+    Digest - Supplies the digest, or NULL to only encrypt.
+
+    Destination - Supplies the buffer to receive the encrypted block.
+
+    Source - Supplies the block to encrypt. It may be the destination.
+
+    Length - Supplies the length of the block.
+
+    Offset - Supplies the stream offset of the block.
+
+    KeyTable - Supplies the key table.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero on failure.
+
+--*/
+
+{
+
+    uint64_t Chunk;
+    size_t Done;
+    uint32_t Input;
+    uint32_t Inverse;
+    uint32_t Output;
+    size_t Piece;
+    size_t Segment;
+    size_t SegmentDone;
+    CRC_TABLE const * Table;
+
+    if (Digest == NULL) {
+        return EncryptCopy(Destination, Source, Length, Offset, KeyTable);
+    }
+
+    //
+    // The block is split where chunks end, and each piece of a chunk is
+    // checksummed in cache sized parts.
+    //
+
+    Table = Digest->Table;
+    Chunk = 0;
+    for (Done = 0; Done < Length; Done += Segment) {
+        Segment = Length - Done;
+        if ((Digest->Flags & DIGEST_CHUNKS) != 0) {
+            Chunk = (Offset + Done - Digest->Start) / Digest->ChunkSize;
+            if (Segment > Digest->Start + ((Chunk + 1) * Digest->ChunkSize) -
+                          (Offset + Done)) {
+
+                Segment = Digest->Start + ((Chunk + 1) * Digest->ChunkSize) -
+                          (Offset + Done);
+            }
+        }
+
+        Input = 0;
+        Output = 0;
+        for (SegmentDone = 0; SegmentDone < Segment; SegmentDone += Piece) {
+            Piece = Segment - SegmentDone;
+            if (Piece > DIGEST_CHUNK) {
+                Piece = DIGEST_CHUNK;
+            }
+
+            if ((Digest->Flags & DIGEST_STREAM) != 0) {
+                Input = Table->Update(Table,
+                                      Input,
+                                      Source + Done + SegmentDone,
+                                      Piece);
+            }
+
+            if (EncryptCopy(Destination + Done + SegmentDone,
+                            Source + Done + SegmentDone,
+                            Piece,
+                            Offset + Done + SegmentDone,
+                            KeyTable) != 0) {
+
+                return 1;
+            }
+
+            Output = Table->Update(Table,
+                                   Output,
+                                   Destination + Done + SegmentDone,
+                                   Piece);
+        }
+
+        Inverse = RaisePower(Table->InversePowers, Offset + Done + Segment);
+        Output = MultiplyCrc(Output, Inverse);
+        if ((Digest->Flags & DIGEST_STREAM) != 0) {
+            atomic_fetch_xor(&Digest->Input, MultiplyCrc(Input, Inverse));
+            atomic_fetch_xor(&Digest->Output, Output);
+        }
+
+        if ((Digest->Flags & DIGEST_CHUNKS) != 0) {
+            atomic_fetch_xor(GetChunkSlot(Digest, Chunk), Output);
+        }
+    }
+
+    atomic_fetch_add(&Digest->Length, Length);
+    return 0;
+}
+
+void
+GetDigest(
+    DIGEST * Digest,
+    uint32_t * Input,
+    uint32_t * Output,
+    uint64_t * Length
+    )
+
+/*++
+
+Description:
+
+    This routine finds the CRCs of a stream once every block has been added.
+
+Arguments:
+
+    Digest - Supplies the digest.
+
+    Input - Receives the CRC of the input.
+
+    Output - Receives the CRC of the output.
+
+    Length - Receives the number of bytes digested.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    uint32_t Power;
+
+    *Length = atomic_load(&Digest->Length);
+    Power = RaisePower(Digest->Table->Powers, Digest->Start + *Length);
+    *Input = MultiplyCrc(atomic_load(&Digest->Input), Power);
+    *Output = MultiplyCrc(atomic_load(&Digest->Output), Power);
+}
+
+uint32_t
+GetChunkChecksum(
+    DIGEST * Digest,
+    uint64_t Chunk
+    )
+
+/*++
+
+Description:
+
+    This routine finds the CRC of a chunk of the output once every block has
+    been added.
+
+Arguments:
+
+    Digest - Supplies the digest, which must checksum chunks.
+
+    Chunk - Supplies the index of the chunk.
+
+Return Value:
+
+    Returns the CRC of the chunk.
+
+--*/
+
+{
+
+    uint64_t End;
+    uint64_t Length;
+
+    Length = atomic_load(&Digest->Length);
+    End = (Chunk + 1) * Digest->ChunkSize;
+    if (End > Length) {
+        End = Length;
+    }
+
+    return MultiplyCrc(atomic_load(GetChunkSlot(Digest, Chunk)),
+                       RaisePower(Digest->Table->Powers, Digest->Start + End));
+}
+
+void
+ReportDigest(
+    FILE * Stream,
+    DIGEST * Digest,
+    char const * InputName,
+    char const * OutputName
+    )
+
+/*++
+
+Description:
+
+    This routine writes a line giving a stream's CRCs and length, and the
+    names of its files if it has any.
+
+Arguments:
+
+    Stream - Supplies the stream to write to.
+
+    Digest - Supplies the digest.
+
+    InputName - Supplies the name of the input file, or NULL.
+
+    OutputName - Supplies the name of the output file, or NULL.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    uint32_t Input;
+    uint64_t Length;
+    uint32_t Output;
+
+    GetDigest(Digest, &Input, &Output, &Length);
+    fprintf(Stream,
+            "crc32c %08x %08x %llu",
+            Input,
+            Output,
+            (unsigned long long)Length);
+
+    if (InputName != NULL) {
+        fprintf(Stream, " %s %s", InputName, OutputName);
+    }
+
+    fprintf(Stream, "\n");
+}
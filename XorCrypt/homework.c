@@ -44,7 +44,9 @@ Description:
         written.
         
       * The key material used to encrypt a character at a given offset can
-        be calculated in constant time.
+        be calculated in constant time. GenerateKeystream() does exactly
+        that, and it lets the program encrypt or decrypt any byte range of a
+        seekable stream without processing what precedes it.
         
     The implementation below divides the encryption work amongst N threads,
     as specified on the command line. Because the problem statement didn't 
@@ -64,23 +66,35 @@ Description:
     contains the condition variables, mutices, and stream information necessary
     to perform concurrent IO.
     
-    Reads are synchronized by a reader mutex. A read returns the stream data and
-    its offset. The current stream offset is updated under the mutex as well.
+    Reads are synchronized by a reader mutex. A read returns the stream data,
+    its offset, and its sequence number. The current stream offset is updated
+    under the mutex as well.
     
-    Writes are synchronized by a writer mutex. A writer must specify the offset
-    in the stream to write to. If the current write stream offset matches the
-    requested offset, the write is satisfied immediately, and a condition 
-    variable is signaled. If the current write stream offset does not match, 
-    the write will block until the condition is signalled, test the current
-    write offset for the stream, and satisfy the write or block again as
-    appropriate.
+    Writes go through a reorder buffer indexed by block sequence number. A
+    thread that finishes a block parks it in the reorder buffer, takes a fresh
+    buffer from the free list, and moves on to its next block. If the parked
+    block is the next one due in the output stream, that thread becomes the
+    writer: it drains every contiguous completed block in one writev(), outside
+    the writer mutex, and keeps draining blocks that complete meanwhile. No
+    thread waits for the write of a particular block. A thread only waits if
+    it gets a full reorder buffer ahead of the output stream.
 
 Analysis:
 
     There are obvious improvements that can be made with the implementation.
     
-    Key iteration requires one memory allocations. This allocation could be
-    done up front once rather than for every iteration. 
+    Key iteration is done once, up front. Every key iteration K_i is the
+    original key rotated left by i bits, so the key is expanded into a table of
+    its eight bit-rotated phases, each stored twice. Any K_i is then a
+    contiguous slice of one phase, and encryption is a streaming XOR that
+    never allocates or rotates on the hot path. All threads share the table.
+    A table for a very long key would be huge, so such keys are left as they
+    are mapped from the key file, and each block's key material is shifted
+    out of the key as the block is encrypted. Short keys go the other way:
+    their keystream repeats every 8 * |K| * |K| bytes, so a period of it is
+    precomputed, and blocks are XORed with it many kilobytes at a time rather
+    than one key iteration at a time. Per-block work depends only on the
+    block's length in every case.
     
     Error handling is always fatal, as there is no way to gracefully handle an
     error and leave the encrypted stream in a useable state. At best, some
@@ -103,25 +117,35 @@ Analysis:
     it's likely Reads and Writes serialize against one another as well.
     
     It's conceivable that writes could occur out of order. The implementation
-    handles this by blocking out of order writes. This will result in idle CPUs
-    when the number of threads is less than or equal to number of processors.
+    handles this by parking out of order blocks in the reorder buffer, rather
+    than blocking the threads that produced them, so CPUs stay busy as long as
+    the reorder buffer has room.
     
     The implementation handles encryption in fixed size blocks. Tuning these 
     blocks to some ideal size for the given filesystem would likely affect 
-    performance. The current implementation uses a block size of 64k. An
-    implementation that took the block size from the command line would allow
-    one to anyalyze performance for various block sizes.
+    performance. The default block size is 64k, and -b takes another from the
+    command line. With -b auto, the engine is timed on consecutive samples of
+    the stream at a range of block sizes, and the fastest is used for the
+    rest. The samples are encrypted as part of the stream, not set aside, so
+    tuning works on pipes too.
 
 --*/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "homework.h"
 
@@ -146,9 +170,121 @@ Arguments:
 
         -k <filename>   Specifies the key file
         -n <count>      Specifies the number of threads to create.
+        -b <size>       Specifies the block size, with an optional k, m, or g
+                        suffix. The default is 64k. "auto" times the engine
+                        on the first few megabytes of the stream at a range
+                        of block sizes, and uses the fastest for the rest.
+        -v              Reports the block size tuning, and the memory
+                        behind the block buffers, on stderr.
+        -e <engine>     Specifies the engine: "stream", "pipeline", "mmap",
+                        "pread", "uring", or "auto" (the default). The
+                        automatic choice maps the streams when both are
+                        regular files, uses io_uring (or failing that,
+                        positional I/O) when both are otherwise seekable,
+                        and streams them otherwise. The io_uring engine
+                        falls back the same way when it can't be used.
+                        The "splice" engine, for pipes, runs the pipeline
+                        with larger pipes, reading the input descriptor
+                        directly and splicing pages into the output pipe.
+                        It is only safe if the consumer reads the pipe
+                        rather than splicing from it.
+        --queue-depth <count>
+                        Specifies the number of blocks in flight in the
+                        pipeline engine, or per thread in the io_uring
+                        engine.
+        --offset <n>    Specifies the stream offset at which to start. The
+                        preceding input is skipped, and not written. The
+                        offset and length take the same suffixes as -b.
+        --length <n>    Specifies the number of bytes to process. By default
+                        the stream is processed to end-of-file.
+        -i <filename>   Encrypts the file in place rather than stdin to
+                        stdout. The offset and length select the range of
+                        the file to transform, and the rest is untouched.
+        --stats <format>
+                        Reports on stderr at exit where each thread spent
+                        its time, and a histogram of block latencies, as
+                        "text" or "json".
+        --stats-interval <seconds>
+                        Also reports the statistics so far at the given
+                        interval.
+        --cpus <list>   Pins worker N to the Nth CPU of a list such as
+                        "0-3,8", wrapping around.
+        --io-cpus <list>
+                        Pins the threads that only read or write the
+                        streams to the listed CPUs.
+        --numa          Places workers on NUMA nodes, round-robin unless
+                        --cpus is given, and allocates their block buffers
+                        and a replica of the key table on their own nodes.
+                        Threads that only read or write go on the node of
+                        their stream's device, when that is known.
+        --manifest <filename>
+                        Encrypts a batch of files rather than stdin to
+                        stdout. Each line of the manifest names an input
+                        and an output file, separated by a tab or spaces.
+                        "-" reads the manifest from stdin. One pool of
+                        threads encrypts every file, and a file that fails
+                        is reported without stopping the rest.
+        -- <input> <output> ...
+                        Adds pairs of input and output files to the batch.
+        --memory-limit <size>
+                        Caps the memory given to block buffers, with the
+                        same suffixes as -b. Engines shorten their queues
+                        to fit, and fail if even the shortest doesn't.
+        --digest        Reports on stderr the CRC32C of the input and of
+                        the output, and the number of bytes, as
+                        "crc32c <input> <output> <bytes>", followed by the
+                        file names in a batch. The checksums are taken as
+                        each block is encrypted, and are the same as those
+                        of the whole files read front to back.
+        --digest-file <filename>
+                        Writes the digests to a file rather than stderr.
+        --container     Writes the output as a container: a header, the
+                        encrypted stream in chunks of the block size, and
+                        an index of the chunks and their CRC32Cs, so that
+                        parts of it can be decrypted on their own.
+        --extract <offset>[:<length>]
+                        Decrypts a range of the container on stdin, which
+                        must be a file, to stdout. The offset is a stream
+                        offset, as for --offset. Only the chunks covering
+                        the range are read, and each is checked against
+                        the index before it is decrypted.
+        --checkpoint <filename>
+                        Records every few seconds how much of the output,
+                        which must be a regular file, is written and
+                        flushed. The mmap and io_uring engines aren't used.
+                        The checkpoint is removed when the run succeeds.
+        --resume        Carries on from the checkpoint left by an
+                        interrupted run with the same key and range, or
+                        starts from the beginning if there is none. Open
+                        the output with 1<> rather than >, so that what
+                        was written isn't truncated away.
+        --shard <i>/<N> Encrypts only the ith of N equal ranges of the
+                        input, which must be a regular file, into the same
+                        range of the output. Every shard opens the output
+                        with 1<>, and extends it to the whole stream's
+                        length. Shards start on 1m boundaries.
+        --range <offset>[:<length>]
+                        Encrypts the given range of the input into the
+                        same range of the output, as a shard does.
+        --part          Writes a shard's range alone to the output, as a
+                        part file, rather than into its place.
+        --verify <digest> ...
+                        Combines the --digest lines of a set of shards,
+                        given in stream order, into the digest of the whole
+                        stream, and checks the output on stdin against it.
+                        Neither -k nor -n is needed.
+        --merge <digest> ...
+                        Verifies as --verify does, while copying stdin to
+                        stdout, which joins part files.
+        --direct        Reads and writes with O_DIRECT, bypassing the page
+                        cache. Both streams must be files or block devices
+                        positioned at multiples of 4k, and the block size a
+                        multiple of 4k. Only the pread and io_uring engines
+                        and -i can be used, and io_uring with a deep
+                        --queue-depth keeps the most requests in flight.
 
     N.B.: Additionally, this routine reads input from stdin, and writes its 
-          output to stdout.
+          output to stdout, unless -i or a batch is given.
 
 Return Value:
 
@@ -159,18 +295,41 @@ Return Value:
 
 {
 
-    int Index;
-    IO_SYNCHRONIZATION_BLOCK IoSyncBlock;
     byte * Key;
     size_t KeyLength;
     OPTIONS Options;
+
+#if defined(REFERENCE_IMPL)
+
+    uint64_t Remaining;
+
+#else
+
+    BUFFER_POOL BufferPool;
+    CHECKPOINT Checkpoint;
+    CONTAINER Container;
+    CRC_TABLE * CrcTable;
+    DIGEST Digest;
+    int DigestFlags;
+    IO_SYNCHRONIZATION_BLOCK IoSyncBlock;
+    KEY_TABLE KeyTable;
+    PLACEMENT Placement;
     int Result;
     WORKER_CONTEXT WorkerContext;
-    pthread_t * WorkerThreads;
+
+#endif
 
     if (ParseCommandLine(argc, argv, &Options) != 0) {
         exit(1);
     }
+
+    if (Options.Engine == ENGINE_VERIFY) {
+        if (RunVerify(&Options) != 0) {
+            exit(1);
+        }
+
+        exit(0);
+    }
     
     // 
     // Read the key.
@@ -185,6 +344,45 @@ Return Value:
         exit(1);
     }
 
+    //
+    // A shard picks its range, and its place in the output, from the size of
+    // the input.
+    //
+
+    if (((Options.ShardCount != 0) || (Options.PlaceOutput != 0)) &&
+        (ResolveShard(&Options, stdin, stdout) != 0)) {
+
+        exit(1);
+    }
+
+#if !defined(REFERENCE_IMPL)
+
+    //
+    // Resuming moves the range past what the checkpoint records, so it comes
+    // before the input is positioned.
+    //
+
+    if ((Options.CheckpointFileName != NULL) &&
+        (OpenCheckpoint(&Checkpoint, &Options, Key, KeyLength, stdout) != 0)) {
+
+        exit(1);
+    }
+
+#endif
+
+    //
+    // Move the input to the start of the requested range.
+    //
+
+    if ((Options.InPlaceFileName == NULL) &&
+        (Options.Engine != ENGINE_BATCH) &&
+        (Options.Engine != ENGINE_EXTRACT) &&
+        (SkipInput(stdin, Options.RangeOffset) != 0)) {
+
+        fprintf(stderr, "Failure seeking input to the requested offset\n");
+        exit(1);
+    }
+
 #if defined(REFERENCE_IMPL)
 
     //
@@ -192,8 +390,29 @@ Return Value:
     // time, XORs it with key material, and writes it out. The key is rotated 
     // one bit once the material is exhausted.
     //
-    
-    for (Index = 0;; ++Index) {
+
+    size_t Index;
+
+    if ((Options.InPlaceFileName != NULL) ||
+        (Options.Engine == ENGINE_BATCH) ||
+        (Options.Engine == ENGINE_EXTRACT) ||
+        (Options.Digest != 0) ||
+        (Options.Container != 0) ||
+        (Options.CheckpointFileName != NULL)) {
+
+        fprintf(stderr,
+                "The reference implementation does not support -i, "
+                "batches, digests, containers, or checkpoints\n");
+
+        exit(1);
+    }
+
+    IterateKey(Key, KeyLength, Options.RangeOffset / KeyLength);
+    Remaining = Options.RangeLength;
+    for (Index = Options.RangeOffset % KeyLength;
+         Remaining > 0;
+         ++Index, --Remaining) {
+
         int Input;
         
         Input = fgetc(stdin);
@@ -214,17 +433,35 @@ Return Value:
 #else
     
     //
-    // This is the multithreaded implementation. The implementation spawns
-    // N-1 threads, and runs one instance of the algorithm on the current 
-    // thread (resulting in N threads running the algorithm).
+    // This is the multithreaded implementation. By default the implementation
+    // spawns N-1 threads, and runs one instance of the algorithm on the
+    // current thread (resulting in N threads running the algorithm). The
+    // pipeline engine instead dedicates one thread each to reading and
+    // writing, and runs N encryption threads between them.
     //
     
+    //
+    // Expand the key into the table of its rotations, shared by all threads.
+    //
+
+    if (BuildKeyTable(Key, KeyLength, &KeyTable) != 0) {
+        fprintf(stderr, "Memory allocation failure for key table\n");
+        exit(1);
+    }
+
     //
     // Initialize the IO state.
     //
 
-    IoSyncBlock.ReadOffset = 0;                
-    IoSyncBlock.WriteOffset = 0;
+    IoSyncBlock.ReadOffset = Options.RangeOffset;
+    IoSyncBlock.WriteOffset = Options.RangeOffset;
+    IoSyncBlock.ReadLimit = Options.RangeOffset + Options.RangeLength;
+    if (IoSyncBlock.ReadLimit < Options.RangeOffset) {
+        IoSyncBlock.ReadLimit = UINT64_MAX;
+    }
+
+    IoSyncBlock.ReadSequence = 0;
+    IoSyncBlock.WriteSequence = 0;
     IoSyncBlock.InputStream = stdin;
     IoSyncBlock.OutputStream = stdout;
     pthread_mutex_init(&IoSyncBlock.ReadLock, NULL);
@@ -236,57 +473,204 @@ Return Value:
     //
     
     WorkerContext.IoSyncBlock = &IoSyncBlock;
-    WorkerContext.Key = Key;
-    WorkerContext.KeyLength = KeyLength;
+    WorkerContext.KeyTable = &KeyTable;
     WorkerContext.Options = &Options;
+    WorkerContext.Placement = NULL;
+    WorkerContext.BufferPool = &BufferPool;
+    InitializeBufferPool(&BufferPool, Options.MemoryLimit, Options.Verbose);
+    WorkerContext.Digest = NULL;
+    WorkerContext.DigestStream = stderr;
+    WorkerContext.Container = NULL;
+    WorkerContext.Checkpoint = NULL;
+    CrcTable = NULL;
+    if ((Options.Digest != 0) ||
+        (Options.Container != 0) ||
+        (Options.Engine == ENGINE_EXTRACT)) {
+
+        CrcTable = malloc(sizeof(CRC_TABLE));
+        if (CrcTable == NULL) {
+            fprintf(stderr, "Memory allocation failure for CRC table\n");
+            exit(1);
+        }
+
+        BuildCrcTable(CrcTable);
+    }
 
     //
-    // Create additional worker threads as necessary.
+    // A container's chunks are the blocks of the default or given size,
+    // even if tuning then picks another block size.
     //
-    
-    if (Options.ThreadCount > 1) {
-        WorkerThreads = calloc(Options.ThreadCount - 1, sizeof(pthread_t));
-        if (WorkerThreads == NULL) {
-            ErrorExit(errno, "Failure allocating thread array.\n");
+
+    if ((Options.Container != 0) || (Options.Engine == ENGINE_EXTRACT)) {
+        memset(&Container, 0, sizeof(Container));
+        Container.Table = CrcTable;
+        Container.KeyFingerprint = UpdateCrc32c(CrcTable, 0, Key, KeyLength);
+        Container.ChunkSize = Options.BlockSize;
+        Container.StreamOffset = Options.RangeOffset;
+        WorkerContext.Container = &Container;
+    }
+
+    if ((Options.Digest != 0) || (Options.Container != 0)) {
+        DigestFlags = 0;
+        if (Options.Digest != 0) {
+            DigestFlags |= DIGEST_STREAM;
         }
-        
-        for (Index = 0; Index < Options.ThreadCount - 1; ++Index) {
-            Result = pthread_create(&WorkerThreads[Index],
-                                    NULL, 
-                                    WorkerThreadRoutine,
-                                    &WorkerContext);
-                                    
-            if (Result != 0) {
-                ErrorExit(Result, "Failed creating thread\n");
+
+        if (Options.Container != 0) {
+            DigestFlags |= DIGEST_CHUNKS;
+        }
+
+        if (InitializeDigest(&Digest,
+                             CrcTable,
+                             Options.RangeOffset,
+                             DigestFlags,
+                             Options.BlockSize) != 0) {
+
+            fprintf(stderr, "Memory allocation failure for the digest\n");
+            exit(1);
+        }
+
+        WorkerContext.Digest = &Digest;
+    }
+
+    if (Options.Digest != 0) {
+        if (Options.DigestFileName != NULL) {
+            WorkerContext.DigestStream = fopen(Options.DigestFileName, "w");
+            if (WorkerContext.DigestStream == NULL) {
+                ErrorExit(errno,
+                          "Failure creating %s\n",
+                          Options.DigestFileName);
             }
         }
     }
-    
+
     //
-    // This thread gets to work, too.
+    // Work out where threads go, if asked to.
     //
-    
-    WorkerThreadRoutine(&WorkerContext);
-    
+
+    if ((Options.CpuCount != 0) ||
+        (Options.IoCpuCount != 0) ||
+        (Options.Numa != 0)) {
+
+        if (InitializePlacement(&Placement, &Options, Key, KeyLength) != 0) {
+            exit(1);
+        }
+
+        WorkerContext.Placement = &Placement;
+    }
+
+    if (Options.StatsFormat != STATS_NONE) {
+        EnableStats();
+        if ((Options.StatsInterval != 0) &&
+            (StartStatsReporter(Options.StatsFormat,
+                                Options.StatsInterval) != 0)) {
+
+            fprintf(stderr, "Failure starting the statistics reporter\n");
+            exit(1);
+        }
+    }
+
     //
-    // Wait for the other worker threads to complete.
+    // Run the selected engine to completion, first tuning the block size if
+    // asked to. In-place encryption has its own engine, since the input and
+    // the output are the same file, and so do batches. Neither is tuned.
     //
-    
-    if (Options.ThreadCount > 1) {
-        for (Index = 0; Index < Options.ThreadCount - 1; ++Index) {
-            pthread_join(WorkerThreads[Index], NULL);
+
+    if (Options.InPlaceFileName != NULL) {
+        Options.Engine = ENGINE_IN_PLACE;
+    }
+
+    if ((Options.Engine == ENGINE_IN_PLACE) ||
+        (Options.Engine == ENGINE_BATCH) ||
+        (Options.Engine == ENGINE_EXTRACT)) {
+
+        Options.AutoBlockSize = 0;
+    }
+
+    if ((Options.Container != 0) &&
+        (WriteContainerHeader(&Container, IoSyncBlock.OutputStream) != 0)) {
+
+        exit(1);
+    }
+
+    if (Options.CheckpointFileName != NULL) {
+        WorkerContext.Checkpoint = &Checkpoint;
+        StartCheckpoint(&Checkpoint, &WorkerContext);
+    }
+
+    if (Options.AutoBlockSize != 0) {
+        Result = TuneBlockSize(&WorkerContext, &Options);
+
+    } else {
+        Result = RunEngine(&WorkerContext);
+    }
+
+    if (WorkerContext.Checkpoint != NULL) {
+        FinishCheckpoint(&Checkpoint, Result);
+    }
+
+    if ((Result == 0) &&
+        (Options.Container != 0) &&
+        (WriteContainerIndex(&Container, &Digest, IoSyncBlock.OutputStream) !=
+         0)) {
+
+        Result = 1;
+    }
+
+    //
+    // Statistics are reported even if the run failed, since a batch fails
+    // when any one of its files does.
+    //
+
+    if (Options.StatsInterval != 0) {
+        StopStatsReporter();
+    }
+
+    ReportStats(stderr, Options.StatsFormat);
+    if (Result != 0) {
+        exit(1);
+    }
+
+    //
+    // A batch has already reported a digest for each of its files.
+    //
+
+    if (Options.Digest != 0) {
+        if (Options.Engine != ENGINE_BATCH) {
+            ReportDigest(WorkerContext.DigestStream, &Digest, NULL, NULL);
         }
-        
-        free(WorkerThreads);
+
+        if ((WorkerContext.DigestStream != stderr) &&
+            (fclose(WorkerContext.DigestStream) != 0)) {
+
+            ErrorExit(errno,
+                      "Failure writing %s\n",
+                      Options.DigestFileName);
+        }
+    }
+
+    if (WorkerContext.Digest != NULL) {
+        FreeDigest(&Digest);
+    }
+
+    free(CrcTable);
+
+    if (WorkerContext.Placement != NULL) {
+        FreePlacement(&Placement);
     }
 
+    FreeBufferPool(&BufferPool);
+    FreeKeyTable(&KeyTable);
+
 #endif
     
     //
     // Clean up as necessary.
     //
 
-    free(Key);
+    free(Options.Cpus);
+    free(Options.IoCpus);
+    FreeKey(Key, KeyLength);
     exit(0);
 }
 
@@ -301,7 +685,8 @@ ReadBlock(
     IO_SYNCHRONIZATION_BLOCK * IoSyncBlock,
     byte * Buffer,
     size_t BufferLength,
-    size_t * Offset,
+    uint64_t * Offset,
+    uint64_t * Sequence,
     size_t * BytesRead
     )
     
@@ -312,7 +697,8 @@ Description:
     This routine reads a block of bytes from a stream synchronously with other
     reads. If another read is in progress, this routine will block until it 
     completes. After reading the block, the ReadOffset in the IoSyncBlock will
-    be updated with the current offset of the input stream.
+    be updated with the current offset of the input stream. Reads stop short
+    at the ReadLimit in the IoSyncBlock, after which no bytes are returned.
     
 Arguments:
 
@@ -327,6 +713,9 @@ Arguments:
         
     Offset - Supplies a pointer to memory that receives the stream offset from 
         which the bytes were read.
+
+    Sequence - Supplies a pointer to memory that receives the sequence number
+        of the block. Only blocks holding at least one byte are numbered.
         
     BytesRead - Supplies a pointer to memory that receives the number of bytes
         read from the stream.
@@ -340,11 +729,25 @@ Return Value:
 
 {
 
+    uint64_t Start;
+
+    Start = StartStatsTimer();
     pthread_mutex_lock(&IoSyncBlock->ReadLock);
+    StopStatsTimer(STAT_READ_LOCK_WAIT, Start);
+
+    if (BufferLength > IoSyncBlock->ReadLimit - IoSyncBlock->ReadOffset) {
+        BufferLength = IoSyncBlock->ReadLimit - IoSyncBlock->ReadOffset;
+    }
 
+    Start = StartStatsTimer();
     *BytesRead = fread(Buffer, 1, BufferLength, IoSyncBlock->InputStream);
+    StopStatsTimer(STAT_READ, Start);
     *Offset = IoSyncBlock->ReadOffset;
+    *Sequence = IoSyncBlock->ReadSequence;
     IoSyncBlock->ReadOffset += *BytesRead;
+    if (*BytesRead != 0) {
+        IoSyncBlock->ReadSequence += 1;
+    }
 
     pthread_mutex_unlock(&IoSyncBlock->ReadLock);
     
@@ -356,179 +759,998 @@ Return Value:
     }
 }
 
-int
-WriteBlock(
-    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock,
-    byte * Buffer,
-    size_t BufferLength,
-    size_t Offset
+static
+byte *
+TakeFreeBuffer(
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock
     )
-    
+
 /*++
 
 Description:
 
-    This routine writes a block of bytes to the output stream specified in the
-    supplied IoSyncBlock. If the current offset of the output stream is not 
-    aligned with the offset of the buffer, the routine will block until other
-    threads have output the bytes that precede the buffer. Accordingly, writes
-    are serialized as one would expect.
-    
+    This routine takes a buffer from the free list. When buffers have home
+    NUMA nodes, one from the calling thread's node is preferred. The caller
+    holds the write lock.
+
 Arguments:
 
-    IoSyncBlock - Supplies the current state of the output stream.
-    
-    Buffer - Supplies a pointer to the bytes to be written.
-    
-    BufferLength - Supplies the number of bytes to be written.
-    
-    Offset - Supplies the desired offset of the buffer in the output stream.
-    
+    IoSyncBlock - Supplies the IO state.
+
 Return Value:
 
-    Returns 0 on success.
-    
+    Returns a block buffer. The free list must not be empty.
+
 --*/
-    
+
 {
-    size_t BytesWritten;
-    
-    pthread_mutex_lock(&IoSyncBlock->WriteLock);
-    
-    //
-    // Repeat until the block is written.
-    //
-    
-    for (;;) {
-    
-        //
-        // If the offset of this block matches the current write stream offset,
-        // write the block out immediately.
-        //
-        
-        if (IoSyncBlock->WriteOffset >= Offset) {
-        
-            //
-            // If the current offset somehow passed this block, then some
-            // earlier write failed. Abandon.
-            //
-                  
-            if (IoSyncBlock->WriteOffset != Offset) {
-                fprintf(stderr, "Mismatched offsets writing stream\n");
-                pthread_mutex_unlock(&IoSyncBlock->WriteLock);
-                return 1;
-            }
-            
-            BytesWritten = fwrite(Buffer, 
-                                  1, 
-                                  BufferLength, 
-                                  IoSyncBlock->OutputStream);
-    
-            if (BytesWritten != BufferLength) {
-                fprintf(stderr, "Stream write failed\n");
-                pthread_mutex_unlock(&IoSyncBlock->WriteLock);
-                return 1;
-            }
-            
-            //
-            // Update the current write offset, and broadcast to waiters that
-            // the stream offset has been updated.
-            //
-            
-            IoSyncBlock->WriteOffset += BufferLength;
-            pthread_cond_broadcast(&IoSyncBlock->WriteEvent);
-            break;
 
-        } else {
-        
-            //
-            // Otherwise this write needs to wait at least one other write 
-            // earlier in the stream to complete.
-            //
-            
-            pthread_cond_wait(&IoSyncBlock->WriteEvent, 
-                              &IoSyncBlock->WriteLock);
+    byte * Buffer;
+    size_t Index;
+    int Node;
+    size_t Top;
+
+    assert(IoSyncBlock->FreeBufferCount != 0);
+    Top = IoSyncBlock->FreeBufferCount - 1;
+    Node = GetCurrentNode();
+    if ((IoSyncBlock->BufferNodes != NULL) && (Node >= 0)) {
+        for (Index = Top + 1; Index > 0; --Index) {
+            Buffer = IoSyncBlock->FreeBuffers[Index - 1];
+            if (IoSyncBlock->BufferNodes[GetPoolBufferIndex(
+                                             IoSyncBlock->BufferPool,
+                                             Buffer)] == Node) {
+
+                IoSyncBlock->FreeBuffers[Index - 1] =
+                    IoSyncBlock->FreeBuffers[Top];
+
+                IoSyncBlock->FreeBuffers[Top] = Buffer;
+                break;
+            }
         }
     }
-    
-    pthread_mutex_unlock(&IoSyncBlock->WriteLock);
-    
-    return 0;
-}
 
-//
-// ------------------------------------------------------------ Program Options
-//
+    IoSyncBlock->FreeBufferCount = Top;
+    return IoSyncBlock->FreeBuffers[Top];
+}
 
 int
-ParseCommandLine(
-    int argc,
-    char* argv[],
-    OPTIONS * Options
+InitializeWriteQueue(
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock,
+    BUFFER_POOL * BufferPool,
+    size_t BlockSize,
+    size_t * Depth,
+    size_t WorkerCount
     )
 
 /*++
 
 Description:
 
-    This routine parses the command line options, defined in the comments for
-    main().
-    
+    This routine allocates the reorder buffer, and takes the block buffers
+    that circulate through it from the buffer pool. Each worker holds one
+    buffer, and the reorder buffer holds at most Depth more, so there is
+    always a free buffer for a worker that hands one in.
+
 Arguments:
 
-    argc - Supplies the count of arguments.
-    
-    argv - Supplies the array of arguments.
-    
-    Options - Supplies a pointer to a structure that receives the parsed 
-        arguments.
-        
+    IoSyncBlock - Supplies the IO state to initialize.
+
+    BufferPool - Supplies the pool to carve the block buffers from.
+
+    BlockSize - Supplies the size of each block buffer.
+
+    Depth - Supplies the number of completed blocks that may wait in the
+        reorder buffer, and receives the number the memory limit allows.
+
+    WorkerCount - Supplies the number of threads that will write blocks.
+
 Return Value:
 
-    Returns zero (0) on success, or non-zero otherwise.
-    
+    Returns zero (0) on success, non-zero on allocation failure.
+
 --*/
 
 {
 
-    int Index;
-    int ThreadCount;
-    char const* KeyFileName;
+    size_t BufferCount;
+    size_t Index;
 
-    ThreadCount = 0;
-    KeyFileName = NULL;
+    BufferCount = *Depth + WorkerCount;
+    if (PrepareBufferPool(BufferPool,
+                          BlockSize,
+                          &BufferCount,
+                          WorkerCount + 1) != 0) {
+
+        return 1;
+    }
+
+    *Depth = BufferCount - WorkerCount;
+    IoSyncBlock->Completed = calloc(*Depth, sizeof(COMPLETED_BLOCK));
+    IoSyncBlock->FreeBuffers = calloc(BufferCount, sizeof(byte *));
+    if ((IoSyncBlock->Completed == NULL) ||
+        (IoSyncBlock->FreeBuffers == NULL)) {
+
+        fprintf(stderr, "Memory allocation failure for write queue\n");
+        FreeWriteQueue(IoSyncBlock);
+        return 1;
+    }
 
     //
-    // Parse the command line arguments.
+    // The free list is the stack of buffers the pool was carved into, kept
+    // under the write lock, which is held whenever buffers change hands.
     //
 
-    for (Index = 1; Index < argc; ++Index) {
-        if (strcmp(argv[Index], "-k") == 0) {
-            ++Index;
-            if (Index >= argc) {
-                fprintf(stderr, "Missing key file name after -k\n");
-                return 1;
-            }
-            
-            KeyFileName = argv[Index];
+    for (Index = 0; Index < BufferCount; ++Index) {
+        IoSyncBlock->FreeBuffers[Index] = GetPoolBuffer(BufferPool, Index);
+    }
+
+    IoSyncBlock->FreeBufferCount = BufferCount;
+    IoSyncBlock->ReorderDepth = *Depth;
+    IoSyncBlock->BufferPool = BufferPool;
+    IoSyncBlock->BlockSize = BlockSize;
+    IoSyncBlock->BufferNodes = NULL;
+    IoSyncBlock->WorkerJoins = 0;
+
+    //
+    // Blocks are numbered afresh for each run over the stream.
+    //
+
+    IoSyncBlock->ReadSequence = 0;
+    IoSyncBlock->WriteSequence = 0;
+    IoSyncBlock->Writing = 0;
+    IoSyncBlock->WindowWaiters = 0;
+    return 0;
+}
+
+void
+FreeWriteQueue(
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock
+    )
+
+/*++
+
+Description:
+
+    This routine releases the reorder buffer. The block buffers stay in the
+    pool for the next run.
+
+Arguments:
+
+    IoSyncBlock - Supplies the IO state.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    free(IoSyncBlock->Completed);
+    free(IoSyncBlock->FreeBuffers);
+    free(IoSyncBlock->BufferNodes);
+    IoSyncBlock->Completed = NULL;
+    IoSyncBlock->FreeBuffers = NULL;
+    IoSyncBlock->BufferNodes = NULL;
+}
+
+byte *
+AcquireBlockBuffer(
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock
+    )
+
+/*++
+
+Description:
+
+    This routine takes a block buffer from the free list, for a worker to read
+    its first block into.
+
+Arguments:
+
+    IoSyncBlock - Supplies the IO state.
+
+Return Value:
+
+    Returns a block buffer. Every worker is guaranteed one.
+
+--*/
+
+{
+
+    byte * Buffer;
+
+    pthread_mutex_lock(&IoSyncBlock->WriteLock);
+    Buffer = TakeFreeBuffer(IoSyncBlock);
+    pthread_mutex_unlock(&IoSyncBlock->WriteLock);
+    return Buffer;
+}
+
+int
+WriteVector(
+    int FileDescriptor,
+    struct iovec * Vector,
+    int Count
+    )
+
+/*++
+
+Description:
+
+    This routine writes a gather list to a file descriptor in full, picking up
+    after any short writes.
+
+Arguments:
+
+    FileDescriptor - Supplies the file descriptor to write.
+
+    Vector - Supplies the gather list. Its entries are consumed as they are
+        written.
+
+    Count - Supplies the number of entries in the gather list.
+
+Return Value:
+
+    Returns zero (0) on success, non-zero if the write failed.
+
+--*/
+
+{
+
+    ssize_t Written;
+
+    while (Count > 0) {
+        Written = writev(FileDescriptor, Vector, Count);
+        if (Written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return 1;
+        }
+
+        while ((Count > 0) && ((size_t)Written >= Vector->iov_len)) {
+            Written -= Vector->iov_len;
+            Vector += 1;
+            Count -= 1;
+        }
+
+        if (Count > 0) {
+            Vector->iov_base = (byte *)Vector->iov_base + Written;
+            Vector->iov_len -= Written;
+        }
+    }
+
+    return 0;
+}
+
+int
+WriteBlock(
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock,
+    byte * Buffer,
+    size_t BufferLength,
+    uint64_t Sequence,
+    uint64_t ReadTime,
+    byte ** NextBuffer
+    )
+    
+/*++
+
+Description:
+
+    This routine hands a completed block to the reorder buffer of the output
+    stream described by the supplied IoSyncBlock, and returns a free buffer in
+    exchange. If the block is next in the output stream, the calling thread
+    writes it along with every contiguous completed block after it, including
+    ones that complete while it writes. Otherwise the block is left for the
+    thread that writes the block ahead of it, and the routine returns at once.
+
+    The routine only blocks if the block is a full reorder buffer ahead of the
+    output stream.
+    
+Arguments:
+
+    IoSyncBlock - Supplies the current state of the output stream.
+    
+    Buffer - Supplies a pointer to the bytes to be written. Ownership of the
+        buffer passes to the reorder buffer.
+    
+    BufferLength - Supplies the number of bytes to be written.
+    
+    Sequence - Supplies the sequence number of the block, as returned by
+        ReadBlock.
+
+    ReadTime - Supplies the time the block's read started, from
+        StartStatsTimer, for the latency statistics.
+
+    NextBuffer - Supplies a pointer to memory that receives a free buffer for
+        the caller's next block.
+    
+Return Value:
+
+    Returns 0 on success.
+    
+--*/
+    
+{
+    size_t Bytes;
+    size_t Count;
+    COMPLETED_BLOCK * Entry;
+    size_t Index;
+    uint64_t Pending;
+    int Result;
+    uint64_t Start;
+    struct iovec Vector[WRITE_BATCH_MAXIMUM];
+    
+    Start = StartStatsTimer();
+    pthread_mutex_lock(&IoSyncBlock->WriteLock);
+    StopStatsTimer(STAT_WRITE_LOCK_WAIT, Start);
+    
+    //
+    // Wait for room in the reorder buffer. This only happens when this thread
+    // is a whole reorder buffer ahead of the output stream. Every waiter is
+    // woken when the output moves, so a wakeup that finds no room yet counts
+    // as spurious.
+    //
+    
+    if (Sequence >= IoSyncBlock->WriteSequence + IoSyncBlock->ReorderDepth) {
+        Start = StartStatsTimer();
+        for (;;) {
+            IoSyncBlock->WindowWaiters += 1;
+            pthread_cond_wait(&IoSyncBlock->WriteEvent,
+                              &IoSyncBlock->WriteLock);
+
+            IoSyncBlock->WindowWaiters -= 1;
+            if (Sequence <
+                IoSyncBlock->WriteSequence + IoSyncBlock->ReorderDepth) {
+
+                break;
+            }
+
+            CountStat(STAT_SPURIOUS_WAKEUPS, 1);
+        }
+
+        StopStatsTimer(STAT_WRITE_EVENT_WAIT, Start);
+    }
+
+    //
+    // Park the block and swap its buffer for a free one.
+    //
+
+    Entry = &IoSyncBlock->Completed[Sequence % IoSyncBlock->ReorderDepth];
+    assert(Entry->Ready == 0);
+    Entry->Buffer = Buffer;
+    Entry->Length = BufferLength;
+    Entry->ReadTime = ReadTime;
+    Entry->Ready = 1;
+
+    *NextBuffer = TakeFreeBuffer(IoSyncBlock);
+
+    //
+    // If another thread is writing, it will pick this block up. If the block
+    // isn't next, whoever completes the block ahead of it will.
+    //
+
+    if ((IoSyncBlock->Writing != 0) ||
+        (Sequence != IoSyncBlock->WriteSequence)) {
+
+        pthread_mutex_unlock(&IoSyncBlock->WriteLock);
+        return 0;
+    }
+
+    //
+    // This thread is the writer. Drain contiguous completed blocks in batches
+    // until the next block due hasn't completed.
+    //
+
+    IoSyncBlock->Writing = 1;
+    Result = 0;
+    for (;;) {
+        Bytes = 0;
+        for (Count = 0;
+             (Count < WRITE_BATCH_MAXIMUM) &&
+             (Count < IoSyncBlock->ReorderDepth);
+             ++Count) {
+
+            Pending = IoSyncBlock->WriteSequence + Count;
+            Entry = &IoSyncBlock->Completed[Pending %
+                                            IoSyncBlock->ReorderDepth];
+
+            if (Entry->Ready == 0) {
+                break;
+            }
+
+            Vector[Count].iov_base = Entry->Buffer;
+            Vector[Count].iov_len = Entry->Length;
+            Bytes += Entry->Length;
+        }
+
+        if (Count == 0) {
+            break;
+        }
+
+        pthread_mutex_unlock(&IoSyncBlock->WriteLock);
+        Start = StartStatsTimer();
+        Result = WriteVector(fileno(IoSyncBlock->OutputStream), Vector, Count);
+        StopStatsTimer(STAT_WRITE, Start);
+        Start = StartStatsTimer();
+        pthread_mutex_lock(&IoSyncBlock->WriteLock);
+        StopStatsTimer(STAT_WRITE_LOCK_WAIT, Start);
+
+        if (Result != 0) {
+            fprintf(stderr, "Stream write failed\n");
+            break;
+        }
+
+        //
+        // Return the written buffers to the free list and advance the output
+        // stream past them.
+        //
+
+        Start = StartStatsTimer();
+        for (Index = 0; Index < Count; ++Index) {
+            Entry = &IoSyncBlock->Completed[IoSyncBlock->WriteSequence %
+                                            IoSyncBlock->ReorderDepth];
+
+            RecordStatsLatency(Entry->ReadTime, Start);
+
+            IoSyncBlock->FreeBuffers[IoSyncBlock->FreeBufferCount] =
+                Entry->Buffer;
+
+            IoSyncBlock->FreeBufferCount += 1;
+            Entry->Ready = 0;
+            IoSyncBlock->WriteSequence += 1;
+        }
+
+        IoSyncBlock->WriteOffset += Bytes;
+        if (IoSyncBlock->WindowWaiters != 0) {
+            pthread_cond_broadcast(&IoSyncBlock->WriteEvent);
+        }
+    }
+
+    IoSyncBlock->Writing = 0;
+    pthread_mutex_unlock(&IoSyncBlock->WriteLock);
+    
+    return Result;
+}
+
+int
+SkipInput(
+    FILE * Stream,
+    uint64_t Count
+    )
+
+/*++
+
+Description:
+
+    This routine advances an input stream by a given number of bytes. Seekable
+    streams are simply repositioned. Other streams are read and the bytes
+    discarded. The descriptor is read directly, so nothing is left in the
+    stream's buffer for engines that read the descriptor themselves. This
+    must be called before anything else has read the stream.
+
+Arguments:
+
+    Stream - Supplies the input stream.
+
+    Count - Supplies the number of bytes to skip.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the stream ended or could not
+    be read before Count bytes were skipped.
+
+--*/
+
+{
+
+    byte Discard[4096];
+    size_t Length;
+    ssize_t Result;
+
+    if (Count == 0) {
+        return 0;
+    }
+
+    if (fseeko(Stream, (off_t)Count, SEEK_CUR) == 0) {
+        return 0;
+    }
+
+    while (Count > 0) {
+        Length = sizeof(Discard);
+        if (Length > Count) {
+            Length = Count;
+        }
+
+        Result = read(fileno(Stream), Discard, Length);
+        if (Result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return 1;
+        }
+
+        if (Result == 0) {
+            return 1;
+        }
+
+        Count -= Result;
+    }
+
+    return 0;
+}
+
+//
+// ------------------------------------------------------------ Program Options
+//
+
+int
+ParseCommandLine(
+    int argc,
+    char* argv[],
+    OPTIONS * Options
+    )
+
+/*++
+
+Description:
+
+    This routine parses the command line options, defined in the comments for
+    main().
+    
+Arguments:
+
+    argc - Supplies the count of arguments.
+    
+    argv - Supplies the array of arguments.
+    
+    Options - Supplies a pointer to a structure that receives the parsed 
+        arguments.
+        
+Return Value:
+
+    Returns zero (0) on success, or non-zero otherwise.
+    
+--*/
+
+{
+
+    int Index;
+    int ThreadCount;
+    char const* KeyFileName;
+    int AutoBlockSize;
+    uint64_t BlockSize;
+    ENGINE Engine;
+    char const* ExtractRange;
+    char const* InPlaceFileName;
+    int Part;
+    int QueueDepth;
+    uint64_t RangeLength;
+    uint64_t RangeOffset;
+    char const* ShardRange;
+    STATS_FORMAT StatsFormat;
+    int StatsInterval;
+    int Verbose;
+
+    Options->Cpus = NULL;
+    Options->CpuCount = 0;
+    Options->IoCpus = NULL;
+    Options->IoCpuCount = 0;
+    Options->Numa = 0;
+    Options->ManifestFileName = NULL;
+    Options->MemoryLimit = 0;
+    Options->Digest = 0;
+    Options->DigestFileName = NULL;
+    Options->Container = 0;
+    Options->CheckpointFileName = NULL;
+    Options->Resume = 0;
+    Options->ShardIndex = 0;
+    Options->ShardCount = 0;
+    Options->PlaceOutput = 0;
+    Options->VerifyNames = NULL;
+    Options->VerifyNameCount = 0;
+    Options->Merge = 0;
+    Options->Direct = 0;
+    Options->BatchNames = NULL;
+    Options->BatchPairCount = 0;
+    ThreadCount = 0;
+    KeyFileName = NULL;
+    AutoBlockSize = 0;
+    BlockSize = DEFAULT_BLOCKSIZE;
+    Engine = ENGINE_AUTO;
+    ExtractRange = NULL;
+    Part = 0;
+    ShardRange = NULL;
+    InPlaceFileName = NULL;
+    QueueDepth = 0;
+    RangeLength = UINT64_MAX;
+    RangeOffset = 0;
+    StatsFormat = STATS_NONE;
+    StatsInterval = 0;
+    Verbose = 0;
+
+    //
+    // Parse the command line arguments.
+    //
+
+    for (Index = 1; Index < argc; ++Index) {
+        if (strcmp(argv[Index], "-k") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing key file name after -k\n");
+                return 1;
+            }
+            
+            KeyFileName = argv[Index];
+            continue;
+        }
+
+        if (strcmp(argv[Index], "-n") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing thread count after -n\n");
+                return 1;
+            }
+            
+            ThreadCount = atoi(argv[Index]);
+            continue;
+        }
+
+        if (strcmp(argv[Index], "-b") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing block size after -b\n");
+                return 1;
+            }
+
+            if (strcmp(argv[Index], "auto") == 0) {
+                AutoBlockSize = 1;
+                continue;
+            }
+
+            if ((ParseOffset(argv[Index], &BlockSize) != 0) ||
+                (BlockSize == 0) ||
+                (BlockSize > MAXIMUM_BLOCKSIZE)) {
+
+                fprintf(stderr, "Invalid block size: %s\n", argv[Index]);
+                return 1;
+            }
+
+            AutoBlockSize = 0;
+            continue;
+        }
+
+        if (strcmp(argv[Index], "-v") == 0) {
+            Verbose = 1;
+            continue;
+        }
+
+        if (strcmp(argv[Index], "-e") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing engine name after -e\n");
+                return 1;
+            }
+
+            if (strcmp(argv[Index], "stream") == 0) {
+                Engine = ENGINE_STREAM;
+
+            } else if (strcmp(argv[Index], "pipeline") == 0) {
+                Engine = ENGINE_PIPELINE;
+
+            } else if (strcmp(argv[Index], "mmap") == 0) {
+                Engine = ENGINE_MAPPED;
+
+            } else if (strcmp(argv[Index], "pread") == 0) {
+                Engine = ENGINE_POSITIONAL;
+
+            } else if (strcmp(argv[Index], "uring") == 0) {
+                Engine = ENGINE_URING;
+
+            } else if (strcmp(argv[Index], "splice") == 0) {
+                Engine = ENGINE_SPLICE;
+
+            } else if (strcmp(argv[Index], "auto") == 0) {
+                Engine = ENGINE_AUTO;
+
+            } else {
+                fprintf(stderr, "Unknown engine: %s\n", argv[Index]);
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[Index], "-i") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing file name after -i\n");
+                return 1;
+            }
+
+            InPlaceFileName = argv[Index];
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--queue-depth") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing queue depth after --queue-depth\n");
+                return 1;
+            }
+
+            QueueDepth = atoi(argv[Index]);
+            if (QueueDepth <= 0) {
+                fprintf(stderr, "Invalid queue depth: %s\n", argv[Index]);
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--offset") == 0) {
+            ++Index;
+            if ((Index >= argc) ||
+                (ParseOffset(argv[Index], &RangeOffset) != 0)) {
+
+                fprintf(stderr, "Missing or invalid offset after --offset\n");
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--length") == 0) {
+            ++Index;
+            if ((Index >= argc) ||
+                (ParseOffset(argv[Index], &RangeLength) != 0)) {
+
+                fprintf(stderr, "Missing or invalid length after --length\n");
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--shard") == 0) {
+            ++Index;
+            if ((Index >= argc) ||
+                (ParseShard(argv[Index],
+                            &Options->ShardIndex,
+                            &Options->ShardCount) != 0)) {
+
+                fprintf(stderr,
+                        "Missing or invalid shard after --shard, which "
+                        "takes i/N with i from 1 to N\n");
+
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--range") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing range after --range\n");
+                return 1;
+            }
+
+            ShardRange = argv[Index];
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--part") == 0) {
+            Part = 1;
+            continue;
+        }
+
+        //
+        // Everything after --verify or --merge is a digest file.
+        //
+
+        if ((strcmp(argv[Index], "--verify") == 0) ||
+            (strcmp(argv[Index], "--merge") == 0)) {
+
+            if (Index + 1 >= argc) {
+                fprintf(stderr, "Missing digest files after %s\n", argv[Index]);
+                return 1;
+            }
+
+            Options->Merge = (strcmp(argv[Index], "--merge") == 0);
+            Options->VerifyNames = &argv[Index + 1];
+            Options->VerifyNameCount = argc - Index - 1;
+            break;
+        }
+
+        if (strcmp(argv[Index], "--stats") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing format after --stats\n");
+                return 1;
+            }
+
+            if (strcmp(argv[Index], "text") == 0) {
+                StatsFormat = STATS_TEXT;
+
+            } else if (strcmp(argv[Index], "json") == 0) {
+                StatsFormat = STATS_JSON;
+
+            } else {
+                fprintf(stderr, "Unknown statistics format: %s\n",
+                        argv[Index]);
+
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--stats-interval") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing interval after --stats-interval\n");
+                return 1;
+            }
+
+            StatsInterval = atoi(argv[Index]);
+            if (StatsInterval <= 0) {
+                fprintf(stderr, "Invalid interval: %s\n", argv[Index]);
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--cpus") == 0) {
+            ++Index;
+            free(Options->Cpus);
+            Options->Cpus = NULL;
+            if ((Index >= argc) ||
+                (ParseCpuList(argv[Index],
+                              &Options->Cpus,
+                              &Options->CpuCount) != 0)) {
+
+                fprintf(stderr, "Missing or invalid CPU list after --cpus\n");
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--io-cpus") == 0) {
+            ++Index;
+            free(Options->IoCpus);
+            Options->IoCpus = NULL;
+            if ((Index >= argc) ||
+                (ParseCpuList(argv[Index],
+                              &Options->IoCpus,
+                              &Options->IoCpuCount) != 0)) {
+
+                fprintf(stderr,
+                        "Missing or invalid CPU list after --io-cpus\n");
+
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--numa") == 0) {
+            Options->Numa = 1;
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--memory-limit") == 0) {
+            ++Index;
+            if ((Index >= argc) ||
+                (ParseOffset(argv[Index], &Options->MemoryLimit) != 0) ||
+                (Options->MemoryLimit == 0)) {
+
+                fprintf(stderr,
+                        "Missing or invalid size after --memory-limit\n");
+
+                return 1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--digest") == 0) {
+            Options->Digest = 1;
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--digest-file") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing file name after --digest-file\n");
+                return 1;
+            }
+
+            Options->Digest = 1;
+            Options->DigestFileName = argv[Index];
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--container") == 0) {
+            Options->Container = 1;
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--extract") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing range after --extract\n");
+                return 1;
+            }
+
+            ExtractRange = argv[Index];
             continue;
         }
 
-        if (strcmp(argv[Index], "-n") == 0) {
+        if (strcmp(argv[Index], "--checkpoint") == 0) {
             ++Index;
             if (Index >= argc) {
-                fprintf(stderr, "Missing thread count after -n\n");
+                fprintf(stderr, "Missing filename after --checkpoint\n");
                 return 1;
             }
-            
-            ThreadCount = atoi(argv[Index]);
+
+            Options->CheckpointFileName = argv[Index];
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--resume") == 0) {
+            Options->Resume = 1;
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--direct") == 0) {
+            Options->Direct = 1;
+            continue;
+        }
+
+        if (strcmp(argv[Index], "--manifest") == 0) {
+            ++Index;
+            if (Index >= argc) {
+                fprintf(stderr, "Missing file name after --manifest\n");
+                return 1;
+            }
+
+            Options->ManifestFileName = argv[Index];
             continue;
         }
 
+        //
+        // Everything after "--" is a pair of batch file names.
+        //
+
+        if (strcmp(argv[Index], "--") == 0) {
+            if (((argc - Index - 1) % 2) != 0) {
+                fprintf(stderr, "Batch files must come in pairs after --\n");
+                return 1;
+            }
+
+            Options->BatchNames = &argv[Index + 1];
+            Options->BatchPairCount = (argc - Index - 1) / 2;
+            break;
+        }
+
         fprintf(stderr, "Invalid option: %s\n", argv[Index]);
         return 1;
     }        
     
+    //
+    // Checking shards needs neither a key nor threads.
+    //
+
+    if (Options->VerifyNameCount != 0) {
+        Options->Engine = ENGINE_VERIFY;
+        return 0;
+    }
+
     if (ThreadCount <= 0) {
         fprintf(stderr, "Thread count was unspecified\n");
         return 1;
@@ -539,9 +1761,319 @@ Return Value:
         return 1;
     }
 
+    if ((Options->ManifestFileName != NULL) ||
+        (Options->BatchPairCount != 0)) {
+
+        if (InPlaceFileName != NULL) {
+            fprintf(stderr, "-i can't be combined with a batch\n");
+            return 1;
+        }
+
+        Engine = ENGINE_BATCH;
+    }
+
+    //
+    // A container frames a whole stream, so it can't be written in place or
+    // over a batch. Extraction takes its range in its own argument.
+    //
+
+    if ((Options->Container != 0) &&
+        ((InPlaceFileName != NULL) || (Engine == ENGINE_BATCH))) {
+
+        fprintf(stderr, "--container can't be combined with -i or a batch\n");
+        return 1;
+    }
+
+    if (ExtractRange != NULL) {
+        if ((InPlaceFileName != NULL) ||
+            (Engine == ENGINE_BATCH) ||
+            (Options->Container != 0) ||
+            (Options->Digest != 0) ||
+            (RangeOffset != 0) ||
+            (RangeLength != UINT64_MAX)) {
+
+            fprintf(stderr,
+                    "--extract can't be combined with -i, a batch, "
+                    "--container, --digest, --offset, or --length\n");
+
+            return 1;
+        }
+
+        if (ParseRange(ExtractRange, &RangeOffset, &RangeLength) != 0) {
+            fprintf(stderr, "Invalid range after --extract\n");
+            return 1;
+        }
+
+        Engine = ENGINE_EXTRACT;
+    }
+
+    //
+    // A shard is a range of the input written to the same range of the
+    // output, or alone with --part.
+    //
+
+    if ((Part != 0) && (Options->ShardCount == 0) && (ShardRange == NULL)) {
+        fprintf(stderr, "--part needs --shard or --range\n");
+        return 1;
+    }
+
+    if ((Options->ShardCount != 0) || (ShardRange != NULL)) {
+        if (((Options->ShardCount != 0) && (ShardRange != NULL)) ||
+            (InPlaceFileName != NULL) ||
+            (Engine == ENGINE_BATCH) ||
+            (Engine == ENGINE_EXTRACT) ||
+            (Options->Container != 0) ||
+            (RangeOffset != 0) ||
+            (RangeLength != UINT64_MAX)) {
+
+            fprintf(stderr,
+                    "--shard and --range can't be combined with each other, "
+                    "-i, a batch,\n--container, --extract, --offset, or "
+                    "--length\n");
+
+            return 1;
+        }
+
+        if ((ShardRange != NULL) &&
+            (ParseRange(ShardRange, &RangeOffset, &RangeLength) != 0)) {
+
+            fprintf(stderr, "Invalid range after --range\n");
+            return 1;
+        }
+
+        Options->PlaceOutput = !Part;
+    }
+
+    //
+    // A checkpoint records how far a single output file is written, so
+    // only the engines that finish the output front to back can keep one.
+    //
+
+    if ((Options->Resume != 0) && (Options->CheckpointFileName == NULL)) {
+        fprintf(stderr, "--resume needs --checkpoint\n");
+        return 1;
+    }
+
+    if ((Options->CheckpointFileName != NULL) &&
+        ((InPlaceFileName != NULL) ||
+         (Engine == ENGINE_BATCH) ||
+         (Engine == ENGINE_EXTRACT) ||
+         (Options->Container != 0))) {
+
+        fprintf(stderr,
+                "--checkpoint can't be combined with -i, a batch, "
+                "--container, or --extract\n");
+
+        return 1;
+    }
+
+    if ((Options->CheckpointFileName != NULL) &&
+        ((Engine == ENGINE_MAPPED) ||
+         (Engine == ENGINE_URING) ||
+         (Engine == ENGINE_SPLICE))) {
+
+        fprintf(stderr,
+                "--checkpoint works with the stream, pipeline, and pread "
+                "engines\n");
+
+        return 1;
+    }
+
+    //
+    // Direct I/O needs positional reads and writes of aligned blocks, which
+    // only the pread, io_uring, and in-place engines make.
+    //
+
+    if ((Options->Direct != 0) &&
+        ((Engine == ENGINE_STREAM) ||
+         (Engine == ENGINE_PIPELINE) ||
+         (Engine == ENGINE_MAPPED) ||
+         (Engine == ENGINE_SPLICE) ||
+         (Engine == ENGINE_BATCH) ||
+         (Engine == ENGINE_EXTRACT) ||
+         (Options->Container != 0))) {
+
+        fprintf(stderr,
+                "--direct works with the pread and io_uring engines and -i, "
+                "not a batch,\n--container, or --extract\n");
+
+        return 1;
+    }
+
+    if ((Options->Direct != 0) &&
+        (AutoBlockSize == 0) &&
+        ((BlockSize % DIRECT_ALIGNMENT) != 0)) {
+
+        fprintf(stderr,
+                "--direct needs a block size that is a multiple of %d\n",
+                DIRECT_ALIGNMENT);
+
+        return 1;
+    }
+
+    //
+    // An interval alone asks for text statistics.
+    //
+
+    if ((StatsInterval != 0) && (StatsFormat == STATS_NONE)) {
+        StatsFormat = STATS_TEXT;
+    }
+
     Options->ThreadCount = ThreadCount;
     Options->KeyFileName = KeyFileName;
-    Options->BlockSize = DEFAULT_BLOCKSIZE;    
+    Options->BlockSize = BlockSize;
+    Options->AutoBlockSize = AutoBlockSize;
+    Options->Verbose = Verbose;
+    Options->RangeOffset = RangeOffset;
+    Options->RangeLength = RangeLength;
+    Options->Engine = Engine;
+    Options->QueueDepth = QueueDepth;
+    Options->InPlaceFileName = InPlaceFileName;
+    Options->StatsFormat = StatsFormat;
+    Options->StatsInterval = StatsInterval;
+
+    return 0;
+}
+
+int
+ParseOffset(
+    char const * String,
+    uint64_t * Value
+    )
+
+/*++
+
+Description:
+
+    This routine parses an unsigned 64-bit decimal stream offset, length, or
+    size. A "k", "m", "g", or "t" suffix (in either case) multiplies the
+    number by the matching power of 1024.
+
+Arguments:
+
+    String - Supplies the string to parse.
+
+    Value - Supplies a pointer to memory that receives the parsed value.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the string isn't a valid
+    number.
+
+--*/
+
+{
+
+    char * End;
+    int Shift;
+    unsigned long long Parsed;
+
+    if ((*String < '0') || (*String > '9')) {
+        return 1;
+    }
+
+    errno = 0;
+    Parsed = strtoull(String, &End, 10);
+    if (errno != 0) {
+        return 1;
+    }
+
+    switch (*End) {
+    case '\0':
+        Shift = 0;
+        break;
+
+    case 'k':
+    case 'K':
+        Shift = 10;
+        break;
+
+    case 'm':
+    case 'M':
+        Shift = 20;
+        break;
+
+    case 'g':
+    case 'G':
+        Shift = 30;
+        break;
+
+    case 't':
+    case 'T':
+        Shift = 40;
+        break;
+
+    default:
+        return 1;
+    }
+
+    if ((Shift != 0) && (End[1] != '\0')) {
+        return 1;
+    }
+
+    if (((Parsed << Shift) >> Shift) != Parsed) {
+        return 1;
+    }
+
+    Parsed <<= Shift;
+
+    *Value = Parsed;
+    return 0;
+}
+
+int
+ParseRange(
+    char const * String,
+    uint64_t * Offset,
+    uint64_t * Length
+    )
+
+/*++
+
+Description:
+
+    This routine parses a range of the form "<offset>:<length>", or just
+    "<offset>" for the rest of the stream. Both take the suffixes that
+    ParseOffset does.
+
+Arguments:
+
+    String - Supplies the string to parse.
+
+    Offset - Supplies a pointer to memory that receives the offset.
+
+    Length - Supplies a pointer to memory that receives the length, which is
+        UINT64_MAX if none is given.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the string isn't a valid
+    range.
+
+--*/
+
+{
+
+    char OffsetString[32];
+    char const * Separator;
+
+    Separator = strchr(String, ':');
+    if (Separator == NULL) {
+        *Length = UINT64_MAX;
+        return ParseOffset(String, Offset);
+    }
+
+    if ((size_t)(Separator - String) >= sizeof(OffsetString)) {
+        return 1;
+    }
+
+    memcpy(OffsetString, String, Separator - String);
+    OffsetString[Separator - String] = '\0';
+    if ((ParseOffset(OffsetString, Offset) != 0) ||
+        (ParseOffset(Separator + 1, Length) != 0)) {
+
+        return 1;
+    }
 
     return 0;
 }
@@ -561,222 +2093,317 @@ ReadKey(
 
 Description:
 
-    This routine reads key material from a given file.
-    
+    This routine maps key material from a given file. The mapping is private
+    and copy on write, so key pages are read on demand, shared by every
+    thread, and never written back. Even a key of many gigabytes is ready
+    at once.
+    
+Arguments:
+
+    FileName - Supplies the name of the file from which to read the key.
+    
+    Key - Supplies a pointer to memory that will receive a pointer to the key,
+        or NULL if the key file is empty. The returned key must be released
+        with FreeKey().
+        
+    KeyLength - Supplies a pointer to memory that receives the length of the 
+        key.
+        
+Return Value:
+
+    Returns zero (0) on success, non-zero on failure.
+
+--*/
+
+{
+
+    int FileDescriptor;
+    struct stat FileStats;
+    byte * KeyMemory;
+
+    FileDescriptor = open(FileName, O_RDONLY);
+    if (FileDescriptor < 0) {
+        fprintf(stderr, "Failure opening keyfile %s\n", FileName);
+        return 1;
+    }
+
+    if (fstat(FileDescriptor, &FileStats) != 0) {
+        fprintf(stderr, "File stats not retrieved for %s\n", FileName);
+        close(FileDescriptor);
+        return 1;
+    }
+
+    KeyMemory = NULL;
+    if (FileStats.st_size != 0) {
+        KeyMemory = mmap(NULL,
+                         FileStats.st_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE,
+                         FileDescriptor,
+                         0);
+
+        if (KeyMemory == MAP_FAILED) {
+            fprintf(stderr, "Failure mapping key from file %s\n", FileName);
+            close(FileDescriptor);
+            return 1;
+        }
+    }
+
+    close(FileDescriptor);
+    *Key = KeyMemory;
+    *KeyLength = FileStats.st_size;
+    return 0;
+}
+
+void
+FreeKey(
+    byte * Key,
+    size_t KeyLength
+    )
+
+/*++
+
+Description:
+
+    This routine releases a key returned by ReadKey.
+
+Arguments:
+
+    Key - Supplies the key, which may be NULL.
+
+    KeyLength - Supplies the length of the key.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if (Key != NULL) {
+        munmap(Key, KeyLength);
+    }
+}
+
+//
+// -------------------------------------------------------------- Worker Thread
+//
+
+typedef struct _NODE_BUFFERS {
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock;
+    size_t BufferCount;
+    int Node;
+} NODE_BUFFERS;
+
+static
+void *
+TouchNodeBuffers(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine writes every block buffer homed on a node, so that the pages
+    behind them are allocated there. It runs on the node.
+
 Arguments:
 
-    FileName - Supplies the name of the file from which to read the key.
-    
-    Key - Supplies a pointer to memory that will receive a pointer to the key.
-        The returned key must be freed with free().
-        
-    KeyLength - Supplies a pointer to memory that receives the length of the 
-        key.
-        
+    Context - Supplies the buffers and the node.
+
 Return Value:
 
-    Returns zero (0) on success, non-zero on failure.
+    NULL.
 
 --*/
 
 {
 
-    FILE * File;
-    struct stat FileStats;
-    byte * KeyMemory;
-    int Result;
-    
-    Result = stat(FileName, &FileStats);
-    if (Result != 0) {
-        fprintf(stderr, "File stats not retrieved for %s\n", FileName);
-        return 1;
-    }
-    
-    KeyMemory = malloc(FileStats.st_size);
-    if (KeyMemory == NULL) {
-        fprintf(stderr, "Memory allocation failure for key\n");
-        return 1;
+    size_t Index;
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock;
+    NODE_BUFFERS * NodeBuffers;
+
+    NodeBuffers = (NODE_BUFFERS *)Context;
+    IoSyncBlock = NodeBuffers->IoSyncBlock;
+    for (Index = 0; Index < NodeBuffers->BufferCount; ++Index) {
+        if (IoSyncBlock->BufferNodes[Index] == NodeBuffers->Node) {
+            memset(GetPoolBuffer(IoSyncBlock->BufferPool, Index),
+                   0,
+                   IoSyncBlock->BlockSize);
+        }
     }
 
-    File = fopen(FileName, "rb");
-    if (File == NULL) {
-        fprintf(stderr, "Failure opening keyfile %s\n", FileName);
-        free(KeyMemory);
-        return 1;
-    }
-    
-    Result = fread(KeyMemory, 1, FileStats.st_size, File);
-    if (Result != FileStats.st_size) {
-        fprintf(stderr, "Failure reading key from file %s\n", FileName);
-        free(KeyMemory);
-        fclose(File);
-        return 1;
-    }
-    
-    fclose(File);
-    *Key = KeyMemory;
-    *KeyLength = FileStats.st_size;
-    return 0;
+    return NULL;
 }
 
-int
-IterateKey(
-    byte * Key,
-    size_t KeyLength,
-    int Iteration
+static
+void
+PlaceBlockBuffers(
+    WORKER_CONTEXT * WorkerContext,
+    size_t BufferCount
     )
-    
+
 /*++
 
 Description:
 
-    This routine iterates a key a given number of times. A key is iterated by
-    rotating all of its bits to the left by one bit. This routine overwrites
-    the input key.
-    
+    This routine gives each block buffer a home NUMA node, dealing them out
+    over the workers' nodes, and allocates each buffer on its home node. It
+    does nothing unless workers are placed on nodes.
+
 Arguments:
 
-    Key - Supplies the key.
-    
-    KeyLength - Supplies the length of the key.
-    
-    Iteration - Supplies the number of bits to rotate the key to the left.
-    
+    WorkerContext - Supplies the context shared by all worker threads.
+
+    BufferCount - Supplies the number of block buffers.
+
 Return Value:
 
-    Returns zero (0) on success, non-zero on failure to allocate working memory
-    to iterate the key.
-    
+    None.
+
 --*/
 
 {
 
-    int Index;
-    int Shift;
-    byte * WorkingKey;
+    size_t Index;
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock;
+    NODE_BUFFERS NodeBuffers;
+    int ThreadCount;
 
-    //
-    // Allocate working space for new key.
-    //
-    
-    WorkingKey = malloc(KeyLength);
-    if (WorkingKey == NULL) {
-        fprintf(stderr, "Memory allocation failed while iterating key\n");
-        return 1;
+    if (GetWorkerNode(WorkerContext->Placement, 0) < 0) {
+        return;
     }
-    
-    //
-    // Do a byte-wise rotation of the key.
-    //
 
-    Shift = Iteration / 8;
-    Shift %= KeyLength;
-    for (Index = 0; Index < KeyLength; ++Index) {
-        if (Index + Shift < KeyLength) {
-            WorkingKey[Index] = Key[Index + Shift];
-        
-        } else {
-            WorkingKey[Index] = Key[Index + Shift - KeyLength];
-        }
+    IoSyncBlock = WorkerContext->IoSyncBlock;
+    IoSyncBlock->BufferNodes = calloc(BufferCount, sizeof(int));
+    if (IoSyncBlock->BufferNodes == NULL) {
+        return;
     }
-    
-    //
-    // Do the bit-wise rotation of the key
-    //
-    
-    Shift = Iteration % 8;
-    for (Index = 0; Index < KeyLength; ++Index) {
-        Key[Index] = WorkingKey[Index] << Shift;
-        if (Index + 1 < KeyLength) {
-            Key[Index] |= WorkingKey[Index + 1] >> (8 - Shift);
-           
-        } else {
-            Key[Index] |= WorkingKey[0] >> (8 - Shift);
-        }
+
+    ThreadCount = WorkerContext->Options->ThreadCount;
+    for (Index = 0; Index < BufferCount; ++Index) {
+        IoSyncBlock->BufferNodes[Index] =
+            GetWorkerNode(WorkerContext->Placement, Index % ThreadCount);
     }
 
-    free(WorkingKey);
-    
-    return 0;
+    NodeBuffers.IoSyncBlock = IoSyncBlock;
+    NodeBuffers.BufferCount = BufferCount;
+    for (NodeBuffers.Node = 0;
+         NodeBuffers.Node < WorkerContext->Placement->NodeCount;
+         ++NodeBuffers.Node) {
+
+        for (Index = 0; Index < (size_t)ThreadCount; ++Index) {
+            if (IoSyncBlock->BufferNodes[Index] == NodeBuffers.Node) {
+                RunOnNode(WorkerContext->Placement,
+                          NodeBuffers.Node,
+                          TouchNodeBuffers,
+                          &NodeBuffers);
+
+                break;
+            }
+        }
+    }
 }
 
 int
-Encrypt(
-    byte * Block,
-    size_t BlockLength,
-    size_t BlockOffset,
-    byte * Key,
-    size_t KeyLength
+RunStreamEngine(
+    WORKER_CONTEXT * WorkerContext
     )
-    
+
 /*++
-    
+
 Description:
 
-    This routine encrypts a block of memory with a given key.
-    
-Parameters:
+    This routine runs the stream engine, in which each of N threads reads,
+    encrypts, and hands off its own blocks. The calling thread is one of the N.
+
+Arguments:
+
+    WorkerContext - Supplies the context shared by all worker threads.
 
-    Block - Supplies the block of memory to encrypt.
-    
-    BlockLength - Supplies the length of the block of memory.
-    
-    BlockOffset - Offset of the block in the original stream.
-    
-    Key - Supplies the key material with which the block is encrypted. The key
-        material is destroyed by this operation.
-        
-    KeyLength - Supplies the length of the key.
-    
 Return Value:
 
-    Returns zero (0) on success, or non-zero on failure.
+    Returns zero (0) once the stream has been encrypted. Failures are fatal.
 
 --*/
 
 {
+
+    size_t Depth;
     int Index;
-    int KeyIndex;
+    int Result;
+    int ThreadCount;
+    pthread_t * WorkerThreads;
 
     //
-    // Calculate the first key to overlap the start of this block.
+    // Set up the reorder buffer. It defaults to a few blocks per thread.
     //
-    
-    if (IterateKey(Key, KeyLength, BlockOffset / KeyLength) != 0) {
+
+    ThreadCount = WorkerContext->Options->ThreadCount;
+    Depth = WorkerContext->Options->QueueDepth;
+    if (Depth == 0) {
+        Depth = 4 * ThreadCount;
+    }
+
+    Result = InitializeWriteQueue(WorkerContext->IoSyncBlock,
+                                  WorkerContext->BufferPool,
+                                  WorkerContext->Options->BlockSize,
+                                  &Depth,
+                                  ThreadCount);
+
+    if (Result != 0) {
         return 1;
     }
+
+    PlaceBlockBuffers(WorkerContext, Depth + ThreadCount);
+
+    //
+    // Create additional worker threads as necessary.
+    //
+    
+    if (ThreadCount > 1) {
+        WorkerThreads = calloc(ThreadCount - 1, sizeof(pthread_t));
+        if (WorkerThreads == NULL) {
+            ErrorExit(errno, "Failure allocating thread array.\n");
+        }
+        
+        for (Index = 0; Index < ThreadCount - 1; ++Index) {
+            Result = pthread_create(&WorkerThreads[Index],
+                                    NULL, 
+                                    WorkerThreadRoutine,
+                                    WorkerContext);
+                                    
+            if (Result != 0) {
+                ErrorExit(Result, "Failed creating thread\n");
+            }
+        }
+    }
     
     //
-    // Calculate the offset into the key.
+    // This thread gets to work, too.
     //
     
-    KeyIndex = BlockOffset % KeyLength;
-
+    WorkerThreadRoutine(WorkerContext);
+    
     //
-    // Encrypt
+    // Wait for the other worker threads to complete. The last block is
+    // written by whichever thread completed it, before that thread exits.
     //
     
-    for (Index = 0;
-         Index < BlockLength; 
-         ++Index, ++KeyIndex) {
-        
-        if (KeyIndex == KeyLength) {
-            KeyIndex = 0;
-            if (IterateKey(Key, KeyLength, 1) != 0) {
-                return 1;
-            }
+    if (ThreadCount > 1) {
+        for (Index = 0; Index < ThreadCount - 1; ++Index) {
+            pthread_join(WorkerThreads[Index], NULL);
         }
         
-        Block[Index] = Block[Index] ^ Key[KeyIndex];
+        free(WorkerThreads);
     }
-    
+
+    FreeWriteQueue(WorkerContext->IoSyncBlock);
     return 0;
 }
 
-//
-// -------------------------------------------------------------- Worker Thread
-//
-
 void *
 WorkerThreadRoutine(
     void * Context
@@ -784,21 +2411,33 @@ WorkerThreadRoutine(
 {
     byte * Buffer;
     size_t BytesRead;
-    byte * BlockKey;
-    size_t Offset;
+    KEY_TABLE const * KeyTable;
+    uint64_t Offset;
+    uint64_t ReadTime;
     int Result;
+    uint64_t Sequence;
+    uint64_t Start;
+    int Worker;
     WORKER_CONTEXT * WorkerContext;
 
+    //
+    // Take a worker number, and go where that worker is placed.
+    //
+
     WorkerContext = (WORKER_CONTEXT*)Context;
-    Buffer = malloc(WorkerContext->Options->BlockSize);
-    if (Buffer == NULL) {
-        ErrorExit(errno, "Buffer allocation failure in WorkerThreadRoutine\n");
-    }
-    
-    BlockKey = malloc(WorkerContext->KeyLength);
-    if (BlockKey == NULL) {
-        ErrorExit(errno, "Key allocation failure in WorkerThreadRoutine\n");
-    }
+    pthread_mutex_lock(&WorkerContext->IoSyncBlock->WriteLock);
+    Worker = WorkerContext->IoSyncBlock->WorkerJoins;
+    WorkerContext->IoSyncBlock->WorkerJoins += 1;
+    pthread_mutex_unlock(&WorkerContext->IoSyncBlock->WriteLock);
+    KeyTable = PlaceWorkerThread(WorkerContext, Worker);
+    AttachStatsThread("stream", Worker);
+
+    //
+    // Block buffers belong to the write queue. A worker holds one at a time,
+    // and trades it for another each time it hands off a block.
+    //
+
+    Buffer = AcquireBlockBuffer(WorkerContext->IoSyncBlock);
     
     for (;;) {
     
@@ -806,10 +2445,12 @@ WorkerThreadRoutine(
         // Read a block from the stream.
         //
         
+        ReadTime = StartStatsTimer();
         Result = ReadBlock(WorkerContext->IoSyncBlock,
                            Buffer,
                            WorkerContext->Options->BlockSize,
                            &Offset,
+                           &Sequence,
                            &BytesRead);
                            
         if (Result != 0) {
@@ -818,25 +2459,33 @@ WorkerThreadRoutine(
         }
 
         if (BytesRead > 0) {
-            memcpy(BlockKey, WorkerContext->Key, WorkerContext->KeyLength);
-            Result = Encrypt(Buffer, 
-                             BytesRead, 
-                             Offset,
-                             BlockKey, 
-                             WorkerContext->KeyLength);
+            Start = StartStatsTimer();
+            Result = EncryptAndDigest(WorkerContext->Digest,
+                                      Buffer,
+                                      Buffer,
+                                      BytesRead,
+                                      Offset,
+                                      KeyTable);
                              
             if (Result != 0) {
                 exit(1);
             }
+
+            StopStatsTimer(STAT_ENCRYPT, Start);
+            CountStat(STAT_BLOCKS, 1);
+            CountStat(STAT_BYTES, BytesRead);
             
             //
-            // Write out the encrypted block.
+            // Hand the encrypted block to the writer, and carry on with a
+            // fresh buffer.
             //
             
             Result = WriteBlock(WorkerContext->IoSyncBlock,
                                 Buffer,
                                 BytesRead,
-                                Offset);
+                                Sequence,
+                                ReadTime,
+                                &Buffer);
 
             if (Result != 0) {
                 exit(1);
@@ -844,20 +2493,266 @@ WorkerThreadRoutine(
         }
 
         //
-        // Work is complete when EOF is reached.
+        // Work is complete when EOF or the end of the requested range is
+        // reached.
         //
         
-        if (feof(WorkerContext->IoSyncBlock->InputStream)) {
+        if ((BytesRead == 0) ||
+            feof(WorkerContext->IoSyncBlock->InputStream)) {
             break;
         }
     }
 
-    free(BlockKey);
-    free(Buffer);
-        
+    DetachStatsThread();
     return NULL;
 }
 
+int
+RunEngine(
+    WORKER_CONTEXT * WorkerContext
+    )
+
+/*++
+
+Description:
+
+    This routine runs the selected engine over the rest of the range. If the
+    engine chosen automatically doesn't suit the streams, the next one is
+    tried.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+Return Value:
+
+    Returns zero (0) once the range has been encrypted, or non-zero on
+    failure.
+
+--*/
+
+{
+
+    int Result;
+
+    switch (WorkerContext->Options->Engine) {
+    case ENGINE_BATCH:
+        Result = RunBatch(WorkerContext);
+        break;
+
+    case ENGINE_EXTRACT:
+        Result = RunExtract(WorkerContext);
+        break;
+
+    case ENGINE_IN_PLACE:
+        Result = RunInPlace(WorkerContext,
+                            WorkerContext->Options->InPlaceFileName);
+        break;
+
+    case ENGINE_PIPELINE:
+        Result = RunPipelineEngine(WorkerContext);
+        break;
+
+    case ENGINE_MAPPED:
+        Result = RunMappedEngine(WorkerContext);
+        if (Result == ENGINE_NOT_APPLICABLE) {
+            fprintf(stderr, "The mmap engine needs regular files\n");
+        }
+
+        break;
+
+    case ENGINE_POSITIONAL:
+        Result = RunPositionalEngine(WorkerContext);
+        if (Result == ENGINE_NOT_APPLICABLE) {
+            fprintf(stderr, "The pread engine needs seekable streams\n");
+        }
+
+        break;
+
+    case ENGINE_SPLICE:
+        Result = RunSpliceEngine(WorkerContext);
+        if (Result == ENGINE_NOT_APPLICABLE) {
+            fprintf(stderr, "The splice engine needs a pipe for output\n");
+        }
+
+        break;
+
+    case ENGINE_STREAM:
+        Result = RunStreamEngine(WorkerContext);
+        break;
+
+    case ENGINE_URING:
+        Result = RunUringEngine(WorkerContext);
+        if (Result == ENGINE_NOT_APPLICABLE) {
+            Result = RunPositionalEngine(WorkerContext);
+        }
+
+        if ((Result == ENGINE_NOT_APPLICABLE) &&
+            (WorkerContext->Options->Direct == 0)) {
+
+            Result = RunStreamEngine(WorkerContext);
+        }
+
+        break;
+
+    default:
+
+        //
+        // A checkpoint needs the output finished front to back, which the
+        // mapped and io_uring engines don't do. Direct I/O can't go through
+        // a mapping.
+        //
+
+        Result = ENGINE_NOT_APPLICABLE;
+        if (WorkerContext->Checkpoint == NULL) {
+            if (WorkerContext->Options->Direct == 0) {
+                Result = RunMappedEngine(WorkerContext);
+            }
+
+            if (Result == ENGINE_NOT_APPLICABLE) {
+                Result = RunUringEngine(WorkerContext);
+            }
+        }
+
+        if (Result == ENGINE_NOT_APPLICABLE) {
+            Result = RunPositionalEngine(WorkerContext);
+        }
+
+        if ((Result == ENGINE_NOT_APPLICABLE) &&
+            (WorkerContext->Options->Direct == 0)) {
+
+            Result = RunStreamEngine(WorkerContext);
+        }
+
+        break;
+    }
+
+    if ((Result == ENGINE_NOT_APPLICABLE) &&
+        (WorkerContext->Options->Direct != 0) &&
+        (WorkerContext->Options->Engine != ENGINE_POSITIONAL)) {
+
+        fprintf(stderr, "--direct needs seekable streams\n");
+    }
+
+    return Result;
+}
+
+int
+TuneBlockSize(
+    WORKER_CONTEXT * WorkerContext,
+    OPTIONS * Options
+    )
+
+/*++
+
+Description:
+
+    This routine picks a block size by timing the engine on a sample of the
+    stream at each candidate size, and then encrypts the rest of the stream
+    at the fastest one. The samples are encrypted and written like any other
+    part of the stream, so nothing is processed twice.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+    Options - Supplies the options the context refers to. The block size is
+        updated.
+
+Return Value:
+
+    Returns zero (0) once the range has been encrypted, or non-zero on
+    failure.
+
+--*/
+
+{
+
+    size_t BestBlockSize;
+    double BestRate;
+    size_t Candidate;
+    uint64_t Elapsed;
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock;
+    double Rate;
+    uint64_t ReadLimit;
+    int Result;
+    uint64_t Sample;
+    uint64_t Start;
+    struct timespec Time;
+
+    IoSyncBlock = WorkerContext->IoSyncBlock;
+    ReadLimit = IoSyncBlock->ReadLimit;
+    BestBlockSize = DEFAULT_BLOCKSIZE;
+    BestRate = 0;
+    for (Candidate = AUTO_BLOCKSIZE_MINIMUM;
+         Candidate <= AUTO_BLOCKSIZE_MAXIMUM;
+         Candidate *= 4) {
+
+        //
+        // Give every thread a few blocks of the sample, however large.
+        //
+
+        Sample = 4 * (uint64_t)Options->ThreadCount * Candidate;
+        if (Sample < AUTO_SAMPLE_MINIMUM) {
+            Sample = AUTO_SAMPLE_MINIMUM;
+        }
+
+        if (Sample > ReadLimit - IoSyncBlock->ReadOffset) {
+            break;
+        }
+
+        Start = IoSyncBlock->ReadOffset;
+        IoSyncBlock->ReadLimit = Start + Sample;
+        Options->BlockSize = Candidate;
+        clock_gettime(CLOCK_MONOTONIC, &Time);
+        Elapsed = Time.tv_sec * 1000000000ULL + Time.tv_nsec;
+        Result = RunEngine(WorkerContext);
+        if (Result != 0) {
+            return Result;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &Time);
+        Elapsed = Time.tv_sec * 1000000000ULL + Time.tv_nsec - Elapsed;
+        if (Elapsed == 0) {
+            Elapsed = 1;
+        }
+
+        Rate = (IoSyncBlock->ReadOffset - Start) * 1000.0 / Elapsed;
+        if (Options->Verbose != 0) {
+            fprintf(stderr,
+                    "Block size %zu: %llu bytes in %.3f ms, %.1f MB/s\n",
+                    Candidate,
+                    (unsigned long long)(IoSyncBlock->ReadOffset - Start),
+                    Elapsed / 1000000.0,
+                    Rate);
+        }
+
+        if (Rate > BestRate) {
+            BestRate = Rate;
+            BestBlockSize = Candidate;
+        }
+
+        //
+        // The stream ended during the sample.
+        //
+
+        if (IoSyncBlock->ReadOffset - Start < Sample) {
+            IoSyncBlock->ReadLimit = ReadLimit;
+            return 0;
+        }
+    }
+
+    IoSyncBlock->ReadLimit = ReadLimit;
+    Options->BlockSize = BestBlockSize;
+    if (Options->Verbose != 0) {
+        fprintf(stderr, "Using block size %zu\n", BestBlockSize);
+    }
+
+    return RunEngine(WorkerContext);
+}
+
 void
 ErrorExit(
     int ErrorNumber,
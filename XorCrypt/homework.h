@@ -8,10 +8,67 @@ typedef unsigned char byte;
 // ------------------------------------------------------------ Program Options
 //
 
+typedef enum _ENGINE {
+    ENGINE_AUTO,
+    ENGINE_STREAM,
+    ENGINE_PIPELINE,
+    ENGINE_MAPPED,
+    ENGINE_POSITIONAL,
+    ENGINE_URING,
+    ENGINE_SPLICE,
+    ENGINE_IN_PLACE,
+    ENGINE_BATCH,
+    ENGINE_EXTRACT,
+    ENGINE_VERIFY
+} ENGINE;
+
+//
+// Engines that only suit some kinds of stream return ENGINE_NOT_APPLICABLE,
+// without touching the streams, when handed streams they don't suit.
+//
+
+#define ENGINE_NOT_APPLICABLE (-1)
+
+typedef enum _STATS_FORMAT {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON
+} STATS_FORMAT;
+
 typedef struct _OPTIONS {
     int ThreadCount;
     char const* KeyFileName;
-    int BlockSize;
+    size_t BlockSize;
+    int AutoBlockSize;
+    int Verbose;
+    uint64_t RangeOffset;
+    uint64_t RangeLength;
+    ENGINE Engine;
+    int QueueDepth;
+    char const* InPlaceFileName;
+    STATS_FORMAT StatsFormat;
+    int StatsInterval;
+    int * Cpus;
+    int CpuCount;
+    int * IoCpus;
+    int IoCpuCount;
+    int Numa;
+    char const* ManifestFileName;
+    char** BatchNames;
+    int BatchPairCount;
+    uint64_t MemoryLimit;
+    int Digest;
+    char const* DigestFileName;
+    int Container;
+    char const* CheckpointFileName;
+    int Resume;
+    int ShardIndex;
+    int ShardCount;
+    int PlaceOutput;
+    char** VerifyNames;
+    int VerifyNameCount;
+    int Merge;
+    int Direct;
 } OPTIONS;
 
 int
@@ -21,26 +78,80 @@ ParseCommandLine(
     OPTIONS * Options
     );
 
+int
+ParseOffset(
+    char const * String,
+    uint64_t * Value
+    );
+
+int
+ParseRange(
+    char const * String,
+    uint64_t * Offset,
+    uint64_t * Length
+    );
+
 //
 // Some options are currently compile time constants.
 //
 
-#define DEFAULT_BLOCKSIZE 128
+#define DEFAULT_BLOCKSIZE (64 * 1024)
+#define MAXIMUM_BLOCKSIZE (1024 * 1024 * 1024)
+
+//
+// Automatic tuning times candidate block sizes from the minimum to the
+// maximum, in steps of four, on samples of at least the given length.
+//
+
+#define AUTO_BLOCKSIZE_MINIMUM (4 * 1024)
+#define AUTO_BLOCKSIZE_MAXIMUM (1024 * 1024)
+#define AUTO_SAMPLE_MINIMUM (2 * 1024 * 1024)
 
 //
 // ------------------------------------------------------------------- File I/O
 //
 
+//
+// Completed blocks wait in a reorder buffer, indexed by sequence number, until
+// every block ahead of them has been written.
+//
+
+typedef struct _COMPLETED_BLOCK {
+    byte * Buffer;
+    size_t Length;
+    uint64_t ReadTime;
+    int Ready;
+} COMPLETED_BLOCK;
+
+//
+// The most blocks gathered into one write.
+//
+
+#define WRITE_BATCH_MAXIMUM 64
+
 typedef struct _IO_SYNCHRONIZATION_BLOCK {
 
     FILE * InputStream;
     pthread_mutex_t ReadLock;
-    size_t ReadOffset;
+    uint64_t ReadOffset;
+    uint64_t ReadLimit;
+    uint64_t ReadSequence;
     
     FILE * OutputStream;
     pthread_mutex_t WriteLock;
     pthread_cond_t WriteEvent;
-    size_t WriteOffset;
+    _Atomic uint64_t WriteOffset;
+    uint64_t WriteSequence;
+    COMPLETED_BLOCK * Completed;
+    size_t ReorderDepth;
+    int Writing;
+    int WindowWaiters;
+    byte ** FreeBuffers;
+    size_t FreeBufferCount;
+    struct _BUFFER_POOL * BufferPool;
+    size_t BlockSize;
+    int * BufferNodes;
+    int WorkerJoins;
     
 } IO_SYNCHRONIZATION_BLOCK;
 
@@ -50,22 +161,63 @@ ReadBlock(
     IO_SYNCHRONIZATION_BLOCK * IoSyncBlock,
     byte * Buffer,
     size_t BufferLength,
-    size_t * Offset,
+    uint64_t * Offset,
+    uint64_t * Sequence,
     size_t * BytesRead
     );
 
+int
+InitializeWriteQueue(
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock,
+    struct _BUFFER_POOL * BufferPool,
+    size_t BlockSize,
+    size_t * Depth,
+    size_t WorkerCount
+    );
+
+void
+FreeWriteQueue(
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock
+    );
+
+byte *
+AcquireBlockBuffer(
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock
+    );
+
+int
+WriteVector(
+    int FileDescriptor,
+    struct iovec * Vector,
+    int Count
+    );
+
 int
 WriteBlock(
     IO_SYNCHRONIZATION_BLOCK * IoSyncBlock,
     byte * Buffer,
     size_t BufferLength,
-    size_t Offset
+    uint64_t Sequence,
+    uint64_t ReadTime,
+    byte ** NextBuffer
+    );
+
+int
+SkipInput(
+    FILE * Stream,
+    uint64_t Count
     );
     
 //
 // ----------------------------------------------------------------- Encryption 
 //
 
+//
+// ReadKey and FreeKey are part of the program. The rest of this section is
+// the internal interface of libxorcrypt, in xorcrypt.c, whose public
+// interface is in xorcrypt.h.
+//
+
 int
 ReadKey(
     char const * FileName,
@@ -73,11 +225,159 @@ ReadKey(
     size_t * KeyLength
     );
 
+void
+FreeKey(
+    byte * Key,
+    size_t KeyLength
+    );
+
 int
 IterateKey(
     byte * Key,
     size_t KeyLength,
-    int Iteration
+    uint64_t Iteration
+    );
+
+int
+IterateKeyInto(
+    byte * Destination,
+    byte const * Key,
+    size_t KeyLength,
+    uint64_t Iteration
+    );
+
+//
+// Every key iteration K_i is the original key rotated left by i bits. The key
+// table holds the key expanded into its eight bit-rotated phases, each stored
+// twice back to back. K_i is then the contiguous KeyLength bytes starting at
+// byte (i / 8) % KeyLength of phase i % 8.
+//
+
+#define KEY_PHASE_COUNT 8
+
+//
+// Keys longer than this are not expanded, since the table takes sixteen times
+// the key's length. A direct key table refers to the key itself instead, and
+// shifts each iteration's material out of it, a chunk at a time, as blocks
+// are encrypted. Either way the work per block is proportional to the block's
+// length, not the key's.
+//
+
+#define KEY_TABLE_MAXIMUM (1024 * 1024)
+#define KEYSTREAM_CHUNK 4096
+
+//
+// The keystream repeats: after 8 * KeyLength iterations every key byte is
+// back where it started, so the period is 8 * KeyLength * KeyLength bytes.
+// Keys whose period is at most KEYSTREAM_PERIOD_MAXIMUM get a periodic key
+// table, which holds the keystream itself, repeated so that a window of at
+// least KEYSTREAM_WINDOW_MINIMUM bytes starting at any offset in the period
+// is contiguous. A block is then encrypted with one kernel call per window,
+// rather than one per key iteration.
+//
+
+#define KEYSTREAM_PERIOD_MAXIMUM (512 * 1024)
+#define KEYSTREAM_WINDOW_MINIMUM (8 * 1024)
+
+//
+// XOR kernels combine a run of source bytes with a run of key material into a
+// destination, which may be the source itself. The best kernel the processor
+// supports is selected at startup.
+//
+
+typedef
+void
+(*XOR_ROUTINE)(
+    byte * Destination,
+    byte const * Source,
+    byte const * KeyMaterial,
+    size_t Length
+    );
+
+typedef struct _XOR_KERNEL {
+    char const * Name;
+    int (*IsSupported)(void);
+    XOR_ROUTINE Xor;
+} XOR_KERNEL;
+
+//
+// Kernels are listed from most to least preferred. The last entry is the
+// portable scalar kernel, which is always supported.
+//
+
+extern XOR_KERNEL const XorKernels[];
+extern int const XorKernelCount;
+
+XOR_KERNEL const *
+SelectXorKernel(
+    void
+    );
+
+//
+// A direct key table has no phases, and its key must outlive it. A periodic
+// key table has no phases either, but a keystream.
+//
+
+typedef struct _KEY_TABLE {
+    size_t KeyLength;
+    byte * Phases[KEY_PHASE_COUNT];
+    byte const * Key;
+    byte * Keystream;
+    size_t Period;
+    size_t Window;
+    XOR_ROUTINE Xor;
+} KEY_TABLE;
+
+int
+BuildKeyTable(
+    byte const * Key,
+    size_t KeyLength,
+    KEY_TABLE * KeyTable
+    );
+
+void
+BuildDirectKeyTable(
+    byte const * Key,
+    size_t KeyLength,
+    KEY_TABLE * KeyTable
+    );
+
+int
+BuildPeriodicKeyTable(
+    byte const * Key,
+    size_t KeyLength,
+    KEY_TABLE * KeyTable
+    );
+
+void
+FreeKeyTable(
+    KEY_TABLE * KeyTable
+    );
+
+int
+Encrypt(
+    byte * Block,
+    size_t BlockLength,
+    uint64_t BlockOffset,
+    KEY_TABLE const * KeyTable
+    );
+
+int
+EncryptCopy(
+    byte * Destination,
+    byte const * Source,
+    size_t BlockLength,
+    uint64_t BlockOffset,
+    KEY_TABLE const * KeyTable
+    );
+
+void
+GenerateKeystream(
+    byte const * Key,
+    size_t KeyLength,
+    uint64_t Offset,
+    byte * Output,
+    size_t Length
     );
 
 //
@@ -87,15 +387,721 @@ IterateKey(
 typedef struct _WORKER_CONTEXT {
     IO_SYNCHRONIZATION_BLOCK * IoSyncBlock;
     OPTIONS const * Options;
-    byte const * Key;
-    size_t KeyLength;
+    KEY_TABLE const * KeyTable;
+    struct _PLACEMENT * Placement;
+    struct _BUFFER_POOL * BufferPool;
+    struct _DIGEST * Digest;
+    FILE * DigestStream;
+    struct _CONTAINER * Container;
+    struct _CHECKPOINT * Checkpoint;
 } WORKER_CONTEXT;
 
 void *
 WorkerThreadRoutine(
     void * Context
     );
-    
+
+int
+RunStreamEngine(
+    WORKER_CONTEXT * WorkerContext
+    );
+
+int
+RunEngine(
+    WORKER_CONTEXT * WorkerContext
+    );
+
+int
+TuneBlockSize(
+    WORKER_CONTEXT * WorkerContext,
+    OPTIONS * Options
+    );
+
+//
+// ------------------------------------------------------------ Pipeline Engine
+//
+
+int
+RunPipelineEngine(
+    WORKER_CONTEXT * WorkerContext
+    );
+
+int
+RunSpliceEngine(
+    WORKER_CONTEXT * WorkerContext
+    );
+
+//
+// -------------------------------------------------------------- Mapped Engine
+//
+
+int
+RunMappedEngine(
+    WORKER_CONTEXT * WorkerContext
+    );
+
+//
+// ---------------------------------------------------------- Positional Engine
+//
+
+//
+// With --direct, file positions and transfer lengths are kept to multiples
+// of this, which suits devices with either 512 byte or 4 KiB sectors.
+//
+
+#define DIRECT_ALIGNMENT 4096
+
+typedef struct _POSITIONAL_WORKER {
+    _Atomic uint64_t Claimed;
+    struct _POSITIONAL_ENGINE * Engine;
+} __attribute__((aligned(64))) POSITIONAL_WORKER;
+
+typedef struct _POSITIONAL_ENGINE {
+    _Atomic uint64_t NextOffset __attribute__((aligned(64)));
+    _Atomic uint64_t EndOffset __attribute__((aligned(64)));
+    WORKER_CONTEXT * WorkerContext __attribute__((aligned(64)));
+    int InputFd;
+    off_t InputPosition;
+    int OutputFd;
+    off_t OutputPosition;
+    uint64_t StreamOffset;
+    uint64_t Length;
+    POSITIONAL_WORKER * Workers;
+    int WorkerCount;
+    int Direct;
+    int BufferedOutputFd;
+} POSITIONAL_ENGINE;
+
+int
+ReadPositioned(
+    int FileDescriptor,
+    byte * Buffer,
+    size_t Length,
+    off_t Position,
+    size_t * BytesRead
+    );
+
+int
+WritePositioned(
+    int FileDescriptor,
+    byte const * Buffer,
+    size_t Length,
+    off_t Position
+    );
+
+size_t
+ReadFully(
+    int FileDescriptor,
+    byte * Buffer,
+    size_t Length,
+    off_t Position
+    );
+
+void
+WriteFully(
+    int FileDescriptor,
+    byte const * Buffer,
+    size_t Length,
+    off_t Position
+    );
+
+int
+InitializePositionalEngine(
+    POSITIONAL_ENGINE * Engine
+    );
+
+void
+FreePositionalEngine(
+    POSITIONAL_ENGINE * Engine
+    );
+
+int
+EnableDirectIo(
+    POSITIONAL_ENGINE * Engine
+    );
+
+size_t
+WriteDirectTail(
+    POSITIONAL_ENGINE * Engine,
+    byte const * Buffer,
+    size_t Length,
+    uint64_t Offset
+    );
+
+void
+RecordPositionalEnd(
+    POSITIONAL_ENGINE * Engine,
+    uint64_t End
+    );
+
+void
+TransferPositional(
+    POSITIONAL_ENGINE * Engine
+    );
+
+uint64_t
+GetPositionalProgress(
+    POSITIONAL_ENGINE * Engine
+    );
+
+int
+OpenPositionalEngine(
+    WORKER_CONTEXT * WorkerContext,
+    POSITIONAL_ENGINE * Engine
+    );
+
+void
+ClosePositionalEngine(
+    POSITIONAL_ENGINE * Engine
+    );
+
+int
+RunPositionalEngine(
+    WORKER_CONTEXT * WorkerContext
+    );
+
+//
+// ------------------------------------------------------------ io_uring Engine
+//
+
+int
+RunUringEngine(
+    WORKER_CONTEXT * WorkerContext
+    );
+
+//
+// ------------------------------------------------------------------- In Place
+//
+
+int
+RunInPlace(
+    WORKER_CONTEXT * WorkerContext,
+    char const * FileName
+    );
+
+void
+WriteMarker(
+    char const * FileName,
+    int Flags,
+    char const * Text,
+    size_t Length
+    );
+
+void
+SyncParentDirectory(
+    char const * FileName
+    );
+
+//
+// --------------------------------------------------------------------- Shards
+//
+
+//
+// Shards start on multiples of this many bytes.
+//
+
+#define SHARD_ALIGNMENT (1024 * 1024)
+
+int
+ParseShard(
+    char const * String,
+    int * Index,
+    int * Count
+    );
+
+void
+GetShardRange(
+    int Index,
+    int Count,
+    uint64_t StreamLength,
+    uint64_t * Offset,
+    uint64_t * Length
+    );
+
+int
+ResolveShard(
+    OPTIONS * Options,
+    FILE * InputStream,
+    FILE * OutputStream
+    );
+
+int
+RunVerify(
+    OPTIONS const * Options
+    );
+
+//
+// ----------------------------------------------------------------- Checkpoint
+//
+
+typedef struct _CHECKPOINT {
+    char const * FileName;
+    char * TemporaryName;
+    int OutputFd;
+    off_t OutputPosition;
+    uint64_t StreamOffset;
+    uint64_t Length;
+    uint32_t KeyFingerprint;
+    uint64_t Recorded;
+    WORKER_CONTEXT * WorkerContext;
+    POSITIONAL_ENGINE * Engine;
+    pthread_t Thread;
+    pthread_mutex_t Lock;
+    pthread_cond_t Event;
+    int Done;
+} CHECKPOINT;
+
+int
+OpenCheckpoint(
+    CHECKPOINT * Checkpoint,
+    OPTIONS * Options,
+    byte const * Key,
+    size_t KeyLength,
+    FILE * OutputStream
+    );
+
+void
+StartCheckpoint(
+    CHECKPOINT * Checkpoint,
+    WORKER_CONTEXT * WorkerContext
+    );
+
+void
+AttachCheckpoint(
+    CHECKPOINT * Checkpoint,
+    POSITIONAL_ENGINE * Engine
+    );
+
+void
+DetachCheckpoint(
+    CHECKPOINT * Checkpoint
+    );
+
+void
+FinishCheckpoint(
+    CHECKPOINT * Checkpoint,
+    int Result
+    );
+
+//
+// ----------------------------------------------------------------- Batch Mode
+//
+
+int
+RunBatch(
+    WORKER_CONTEXT * WorkerContext
+    );
+
+//
+// ---------------------------------------------------------------- Buffer Pool
+//
+
+//
+// Buffers are aligned to a cache line, or to a page if they are a page or
+// more. Arenas of a huge page or more are backed by huge pages if possible.
+//
+
+#define POOL_ALIGNMENT 64
+#define POOL_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+typedef enum _POOL_PAGES {
+    POOL_PAGES_SMALL,
+    POOL_PAGES_TRANSPARENT,
+    POOL_PAGES_EXPLICIT
+} POOL_PAGES;
+
+typedef struct _BUFFER_POOL {
+    _Atomic uint64_t FreeHead __attribute__((aligned(64)));
+    _Atomic uint32_t * Links __attribute__((aligned(64)));
+    size_t LinkCount;
+    byte * Arena;
+    size_t ArenaSize;
+    POOL_PAGES Pages;
+    size_t BufferSize;
+    size_t BufferStride;
+    size_t BufferCount;
+    size_t MemoryLimit;
+    int Verbose;
+} BUFFER_POOL;
+
+void
+InitializeBufferPool(
+    BUFFER_POOL * Pool,
+    size_t MemoryLimit,
+    int Verbose
+    );
+
+int
+PrepareBufferPool(
+    BUFFER_POOL * Pool,
+    size_t BufferSize,
+    size_t * BufferCount,
+    size_t MinimumCount
+    );
+
+byte *
+GetPoolBuffer(
+    BUFFER_POOL const * Pool,
+    size_t Index
+    );
+
+size_t
+GetPoolBufferIndex(
+    BUFFER_POOL const * Pool,
+    byte const * Buffer
+    );
+
+byte *
+TakePoolBuffer(
+    BUFFER_POOL * Pool
+    );
+
+void
+ReturnPoolBuffer(
+    BUFFER_POOL * Pool,
+    byte * Buffer
+    );
+
+void
+FreeBufferPool(
+    BUFFER_POOL * Pool
+    );
+
+//
+// ------------------------------------------------------------ Integrity Digest
+//
+
+//
+// Digests are CRC32C (Castagnoli) checksums, as computed by SSE4.2. The
+// hardware kernel runs three lanes of CRC_LANE bytes at once, and joins
+// them with the lane shift table. Blocks are digested in chunks of
+// DIGEST_CHUNK bytes, each checksummed, encrypted, and checksummed again
+// while it is in the first level cache.
+//
+
+#define CRC_LANE 1024
+#define DIGEST_CHUNK (24 * 1024)
+
+struct _CRC_TABLE;
+
+typedef
+uint32_t
+(*CRC_ROUTINE)(
+    struct _CRC_TABLE const * Table,
+    uint32_t Crc,
+    byte const * Data,
+    size_t Length
+    );
+
+typedef struct _CRC_KERNEL {
+    char const * Name;
+    int (*IsSupported)(void);
+    CRC_ROUTINE Update;
+} CRC_KERNEL;
+
+extern CRC_KERNEL const CrcKernels[];
+extern int const CrcKernelCount;
+
+//
+// Powers[N] and InversePowers[N] hold x to the power of plus and minus 8 *
+// 2^N, modulo the polynomial, to shift a CRC forward or back by any number
+// of bytes.
+//
+
+typedef struct _CRC_TABLE {
+    uint32_t Bytes[8][256];
+    uint32_t LaneShift[4][256];
+    uint32_t Powers[64];
+    uint32_t InversePowers[64];
+    CRC_ROUTINE Update;
+} CRC_TABLE;
+
+//
+// A digest gathers the CRCs of the input and the output of a stream whose
+// blocks are encrypted in any order, the CRC of each fixed size chunk of the
+// output, or both. Each piece adds its CRC, shifted back by the offset of
+// its end, so the sums don't depend on the order. Chunk CRCs are kept in
+// segments, allocated as the stream reaches them.
+//
+
+#define DIGEST_STREAM 0x1
+#define DIGEST_CHUNKS 0x2
+
+#define DIGEST_SEGMENT_CHUNKS 65536
+#define DIGEST_SEGMENTS 65536
+
+typedef struct _DIGEST {
+    CRC_TABLE const * Table;
+    uint64_t Start;
+    int Flags;
+    uint64_t ChunkSize;
+    _Atomic(_Atomic uint32_t *) * Segments;
+    _Atomic uint64_t Length;
+    _Atomic uint32_t Input;
+    _Atomic uint32_t Output;
+} DIGEST;
+
+void
+BuildCrcTable(
+    CRC_TABLE * Table
+    );
+
+uint32_t
+UpdateCrc32c(
+    CRC_TABLE const * Table,
+    uint32_t Crc,
+    void const * Data,
+    size_t Length
+    );
+
+uint32_t
+CombineCrc32c(
+    CRC_TABLE const * Table,
+    uint32_t First,
+    uint32_t Second,
+    uint64_t SecondLength
+    );
+
+int
+InitializeDigest(
+    DIGEST * Digest,
+    CRC_TABLE const * Table,
+    uint64_t Start,
+    int Flags,
+    uint64_t ChunkSize
+    );
+
+void
+FreeDigest(
+    DIGEST * Digest
+    );
+
+int
+EncryptAndDigest(
+    DIGEST * Digest,
+    byte * Destination,
+    byte const * Source,
+    size_t Length,
+    uint64_t Offset,
+    KEY_TABLE const * KeyTable
+    );
+
+void
+GetDigest(
+    DIGEST * Digest,
+    uint32_t * Input,
+    uint32_t * Output,
+    uint64_t * Length
+    );
+
+uint32_t
+GetChunkChecksum(
+    DIGEST * Digest,
+    uint64_t Chunk
+    );
+
+void
+ReportDigest(
+    FILE * Stream,
+    DIGEST * Digest,
+    char const * InputName,
+    char const * OutputName
+    );
+
+//
+// ------------------------------------------------------------------ Container
+//
+
+//
+// A container is a header, the encrypted stream cut into chunks, an index of
+// the chunks, and a trailer that locates the index. Integers are stored
+// little endian. See container.c for the layout.
+//
+
+#define CONTAINER_VERSION 1
+#define CONTAINER_HEADER_SIZE 64
+#define CONTAINER_ENTRY_SIZE 16
+#define CONTAINER_TRAILER_SIZE 32
+
+typedef struct _CONTAINER {
+    CRC_TABLE const * Table;
+    uint32_t KeyFingerprint;
+    uint64_t ChunkSize;
+    uint64_t StreamOffset;
+    uint64_t ChunkCount;
+    uint64_t Length;
+} CONTAINER;
+
+int
+WriteContainerHeader(
+    CONTAINER const * Container,
+    FILE * Stream
+    );
+
+int
+WriteContainerIndex(
+    CONTAINER * Container,
+    DIGEST * Digest,
+    FILE * Stream
+    );
+
+int
+RunExtract(
+    WORKER_CONTEXT * WorkerContext
+    );
+
+//
+// ----------------------------------------------------------- Thread Placement
+//
+
+typedef struct _PLACEMENT {
+    int * Cpus;
+    int CpuCount;
+    int * IoCpus;
+    int IoCpuCount;
+    struct _NUMA_NODE * Nodes;
+    int NodeCount;
+    int CpuNodeCount;
+} PLACEMENT;
+
+int
+ParseCpuList(
+    char const * String,
+    int ** Cpus,
+    int * CpuCount
+    );
+
+int
+InitializePlacement(
+    PLACEMENT * Placement,
+    OPTIONS const * Options,
+    byte const * Key,
+    size_t KeyLength
+    );
+
+void
+FreePlacement(
+    PLACEMENT * Placement
+    );
+
+int
+GetWorkerNode(
+    PLACEMENT const * Placement,
+    int Worker
+    );
+
+void
+RunOnNode(
+    PLACEMENT const * Placement,
+    int Node,
+    void * (*Routine)(void *),
+    void * Context
+    );
+
+KEY_TABLE const *
+PlaceWorkerThread(
+    WORKER_CONTEXT * WorkerContext,
+    int Worker
+    );
+
+void
+PlaceIoThread(
+    WORKER_CONTEXT * WorkerContext,
+    int FileDescriptor
+    );
+
+int
+GetCurrentNode(
+    void
+    );
+
+//
+// ----------------------------------------------------------------- Statistics
+//
+
+//
+// Each thread accounts for its time in these counters. The counters before
+// STAT_BLOCKS are times in nanoseconds.
+//
+
+typedef enum _STAT_COUNTER {
+    STAT_READ_LOCK_WAIT,
+    STAT_READ,
+    STAT_ENCRYPT,
+    STAT_WRITE_LOCK_WAIT,
+    STAT_WRITE_EVENT_WAIT,
+    STAT_WRITE,
+    STAT_STAGE_WAIT,
+    STAT_BLOCKS,
+    STAT_BYTES,
+    STAT_SPURIOUS_WAKEUPS,
+    STAT_COUNTER_COUNT
+} STAT_COUNTER;
+
+#define STAT_TIME_COUNT STAT_BLOCKS
+#define STAT_LATENCY_BUCKETS 48
+
+void
+EnableStats(
+    void
+    );
+
+void
+AttachStatsThread(
+    char const * Role,
+    int Index
+    );
+
+void
+DetachStatsThread(
+    void
+    );
+
+uint64_t
+StartStatsTimer(
+    void
+    );
+
+void
+StopStatsTimer(
+    STAT_COUNTER Counter,
+    uint64_t Start
+    );
+
+void
+CountStat(
+    STAT_COUNTER Counter,
+    uint64_t Amount
+    );
+
+int
+GetLatencyBucket(
+    uint64_t Nanoseconds
+    );
+
+void
+RecordStatsLatency(
+    uint64_t Start,
+    uint64_t End
+    );
+
+void
+ReportStats(
+    FILE * Stream,
+    STATS_FORMAT Format
+    );
+
+int
+StartStatsReporter(
+    STATS_FORMAT Format,
+    int Interval
+    );
+
+void
+StopStatsReporter(
+    void
+    );
+
 void
 ErrorExit(
     int ErrorNumber,
@@ -0,0 +1,549 @@
+/*++
+
+Description:
+
+    This module implements in-place encryption, which transforms a range of a
+    file where it sits rather than copying it from stdin to stdout. It needs
+    no second copy of the file, and writes each byte once.
+
+    The file is opened read-write and handed to the positional workers as both
+    the input and the output. Every block is read, encrypted, and written back
+    at the position it came from, and no two threads ever touch the same
+    block, so no further synchronization is needed.
+
+    An interrupted in-place run leaves the file half encrypted, and running it
+    again would decrypt the finished half. To catch that, a progress marker
+    named after the file (with a ".xcprogress" suffix) exists for as long as
+    the run does. A monitor thread periodically flushes the file and then
+    records in the marker how much of the range is certainly encrypted, along
+    with how far beyond that threads may have been working. A run refuses to
+    start while a marker exists, and reports what it recorded instead.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "homework.h"
+
+#define PROGRESS_MARKER_SUFFIX ".xcprogress"
+#define PROGRESS_TEMPORARY_SUFFIX ".tmp"
+#define PROGRESS_INTERVAL_SECONDS 1
+#define PROGRESS_MARKER_MAXIMUM 512
+
+typedef struct _PROGRESS_MONITOR {
+    POSITIONAL_ENGINE * Engine;
+    char * MarkerName;
+    char * TemporaryName;
+    pthread_mutex_t Lock;
+    pthread_cond_t Event;
+    int Done;
+} PROGRESS_MONITOR;
+
+static
+int
+FormatProgress(
+    PROGRESS_MONITOR * Monitor,
+    uint64_t Completed,
+    char * Buffer,
+    size_t BufferLength
+    )
+
+/*++
+
+Description:
+
+    This routine formats the contents of the progress marker.
+
+Arguments:
+
+    Monitor - Supplies the progress monitor.
+
+    Completed - Supplies the number of bytes of the range known to be
+        encrypted and flushed.
+
+    Buffer - Supplies the buffer that receives the text.
+
+    BufferLength - Supplies the size of the buffer.
+
+Return Value:
+
+    Returns the length of the text.
+
+--*/
+
+{
+
+    POSITIONAL_ENGINE * Engine;
+    uint64_t Window;
+
+    Engine = Monitor->Engine;
+    Window = (uint64_t)Engine->WorkerContext->Options->ThreadCount *
+             Engine->WorkerContext->Options->BlockSize;
+
+    return snprintf(Buffer,
+                    BufferLength,
+                    "offset %llu\n"
+                    "length %llu\n"
+                    "completed %llu\n"
+                    "window %llu\n",
+                    (unsigned long long)Engine->OutputPosition,
+                    (unsigned long long)Engine->Length,
+                    (unsigned long long)Completed,
+                    (unsigned long long)Window);
+}
+
+void
+WriteMarker(
+    char const * FileName,
+    int Flags,
+    char const * Text,
+    size_t Length
+    )
+
+/*++
+
+Description:
+
+    This routine writes a marker file, such as a progress marker or a
+    checkpoint, and flushes it to disk.
+
+Arguments:
+
+    FileName - Supplies the name of the marker file.
+
+    Flags - Supplies additional flags for open().
+
+    Text - Supplies the contents of the marker.
+
+    Length - Supplies the length of the contents.
+
+Return Value:
+
+    None. Failures are fatal.
+
+--*/
+
+{
+
+    int FileDescriptor;
+
+    FileDescriptor = open(FileName, O_WRONLY | O_CREAT | Flags, 0644);
+    if (FileDescriptor < 0) {
+        ErrorExit(errno, "Failure creating %s\n", FileName);
+    }
+
+    WriteFully(FileDescriptor, (byte const *)Text, Length, 0);
+    if (fsync(FileDescriptor) != 0) {
+        ErrorExit(errno, "Failure flushing %s\n", FileName);
+    }
+
+    close(FileDescriptor);
+}
+
+void
+SyncParentDirectory(
+    char const * FileName
+    )
+
+/*++
+
+Description:
+
+    This routine flushes the directory holding a file, so that the file's
+    creation or removal survives a crash.
+
+Arguments:
+
+    FileName - Supplies the name of the file.
+
+Return Value:
+
+    None. Failures are ignored, since some file systems don't allow it.
+
+--*/
+
+{
+
+    char * DirectoryName;
+    int FileDescriptor;
+    char * Separator;
+
+    DirectoryName = strdup(FileName);
+    if (DirectoryName == NULL) {
+        return;
+    }
+
+    Separator = strrchr(DirectoryName, '/');
+    if (Separator == NULL) {
+        strcpy(DirectoryName, ".");
+
+    } else if (Separator == DirectoryName) {
+        Separator[1] = '\0';
+
+    } else {
+        *Separator = '\0';
+    }
+
+    FileDescriptor = open(DirectoryName, O_RDONLY | O_DIRECTORY);
+    if (FileDescriptor >= 0) {
+        fsync(FileDescriptor);
+        close(FileDescriptor);
+    }
+
+    free(DirectoryName);
+}
+
+static
+void
+UpdateProgressMarker(
+    PROGRESS_MONITOR * Monitor,
+    int FileDescriptor
+    )
+
+/*++
+
+Description:
+
+    This routine flushes the file, then records how much of it is encrypted.
+    The marker is replaced with a rename, so a crash leaves either the old
+    marker or the new one.
+
+Arguments:
+
+    Monitor - Supplies the progress monitor.
+
+    FileDescriptor - Supplies the descriptor of the file being encrypted.
+
+Return Value:
+
+    None. Failures are fatal.
+
+--*/
+
+{
+
+    uint64_t Completed;
+    int Length;
+    char Text[PROGRESS_MARKER_MAXIMUM];
+
+    //
+    // Measure first, then flush. Everything measured has been written, so it
+    // is on disk by the time the marker claims it.
+    //
+
+    Completed = GetPositionalProgress(Monitor->Engine);
+    if (fdatasync(FileDescriptor) != 0) {
+        ErrorExit(errno, "Failure flushing the file\n");
+    }
+
+    Length = FormatProgress(Monitor, Completed, Text, sizeof(Text));
+    WriteMarker(Monitor->TemporaryName, O_TRUNC, Text, Length);
+    if (rename(Monitor->TemporaryName, Monitor->MarkerName) != 0) {
+        ErrorExit(errno, "Failure updating the progress marker\n");
+    }
+}
+
+static
+void *
+ProgressMonitorRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine updates the progress marker periodically until the transfer
+    is done.
+
+Arguments:
+
+    Context - Supplies the progress monitor.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    struct timespec Deadline;
+    PROGRESS_MONITOR * Monitor;
+
+    Monitor = (PROGRESS_MONITOR *)Context;
+    pthread_mutex_lock(&Monitor->Lock);
+    while (Monitor->Done == 0) {
+        clock_gettime(CLOCK_REALTIME, &Deadline);
+        Deadline.tv_sec += PROGRESS_INTERVAL_SECONDS;
+        pthread_cond_timedwait(&Monitor->Event, &Monitor->Lock, &Deadline);
+        if (Monitor->Done != 0) {
+            break;
+        }
+
+        pthread_mutex_unlock(&Monitor->Lock);
+        UpdateProgressMarker(Monitor, Monitor->Engine->OutputFd);
+        pthread_mutex_lock(&Monitor->Lock);
+    }
+
+    pthread_mutex_unlock(&Monitor->Lock);
+    return NULL;
+}
+
+static
+void
+ReportInterruptedRun(
+    char const * FileName,
+    char const * MarkerName
+    )
+
+/*++
+
+Description:
+
+    This routine explains that an earlier in-place run didn't finish, and
+    prints what its progress marker recorded.
+
+Arguments:
+
+    FileName - Supplies the name of the file being encrypted.
+
+    MarkerName - Supplies the name of its progress marker.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    int FileDescriptor;
+    ssize_t Length;
+    char Text[PROGRESS_MARKER_MAXIMUM];
+
+    fprintf(stderr,
+            "An in-place run on %s was interrupted, and the file may be "
+            "partly encrypted.\n"
+            "The progress marker %s records:\n",
+            FileName,
+            MarkerName);
+
+    Length = 0;
+    FileDescriptor = open(MarkerName, O_RDONLY);
+    if (FileDescriptor >= 0) {
+        Length = read(FileDescriptor, Text, sizeof(Text) - 1);
+        close(FileDescriptor);
+    }
+
+    if (Length <= 0) {
+        fprintf(stderr, "(nothing)\n");
+
+    } else {
+        Text[Length] = '\0';
+        fputs(Text, stderr);
+    }
+
+    fprintf(stderr,
+            "The first \"completed\" bytes after \"offset\" are encrypted, "
+            "and up to \"window\"\nbytes after those may be. Remove the "
+            "marker once the file has been recovered.\n");
+}
+
+static
+int
+EncryptUnderMarker(
+    PROGRESS_MONITOR * Monitor,
+    int FileDescriptor
+    )
+
+/*++
+
+Description:
+
+    This routine creates the progress marker, encrypts the range while the
+    monitor keeps the marker up to date, and removes the marker once the
+    range is on disk.
+
+Arguments:
+
+    Monitor - Supplies the progress monitor, holding the initialized engine.
+
+    FileDescriptor - Supplies the descriptor of the file being encrypted.
+
+Return Value:
+
+    Returns zero (0) on success. Failures are fatal.
+
+--*/
+
+{
+
+    int Length;
+    pthread_t MonitorThread;
+    int Result;
+    char Text[PROGRESS_MARKER_MAXIMUM];
+
+    Length = FormatProgress(Monitor, 0, Text, sizeof(Text));
+    WriteMarker(Monitor->MarkerName, O_EXCL, Text, Length);
+    SyncParentDirectory(Monitor->MarkerName);
+
+    //
+    // Encrypt the range on all threads, while the monitor keeps the marker
+    // up to date.
+    //
+
+    Monitor->Done = 0;
+    pthread_mutex_init(&Monitor->Lock, NULL);
+    pthread_cond_init(&Monitor->Event, NULL);
+    Result = pthread_create(&MonitorThread,
+                            NULL,
+                            ProgressMonitorRoutine,
+                            Monitor);
+
+    if (Result != 0) {
+        ErrorExit(Result, "Failed creating thread\n");
+    }
+
+    TransferPositional(Monitor->Engine);
+
+    pthread_mutex_lock(&Monitor->Lock);
+    Monitor->Done = 1;
+    pthread_cond_signal(&Monitor->Event);
+    pthread_mutex_unlock(&Monitor->Lock);
+    pthread_join(MonitorThread, NULL);
+    pthread_cond_destroy(&Monitor->Event);
+    pthread_mutex_destroy(&Monitor->Lock);
+
+    //
+    // Only once the whole range is on disk can the marker go.
+    //
+
+    if (fsync(FileDescriptor) != 0) {
+        ErrorExit(errno, "Failure flushing the file\n");
+    }
+
+    unlink(Monitor->MarkerName);
+    SyncParentDirectory(Monitor->MarkerName);
+    return 0;
+}
+
+int
+RunInPlace(
+    WORKER_CONTEXT * WorkerContext,
+    char const * FileName
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts a range of a file in place.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the options and key. The
+        range comes from the options.
+
+    FileName - Supplies the name of the file to encrypt.
+
+Return Value:
+
+    Returns zero (0) once the range has been encrypted and flushed, or
+    non-zero on failure.
+
+--*/
+
+{
+
+    POSITIONAL_ENGINE Engine;
+    int FileDescriptor;
+    struct stat FileStats;
+    PROGRESS_MONITOR Monitor;
+    size_t NameLength;
+    OPTIONS const * Options;
+    int Result;
+
+    Options = WorkerContext->Options;
+    FileDescriptor = open(FileName, O_RDWR);
+    if ((FileDescriptor < 0) || (fstat(FileDescriptor, &FileStats) != 0)) {
+        fprintf(stderr, "Cannot open %s: %s\n", FileName, strerror(errno));
+        return 1;
+    }
+
+    //
+    // The range is the file from the offset, up to the length.
+    //
+
+    Engine.WorkerContext = WorkerContext;
+    Engine.InputFd = FileDescriptor;
+    Engine.OutputFd = FileDescriptor;
+    Engine.InputPosition = Options->RangeOffset;
+    Engine.OutputPosition = Options->RangeOffset;
+    Engine.StreamOffset = Options->RangeOffset;
+    Engine.Length = 0;
+    if ((uint64_t)FileStats.st_size > Options->RangeOffset) {
+        Engine.Length = FileStats.st_size - Options->RangeOffset;
+    }
+
+    if (Engine.Length > Options->RangeLength) {
+        Engine.Length = Options->RangeLength;
+    }
+
+    if (InitializePositionalEngine(&Engine) != 0) {
+        ErrorExit(errno, "Failure allocating the positional engine\n");
+    }
+
+    if ((Options->Direct != 0) && (EnableDirectIo(&Engine) != 0)) {
+        FreePositionalEngine(&Engine);
+        close(FileDescriptor);
+        return 1;
+    }
+
+    //
+    // Claim the file with a fresh marker. If one is already there, an
+    // earlier run was interrupted, and it's not safe to go on.
+    //
+
+    NameLength = strlen(FileName);
+    Monitor.Engine = &Engine;
+    Monitor.MarkerName = malloc(NameLength +
+                                sizeof(PROGRESS_MARKER_SUFFIX));
+
+    Monitor.TemporaryName = malloc(NameLength +
+                                   sizeof(PROGRESS_MARKER_SUFFIX) +
+                                   sizeof(PROGRESS_TEMPORARY_SUFFIX));
+
+    if ((Monitor.MarkerName == NULL) || (Monitor.TemporaryName == NULL)) {
+        ErrorExit(errno, "Failure allocating marker names\n");
+    }
+
+    strcpy(Monitor.MarkerName, FileName);
+    strcat(Monitor.MarkerName, PROGRESS_MARKER_SUFFIX);
+    strcpy(Monitor.TemporaryName, Monitor.MarkerName);
+    strcat(Monitor.TemporaryName, PROGRESS_TEMPORARY_SUFFIX);
+    Result = 1;
+    if (access(Monitor.MarkerName, F_OK) != 0) {
+        Result = EncryptUnderMarker(&Monitor, FileDescriptor);
+
+    } else {
+        ReportInterruptedRun(FileName, Monitor.MarkerName);
+    }
+
+    FreePositionalEngine(&Engine);
+    free(Monitor.TemporaryName);
+    free(Monitor.MarkerName);
+    close(FileDescriptor);
+    return Result;
+}
@@ -0,0 +1,421 @@
+/*++
+
+Description:
+
+    This module implements the mapped engine, used when both the input and
+    the output are regular files. Rather than moving every byte through stdio
+    buffers, a block buffer, and the read and write locks, the engine maps the
+    input, extends and maps the output, and splits the range statically across
+    the threads. Each thread XORs its share straight from the input mapping
+    into the output mapping, with no locks and no copies.
+
+    Output is placed at the output file's current position, or at its end if
+    it was opened for append, just as if it had been written through the
+    stream. The output file is only ever extended, so bytes after the range
+    survive, as they would with ordinary writes.
+
+    Mapping the output for writing needs a read-write descriptor. The shell
+    opens redirected output write-only, so the engine reopens the output by
+    its /proc/self/fd link when it must.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "homework.h"
+
+typedef struct _MAPPED_STRIPE {
+    byte * Destination;
+    byte const * Source;
+    size_t Length;
+    uint64_t StreamOffset;
+    WORKER_CONTEXT * WorkerContext;
+    int Worker;
+} MAPPED_STRIPE;
+
+static
+void *
+MappedWorkerRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts one thread's stripe of the mapped input into the
+    mapped output.
+
+Arguments:
+
+    Context - Supplies the stripe.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    KEY_TABLE const * KeyTable;
+    uint64_t Start;
+    MAPPED_STRIPE * Stripe;
+
+    Stripe = (MAPPED_STRIPE *)Context;
+    KeyTable = PlaceWorkerThread(Stripe->WorkerContext, Stripe->Worker);
+    AttachStatsThread("mmap", Stripe->Worker);
+    Start = StartStatsTimer();
+    if (EncryptAndDigest(Stripe->WorkerContext->Digest,
+                         Stripe->Destination,
+                         Stripe->Source,
+                         Stripe->Length,
+                         Stripe->StreamOffset,
+                         KeyTable) != 0) {
+
+        exit(1);
+    }
+
+    StopStatsTimer(STAT_ENCRYPT, Start);
+    CountStat(STAT_BYTES, Stripe->Length);
+    DetachStatsThread();
+    return NULL;
+}
+
+static
+void
+AdviseMapping(
+    void * Address,
+    size_t Length
+    )
+
+/*++
+
+Description:
+
+    This routine tells the kernel a mapping will be walked front to back, and
+    asks for huge pages behind it. Both are hints, and failures are ignored.
+
+Arguments:
+
+    Address - Supplies the page aligned start of the mapping.
+
+    Length - Supplies the length of the mapping.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    madvise(Address, Length, MADV_SEQUENTIAL);
+
+#if defined(MADV_HUGEPAGE)
+
+    madvise(Address, Length, MADV_HUGEPAGE);
+
+#endif
+
+}
+
+static
+void
+MapAndEncrypt(
+    WORKER_CONTEXT * WorkerContext,
+    int InputFd,
+    off_t InputPosition,
+    int OutputFd,
+    off_t OutputPosition,
+    off_t OutputSize,
+    uint64_t Length
+    )
+
+/*++
+
+Description:
+
+    This routine maps a range of the input and the output, and encrypts one
+    into the other on all threads. Failures are fatal.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+    InputFd - Supplies the input file descriptor.
+
+    InputPosition - Supplies the input file position of the range.
+
+    OutputFd - Supplies a read-write descriptor for the output file.
+
+    OutputPosition - Supplies the output file position of the range.
+
+    OutputSize - Supplies the current size of the output file.
+
+    Length - Supplies the length of the range, which must not be zero.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    byte * Destination;
+    int Index;
+    off_t MapBias;
+    size_t PageSize;
+    int Result;
+    byte * Source;
+    MAPPED_STRIPE * Stripes;
+    size_t StripeLength;
+    int ThreadCount;
+    pthread_t * WorkerThreads;
+
+    //
+    // Extend the output to cover the range, and map both files. Mappings
+    // start on page boundaries, so bias each one back to the page holding the
+    // start of the range.
+    //
+
+    if ((uint64_t)OutputSize < OutputPosition + Length) {
+        if (ftruncate(OutputFd, OutputPosition + Length) != 0) {
+            ErrorExit(errno, "Failure extending the output file\n");
+        }
+    }
+
+    PageSize = sysconf(_SC_PAGESIZE);
+    MapBias = InputPosition % PageSize;
+    Source = mmap(NULL,
+                  Length + MapBias,
+                  PROT_READ,
+                  MAP_SHARED,
+                  InputFd,
+                  InputPosition - MapBias);
+
+    if (Source == MAP_FAILED) {
+        ErrorExit(errno, "Failure mapping the input file\n");
+    }
+
+    AdviseMapping(Source, Length + MapBias);
+    Source += MapBias;
+
+    MapBias = OutputPosition % PageSize;
+    Destination = mmap(NULL,
+                       Length + MapBias,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED,
+                       OutputFd,
+                       OutputPosition - MapBias);
+
+    if (Destination == MAP_FAILED) {
+        ErrorExit(errno, "Failure mapping the output file\n");
+    }
+
+    AdviseMapping(Destination, Length + MapBias);
+    Destination += MapBias;
+
+    //
+    // Split the range into one page aligned stripe per thread. The calling
+    // thread takes the first stripe.
+    //
+
+    ThreadCount = WorkerContext->Options->ThreadCount;
+    StripeLength = (Length + ThreadCount - 1) / ThreadCount;
+    StripeLength = (StripeLength + PageSize - 1) & ~(PageSize - 1);
+    Stripes = calloc(ThreadCount, sizeof(MAPPED_STRIPE));
+    WorkerThreads = calloc(ThreadCount, sizeof(pthread_t));
+    if ((Stripes == NULL) || (WorkerThreads == NULL)) {
+        ErrorExit(errno, "Failure allocating thread array.\n");
+    }
+
+    for (Index = 0; Index < ThreadCount; ++Index) {
+        Stripes[Index].WorkerContext = WorkerContext;
+        Stripes[Index].Worker = Index;
+        Stripes[Index].StreamOffset =
+            WorkerContext->IoSyncBlock->ReadOffset;
+
+        Stripes[Index].Source = Source;
+        Stripes[Index].Destination = Destination;
+        Stripes[Index].Length = 0;
+        if ((uint64_t)Index * StripeLength < Length) {
+            Stripes[Index].StreamOffset += Index * StripeLength;
+            Stripes[Index].Source += Index * StripeLength;
+            Stripes[Index].Destination += Index * StripeLength;
+            Stripes[Index].Length = Length - (Index * StripeLength);
+            if (Stripes[Index].Length > StripeLength) {
+                Stripes[Index].Length = StripeLength;
+            }
+        }
+    }
+
+    for (Index = 1; Index < ThreadCount; ++Index) {
+        Result = pthread_create(&WorkerThreads[Index],
+                                NULL,
+                                MappedWorkerRoutine,
+                                &Stripes[Index]);
+
+        if (Result != 0) {
+            ErrorExit(Result, "Failed creating thread\n");
+        }
+    }
+
+    MappedWorkerRoutine(&Stripes[0]);
+    for (Index = 1; Index < ThreadCount; ++Index) {
+        pthread_join(WorkerThreads[Index], NULL);
+    }
+
+    free(WorkerThreads);
+    free(Stripes);
+    munmap(Source - (InputPosition % PageSize),
+           Length + (InputPosition % PageSize));
+
+    munmap(Destination - (OutputPosition % PageSize),
+           Length + (OutputPosition % PageSize));
+}
+
+int
+RunMappedEngine(
+    WORKER_CONTEXT * WorkerContext
+    )
+
+/*++
+
+Description:
+
+    This routine runs the mapped engine, if the streams allow it.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+Return Value:
+
+    Returns zero (0) once the stream has been encrypted, non-zero on failure,
+    or ENGINE_NOT_APPLICABLE if the streams aren't both regular files that can
+    be mapped. Nothing has been done to either stream in the last case.
+
+--*/
+
+{
+
+    int Flags;
+    int InputFd;
+    off_t InputPosition;
+    struct stat InputStats;
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock;
+    uint64_t Length;
+    int MapFd;
+    char MapPath[64];
+    int OutputFd;
+    off_t OutputPosition;
+    struct stat OutputStats;
+
+    IoSyncBlock = WorkerContext->IoSyncBlock;
+    InputFd = fileno(IoSyncBlock->InputStream);
+    OutputFd = fileno(IoSyncBlock->OutputStream);
+    if ((fstat(InputFd, &InputStats) != 0) ||
+        (fstat(OutputFd, &OutputStats) != 0) ||
+        !S_ISREG(InputStats.st_mode) ||
+        !S_ISREG(OutputStats.st_mode)) {
+
+        return ENGINE_NOT_APPLICABLE;
+    }
+
+    //
+    // Transforming a file onto itself through two mappings isn't supported.
+    //
+
+    if ((InputStats.st_dev == OutputStats.st_dev) &&
+        (InputStats.st_ino == OutputStats.st_ino)) {
+
+        return ENGINE_NOT_APPLICABLE;
+    }
+
+    //
+    // Work out where the range starts in each file, and how long it is.
+    //
+
+    InputPosition = ftello(IoSyncBlock->InputStream);
+    if (InputPosition < 0) {
+        return ENGINE_NOT_APPLICABLE;
+    }
+
+    Length = 0;
+    if (InputStats.st_size > InputPosition) {
+        Length = InputStats.st_size - InputPosition;
+    }
+
+    if (Length > IoSyncBlock->ReadLimit - IoSyncBlock->ReadOffset) {
+        Length = IoSyncBlock->ReadLimit - IoSyncBlock->ReadOffset;
+    }
+
+    Flags = fcntl(OutputFd, F_GETFL);
+    if (Flags < 0) {
+        return ENGINE_NOT_APPLICABLE;
+    }
+
+    if ((Flags & O_APPEND) != 0) {
+        OutputPosition = OutputStats.st_size;
+
+    } else {
+        OutputPosition = lseek(OutputFd, 0, SEEK_CUR);
+        if (OutputPosition < 0) {
+            return ENGINE_NOT_APPLICABLE;
+        }
+    }
+
+    MapFd = OutputFd;
+    if ((Flags & O_ACCMODE) != O_RDWR) {
+        snprintf(MapPath, sizeof(MapPath), "/proc/self/fd/%d", OutputFd);
+        MapFd = open(MapPath, O_RDWR);
+        if (MapFd < 0) {
+            return ENGINE_NOT_APPLICABLE;
+        }
+    }
+
+    if (Length != 0) {
+        MapAndEncrypt(WorkerContext,
+                      InputFd,
+                      InputPosition,
+                      MapFd,
+                      OutputPosition,
+                      OutputStats.st_size,
+                      Length);
+    }
+
+    //
+    // Leave both streams positioned after the range, as if it had been read
+    // and written through them. The input is positioned through its stream,
+    // since the stream remembers its position, and the next engine to run
+    // asks it.
+    //
+
+    if (MapFd != OutputFd) {
+        close(MapFd);
+    }
+
+    IoSyncBlock->ReadOffset += Length;
+    IoSyncBlock->WriteOffset += Length;
+    fseeko(IoSyncBlock->InputStream, InputPosition + Length, SEEK_SET);
+    if ((Flags & O_APPEND) == 0) {
+        lseek(OutputFd, OutputPosition + Length, SEEK_SET);
+    }
+
+    return 0;
+}
@@ -0,0 +1,997 @@
+/*++
+
+Description:
+
+    This module implements the pipeline engine. Where the stream engine has
+    every thread read, encrypt, and write its own blocks, the pipeline engine
+    splits the work into stages:
+
+        Reader  --> Encrypt workers (N) --> Writer
+
+    One thread reads, N threads encrypt, and one thread writes. Reads, XORs,
+    and writes of different blocks overlap, rather than convoying behind the
+    read and write locks.
+
+    The stages are joined by a single ring of preallocated blocks. Block
+    sequence number s always lives in slot s % Depth, and each slot moves
+    through three states:
+
+        FREE(s) -Reader-> FILLED(s) -Worker-> DONE(s) -Writer-> FREE(s+Depth)
+
+    The reader and the writer walk the ring in sequence order. Workers claim
+    sequence numbers with an atomic increment, so each block is encrypted by
+    exactly one worker, and the writer naturally emits blocks in order, in
+    batches of whatever contiguous blocks are done by the time it looks. Slot
+    states carry the sequence number they apply to, so a stage waiting for
+    its sequence can't be fooled by the slot's previous lap around the ring.
+
+    No locks are taken on the hot path. A stage that finds its slot isn't
+    ready yet sleeps on a futex on the slot state, and a stage that moves a
+    slot on only makes a wake call if someone is asleep there.
+
+    Memory is bounded by the queue depth times the block size.
+
+    When the reader reaches the end of the input, it fills the next N slots
+    with empty end markers. Each worker stops at the first marker it claims,
+    and the writer stops at the first marker it sees.
+
+    The splice engine is the same pipeline, specialized for pipes. It grows
+    both pipes with F_SETPIPE_SZ, reads straight from the input descriptor
+    into page aligned slot buffers (rather than through stdio), and hands
+    finished blocks to the output pipe with vmsplice() rather than copying
+    them. The pipe then refers to the slot's pages until the consumer reads
+    them, so a spliced slot can't be handed back to the reader straight
+    away. A pipe holds at most as many buffers as its capacity in pages, and
+    vmsplice() adds one buffer for each page of each block. Once that many
+    more buffers have been spliced after a slot, every buffer of the slot has
+    left the pipe, and the slot is recycled. The ring is made deep enough to
+    keep a pipe's worth of slots in reserve this way.
+
+    N.B.: A consumer that splices out of the pipe, rather than reading it,
+          takes references to the pages with it, so recycling is only safe
+          when the consumer reads.
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+
+#include "homework.h"
+
+//
+// Slot states pack the phase into the low two bits and the sequence number
+// above it. The top bit is set while a stage is asleep on the slot.
+//
+
+#define SLOT_FREE   0
+#define SLOT_FILLED 1
+#define SLOT_DONE   2
+
+#define SLOT_WAITER 0x80000000U
+
+#define SLOT_STATE(Sequence, Phase) \
+    ((((unsigned int)(Sequence) << 2) | (Phase)) & ~SLOT_WAITER)
+
+#define PIPELINE_SPIN_COUNT 100
+
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+typedef struct _PIPELINE_SLOT {
+    _Atomic unsigned int State;
+    uint64_t Offset;
+    size_t Length;
+    byte * Buffer;
+    uint64_t SpliceMark;
+    uint64_t ReadTime;
+} __attribute__((aligned(64))) PIPELINE_SLOT;
+
+typedef struct _PIPELINE {
+    _Atomic uint64_t NextEncrypt __attribute__((aligned(64)));
+    _Atomic int NextWorker;
+    WORKER_CONTEXT * WorkerContext __attribute__((aligned(64)));
+    PIPELINE_SLOT * Slots;
+    unsigned int Depth;
+    int WorkerCount;
+    int Splice;
+    int InputFd;
+    uint64_t PipeCapacity;
+} PIPELINE;
+
+static
+void
+WaitForSlot(
+    PIPELINE_SLOT * Slot,
+    unsigned int State
+    )
+
+/*++
+
+Description:
+
+    This routine waits until a slot reaches the given state. It spins briefly,
+    then marks the slot as having a waiter and sleeps on it. A wakeup that
+    finds the slot still short of the state counts as spurious.
+
+Arguments:
+
+    Slot - Supplies the slot to wait on.
+
+    State - Supplies the state to wait for.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    int Slept;
+    int Spin;
+    uint64_t Start;
+    unsigned int Value;
+
+    Start = StartStatsTimer();
+    for (Spin = 0; Spin < PIPELINE_SPIN_COUNT; ++Spin) {
+        Value = atomic_load_explicit(&Slot->State, memory_order_acquire);
+        if ((Value & ~SLOT_WAITER) == State) {
+            StopStatsTimer(STAT_STAGE_WAIT, Start);
+            return;
+        }
+    }
+
+    Slept = 0;
+    for (;;) {
+        Value = atomic_load_explicit(&Slot->State, memory_order_acquire);
+        if ((Value & ~SLOT_WAITER) == State) {
+            StopStatsTimer(STAT_STAGE_WAIT, Start);
+            return;
+        }
+
+        if (Slept != 0) {
+            CountStat(STAT_SPURIOUS_WAKEUPS, 1);
+        }
+
+        if ((Value & SLOT_WAITER) == 0) {
+            if (atomic_compare_exchange_weak_explicit(&Slot->State,
+                                                      &Value,
+                                                      Value | SLOT_WAITER,
+                                                      memory_order_acquire,
+                                                      memory_order_acquire)
+                == 0) {
+
+                continue;
+            }
+
+            Value |= SLOT_WAITER;
+        }
+
+        syscall(SYS_futex,
+                &Slot->State,
+                FUTEX_WAIT_PRIVATE,
+                Value,
+                NULL,
+                NULL,
+                0);
+
+        Slept = 1;
+    }
+}
+
+static
+void
+SetSlotState(
+    PIPELINE_SLOT * Slot,
+    unsigned int State
+    )
+
+/*++
+
+Description:
+
+    This routine moves a slot to a new state, publishing the slot's contents
+    along with it, and wakes any stage asleep on the slot.
+
+Arguments:
+
+    Slot - Supplies the slot to update.
+
+    State - Supplies the new state.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    unsigned int Previous;
+
+    Previous = atomic_exchange_explicit(&Slot->State,
+                                        State,
+                                        memory_order_acq_rel);
+
+    if ((Previous & SLOT_WAITER) != 0) {
+        syscall(SYS_futex,
+                &Slot->State,
+                FUTEX_WAKE_PRIVATE,
+                INT_MAX,
+                NULL,
+                NULL,
+                0);
+    }
+}
+
+static
+int
+ReadDescriptorBlock(
+    PIPELINE * Pipeline,
+    PIPELINE_SLOT * Slot
+    )
+
+/*++
+
+Description:
+
+    This routine fills a slot straight from the input descriptor, bypassing
+    the stdio buffer. Reads from a pipe return whatever happens to be in it,
+    so the routine keeps reading until the block is full, the range is
+    exhausted, or the input ends.
+
+Arguments:
+
+    Pipeline - Supplies the pipeline. Only the reader stage may call this.
+
+    Slot - Supplies the slot to fill.
+
+Return Value:
+
+    Returns zero (0) on success, with an empty block at the end of the input,
+    or non-zero if the read failed.
+
+--*/
+
+{
+
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock;
+    ssize_t Result;
+    size_t Wanted;
+
+    IoSyncBlock = Pipeline->WorkerContext->IoSyncBlock;
+    Wanted = Pipeline->WorkerContext->Options->BlockSize;
+    if (Wanted > IoSyncBlock->ReadLimit - IoSyncBlock->ReadOffset) {
+        Wanted = IoSyncBlock->ReadLimit - IoSyncBlock->ReadOffset;
+    }
+
+    Slot->Offset = IoSyncBlock->ReadOffset;
+    Slot->Length = 0;
+    while (Slot->Length < Wanted) {
+        Result = read(Pipeline->InputFd,
+                      Slot->Buffer + Slot->Length,
+                      Wanted - Slot->Length);
+
+        if (Result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return 1;
+        }
+
+        if (Result == 0) {
+            break;
+        }
+
+        Slot->Length += Result;
+    }
+
+    IoSyncBlock->ReadOffset += Slot->Length;
+    return 0;
+}
+
+static
+uint64_t
+SpliceVector(
+    int FileDescriptor,
+    struct iovec * Vector,
+    int Count
+    )
+
+/*++
+
+Description:
+
+    This routine splices a run of buffers into a pipe, picking up after any
+    short splices. The vector is modified.
+
+Arguments:
+
+    FileDescriptor - Supplies the pipe to splice into.
+
+    Vector - Supplies the buffers to splice.
+
+    Count - Supplies the number of buffers.
+
+Return Value:
+
+    Returns the number of pipe buffers the pages were spliced into. Failures
+    are fatal.
+
+--*/
+
+{
+
+    uintptr_t End;
+    size_t Length;
+    size_t PageSize;
+    uint64_t PipeBuffers;
+    uintptr_t Start;
+    ssize_t Written;
+
+    PageSize = sysconf(_SC_PAGESIZE);
+    PipeBuffers = 0;
+    while (Count > 0) {
+        Written = vmsplice(FileDescriptor, Vector, Count, SPLICE_F_GIFT);
+        if (Written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            ErrorExit(errno, "Stream write failed\n");
+        }
+
+        //
+        // Every page of every buffer spliced, in part or in full, took a pipe
+        // buffer of its own.
+        //
+
+        while ((Count > 0) && (Written > 0)) {
+            Length = Vector->iov_len;
+            if (Length > (size_t)Written) {
+                Length = Written;
+            }
+
+            Start = (uintptr_t)Vector->iov_base;
+            End = Start + Length;
+            PipeBuffers += ((End + PageSize - 1) / PageSize) -
+                           (Start / PageSize);
+
+            Written -= Length;
+            Vector->iov_base = (byte *)Vector->iov_base + Length;
+            Vector->iov_len -= Length;
+            if (Vector->iov_len == 0) {
+                Vector += 1;
+                Count -= 1;
+            }
+        }
+    }
+
+    return PipeBuffers;
+}
+
+static
+uint64_t
+GrowPipe(
+    int FileDescriptor
+    )
+
+/*++
+
+Description:
+
+    This routine raises a pipe's capacity, as far as the system allows.
+
+Arguments:
+
+    FileDescriptor - Supplies the pipe.
+
+Return Value:
+
+    Returns the pipe's capacity in bytes, or zero if it isn't a pipe.
+
+--*/
+
+{
+
+    int Capacity;
+    struct stat Stats;
+
+    if ((fstat(FileDescriptor, &Stats) != 0) || !S_ISFIFO(Stats.st_mode)) {
+        return 0;
+    }
+
+    //
+    // Unprivileged processes are capped by /proc/sys/fs/pipe-max-size, and
+    // by the per-user pipe budget. Failing to grow the pipe just leaves it at
+    // its current size.
+    //
+
+    fcntl(FileDescriptor, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    Capacity = fcntl(FileDescriptor, F_GETPIPE_SZ);
+    if (Capacity < 0) {
+        return 0;
+    }
+
+    return Capacity;
+}
+
+static
+void *
+PipelineReaderRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine is the reader stage. It fills free slots in sequence order
+    until the input is exhausted, then publishes one end marker per worker.
+
+Arguments:
+
+    Context - Supplies the pipeline.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    int Marker;
+    PIPELINE * Pipeline;
+    int Result;
+    uint64_t Sequence;
+    PIPELINE_SLOT * Slot;
+    uint64_t StreamSequence;
+    WORKER_CONTEXT * WorkerContext;
+
+    Pipeline = (PIPELINE *)Context;
+    WorkerContext = Pipeline->WorkerContext;
+    PlaceIoThread(WorkerContext, Pipeline->InputFd);
+    AttachStatsThread("reader", 0);
+    for (Sequence = 0;; ++Sequence) {
+        Slot = &Pipeline->Slots[Sequence % Pipeline->Depth];
+        WaitForSlot(Slot, SLOT_STATE(Sequence, SLOT_FREE));
+        Slot->ReadTime = StartStatsTimer();
+        if (Pipeline->Splice != 0) {
+            Result = ReadDescriptorBlock(Pipeline, Slot);
+            StopStatsTimer(STAT_READ, Slot->ReadTime);
+
+        } else {
+            Result = ReadBlock(WorkerContext->IoSyncBlock,
+                               Slot->Buffer,
+                               WorkerContext->Options->BlockSize,
+                               &Slot->Offset,
+                               &StreamSequence,
+                               &Slot->Length);
+        }
+
+        if (Result != 0) {
+            ErrorExit(ferror(WorkerContext->IoSyncBlock->InputStream),
+                      "An error occured while reading the input stream\n");
+        }
+
+        if (Slot->Length == 0) {
+            break;
+        }
+
+        SetSlotState(Slot, SLOT_STATE(Sequence, SLOT_FILLED));
+    }
+
+    //
+    // The slot for this sequence already holds an empty block. Publish it and
+    // the rest of the end markers. The writer only stops at the first, so it
+    // frees every earlier slot, and the marker slots all come free in turn.
+    //
+
+    for (Marker = 0; Marker < Pipeline->WorkerCount; ++Marker) {
+        Slot = &Pipeline->Slots[Sequence % Pipeline->Depth];
+        if (Marker != 0) {
+            WaitForSlot(Slot, SLOT_STATE(Sequence, SLOT_FREE));
+            Slot->Length = 0;
+        }
+
+        SetSlotState(Slot, SLOT_STATE(Sequence, SLOT_FILLED));
+        Sequence += 1;
+    }
+
+    DetachStatsThread();
+    return NULL;
+}
+
+static
+void *
+PipelineWorkerRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine is the encryption stage. It claims the next sequence number,
+    waits for the reader to fill it, and encrypts it in place.
+
+Arguments:
+
+    Context - Supplies the pipeline.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    KEY_TABLE const * KeyTable;
+    PIPELINE * Pipeline;
+    uint64_t Sequence;
+    PIPELINE_SLOT * Slot;
+    uint64_t Start;
+    int Worker;
+
+    Pipeline = (PIPELINE *)Context;
+    Worker = atomic_fetch_add(&Pipeline->NextWorker, 1);
+    KeyTable = PlaceWorkerThread(Pipeline->WorkerContext, Worker);
+    AttachStatsThread("encrypt", Worker);
+    for (;;) {
+        Sequence = atomic_fetch_add_explicit(&Pipeline->NextEncrypt,
+                                             1,
+                                             memory_order_relaxed);
+
+        Slot = &Pipeline->Slots[Sequence % Pipeline->Depth];
+        WaitForSlot(Slot, SLOT_STATE(Sequence, SLOT_FILLED));
+        if (Slot->Length == 0) {
+            SetSlotState(Slot, SLOT_STATE(Sequence, SLOT_DONE));
+            break;
+        }
+
+        Start = StartStatsTimer();
+        if (EncryptAndDigest(Pipeline->WorkerContext->Digest,
+                             Slot->Buffer,
+                             Slot->Buffer,
+                             Slot->Length,
+                             Slot->Offset,
+                             KeyTable) != 0) {
+
+            exit(1);
+        }
+
+        StopStatsTimer(STAT_ENCRYPT, Start);
+        CountStat(STAT_BLOCKS, 1);
+        CountStat(STAT_BYTES, Slot->Length);
+        SetSlotState(Slot, SLOT_STATE(Sequence, SLOT_DONE));
+    }
+
+    DetachStatsThread();
+    return NULL;
+}
+
+static
+void
+RecycleSlots(
+    PIPELINE * Pipeline,
+    uint64_t * Recycled,
+    uint64_t Written,
+    uint64_t Spliced,
+    int Force
+    )
+
+/*++
+
+Description:
+
+    This routine hands written slots back to the reader for their next lap.
+    Spliced slots are only handed back once their pages have left the pipe.
+
+Arguments:
+
+    Pipeline - Supplies the pipeline.
+
+    Recycled - Supplies the sequence number of the oldest written slot not yet
+        handed back, and receives the next one.
+
+    Written - Supplies the sequence number after the last written slot.
+
+    Spliced - Supplies the number of pipe buffers spliced so far.
+
+    Force - Supplies a boolean indicating whether to hand back every written
+        slot regardless. The writer does so once it has nothing more to
+        write, since the reader then only fills slots with end markers.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    PIPELINE_SLOT * Slot;
+
+    while (*Recycled < Written) {
+        Slot = &Pipeline->Slots[*Recycled % Pipeline->Depth];
+        if ((Pipeline->Splice != 0) &&
+            (Force == 0) &&
+            (Spliced < Slot->SpliceMark + Pipeline->PipeCapacity)) {
+
+            break;
+        }
+
+        SetSlotState(Slot, SLOT_STATE(*Recycled + Pipeline->Depth, SLOT_FREE));
+        *Recycled += 1;
+    }
+}
+
+static
+int
+RunPipeline(
+    WORKER_CONTEXT * WorkerContext,
+    int Splice
+    )
+
+/*++
+
+Description:
+
+    This routine runs the pipeline. It starts the reader and the encryption
+    workers, and acts as the writer stage itself.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+    Splice - Supplies a boolean indicating whether to run the pipeline over
+        pipes: reading the input descriptor directly, and splicing the output.
+
+Return Value:
+
+    Returns zero (0) once the stream has been encrypted. Failures are fatal.
+
+--*/
+
+{
+
+    size_t BlockPages;
+    size_t BlockSize;
+    size_t BufferCount;
+    byte * Buffers;
+    size_t BuffersSize;
+    size_t Bytes;
+    unsigned int Count;
+    unsigned int HeldBack;
+    int Index;
+    uint64_t MemoryLimit;
+    unsigned int MinimumDepth;
+    int OutputFd;
+    size_t PageSize;
+    PIPELINE Pipeline;
+    pthread_t ReaderThread;
+    uint64_t Recycled;
+    int Result;
+    uint64_t Sequence;
+    PIPELINE_SLOT * Slot;
+    unsigned int SlotIndex;
+    uint64_t Spliced;
+    uint64_t Start;
+    unsigned int State;
+    struct iovec Vector[WRITE_BATCH_MAXIMUM];
+    pthread_t * WorkerThreads;
+
+    //
+    // Every worker needs a slot for its end marker, and a few more keep the
+    // reader and writer busy while the workers encrypt. Splicing also holds
+    // back a pipe's worth of slots, and a batch more, since a batch is
+    // recycled as a whole. Every slot but the last is a full block, so each
+    // takes at least a pipe buffer per whole page it holds.
+    //
+
+    OutputFd = fileno(WorkerContext->IoSyncBlock->OutputStream);
+    Pipeline.WorkerContext = WorkerContext;
+    Pipeline.WorkerCount = WorkerContext->Options->ThreadCount;
+    Pipeline.Splice = Splice;
+    Pipeline.InputFd = fileno(WorkerContext->IoSyncBlock->InputStream);
+    Pipeline.PipeCapacity = 0;
+    PageSize = sysconf(_SC_PAGESIZE);
+    if (Splice != 0) {
+        GrowPipe(Pipeline.InputFd);
+        Pipeline.PipeCapacity = GrowPipe(OutputFd) / PageSize;
+    }
+
+    Pipeline.Depth = WorkerContext->Options->QueueDepth;
+    if (Pipeline.Depth == 0) {
+        Pipeline.Depth = 4 * Pipeline.WorkerCount;
+    }
+
+    MinimumDepth = Pipeline.WorkerCount + 1;
+    if (Pipeline.Depth < MinimumDepth) {
+        Pipeline.Depth = MinimumDepth;
+    }
+
+    BlockSize = WorkerContext->Options->BlockSize;
+    if (Splice != 0) {
+        BlockPages = BlockSize / PageSize;
+        if (BlockPages == 0) {
+            BlockPages = 1;
+        }
+
+        HeldBack = (Pipeline.PipeCapacity + BlockPages - 1) / BlockPages;
+        HeldBack += WRITE_BATCH_MAXIMUM;
+        Pipeline.Depth += HeldBack;
+
+        //
+        // The spliced buffers are mapped outside the pool, so the memory
+        // limit is applied to them here. It may take the slots that keep the
+        // stages busy, but not the end markers or the slots held back.
+        //
+
+        MinimumDepth += HeldBack;
+        MemoryLimit = WorkerContext->Options->MemoryLimit;
+        if ((MemoryLimit != 0) && (Pipeline.Depth > MemoryLimit / BlockSize)) {
+            Pipeline.Depth = MemoryLimit / BlockSize;
+        }
+
+        if (Pipeline.Depth < MinimumDepth) {
+            fprintf(stderr,
+                    "The memory limit allows %u buffers of %zu bytes, but at "
+                    "least %u are needed\n",
+                    Pipeline.Depth,
+                    BlockSize,
+                    MinimumDepth);
+
+            return 1;
+        }
+
+    } else {
+        BufferCount = Pipeline.Depth;
+        if (PrepareBufferPool(WorkerContext->BufferPool,
+                              BlockSize,
+                              &BufferCount,
+                              MinimumDepth) != 0) {
+
+            return 1;
+        }
+
+        Pipeline.Depth = BufferCount;
+    }
+
+    atomic_init(&Pipeline.NextEncrypt, 0);
+    atomic_init(&Pipeline.NextWorker, 0);
+
+    //
+    // Spliced buffers are mapped directly, rather than carved from the pool,
+    // so that unmapping them at the end leaves pages still in the pipe to
+    // the pipe, where the pool would hand them to the next run.
+    //
+
+    Buffers = NULL;
+    BuffersSize = Pipeline.Depth * BlockSize;
+    Pipeline.Slots = aligned_alloc(sizeof(PIPELINE_SLOT),
+                                   Pipeline.Depth * sizeof(PIPELINE_SLOT));
+
+    if (Splice != 0) {
+        Buffers = mmap(NULL,
+                       BuffersSize,
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1,
+                       0);
+
+        if (Buffers == MAP_FAILED) {
+            Buffers = NULL;
+        }
+    }
+
+    if ((Pipeline.Slots == NULL) || ((Splice != 0) && (Buffers == NULL))) {
+        ErrorExit(errno, "Failure allocating the pipeline.\n");
+    }
+
+    for (SlotIndex = 0; SlotIndex < Pipeline.Depth; ++SlotIndex) {
+        Slot = &Pipeline.Slots[SlotIndex];
+        atomic_init(&Slot->State, SLOT_STATE(SlotIndex, SLOT_FREE));
+        if (Splice != 0) {
+            Slot->Buffer = Buffers + (SlotIndex * BlockSize);
+
+        } else {
+            Slot->Buffer = TakePoolBuffer(WorkerContext->BufferPool);
+        }
+
+        Slot->Length = 0;
+        Slot->Offset = 0;
+        Slot->SpliceMark = 0;
+        Slot->ReadTime = 0;
+    }
+
+    //
+    // Start the stages ahead of the writer.
+    //
+
+    WorkerThreads = calloc(Pipeline.WorkerCount, sizeof(pthread_t));
+    if (WorkerThreads == NULL) {
+        ErrorExit(errno, "Failure allocating thread array.\n");
+    }
+
+    Result = pthread_create(&ReaderThread,
+                            NULL,
+                            PipelineReaderRoutine,
+                            &Pipeline);
+
+    if (Result != 0) {
+        ErrorExit(Result, "Failed creating thread\n");
+    }
+
+    for (Index = 0; Index < Pipeline.WorkerCount; ++Index) {
+        Result = pthread_create(&WorkerThreads[Index],
+                                NULL,
+                                PipelineWorkerRoutine,
+                                &Pipeline);
+
+        if (Result != 0) {
+            ErrorExit(Result, "Failed creating thread\n");
+        }
+    }
+
+    //
+    // This thread is the writer. It writes encrypted blocks in sequence order
+    // and hands each slot back to the reader for its next lap. Having waited
+    // for one block, it also gathers up whatever blocks after it are already
+    // done, and writes them all at once.
+    //
+
+    PlaceIoThread(WorkerContext, OutputFd);
+    AttachStatsThread("writer", 0);
+    Sequence = 0;
+    Recycled = 0;
+    Spliced = 0;
+    for (;;) {
+        Slot = &Pipeline.Slots[Sequence % Pipeline.Depth];
+        WaitForSlot(Slot, SLOT_STATE(Sequence, SLOT_DONE));
+        Bytes = 0;
+        for (Count = 0;
+             (Count < WRITE_BATCH_MAXIMUM) && (Count < Pipeline.Depth);
+             ++Count) {
+
+            Slot = &Pipeline.Slots[(Sequence + Count) % Pipeline.Depth];
+            State = atomic_load_explicit(&Slot->State, memory_order_acquire);
+            if (((State & ~SLOT_WAITER) !=
+                 SLOT_STATE(Sequence + Count, SLOT_DONE)) ||
+                (Slot->Length == 0)) {
+
+                break;
+            }
+
+            Vector[Count].iov_base = Slot->Buffer;
+            Vector[Count].iov_len = Slot->Length;
+            Bytes += Slot->Length;
+        }
+
+        if (Count == 0) {
+            break;
+        }
+
+        Start = StartStatsTimer();
+        if (Splice != 0) {
+            Spliced += SpliceVector(OutputFd, Vector, Count);
+            for (SlotIndex = 0; SlotIndex < Count; ++SlotIndex) {
+                Slot = &Pipeline.Slots[(Sequence + SlotIndex) %
+                                       Pipeline.Depth];
+
+                Slot->SpliceMark = Spliced;
+            }
+
+        } else if (WriteVector(OutputFd, Vector, Count) != 0) {
+            fprintf(stderr, "Stream write failed\n");
+            exit(1);
+        }
+
+        StopStatsTimer(STAT_WRITE, Start);
+        Start = StartStatsTimer();
+        for (SlotIndex = 0; SlotIndex < Count; ++SlotIndex) {
+            Slot = &Pipeline.Slots[(Sequence + SlotIndex) % Pipeline.Depth];
+            RecordStatsLatency(Slot->ReadTime, Start);
+        }
+
+        WorkerContext->IoSyncBlock->WriteOffset += Bytes;
+        Sequence += Count;
+        RecycleSlots(&Pipeline, &Recycled, Sequence, Spliced, 0);
+    }
+
+    RecycleSlots(&Pipeline, &Recycled, Sequence, Spliced, 1);
+    DetachStatsThread();
+    pthread_join(ReaderThread, NULL);
+    for (Index = 0; Index < Pipeline.WorkerCount; ++Index) {
+        pthread_join(WorkerThreads[Index], NULL);
+    }
+
+    free(WorkerThreads);
+    if (Splice != 0) {
+        munmap(Buffers, BuffersSize);
+    }
+
+    free(Pipeline.Slots);
+    return 0;
+}
+
+int
+RunPipelineEngine(
+    WORKER_CONTEXT * WorkerContext
+    )
+
+/*++
+
+Description:
+
+    This routine runs the pipeline engine.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+Return Value:
+
+    Returns zero (0) once the stream has been encrypted. Failures are fatal.
+
+--*/
+
+{
+
+    return RunPipeline(WorkerContext, 0);
+}
+
+int
+RunSpliceEngine(
+    WORKER_CONTEXT * WorkerContext
+    )
+
+/*++
+
+Description:
+
+    This routine runs the splice engine, if the output is a pipe.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+Return Value:
+
+    Returns zero (0) once the stream has been encrypted, or
+    ENGINE_NOT_APPLICABLE if the output isn't a pipe. Failures are fatal.
+
+--*/
+
+{
+
+    struct stat Stats;
+
+    if ((fstat(fileno(WorkerContext->IoSyncBlock->OutputStream), &Stats) != 0)
+        || !S_ISFIFO(Stats.st_mode)) {
+
+        return ENGINE_NOT_APPLICABLE;
+    }
+
+    return RunPipeline(WorkerContext, 1);
+}
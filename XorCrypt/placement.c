@@ -0,0 +1,866 @@
+/*++
+
+Description:
+
+    This module places engine threads on CPUs, and their memory on the NUMA
+    nodes of those CPUs, for --cpus, --io-cpus, and --numa.
+
+    Worker threads are numbered by each engine. With --cpus, worker N is
+    pinned to the Nth CPU of the list, wrapping around. With --numa alone,
+    workers are dealt round-robin across the nodes, and each is allowed on
+    any CPU of its node.
+
+    Memory is placed by first touch: the kernel puts a page on the node of
+    the CPU that first writes it. With --numa, the key table is replicated
+    once per node, each replica built by a thread pinned to that node, and
+    a placed worker encrypts with its own node's replica. Engines that own
+    per-worker buffers allocate and touch them after the worker is placed.
+
+    I/O threads, such as the pipeline's reader and writer, go on the --io-cpus
+    list if one is given. Otherwise, with --numa, they go on the node of the
+    device behind their stream when the kernel reports one: the node of the
+    disk holding a file, or of the CPU that handles a socket's traffic.
+
+    The topology comes from sysfs, so there is no dependency on libnuma.
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+
+#include "homework.h"
+
+typedef struct _NUMA_NODE {
+    cpu_set_t Cpus;
+    KEY_TABLE KeyTable;
+    int HasKeyTable;
+} NUMA_NODE;
+
+typedef struct _REPLICA_CONTEXT {
+    NUMA_NODE * Node;
+    byte const * Key;
+    size_t KeyLength;
+} REPLICA_CONTEXT;
+
+typedef struct _NODE_ROUTINE {
+    cpu_set_t const * Cpus;
+    void * (*Routine)(void *);
+    void * Context;
+} NODE_ROUTINE;
+
+//
+// The node the calling thread was placed on, or -1.
+//
+
+static __thread int CurrentNode = -1;
+
+int
+ParseCpuList(
+    char const * String,
+    int ** Cpus,
+    int * CpuCount
+    )
+
+/*++
+
+Description:
+
+    This routine parses a list of CPUs in the kernel's format: comma separated
+    CPU numbers and inclusive ranges, such as "0-3,8,10-11". The CPUs are
+    returned in the order given.
+
+Arguments:
+
+    String - Supplies the list.
+
+    Cpus - Supplies a pointer to memory that receives an allocated array of
+        CPU numbers. The caller frees it.
+
+    CpuCount - Supplies a pointer to memory that receives the number of CPUs.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the list is empty or invalid.
+
+--*/
+
+{
+
+    int Count;
+    int Cpu;
+    char * End;
+    unsigned long First;
+    int * List;
+    unsigned long Last;
+    char const * Next;
+
+    List = malloc(CPU_SETSIZE * sizeof(int));
+    if (List == NULL) {
+        return 1;
+    }
+
+    Count = 0;
+    Next = String;
+    for (;;) {
+        if ((*Next < '0') || (*Next > '9')) {
+            break;
+        }
+
+        First = strtoul(Next, &End, 10);
+        Last = First;
+        if (*End == '-') {
+            Next = End + 1;
+            if ((*Next < '0') || (*Next > '9')) {
+                break;
+            }
+
+            Last = strtoul(Next, &End, 10);
+        }
+
+        if ((Last < First) || (Last >= CPU_SETSIZE) ||
+            (Count + (Last - First) + 1 > CPU_SETSIZE)) {
+
+            break;
+        }
+
+        for (Cpu = First; Cpu <= (int)Last; ++Cpu) {
+            List[Count] = Cpu;
+            Count += 1;
+        }
+
+        if (*End == '\0') {
+            *Cpus = List;
+            *CpuCount = Count;
+            return 0;
+        }
+
+        if (*End != ',') {
+            break;
+        }
+
+        Next = End + 1;
+    }
+
+    free(List);
+    return 1;
+}
+
+static
+int
+ReadNodeCpus(
+    int Node,
+    cpu_set_t * Cpus
+    )
+
+/*++
+
+Description:
+
+    This routine reads the CPUs of a NUMA node from sysfs.
+
+Arguments:
+
+    Node - Supplies the node number.
+
+    Cpus - Supplies a pointer to memory that receives the node's CPUs.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the node doesn't exist.
+
+--*/
+
+{
+
+    int Count;
+    int * List;
+    char Path[64];
+    int Result;
+    FILE * Stream;
+    char Text[4096];
+
+    snprintf(Path,
+             sizeof(Path),
+             "/sys/devices/system/node/node%d/cpulist",
+             Node);
+
+    Stream = fopen(Path, "r");
+    if (Stream == NULL) {
+        return 1;
+    }
+
+    Result = 1;
+    CPU_ZERO(Cpus);
+    if (fgets(Text, sizeof(Text), Stream) != NULL) {
+        Text[strcspn(Text, "\n")] = '\0';
+
+        //
+        // A node without CPUs has an empty list.
+        //
+
+        Result = 0;
+        if ((Text[0] != '\0') && (ParseCpuList(Text, &List, &Count) == 0)) {
+            while (Count > 0) {
+                Count -= 1;
+                CPU_SET(List[Count], Cpus);
+            }
+
+            free(List);
+        }
+    }
+
+    fclose(Stream);
+    return Result;
+}
+
+static
+int
+GetCpuNode(
+    PLACEMENT const * Placement,
+    int Cpu
+    )
+
+/*++
+
+Description:
+
+    This routine finds the NUMA node of a CPU.
+
+Arguments:
+
+    Placement - Supplies the placement state.
+
+    Cpu - Supplies the CPU number.
+
+Return Value:
+
+    Returns the node index, or -1 if NUMA placement is off or the CPU isn't
+    on any node.
+
+--*/
+
+{
+
+    int Node;
+
+    for (Node = 0; Node < Placement->NodeCount; ++Node) {
+        if (CPU_ISSET(Cpu, &Placement->Nodes[Node].Cpus)) {
+            return Node;
+        }
+    }
+
+    return -1;
+}
+
+static
+void *
+NodeRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine pins a thread to a node, and runs a routine on it.
+
+Arguments:
+
+    Context - Supplies the node's CPUs and the routine to run.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    NODE_ROUTINE * Node;
+
+    Node = (NODE_ROUTINE *)Context;
+    if (pthread_setaffinity_np(pthread_self(),
+                               sizeof(cpu_set_t),
+                               Node->Cpus) == 0) {
+
+        Node->Routine(Node->Context);
+    }
+
+    return NULL;
+}
+
+void
+RunOnNode(
+    PLACEMENT const * Placement,
+    int Node,
+    void * (*Routine)(void *),
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine runs a routine to completion on a thread pinned to a node,
+    so that memory it touches first is allocated on that node. Nothing is
+    run if the thread can't be pinned there.
+
+Arguments:
+
+    Placement - Supplies the placement state.
+
+    Node - Supplies the node index.
+
+    Routine - Supplies the routine.
+
+    Context - Supplies the routine's argument.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    NODE_ROUTINE Pinned;
+    int Result;
+    pthread_t Thread;
+
+    Pinned.Cpus = &Placement->Nodes[Node].Cpus;
+    Pinned.Routine = Routine;
+    Pinned.Context = Context;
+    Result = pthread_create(&Thread, NULL, NodeRoutine, &Pinned);
+    if (Result != 0) {
+        ErrorExit(Result, "Failed creating thread\n");
+    }
+
+    pthread_join(Thread, NULL);
+}
+
+static
+void *
+BuildReplicaRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine builds one node's replica of the key table. It runs pinned
+    to the node, so the replica's pages are allocated there.
+
+Arguments:
+
+    Context - Supplies the replica context.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    REPLICA_CONTEXT * Replica;
+
+    Replica = (REPLICA_CONTEXT *)Context;
+    if (BuildKeyTable(Replica->Key,
+                      Replica->KeyLength,
+                      &Replica->Node->KeyTable) == 0) {
+
+        Replica->Node->HasKeyTable = 1;
+    }
+
+    return NULL;
+}
+
+int
+InitializePlacement(
+    PLACEMENT * Placement,
+    OPTIONS const * Options,
+    byte const * Key,
+    size_t KeyLength
+    )
+
+/*++
+
+Description:
+
+    This routine reads the NUMA topology if --numa was given, and replicates
+    the key table on every node that has CPUs. A node whose replica can't be
+    built falls back to the shared key table.
+
+Arguments:
+
+    Placement - Supplies the placement state to initialize.
+
+    Options - Supplies the CPU lists and the NUMA flag.
+
+    Key - Supplies the key.
+
+    KeyLength - Supplies the length of the key.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the topology can't be read.
+
+--*/
+
+{
+
+    int Node;
+    REPLICA_CONTEXT Replica;
+
+    Placement->Cpus = Options->Cpus;
+    Placement->CpuCount = Options->CpuCount;
+    Placement->IoCpus = Options->IoCpus;
+    Placement->IoCpuCount = Options->IoCpuCount;
+    Placement->Nodes = NULL;
+    Placement->NodeCount = 0;
+    Placement->CpuNodeCount = 0;
+    if (Options->Numa == 0) {
+        return 0;
+    }
+
+    //
+    // Node numbers are dense on every system seen so far. Stop at the first
+    // gap rather than scanning the whole possible range.
+    //
+
+    for (Node = 0;; ++Node) {
+        Placement->Nodes = realloc(Placement->Nodes,
+                                   (Node + 1) * sizeof(NUMA_NODE));
+
+        if (Placement->Nodes == NULL) {
+            fprintf(stderr, "Memory allocation failure for NUMA nodes\n");
+            return 1;
+        }
+
+        memset(&Placement->Nodes[Node], 0, sizeof(NUMA_NODE));
+        if (ReadNodeCpus(Node, &Placement->Nodes[Node].Cpus) != 0) {
+            break;
+        }
+
+        Placement->NodeCount += 1;
+        if (CPU_COUNT(&Placement->Nodes[Node].Cpus) != 0) {
+            Placement->CpuNodeCount += 1;
+        }
+    }
+
+    if (Placement->CpuNodeCount == 0) {
+        fprintf(stderr, "Cannot read the NUMA topology\n");
+        return 1;
+    }
+
+    //
+    // A single node has nothing to replicate.
+    //
+
+    if (Placement->CpuNodeCount == 1) {
+        return 0;
+    }
+
+    Replica.Key = Key;
+    Replica.KeyLength = KeyLength;
+    for (Node = 0; Node < Placement->NodeCount; ++Node) {
+        if (CPU_COUNT(&Placement->Nodes[Node].Cpus) == 0) {
+            continue;
+        }
+
+        Replica.Node = &Placement->Nodes[Node];
+        RunOnNode(Placement, Node, BuildReplicaRoutine, &Replica);
+    }
+
+    return 0;
+}
+
+void
+FreePlacement(
+    PLACEMENT * Placement
+    )
+
+/*++
+
+Description:
+
+    This routine frees the key table replicas and the topology.
+
+Arguments:
+
+    Placement - Supplies the placement state.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    int Node;
+
+    for (Node = 0; Node < Placement->NodeCount; ++Node) {
+        if (Placement->Nodes[Node].HasKeyTable != 0) {
+            FreeKeyTable(&Placement->Nodes[Node].KeyTable);
+        }
+    }
+
+    free(Placement->Nodes);
+    Placement->Nodes = NULL;
+    Placement->NodeCount = 0;
+}
+
+int
+GetWorkerNode(
+    PLACEMENT const * Placement,
+    int Worker
+    )
+
+/*++
+
+Description:
+
+    This routine finds the NUMA node a worker is placed on.
+
+Arguments:
+
+    Placement - Supplies the placement state, or NULL.
+
+    Worker - Supplies the worker number.
+
+Return Value:
+
+    Returns the node index, or -1 if workers aren't placed on nodes.
+
+--*/
+
+{
+
+    int Node;
+
+    if ((Placement == NULL) || (Placement->NodeCount == 0)) {
+        return -1;
+    }
+
+    if (Placement->CpuCount != 0) {
+        return GetCpuNode(Placement,
+                          Placement->Cpus[Worker % Placement->CpuCount]);
+    }
+
+    //
+    // Deal workers out over the nodes that have CPUs, skipping memory-only
+    // nodes.
+    //
+
+    Worker %= Placement->CpuNodeCount;
+    for (Node = 0;; ++Node) {
+        if (CPU_COUNT(&Placement->Nodes[Node].Cpus) != 0) {
+            if (Worker == 0) {
+                return Node;
+            }
+
+            Worker -= 1;
+        }
+    }
+}
+
+static
+void
+PinThread(
+    cpu_set_t const * Cpus,
+    int Node
+    )
+
+/*++
+
+Description:
+
+    This routine pins the calling thread to a set of CPUs. Failure is fatal,
+    since it means a requested CPU can't be used.
+
+Arguments:
+
+    Cpus - Supplies the CPUs.
+
+    Node - Supplies the node the CPUs belong to, or -1.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    int Result;
+
+    Result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), Cpus);
+    if (Result != 0) {
+        ErrorExit(Result, "Failure pinning a thread to its CPUs\n");
+    }
+
+    CurrentNode = Node;
+}
+
+KEY_TABLE const *
+PlaceWorkerThread(
+    WORKER_CONTEXT * WorkerContext,
+    int Worker
+    )
+
+/*++
+
+Description:
+
+    This routine pins the calling thread as the given worker, if placement was
+    asked for, and picks the key table it should encrypt with.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+    Worker - Supplies the worker number, counting from zero in each engine.
+
+Return Value:
+
+    Returns the key table replica on the worker's node, or the shared key
+    table.
+
+--*/
+
+{
+
+    cpu_set_t Cpus;
+    int Node;
+    PLACEMENT * Placement;
+
+    Placement = WorkerContext->Placement;
+    if ((Placement == NULL) ||
+        ((Placement->CpuCount == 0) && (Placement->NodeCount == 0))) {
+
+        return WorkerContext->KeyTable;
+    }
+
+    Node = GetWorkerNode(Placement, Worker);
+    if (Placement->CpuCount != 0) {
+        CPU_ZERO(&Cpus);
+        CPU_SET(Placement->Cpus[Worker % Placement->CpuCount], &Cpus);
+        PinThread(&Cpus, Node);
+
+    } else {
+        PinThread(&Placement->Nodes[Node].Cpus, Node);
+    }
+
+    if ((Node >= 0) && (Placement->Nodes[Node].HasKeyTable != 0)) {
+        return &Placement->Nodes[Node].KeyTable;
+    }
+
+    return WorkerContext->KeyTable;
+}
+
+static
+int
+GetStreamNode(
+    PLACEMENT const * Placement,
+    int FileDescriptor
+    )
+
+/*++
+
+Description:
+
+    This routine finds the NUMA node nearest the device behind a descriptor:
+    the disk holding a file, the disk itself, or the CPU that handles a
+    socket's traffic.
+
+Arguments:
+
+    Placement - Supplies the placement state.
+
+    FileDescriptor - Supplies the descriptor.
+
+Return Value:
+
+    Returns the node index, or -1 if it isn't known.
+
+--*/
+
+{
+
+    int Cpu;
+    dev_t Device;
+    socklen_t Length;
+    int Node;
+    char Path[128];
+    struct stat Stats;
+    FILE * Stream;
+
+    if (fstat(FileDescriptor, &Stats) != 0) {
+        return -1;
+    }
+
+    if (S_ISSOCK(Stats.st_mode)) {
+        Length = sizeof(Cpu);
+        if ((getsockopt(FileDescriptor,
+                        SOL_SOCKET,
+                        SO_INCOMING_CPU,
+                        &Cpu,
+                        &Length) != 0) ||
+            (Cpu < 0)) {
+
+            return -1;
+        }
+
+        return GetCpuNode(Placement, Cpu);
+    }
+
+    if (S_ISBLK(Stats.st_mode)) {
+        Device = Stats.st_rdev;
+
+    } else if (S_ISREG(Stats.st_mode)) {
+        Device = Stats.st_dev;
+
+    } else {
+        return -1;
+    }
+
+    //
+    // A partition's device directory is its disk's, one level up.
+    //
+
+    snprintf(Path,
+             sizeof(Path),
+             "/sys/dev/block/%u:%u/device/numa_node",
+             major(Device),
+             minor(Device));
+
+    Stream = fopen(Path, "r");
+    if (Stream == NULL) {
+        snprintf(Path,
+                 sizeof(Path),
+                 "/sys/dev/block/%u:%u/../device/numa_node",
+                 major(Device),
+                 minor(Device));
+
+        Stream = fopen(Path, "r");
+        if (Stream == NULL) {
+            return -1;
+        }
+    }
+
+    if (fscanf(Stream, "%d", &Node) != 1) {
+        Node = -1;
+    }
+
+    fclose(Stream);
+    if ((Node < 0) || (Node >= Placement->NodeCount)) {
+        return -1;
+    }
+
+    return Node;
+}
+
+void
+PlaceIoThread(
+    WORKER_CONTEXT * WorkerContext,
+    int FileDescriptor
+    )
+
+/*++
+
+Description:
+
+    This routine pins the calling thread, which moves data to or from the
+    given descriptor, to the I/O CPUs if they were given, or else to the node
+    of the descriptor's device if that is known. Otherwise it does nothing.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+    FileDescriptor - Supplies the descriptor the thread reads or writes.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    cpu_set_t Cpus;
+    int Index;
+    int Node;
+    PLACEMENT * Placement;
+
+    Placement = WorkerContext->Placement;
+    if (Placement == NULL) {
+        return;
+    }
+
+    if (Placement->IoCpuCount != 0) {
+        CPU_ZERO(&Cpus);
+        for (Index = 0; Index < Placement->IoCpuCount; ++Index) {
+            CPU_SET(Placement->IoCpus[Index], &Cpus);
+        }
+
+        Node = -1;
+        if (Placement->NodeCount != 0) {
+            Node = GetCpuNode(Placement, Placement->IoCpus[0]);
+        }
+
+        PinThread(&Cpus, Node);
+        return;
+    }
+
+    if (Placement->NodeCount == 0) {
+        return;
+    }
+
+    Node = GetStreamNode(Placement, FileDescriptor);
+    if ((Node >= 0) && (CPU_COUNT(&Placement->Nodes[Node].Cpus) != 0)) {
+        PinThread(&Placement->Nodes[Node].Cpus, Node);
+    }
+}
+
+int
+GetCurrentNode(
+    void
+    )
+
+/*++
+
+Description:
+
+    This routine returns the NUMA node the calling thread was placed on.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Returns the node index, or -1 if the thread wasn't placed on a node.
+
+--*/
+
+{
+
+    return CurrentNode;
+}
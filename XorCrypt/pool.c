@@ -0,0 +1,498 @@
+/*++
+
+Description:
+
+    This module implements the block buffer pool that the engines draw their
+    block buffers from. The pool maps one arena, and carves it into buffers
+    for each run of an engine. The arena is kept from run to run, and from
+    file to file in a batch, and only grows, so -b auto and batches don't
+    map memory over and over.
+
+    Buffers start on cache line boundaries, and buffers of a page or more
+    start on page boundaries, as O_DIRECT and registered io_uring buffers
+    want. An arena of a huge page or more is backed by explicit huge pages if
+    any are reserved, and otherwise by transparent huge pages, aligned so the
+    kernel can use them. Either way, large blocks take far fewer TLB entries.
+
+    Free buffers are kept on a lock-free stack. The head of the stack packs
+    the index of the top buffer with a count of the changes made to it, so a
+    thread that was preempted between reading the head and swapping it can't
+    succeed with a stale head (the ABA problem). The links live beside the
+    arena rather than in the free buffers themselves, so a thread reading a
+    link never races with a thread filling the buffer.
+
+    --memory-limit caps the bytes of buffers a run may carve. Engines ask
+    for the buffers they would like and the fewest they can work with, and
+    shorten their queues to what the limit allows.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "homework.h"
+
+//
+// The index part of the stack head is one more than the index of the top
+// buffer, so that zero means the stack is empty.
+//
+
+#define POOL_EMPTY 0
+#define POOL_INDEX_MASK 0xffffffffULL
+#define POOL_TAG_ONE (1ULL << 32)
+
+static char const * const PoolPageNames[] = {
+    "small pages",
+    "transparent huge pages",
+    "explicit huge pages"
+};
+
+void
+InitializeBufferPool(
+    BUFFER_POOL * Pool,
+    size_t MemoryLimit,
+    int Verbose
+    )
+
+/*++
+
+Description:
+
+    This routine initializes an empty buffer pool. Nothing is mapped until the
+    pool is first prepared.
+
+Arguments:
+
+    Pool - Supplies the pool to initialize.
+
+    MemoryLimit - Supplies the most bytes of buffers a run may carve, or zero
+        (0) for no limit.
+
+    Verbose - Supplies non-zero to report each new arena on stderr.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    memset(Pool, 0, sizeof(BUFFER_POOL));
+    Pool->MemoryLimit = MemoryLimit;
+    Pool->Verbose = Verbose;
+    atomic_init(&Pool->FreeHead, POOL_EMPTY);
+}
+
+static
+int
+MapArena(
+    BUFFER_POOL * Pool,
+    size_t Size
+    )
+
+/*++
+
+Description:
+
+    This routine maps a new arena of at least the given size, preferring
+    explicit huge pages, then transparent huge pages, for arenas of a huge
+    page or more.
+
+Arguments:
+
+    Pool - Supplies the pool. Its arena must be unmapped.
+
+    Size - Supplies the number of bytes needed.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if no memory could be mapped.
+
+--*/
+
+{
+
+    byte * Arena;
+    size_t Head;
+    size_t Mapped;
+
+    if (Size >= POOL_HUGE_PAGE_SIZE) {
+        Size = (Size + POOL_HUGE_PAGE_SIZE - 1) & ~(POOL_HUGE_PAGE_SIZE - 1);
+
+#if defined(MAP_HUGETLB)
+
+        Arena = mmap(NULL,
+                     Size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                     -1,
+                     0);
+
+        if (Arena != MAP_FAILED) {
+            Pool->Arena = Arena;
+            Pool->ArenaSize = Size;
+            Pool->Pages = POOL_PAGES_EXPLICIT;
+            return 0;
+        }
+
+#endif
+
+        //
+        // Transparent huge pages only back aligned huge pages of a mapping,
+        // so map a huge page extra, and trim the mapping to an aligned one.
+        //
+
+        Mapped = Size + POOL_HUGE_PAGE_SIZE;
+        Arena = mmap(NULL,
+                     Mapped,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+
+        if (Arena == MAP_FAILED) {
+            return 1;
+        }
+
+        Head = (POOL_HUGE_PAGE_SIZE -
+                ((uintptr_t)Arena & (POOL_HUGE_PAGE_SIZE - 1))) &
+               (POOL_HUGE_PAGE_SIZE - 1);
+
+        if (Head != 0) {
+            munmap(Arena, Head);
+        }
+
+        munmap(Arena + Head + Size, Mapped - Head - Size);
+        Arena += Head;
+        Pool->Pages = POOL_PAGES_SMALL;
+
+#if defined(MADV_HUGEPAGE)
+
+        if (madvise(Arena, Size, MADV_HUGEPAGE) == 0) {
+            Pool->Pages = POOL_PAGES_TRANSPARENT;
+        }
+
+#endif
+
+    } else {
+        Arena = mmap(NULL,
+                     Size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+
+        if (Arena == MAP_FAILED) {
+            return 1;
+        }
+
+        Pool->Pages = POOL_PAGES_SMALL;
+    }
+
+    Pool->Arena = Arena;
+    Pool->ArenaSize = Size;
+    return 0;
+}
+
+int
+PrepareBufferPool(
+    BUFFER_POOL * Pool,
+    size_t BufferSize,
+    size_t * BufferCount,
+    size_t MinimumCount
+    )
+
+/*++
+
+Description:
+
+    This routine carves the pool into buffers for a run of an engine, and
+    puts them all on the free stack, lowest address on top. Any buffers still
+    out from an earlier run are taken back, so it must only be called while
+    no thread is using the pool.
+
+Arguments:
+
+    Pool - Supplies the pool.
+
+    BufferSize - Supplies the size of each buffer.
+
+    BufferCount - Supplies the number of buffers wanted, and receives the
+        number carved, which the memory limit may make smaller.
+
+    MinimumCount - Supplies the fewest buffers the engine can work with.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the memory limit allows fewer
+    than the minimum number of buffers, or the memory can't be allocated.
+
+--*/
+
+{
+
+    size_t Count;
+    size_t Index;
+    _Atomic uint32_t * Links;
+    size_t PageSize;
+    size_t Stride;
+
+    PageSize = sysconf(_SC_PAGESIZE);
+    Stride = (BufferSize + POOL_ALIGNMENT - 1) & ~(size_t)(POOL_ALIGNMENT - 1);
+    if (BufferSize >= PageSize) {
+        Stride = (BufferSize + PageSize - 1) & ~(PageSize - 1);
+    }
+
+    Count = *BufferCount;
+    if ((Pool->MemoryLimit != 0) && (Count > Pool->MemoryLimit / Stride)) {
+        Count = Pool->MemoryLimit / Stride;
+    }
+
+    if (Count < MinimumCount) {
+        fprintf(stderr,
+                "The memory limit allows %zu buffers of %zu bytes, but at "
+                "least %zu are needed\n",
+                Count,
+                BufferSize,
+                MinimumCount);
+
+        return 1;
+    }
+
+    if (Count * Stride > Pool->ArenaSize) {
+        if (Pool->Arena != NULL) {
+            munmap(Pool->Arena, Pool->ArenaSize);
+            Pool->Arena = NULL;
+            Pool->ArenaSize = 0;
+        }
+
+        if (MapArena(Pool, Count * Stride) != 0) {
+            fprintf(stderr, "Memory allocation failure for block buffers\n");
+            return 1;
+        }
+
+        if (Pool->Verbose != 0) {
+            fprintf(stderr,
+                    "Buffer pool: %zu bytes of %s\n",
+                    Pool->ArenaSize,
+                    PoolPageNames[Pool->Pages]);
+        }
+    }
+
+    if (Count > Pool->LinkCount) {
+        Links = realloc(Pool->Links, Count * sizeof(Pool->Links[0]));
+        if (Links == NULL) {
+            fprintf(stderr, "Memory allocation failure for block buffers\n");
+            return 1;
+        }
+
+        Pool->Links = Links;
+        Pool->LinkCount = Count;
+    }
+
+    for (Index = 0; Index < Count; ++Index) {
+        atomic_init(&Pool->Links[Index],
+                    (Index + 1 < Count) ? Index + 2 : POOL_EMPTY);
+    }
+
+    Pool->BufferSize = BufferSize;
+    Pool->BufferStride = Stride;
+    Pool->BufferCount = Count;
+    atomic_store(&Pool->FreeHead, (Count != 0) ? 1 : POOL_EMPTY);
+    *BufferCount = Count;
+    return 0;
+}
+
+byte *
+GetPoolBuffer(
+    BUFFER_POOL const * Pool,
+    size_t Index
+    )
+
+/*++
+
+Description:
+
+    This routine finds a buffer of the current carving by its index.
+
+Arguments:
+
+    Pool - Supplies the pool.
+
+    Index - Supplies the index of the buffer.
+
+Return Value:
+
+    Returns the buffer.
+
+--*/
+
+{
+
+    return Pool->Arena + (Index * Pool->BufferStride);
+}
+
+size_t
+GetPoolBufferIndex(
+    BUFFER_POOL const * Pool,
+    byte const * Buffer
+    )
+
+/*++
+
+Description:
+
+    This routine finds the index of a buffer of the current carving.
+
+Arguments:
+
+    Pool - Supplies the pool.
+
+    Buffer - Supplies the buffer.
+
+Return Value:
+
+    Returns the buffer's index.
+
+--*/
+
+{
+
+    return (Buffer - Pool->Arena) / Pool->BufferStride;
+}
+
+byte *
+TakePoolBuffer(
+    BUFFER_POOL * Pool
+    )
+
+/*++
+
+Description:
+
+    This routine pops a buffer off the free stack. It may be called from any
+    number of threads at once.
+
+Arguments:
+
+    Pool - Supplies the pool.
+
+Return Value:
+
+    Returns a buffer, or NULL if none is free.
+
+--*/
+
+{
+
+    uint64_t Head;
+    uint64_t Next;
+    uint64_t Top;
+
+    Head = atomic_load_explicit(&Pool->FreeHead, memory_order_acquire);
+    do {
+        Top = Head & POOL_INDEX_MASK;
+        if (Top == POOL_EMPTY) {
+            return NULL;
+        }
+
+        Next = atomic_load_explicit(&Pool->Links[Top - 1],
+                                    memory_order_relaxed);
+
+        Next |= (Head & ~POOL_INDEX_MASK) + POOL_TAG_ONE;
+
+    } while (atomic_compare_exchange_weak_explicit(&Pool->FreeHead,
+                                                   &Head,
+                                                   Next,
+                                                   memory_order_acquire,
+                                                   memory_order_acquire) == 0);
+
+    return GetPoolBuffer(Pool, Top - 1);
+}
+
+void
+ReturnPoolBuffer(
+    BUFFER_POOL * Pool,
+    byte * Buffer
+    )
+
+/*++
+
+Description:
+
+    This routine pushes a buffer back on the free stack. It may be called from
+    any number of threads at once.
+
+Arguments:
+
+    Pool - Supplies the pool.
+
+    Buffer - Supplies a buffer taken from the pool.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    uint64_t Head;
+    uint64_t Index;
+    uint64_t Next;
+
+    Index = GetPoolBufferIndex(Pool, Buffer);
+    Head = atomic_load_explicit(&Pool->FreeHead, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&Pool->Links[Index],
+                              (uint32_t)(Head & POOL_INDEX_MASK),
+                              memory_order_relaxed);
+
+        Next = ((Head & ~POOL_INDEX_MASK) + POOL_TAG_ONE) | (Index + 1);
+
+    } while (atomic_compare_exchange_weak_explicit(&Pool->FreeHead,
+                                                   &Head,
+                                                   Next,
+                                                   memory_order_release,
+                                                   memory_order_relaxed) == 0);
+}
+
+void
+FreeBufferPool(
+    BUFFER_POOL * Pool
+    )
+
+/*++
+
+Description:
+
+    This routine unmaps a pool's arena and frees its links.
+
+Arguments:
+
+    Pool - Supplies the pool.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if (Pool->Arena != NULL) {
+        munmap(Pool->Arena, Pool->ArenaSize);
+    }
+
+    free(Pool->Links);
+    InitializeBufferPool(Pool, Pool->MemoryLimit, Pool->Verbose);
+}
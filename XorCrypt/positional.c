@@ -0,0 +1,1015 @@
+/*++
+
+Description:
+
+    This module implements the positional engine, used when the input and the
+    output are both seekable. The stream engine only needs ordered writes
+    because its output is a FILE stream with a single current position. With
+    seekable descriptors every block's position is known up front, so each
+    thread simply claims the next block offset with an atomic increment, reads
+    the block with pread(), encrypts it, and writes it with pwrite() at the
+    same relative position in the output.
+
+    There is no read lock, no write lock, and no condition variable. Threads
+    never wait on one another, so the number of threads sets the number of
+    I/Os in flight, and throughput scales with the device queues behind the
+    descriptors.
+
+    The range ends at the ReadLimit, or where pread() first comes up short. A
+    thread that claims a block past the end finds it empty and stops.
+
+    Blocks finish out of order, but they are claimed in order, so everything
+    before the lowest block still in progress is done. Each thread publishes
+    the block it is working on, which lets an observer work out how far the
+    output is complete without ever stopping the threads.
+
+    With --direct, both files are reopened with O_DIRECT, so that blocks move
+    between the device and the pool's buffers without passing through the
+    page cache. Buffers are page aligned, and blocks are a multiple of
+    DIRECT_ALIGNMENT, so every read and write is aligned but for the one at
+    the end of the range. Its read is rounded up, and comes up short at the
+    end of the file, and its unaligned tail is written through the original,
+    buffered output descriptor. With no readahead or write behind, only the
+    requests the threads have in flight keep the device busy, so the io_uring
+    engine, which keeps many per thread, suits direct I/O best.
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "homework.h"
+
+#define POSITIONAL_IDLE UINT64_MAX
+
+int
+ReadPositioned(
+    int FileDescriptor,
+    byte * Buffer,
+    size_t Length,
+    off_t Position,
+    size_t * BytesRead
+    )
+
+/*++
+
+Description:
+
+    This routine reads a run of bytes at a file position, picking up after any
+    short reads, until the run is complete or the end of the file is reached.
+
+Arguments:
+
+    FileDescriptor - Supplies the file descriptor to read.
+
+    Buffer - Supplies the buffer that receives the bytes.
+
+    Length - Supplies the number of bytes to read.
+
+    Position - Supplies the file position to read from.
+
+    BytesRead - Supplies a pointer to memory that receives the number of bytes
+        read.
+
+Return Value:
+
+    Returns zero (0) on success, or the error number if a read failed.
+
+--*/
+
+{
+
+    ssize_t Result;
+    size_t Total;
+
+    Total = 0;
+    while (Total < Length) {
+        Result = pread(FileDescriptor,
+                       Buffer + Total,
+                       Length - Total,
+                       Position + Total);
+
+        if (Result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            *BytesRead = Total;
+            return errno;
+        }
+
+        if (Result == 0) {
+            break;
+        }
+
+        Total += Result;
+    }
+
+    *BytesRead = Total;
+    return 0;
+}
+
+int
+WritePositioned(
+    int FileDescriptor,
+    byte const * Buffer,
+    size_t Length,
+    off_t Position
+    )
+
+/*++
+
+Description:
+
+    This routine writes a run of bytes at a file position, picking up after
+    any short writes.
+
+Arguments:
+
+    FileDescriptor - Supplies the file descriptor to write.
+
+    Buffer - Supplies the bytes to write.
+
+    Length - Supplies the number of bytes to write.
+
+    Position - Supplies the file position to write to.
+
+Return Value:
+
+    Returns zero (0) on success, or the error number if a write failed.
+
+--*/
+
+{
+
+    ssize_t Result;
+    size_t Total;
+
+    Total = 0;
+    while (Total < Length) {
+        Result = pwrite(FileDescriptor,
+                        Buffer + Total,
+                        Length - Total,
+                        Position + Total);
+
+        if (Result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno;
+        }
+
+        Total += Result;
+    }
+
+    return 0;
+}
+
+size_t
+ReadFully(
+    int FileDescriptor,
+    byte * Buffer,
+    size_t Length,
+    off_t Position
+    )
+
+/*++
+
+Description:
+
+    This routine reads a run of bytes at a file position, picking up after any
+    short reads, until the run is complete or the end of the file is reached.
+
+Arguments:
+
+    FileDescriptor - Supplies the file descriptor to read.
+
+    Buffer - Supplies the buffer that receives the bytes.
+
+    Length - Supplies the number of bytes to read.
+
+    Position - Supplies the file position to read from.
+
+Return Value:
+
+    Returns the number of bytes read. Failures are fatal.
+
+--*/
+
+{
+
+    size_t BytesRead;
+    int Result;
+
+    Result = ReadPositioned(FileDescriptor,
+                            Buffer,
+                            Length,
+                            Position,
+                            &BytesRead);
+
+    if (Result != 0) {
+        ErrorExit(Result, "An error occured while reading the input\n");
+    }
+
+    return BytesRead;
+}
+
+void
+WriteFully(
+    int FileDescriptor,
+    byte const * Buffer,
+    size_t Length,
+    off_t Position
+    )
+
+/*++
+
+Description:
+
+    This routine writes a run of bytes at a file position, picking up after
+    any short writes.
+
+Arguments:
+
+    FileDescriptor - Supplies the file descriptor to write.
+
+    Buffer - Supplies the bytes to write.
+
+    Length - Supplies the number of bytes to write.
+
+    Position - Supplies the file position to write to.
+
+Return Value:
+
+    None. Failures are fatal.
+
+--*/
+
+{
+
+    int Result;
+
+    Result = WritePositioned(FileDescriptor, Buffer, Length, Position);
+    if (Result != 0) {
+        ErrorExit(Result, "Stream write failed\n");
+    }
+}
+
+void
+RecordPositionalEnd(
+    POSITIONAL_ENGINE * Engine,
+    uint64_t End
+    )
+
+/*++
+
+Description:
+
+    This routine remembers how far the output reaches, to position the
+    streams at the end of the range afterwards.
+
+Arguments:
+
+    Engine - Supplies the engine state.
+
+    End - Supplies the end of a block that has been written, relative to the
+        start of the range.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    uint64_t Previous;
+
+    Previous = atomic_load_explicit(&Engine->EndOffset, memory_order_relaxed);
+    while (Previous < End) {
+        if (atomic_compare_exchange_weak_explicit(&Engine->EndOffset,
+                                                  &Previous,
+                                                  End,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+
+            break;
+        }
+    }
+}
+
+static
+size_t
+ReadPositionalBlock(
+    POSITIONAL_ENGINE * Engine,
+    byte * Buffer,
+    size_t Length,
+    uint64_t Offset
+    )
+
+/*++
+
+Description:
+
+    This routine reads a block of the range. With direct I/O, the read is
+    rounded up to a multiple of DIRECT_ALIGNMENT, which the buffer has room
+    for, and a read that ends off the alignment has reached the end of the
+    file, since the next one would have to start there.
+
+Arguments:
+
+    Engine - Supplies the engine state.
+
+    Buffer - Supplies a buffer of the engine's block size.
+
+    Length - Supplies the number of bytes of the range in the block.
+
+    Offset - Supplies the offset of the block in the range.
+
+Return Value:
+
+    Returns the number of bytes read, up to the length. Failures are fatal.
+
+--*/
+
+{
+
+    size_t Aligned;
+    ssize_t Result;
+    size_t Total;
+
+    if (Engine->Direct == 0) {
+        return ReadFully(Engine->InputFd,
+                         Buffer,
+                         Length,
+                         Engine->InputPosition + Offset);
+    }
+
+    Aligned = (Length + DIRECT_ALIGNMENT - 1) &
+              ~(size_t)(DIRECT_ALIGNMENT - 1);
+
+    Total = 0;
+    while (Total < Aligned) {
+        Result = pread(Engine->InputFd,
+                       Buffer + Total,
+                       Aligned - Total,
+                       Engine->InputPosition + Offset + Total);
+
+        if (Result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            ErrorExit(errno, "An error occured while reading the input\n");
+        }
+
+        Total += Result;
+        if ((Result == 0) || ((Total % DIRECT_ALIGNMENT) != 0)) {
+            break;
+        }
+    }
+
+    if (Total > Length) {
+        Total = Length;
+    }
+
+    return Total;
+}
+
+static
+void *
+PositionalWorkerRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine claims, reads, encrypts, and writes blocks until the range is
+    exhausted.
+
+Arguments:
+
+    Context - Supplies the thread's slot in the positional engine.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    size_t BlockSize;
+    byte * Buffer;
+    size_t BytesRead;
+    POSITIONAL_ENGINE * Engine;
+    KEY_TABLE const * KeyTable;
+    uint64_t Offset;
+    uint64_t ReadTime;
+    uint64_t Start;
+    size_t Wanted;
+    POSITIONAL_WORKER * Worker;
+
+    Worker = (POSITIONAL_WORKER *)Context;
+    Engine = Worker->Engine;
+    KeyTable = PlaceWorkerThread(Engine->WorkerContext,
+                                 Worker - Engine->Workers);
+
+    AttachStatsThread("pread", Worker - Engine->Workers);
+
+    //
+    // The pool was carved with a buffer for every thread.
+    //
+
+    BlockSize = Engine->WorkerContext->Options->BlockSize;
+    Buffer = TakePoolBuffer(Engine->WorkerContext->BufferPool);
+
+    for (;;) {
+
+        //
+        // Publish a lower bound on the block about to be claimed before
+        // claiming it, so the published offset never runs ahead of the work.
+        //
+
+        atomic_store(&Worker->Claimed, atomic_load(&Engine->NextOffset));
+        Offset = atomic_fetch_add(&Engine->NextOffset, BlockSize);
+        atomic_store(&Worker->Claimed, Offset);
+        if (Offset >= Engine->Length) {
+            break;
+        }
+
+        Wanted = BlockSize;
+        if (Wanted > Engine->Length - Offset) {
+            Wanted = Engine->Length - Offset;
+        }
+
+        ReadTime = StartStatsTimer();
+        BytesRead = ReadPositionalBlock(Engine, Buffer, Wanted, Offset);
+
+        StopStatsTimer(STAT_READ, ReadTime);
+        if (BytesRead == 0) {
+            break;
+        }
+
+        Start = StartStatsTimer();
+        if (EncryptAndDigest(Engine->WorkerContext->Digest,
+                             Buffer,
+                             Buffer,
+                             BytesRead,
+                             Engine->StreamOffset + Offset,
+                             KeyTable) != 0) {
+
+            exit(1);
+        }
+
+        StopStatsTimer(STAT_ENCRYPT, Start);
+        Start = StartStatsTimer();
+        WriteFully(Engine->OutputFd,
+                   Buffer,
+                   WriteDirectTail(Engine, Buffer, BytesRead, Offset),
+                   Engine->OutputPosition + Offset);
+
+        StopStatsTimer(STAT_WRITE, Start);
+        RecordStatsLatency(ReadTime, StartStatsTimer());
+        CountStat(STAT_BLOCKS, 1);
+        CountStat(STAT_BYTES, BytesRead);
+
+        RecordPositionalEnd(Engine, Offset + BytesRead);
+        if (BytesRead < Wanted) {
+            break;
+        }
+    }
+
+    atomic_store(&Worker->Claimed, POSITIONAL_IDLE);
+    DetachStatsThread();
+    ReturnPoolBuffer(Engine->WorkerContext->BufferPool, Buffer);
+    return NULL;
+}
+
+int
+InitializePositionalEngine(
+    POSITIONAL_ENGINE * Engine
+    )
+
+/*++
+
+Description:
+
+    This routine allocates a slot for each thread, and readies the engine for
+    a transfer.
+
+Arguments:
+
+    Engine - Supplies the engine state. The caller fills in the context, the
+        descriptors and positions, the stream offset, and the length first.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero on failure.
+
+--*/
+
+{
+
+    int Index;
+
+    Engine->WorkerCount = Engine->WorkerContext->Options->ThreadCount;
+    Engine->Workers = aligned_alloc(sizeof(POSITIONAL_WORKER),
+                                    Engine->WorkerCount *
+                                    sizeof(POSITIONAL_WORKER));
+
+    if (Engine->Workers == NULL) {
+        return 1;
+    }
+
+    for (Index = 0; Index < Engine->WorkerCount; ++Index) {
+        atomic_init(&Engine->Workers[Index].Claimed, 0);
+        Engine->Workers[Index].Engine = Engine;
+    }
+
+    atomic_init(&Engine->NextOffset, 0);
+    atomic_init(&Engine->EndOffset, 0);
+    Engine->Direct = 0;
+    Engine->BufferedOutputFd = Engine->OutputFd;
+    return 0;
+}
+
+void
+FreePositionalEngine(
+    POSITIONAL_ENGINE * Engine
+    )
+
+/*++
+
+Description:
+
+    This routine frees the resources held by the positional engine, closing
+    the descriptors opened for direct I/O.
+
+Arguments:
+
+    Engine - Supplies the engine state.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if (Engine->Direct != 0) {
+        if (Engine->OutputFd != Engine->InputFd) {
+            close(Engine->OutputFd);
+        }
+
+        close(Engine->InputFd);
+        Engine->Direct = 0;
+    }
+
+    free(Engine->Workers);
+    Engine->Workers = NULL;
+}
+
+static
+int
+ReopenDirect(
+    int FileDescriptor
+    )
+
+/*++
+
+Description:
+
+    This routine opens the file behind a descriptor again, with the same
+    access but with O_DIRECT. The new descriptor has a file position and
+    flags of its own, so the original is left as it was.
+
+Arguments:
+
+    FileDescriptor - Supplies the descriptor to reopen.
+
+Return Value:
+
+    Returns the new descriptor, or -1 on failure with errno set.
+
+--*/
+
+{
+
+    int Flags;
+    char Path[64];
+
+    Flags = fcntl(FileDescriptor, F_GETFL);
+    if (Flags < 0) {
+        return -1;
+    }
+
+    snprintf(Path, sizeof(Path), "/proc/self/fd/%d", FileDescriptor);
+    return open(Path, (Flags & O_ACCMODE) | O_DIRECT);
+}
+
+int
+EnableDirectIo(
+    POSITIONAL_ENGINE * Engine
+    )
+
+/*++
+
+Description:
+
+    This routine switches an initialized engine to direct I/O, reopening its
+    input and output with O_DIRECT. The original output descriptor is kept
+    for the unaligned tail of the range.
+
+Arguments:
+
+    Engine - Supplies the engine state.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero on failure, once the reason has
+    been reported.
+
+--*/
+
+{
+
+    int Error;
+    int InputFd;
+    int OutputFd;
+
+    if (((Engine->InputPosition % DIRECT_ALIGNMENT) != 0) ||
+        ((Engine->OutputPosition % DIRECT_ALIGNMENT) != 0)) {
+
+        fprintf(stderr,
+                "--direct needs the input and output to start at multiples "
+                "of %d bytes\n",
+                DIRECT_ALIGNMENT);
+
+        return 1;
+    }
+
+    InputFd = ReopenDirect(Engine->InputFd);
+    OutputFd = InputFd;
+    if ((InputFd >= 0) && (Engine->OutputFd != Engine->InputFd)) {
+        OutputFd = ReopenDirect(Engine->OutputFd);
+    }
+
+    if (OutputFd < 0) {
+        Error = errno;
+        if (InputFd >= 0) {
+            close(InputFd);
+        }
+
+        fprintf(stderr,
+                "Cannot open the files for direct I/O: %s\n",
+                strerror(Error));
+
+        return 1;
+    }
+
+    Engine->InputFd = InputFd;
+    Engine->OutputFd = OutputFd;
+    Engine->Direct = 1;
+    return 0;
+}
+
+size_t
+WriteDirectTail(
+    POSITIONAL_ENGINE * Engine,
+    byte const * Buffer,
+    size_t Length,
+    uint64_t Offset
+    )
+
+/*++
+
+Description:
+
+    This routine writes the part of a block past its last multiple of
+    DIRECT_ALIGNMENT through the buffered output descriptor, since a direct
+    write can't end off the alignment. Only the block at the end of the range
+    can have such a tail.
+
+Arguments:
+
+    Engine - Supplies the engine state.
+
+    Buffer - Supplies the encrypted block.
+
+    Length - Supplies the length of the block.
+
+    Offset - Supplies the offset of the block in the range.
+
+Return Value:
+
+    Returns the length of the block left to write to the output descriptor,
+    which is all of it unless direct I/O is in use.
+
+--*/
+
+{
+
+    size_t Aligned;
+
+    if (Engine->Direct == 0) {
+        return Length;
+    }
+
+    Aligned = Length & ~(size_t)(DIRECT_ALIGNMENT - 1);
+    if (Aligned != Length) {
+        WriteFully(Engine->BufferedOutputFd,
+                   Buffer + Aligned,
+                   Length - Aligned,
+                   Engine->OutputPosition + Offset + Aligned);
+    }
+
+    return Aligned;
+}
+
+void
+TransferPositional(
+    POSITIONAL_ENGINE * Engine
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts a range from one descriptor to another (or to the
+    same one) on N threads, including the calling thread.
+
+Arguments:
+
+    Engine - Supplies the initialized engine state.
+
+Return Value:
+
+    None. Failures are fatal.
+
+--*/
+
+{
+
+    size_t BufferCount;
+    int Index;
+    int Result;
+    pthread_t * WorkerThreads;
+
+    BufferCount = Engine->WorkerCount;
+    if (PrepareBufferPool(Engine->WorkerContext->BufferPool,
+                          Engine->WorkerContext->Options->BlockSize,
+                          &BufferCount,
+                          BufferCount) != 0) {
+
+        exit(1);
+    }
+
+    WorkerThreads = calloc(Engine->WorkerCount, sizeof(pthread_t));
+    if (WorkerThreads == NULL) {
+        ErrorExit(errno, "Failure allocating thread array.\n");
+    }
+
+    for (Index = 1; Index < Engine->WorkerCount; ++Index) {
+        Result = pthread_create(&WorkerThreads[Index],
+                                NULL,
+                                PositionalWorkerRoutine,
+                                &Engine->Workers[Index]);
+
+        if (Result != 0) {
+            ErrorExit(Result, "Failed creating thread\n");
+        }
+    }
+
+    PositionalWorkerRoutine(&Engine->Workers[0]);
+    for (Index = 1; Index < Engine->WorkerCount; ++Index) {
+        pthread_join(WorkerThreads[Index], NULL);
+    }
+
+    free(WorkerThreads);
+}
+
+uint64_t
+GetPositionalProgress(
+    POSITIONAL_ENGINE * Engine
+    )
+
+/*++
+
+Description:
+
+    This routine works out how much of the range is certainly complete. It may
+    be called from any thread, at any time between initializing the engine
+    and freeing it.
+
+Arguments:
+
+    Engine - Supplies the engine state.
+
+Return Value:
+
+    Returns the length of the longest prefix of the range that has been
+    written. More may have been written beyond it.
+
+--*/
+
+{
+
+    uint64_t Claimed;
+    int Index;
+    uint64_t Progress;
+
+    //
+    // Nothing at or beyond the next unclaimed block has been started, and
+    // nothing before the lowest block a thread is working on is unfinished.
+    //
+
+    Progress = atomic_load(&Engine->NextOffset);
+    for (Index = 0; Index < Engine->WorkerCount; ++Index) {
+        Claimed = atomic_load(&Engine->Workers[Index].Claimed);
+        if (Claimed < Progress) {
+            Progress = Claimed;
+        }
+    }
+
+    if (Progress > Engine->Length) {
+        Progress = Engine->Length;
+    }
+
+    return Progress;
+}
+
+int
+OpenPositionalEngine(
+    WORKER_CONTEXT * WorkerContext,
+    POSITIONAL_ENGINE * Engine
+    )
+
+/*++
+
+Description:
+
+    This routine checks that the streams allow positional I/O, and sets up
+    the engine to transfer the range from stdin's position to stdout's. With
+    --direct, failing to open the files for direct I/O is fatal.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+    Engine - Supplies the engine state to set up.
+
+Return Value:
+
+    Returns zero (0) on success, or ENGINE_NOT_APPLICABLE if either stream
+    isn't seekable, the output is opened for append, or both are the same
+    file. Nothing has been done to either stream in the last case.
+
+--*/
+
+{
+
+    int Flags;
+    struct stat InputStats;
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock;
+    struct stat OutputStats;
+
+    IoSyncBlock = WorkerContext->IoSyncBlock;
+    Engine->WorkerContext = WorkerContext;
+    Engine->InputFd = fileno(IoSyncBlock->InputStream);
+    Engine->OutputFd = fileno(IoSyncBlock->OutputStream);
+
+    //
+    // Positional writes ignore the position on a descriptor opened for
+    // append, so those are left to the stream engine.
+    //
+
+    Flags = fcntl(Engine->OutputFd, F_GETFL);
+    if ((Flags < 0) || ((Flags & O_APPEND) != 0)) {
+        return ENGINE_NOT_APPLICABLE;
+    }
+
+    if ((fstat(Engine->InputFd, &InputStats) != 0) ||
+        (fstat(Engine->OutputFd, &OutputStats) != 0) ||
+        ((InputStats.st_dev == OutputStats.st_dev) &&
+         (InputStats.st_ino == OutputStats.st_ino))) {
+
+        return ENGINE_NOT_APPLICABLE;
+    }
+
+    Engine->InputPosition = ftello(IoSyncBlock->InputStream);
+    Engine->OutputPosition = lseek(Engine->OutputFd, 0, SEEK_CUR);
+    if ((Engine->InputPosition < 0) || (Engine->OutputPosition < 0)) {
+        return ENGINE_NOT_APPLICABLE;
+    }
+
+    Engine->StreamOffset = IoSyncBlock->ReadOffset;
+    Engine->Length = IoSyncBlock->ReadLimit - IoSyncBlock->ReadOffset;
+    if (InitializePositionalEngine(Engine) != 0) {
+        ErrorExit(errno, "Failure allocating the positional engine\n");
+    }
+
+    if ((WorkerContext->Options->Direct != 0) &&
+        (EnableDirectIo(Engine) != 0)) {
+
+        exit(1);
+    }
+
+    return 0;
+}
+
+void
+ClosePositionalEngine(
+    POSITIONAL_ENGINE * Engine
+    )
+
+/*++
+
+Description:
+
+    This routine leaves both streams positioned after the transferred range,
+    as if it had been read and written through them, and frees the engine.
+    The input is moved with fseeko(), so that the stream's own idea of its
+    position, which the next engine starts from, stays true.
+
+Arguments:
+
+    Engine - Supplies the engine state set up by OpenPositionalEngine.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    uint64_t End;
+    IO_SYNCHRONIZATION_BLOCK * IoSyncBlock;
+
+    IoSyncBlock = Engine->WorkerContext->IoSyncBlock;
+    End = atomic_load(&Engine->EndOffset);
+    IoSyncBlock->ReadOffset += End;
+    IoSyncBlock->WriteOffset += End;
+    fseeko(IoSyncBlock->InputStream, Engine->InputPosition + End, SEEK_SET);
+    lseek(Engine->BufferedOutputFd, Engine->OutputPosition + End, SEEK_SET);
+    FreePositionalEngine(Engine);
+}
+
+int
+RunPositionalEngine(
+    WORKER_CONTEXT * WorkerContext
+    )
+
+/*++
+
+Description:
+
+    This routine runs the positional engine, if the streams allow it.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+Return Value:
+
+    Returns zero (0) once the stream has been encrypted, non-zero on failure,
+    or ENGINE_NOT_APPLICABLE if either stream isn't seekable, the output is
+    opened for append, or both are the same file. Nothing has been done to
+    either stream in the last case.
+
+--*/
+
+{
+
+    POSITIONAL_ENGINE Engine;
+    int Result;
+
+    Result = OpenPositionalEngine(WorkerContext, &Engine);
+    if (Result != 0) {
+        return Result;
+    }
+
+    AttachCheckpoint(WorkerContext->Checkpoint, &Engine);
+    TransferPositional(&Engine);
+    DetachCheckpoint(WorkerContext->Checkpoint);
+    ClosePositionalEngine(&Engine);
+    return 0;
+}
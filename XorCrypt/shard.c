@@ -0,0 +1,488 @@
+/*++
+
+Description:
+
+    This module implements shards, which split one large stream between any
+    number of processes, on one machine or several sharing a file system.
+    The key stream at any offset can be computed directly, so each process
+    only needs to know which range is its own, and none of them need to talk
+    to each other.
+
+    --shard i/N takes the ith of N equal ranges of the input, which must be a
+    regular file, and --range takes an explicit one. The range is written to
+    the same range of the output, which every shard opens without truncating
+    it (with 1<>), or with --part to a part file of its own:
+
+        for i in 1 2 3 4; do
+            XorCrypt -k key -n 4 --shard $i/4 --digest-file d.$i \
+                < in 1<> out &
+        done
+        wait
+        XorCrypt --verify d.1 d.2 d.3 d.4 < out
+
+    Every shard extends the output to the length of the whole stream before
+    writing. Shards running at once then all extend it to the same length,
+    so none can cut short another's work by truncating it.
+
+    --verify reads the shards' digests in stream order, combines them into
+    the digest a single run over the whole stream would have reported, and
+    checks the output on stdin against it. --merge does the same while
+    copying its input to stdout, which joins part files:
+
+        cat part.1 part.2 part.3 part.4 |
+            XorCrypt --merge d.1 d.2 d.3 d.4 > out
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "homework.h"
+
+#define VERIFY_BUFFER_SIZE (1024 * 1024)
+#define VERIFY_LINE_MAXIMUM 8192
+
+int
+ParseShard(
+    char const * String,
+    int * Index,
+    int * Count
+    )
+
+/*++
+
+Description:
+
+    This routine parses a shard of the form "i/N", where i runs from 1 to N.
+
+Arguments:
+
+    String - Supplies the string to parse.
+
+    Index - Supplies a pointer that receives i.
+
+    Count - Supplies a pointer that receives N.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the string isn't a shard.
+
+--*/
+
+{
+
+    char * End;
+    long First;
+    long Second;
+
+    errno = 0;
+    First = strtol(String, &End, 10);
+    if ((End == String) || (*End != '/')) {
+        return 1;
+    }
+
+    String = End + 1;
+    Second = strtol(String, &End, 10);
+    if ((End == String) ||
+        (*End != '\0') ||
+        (errno != 0) ||
+        (First < 1) ||
+        (First > Second) ||
+        (Second > INT32_MAX)) {
+
+        return 1;
+    }
+
+    *Index = First;
+    *Count = Second;
+    return 0;
+}
+
+void
+GetShardRange(
+    int Index,
+    int Count,
+    uint64_t StreamLength,
+    uint64_t * Offset,
+    uint64_t * Length
+    )
+
+/*++
+
+Description:
+
+    This routine works out the range of a stream that belongs to a shard. The
+    shards are as equal as they can be while starting on multiples of
+    SHARD_ALIGNMENT, so the last ones may be short or empty.
+
+Arguments:
+
+    Index - Supplies the shard, from 1 to Count.
+
+    Count - Supplies the number of shards.
+
+    StreamLength - Supplies the length of the whole stream.
+
+    Offset - Supplies a pointer that receives the start of the shard.
+
+    Length - Supplies a pointer that receives the length of the shard.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    uint64_t End;
+    uint64_t ShardLength;
+
+    ShardLength = StreamLength / Count;
+    if (ShardLength * Count < StreamLength) {
+        ShardLength += 1;
+    }
+
+    ShardLength = (ShardLength + SHARD_ALIGNMENT - 1) &
+                  ~(uint64_t)(SHARD_ALIGNMENT - 1);
+
+    *Offset = (Index - 1) * ShardLength;
+    if (*Offset > StreamLength) {
+        *Offset = StreamLength;
+    }
+
+    End = *Offset + ShardLength;
+    if (End > StreamLength) {
+        End = StreamLength;
+    }
+
+    *Length = End - *Offset;
+}
+
+int
+ResolveShard(
+    OPTIONS * Options,
+    FILE * InputStream,
+    FILE * OutputStream
+    )
+
+/*++
+
+Description:
+
+    This routine sets the range of a shard, and unless it goes to a part
+    file, extends the output to the whole stream and positions it at the
+    start of the range. This must be called before the input is positioned.
+
+Arguments:
+
+    Options - Supplies the options naming the shard or range. The range is
+        updated.
+
+    InputStream - Supplies the input stream, which must be a regular file.
+
+    OutputStream - Supplies the output stream.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero on failure.
+
+--*/
+
+{
+
+    int Flags;
+    off_t InputPosition;
+    struct stat InputStats;
+    int OutputFd;
+    off_t OutputPosition;
+    struct stat OutputStats;
+    uint64_t StreamLength;
+
+    InputPosition = ftello(InputStream);
+    if ((fstat(fileno(InputStream), &InputStats) != 0) ||
+        !S_ISREG(InputStats.st_mode) ||
+        (InputPosition < 0)) {
+
+        fprintf(stderr, "--shard and --range need a regular file as input\n");
+        return 1;
+    }
+
+    StreamLength = 0;
+    if (InputStats.st_size > InputPosition) {
+        StreamLength = InputStats.st_size - InputPosition;
+    }
+
+    if (Options->ShardCount != 0) {
+        GetShardRange(Options->ShardIndex,
+                      Options->ShardCount,
+                      StreamLength,
+                      &Options->RangeOffset,
+                      &Options->RangeLength);
+    }
+
+    //
+    // An explicit range is clipped to the stream, as the engines would.
+    //
+
+    if (Options->RangeOffset > StreamLength) {
+        Options->RangeOffset = StreamLength;
+    }
+
+    if (Options->RangeLength > StreamLength - Options->RangeOffset) {
+        Options->RangeLength = StreamLength - Options->RangeOffset;
+    }
+
+    if (Options->Verbose != 0) {
+        fprintf(stderr,
+                "Shard of stream offsets %llu to %llu\n",
+                (unsigned long long)Options->RangeOffset,
+                (unsigned long long)(Options->RangeOffset +
+                                     Options->RangeLength));
+    }
+
+    if (Options->PlaceOutput == 0) {
+        return 0;
+    }
+
+    OutputFd = fileno(OutputStream);
+    Flags = fcntl(OutputFd, F_GETFL);
+    OutputPosition = lseek(OutputFd, 0, SEEK_CUR);
+    if ((Flags < 0) ||
+        ((Flags & O_APPEND) != 0) ||
+        (fstat(OutputFd, &OutputStats) != 0) ||
+        !S_ISREG(OutputStats.st_mode) ||
+        (OutputPosition < 0)) {
+
+        fprintf(stderr,
+                "Shards need a regular file as output, opened with 1<>, "
+                "unless --part is given\n");
+
+        return 1;
+    }
+
+    if ((uint64_t)OutputStats.st_size < OutputPosition + StreamLength) {
+        if (ftruncate(OutputFd, OutputPosition + StreamLength) != 0) {
+            ErrorExit(errno, "Failure extending the output file\n");
+        }
+    }
+
+    if (lseek(OutputFd,
+              OutputPosition + Options->RangeOffset,
+              SEEK_SET) < 0) {
+
+        ErrorExit(errno, "Failure positioning the output\n");
+    }
+
+    return 0;
+}
+
+static
+int
+ReadShardDigests(
+    OPTIONS const * Options,
+    CRC_TABLE const * Table,
+    uint32_t * Input,
+    uint32_t * Output,
+    uint64_t * Length
+    )
+
+/*++
+
+Description:
+
+    This routine reads every digest line from the files named after --verify
+    or --merge, in order, and combines them into the digest of the whole
+    stream.
+
+Arguments:
+
+    Options - Supplies the options naming the digest files.
+
+    Table - Supplies the CRC table.
+
+    Input - Supplies a pointer that receives the CRC of the whole input.
+
+    Output - Supplies a pointer that receives the CRC of the whole output.
+
+    Length - Supplies a pointer that receives the length of the stream.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero on failure.
+
+--*/
+
+{
+
+    unsigned long long Bytes;
+    int Found;
+    int Index;
+    char Line[VERIFY_LINE_MAXIMUM];
+    int LineNumber;
+    unsigned int PieceInput;
+    unsigned int PieceOutput;
+    FILE * Stream;
+
+    *Input = 0;
+    *Output = 0;
+    *Length = 0;
+    Found = 0;
+    for (Index = 0; Index < Options->VerifyNameCount; ++Index) {
+        Stream = fopen(Options->VerifyNames[Index], "r");
+        if (Stream == NULL) {
+            fprintf(stderr,
+                    "Cannot open %s: %s\n",
+                    Options->VerifyNames[Index],
+                    strerror(errno));
+
+            return 1;
+        }
+
+        LineNumber = 0;
+        while (fgets(Line, sizeof(Line), Stream) != NULL) {
+            LineNumber += 1;
+            if (sscanf(Line,
+                       "crc32c %8x %8x %llu",
+                       &PieceInput,
+                       &PieceOutput,
+                       &Bytes) != 3) {
+
+                fprintf(stderr,
+                        "Line %d of %s is not a digest\n",
+                        LineNumber,
+                        Options->VerifyNames[Index]);
+
+                fclose(Stream);
+                return 1;
+            }
+
+            *Input = CombineCrc32c(Table, *Input, PieceInput, Bytes);
+            *Output = CombineCrc32c(Table, *Output, PieceOutput, Bytes);
+            *Length += Bytes;
+            Found += 1;
+        }
+
+        fclose(Stream);
+    }
+
+    if (Found == 0) {
+        fprintf(stderr, "The digest files are empty\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int
+RunVerify(
+    OPTIONS const * Options
+    )
+
+/*++
+
+Description:
+
+    This routine checks the output of a set of shards, read from stdin,
+    against their combined digests, copying it to stdout for --merge. The
+    combined digest is reported on stderr.
+
+Arguments:
+
+    Options - Supplies the options naming the digest files.
+
+Return Value:
+
+    Returns zero (0) if the output matches, or non-zero otherwise.
+
+--*/
+
+{
+
+    byte * Buffer;
+    uint32_t Crc;
+    CRC_TABLE * CrcTable;
+    uint64_t ExpectedLength;
+    uint32_t Input;
+    uint64_t Length;
+    uint32_t Output;
+    int Result;
+    ssize_t Size;
+
+    CrcTable = malloc(sizeof(CRC_TABLE));
+    Buffer = malloc(VERIFY_BUFFER_SIZE);
+    if ((CrcTable == NULL) || (Buffer == NULL)) {
+        ErrorExit(errno, "Failure allocating the verify buffer\n");
+    }
+
+    BuildCrcTable(CrcTable);
+    Result = ReadShardDigests(Options,
+                              CrcTable,
+                              &Input,
+                              &Output,
+                              &ExpectedLength);
+
+    if (Result != 0) {
+        free(Buffer);
+        free(CrcTable);
+        return Result;
+    }
+
+    fprintf(stderr,
+            "crc32c %08x %08x %llu\n",
+            Input,
+            Output,
+            (unsigned long long)ExpectedLength);
+
+    Crc = 0;
+    Length = 0;
+    for (;;) {
+        Size = read(STDIN_FILENO, Buffer, VERIFY_BUFFER_SIZE);
+        if (Size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            ErrorExit(errno, "An error occured while reading the input\n");
+        }
+
+        if (Size == 0) {
+            break;
+        }
+
+        Crc = UpdateCrc32c(CrcTable, Crc, Buffer, Size);
+        Length += Size;
+        if ((Options->Merge != 0) &&
+            (fwrite(Buffer, 1, Size, stdout) != (size_t)Size)) {
+
+            ErrorExit(errno, "Stream write failed\n");
+        }
+    }
+
+    if (fflush(stdout) != 0) {
+        ErrorExit(errno, "Stream write failed\n");
+    }
+
+    if ((Length != ExpectedLength) || (Crc != Output)) {
+        fprintf(stderr,
+                "The output doesn't match the shards: it has %llu bytes "
+                "with CRC32C %08x\n",
+                (unsigned long long)Length,
+                Crc);
+
+        Result = 1;
+    }
+
+    free(Buffer);
+    free(CrcTable);
+    return Result;
+}
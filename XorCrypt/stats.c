@@ -0,0 +1,847 @@
+/*++
+
+Description:
+
+    This module implements --stats, which accounts for where each engine
+    thread spends its time, and reports it on stderr at exit, and optionally
+    at a fixed interval while the stream is encrypted.
+
+    Every thread that does engine work attaches to a statistics slot of its
+    own. Slots are separately allocated and cache line aligned, and each one
+    is only ever written by the thread attached to it, with plain relaxed
+    loads and stores rather than atomic read-modify-writes, so accounting
+    adds no shared cache line traffic. The reporter reads the slots with
+    relaxed loads, which can't tear, and sums them itself.
+
+    Slots are looked up by role and worker index, so every thread of a run
+    has a row of its own, even if it starts after another has finished. A
+    thread reattaches to the idle slot of its role and index, so an engine
+    that is run several times over a stream, as it is by -b auto,
+    accumulates each worker's runs into one slot rather than adding more.
+
+    Times come from CLOCK_MONOTONIC, which is read through the vDSO without
+    a system call. When statistics are off, no thread is attached, and every
+    accounting routine returns after testing one thread-local pointer.
+
+    Besides the counters, each slot keeps a histogram of block latencies,
+    from the start of a block's read to the end of its write, in buckets of
+    powers of two nanoseconds. The thread that writes a block records its
+    latency.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "homework.h"
+
+typedef struct _THREAD_STATS {
+    _Atomic uint64_t Counters[STAT_COUNTER_COUNT];
+    _Atomic uint64_t Latency[STAT_LATENCY_BUCKETS];
+    char const * Role;
+    int Index;
+    int Attached;
+    struct _THREAD_STATS * Next;
+} __attribute__((aligned(64))) THREAD_STATS;
+
+typedef struct _STATS_TOTALS {
+    uint64_t Counters[STAT_COUNTER_COUNT];
+    uint64_t Latency[STAT_LATENCY_BUCKETS];
+} STATS_TOTALS;
+
+static char const * const StatJsonNames[STAT_COUNTER_COUNT] = {
+    "read_lock_wait_ns",
+    "read_ns",
+    "encrypt_ns",
+    "write_lock_wait_ns",
+    "write_event_wait_ns",
+    "write_ns",
+    "stage_wait_ns",
+    "blocks",
+    "bytes",
+    "spurious_wakeups"
+};
+
+static char const * const StatTextNames[STAT_COUNTER_COUNT] = {
+    "rd-lock",
+    "read",
+    "encrypt",
+    "wr-lock",
+    "wr-event",
+    "write",
+    "stage",
+    "blocks",
+    "bytes",
+    "spurious"
+};
+
+static pthread_mutex_t StatsLock = PTHREAD_MUTEX_INITIALIZER;
+static THREAD_STATS * StatsList;
+static int StatsEnabled;
+static uint64_t StatsStartTime;
+static __thread THREAD_STATS * CurrentStats;
+
+static pthread_t ReporterThread;
+static pthread_cond_t ReporterEvent = PTHREAD_COND_INITIALIZER;
+static STATS_FORMAT ReporterFormat;
+static int ReporterInterval;
+static int ReporterStopping;
+
+static
+uint64_t
+ReadClock(
+    void
+    )
+
+/*++
+
+Description:
+
+    This routine reads the monotonic clock.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Returns the time in nanoseconds. It is never zero, which stands for a
+    time that wasn't taken.
+
+--*/
+
+{
+
+    struct timespec Time;
+
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (Time.tv_sec * 1000000000ULL) + Time.tv_nsec + 1;
+}
+
+static
+void
+AddCounter(
+    _Atomic uint64_t * Counter,
+    uint64_t Amount
+    )
+
+/*++
+
+Description:
+
+    This routine adds to a counter owned by the calling thread. Only the
+    owner writes it, so a relaxed load and store are enough, and no locked
+    instruction is needed.
+
+Arguments:
+
+    Counter - Supplies the counter.
+
+    Amount - Supplies the amount to add.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    atomic_store_explicit(Counter,
+                          atomic_load_explicit(Counter,
+                                               memory_order_relaxed) + Amount,
+                          memory_order_relaxed);
+}
+
+void
+EnableStats(
+    void
+    )
+
+/*++
+
+Description:
+
+    This routine turns statistics on. Threads that attach afterwards are
+    accounted for.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    StatsStartTime = ReadClock();
+    StatsEnabled = 1;
+}
+
+void
+AttachStatsThread(
+    char const * Role,
+    int Index
+    )
+
+/*++
+
+Description:
+
+    This routine gives the calling thread a statistics slot, reusing the idle
+    slot of the same role and index if there is one. Nothing is done if
+    statistics are off, or if a slot can't be allocated.
+
+Arguments:
+
+    Role - Supplies a static string naming the thread's part in its engine.
+
+    Index - Supplies the thread's index among the threads of its role in the
+        run, from zero.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    THREAD_STATS ** Insert;
+    THREAD_STATS ** Link;
+    THREAD_STATS * Stats;
+
+    if (StatsEnabled == 0) {
+        return;
+    }
+
+    //
+    // A new slot goes before the first of its role with a higher index, so
+    // that threads are reported in order however they started.
+    //
+
+    pthread_mutex_lock(&StatsLock);
+    Insert = NULL;
+    Link = &StatsList;
+    while (*Link != NULL) {
+        Stats = *Link;
+        if (strcmp(Stats->Role, Role) == 0) {
+            if ((Stats->Index == Index) && (Stats->Attached == 0)) {
+                Stats->Attached = 1;
+                CurrentStats = Stats;
+                pthread_mutex_unlock(&StatsLock);
+                return;
+            }
+
+            if ((Stats->Index > Index) && (Insert == NULL)) {
+                Insert = Link;
+            }
+        }
+
+        Link = &Stats->Next;
+    }
+
+    if (Insert == NULL) {
+        Insert = Link;
+    }
+
+    Stats = aligned_alloc(_Alignof(THREAD_STATS), sizeof(THREAD_STATS));
+    if (Stats != NULL) {
+        memset(Stats, 0, sizeof(THREAD_STATS));
+        Stats->Role = Role;
+        Stats->Index = Index;
+        Stats->Attached = 1;
+        Stats->Next = *Insert;
+        *Insert = Stats;
+    }
+
+    CurrentStats = Stats;
+    pthread_mutex_unlock(&StatsLock);
+}
+
+void
+DetachStatsThread(
+    void
+    )
+
+/*++
+
+Description:
+
+    This routine hands the calling thread's statistics slot back for reuse.
+    The counters are kept.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if (CurrentStats == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&StatsLock);
+    CurrentStats->Attached = 0;
+    CurrentStats = NULL;
+    pthread_mutex_unlock(&StatsLock);
+}
+
+uint64_t
+StartStatsTimer(
+    void
+    )
+
+/*++
+
+Description:
+
+    This routine starts timing an interval on the calling thread.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Returns the start time to pass to StopStatsTimer, or zero if the thread
+    isn't accounted for.
+
+--*/
+
+{
+
+    if (CurrentStats == NULL) {
+        return 0;
+    }
+
+    return ReadClock();
+}
+
+void
+StopStatsTimer(
+    STAT_COUNTER Counter,
+    uint64_t Start
+    )
+
+/*++
+
+Description:
+
+    This routine adds the time since a start time to one of the calling
+    thread's time counters.
+
+Arguments:
+
+    Counter - Supplies the counter to charge.
+
+    Start - Supplies the time returned by StartStatsTimer.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if ((CurrentStats == NULL) || (Start == 0)) {
+        return;
+    }
+
+    AddCounter(&CurrentStats->Counters[Counter], ReadClock() - Start);
+}
+
+void
+CountStat(
+    STAT_COUNTER Counter,
+    uint64_t Amount
+    )
+
+/*++
+
+Description:
+
+    This routine adds to one of the calling thread's counters.
+
+Arguments:
+
+    Counter - Supplies the counter.
+
+    Amount - Supplies the amount to add.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if (CurrentStats == NULL) {
+        return;
+    }
+
+    AddCounter(&CurrentStats->Counters[Counter], Amount);
+}
+
+int
+GetLatencyBucket(
+    uint64_t Nanoseconds
+    )
+
+/*++
+
+Description:
+
+    This routine finds the histogram bucket for a latency. Bucket zero holds
+    latencies under a nanosecond, and bucket N holds latencies from 2^(N-1)
+    up to 2^N nanoseconds. The last bucket also takes anything longer.
+
+Arguments:
+
+    Nanoseconds - Supplies the latency.
+
+Return Value:
+
+    Returns the bucket index.
+
+--*/
+
+{
+
+    int Bucket;
+
+    if (Nanoseconds == 0) {
+        return 0;
+    }
+
+    Bucket = 64 - __builtin_clzll(Nanoseconds);
+    if (Bucket >= STAT_LATENCY_BUCKETS) {
+        Bucket = STAT_LATENCY_BUCKETS - 1;
+    }
+
+    return Bucket;
+}
+
+void
+RecordStatsLatency(
+    uint64_t Start,
+    uint64_t End
+    )
+
+/*++
+
+Description:
+
+    This routine records a block's latency in the calling thread's histogram.
+
+Arguments:
+
+    Start - Supplies the time the block's read started, from
+        StartStatsTimer on any thread.
+
+    End - Supplies the time the block's write finished, from StartStatsTimer
+        on the calling thread.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if ((CurrentStats == NULL) || (Start == 0) || (End < Start)) {
+        return;
+    }
+
+    AddCounter(&CurrentStats->Latency[GetLatencyBucket(End - Start)], 1);
+}
+
+static
+void
+SnapshotStats(
+    THREAD_STATS * Stats,
+    STATS_TOTALS * Snapshot,
+    STATS_TOTALS * Totals
+    )
+
+/*++
+
+Description:
+
+    This routine copies one slot's counters, and adds them to the totals.
+
+Arguments:
+
+    Stats - Supplies the slot.
+
+    Snapshot - Supplies a pointer to memory that receives the copy.
+
+    Totals - Supplies the totals to add to.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    int Index;
+
+    for (Index = 0; Index < STAT_COUNTER_COUNT; ++Index) {
+        Snapshot->Counters[Index] =
+            atomic_load_explicit(&Stats->Counters[Index],
+                                 memory_order_relaxed);
+
+        Totals->Counters[Index] += Snapshot->Counters[Index];
+    }
+
+    for (Index = 0; Index < STAT_LATENCY_BUCKETS; ++Index) {
+        Snapshot->Latency[Index] =
+            atomic_load_explicit(&Stats->Latency[Index],
+                                 memory_order_relaxed);
+
+        Totals->Latency[Index] += Snapshot->Latency[Index];
+    }
+}
+
+static
+void
+PrintTextRow(
+    FILE * Stream,
+    char const * Name,
+    STATS_TOTALS const * Row
+    )
+
+/*++
+
+Description:
+
+    This routine prints one row of the text report. Times are printed in
+    milliseconds.
+
+Arguments:
+
+    Stream - Supplies the stream to print to.
+
+    Name - Supplies the row's name.
+
+    Row - Supplies the counters.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    int Index;
+
+    fprintf(Stream, "%-12s", Name);
+    for (Index = 0; Index < STAT_TIME_COUNT; ++Index) {
+        fprintf(Stream, " %9.1f", Row->Counters[Index] / 1000000.0);
+    }
+
+    fprintf(Stream,
+            " %9llu %13llu %9llu\n",
+            (unsigned long long)Row->Counters[STAT_BLOCKS],
+            (unsigned long long)Row->Counters[STAT_BYTES],
+            (unsigned long long)Row->Counters[STAT_SPURIOUS_WAKEUPS]);
+}
+
+static
+void
+PrintJsonObject(
+    FILE * Stream,
+    STATS_TOTALS const * Row
+    )
+
+/*++
+
+Description:
+
+    This routine prints the members of one object of the JSON report, without
+    the surrounding braces.
+
+Arguments:
+
+    Stream - Supplies the stream to print to.
+
+    Row - Supplies the counters.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    int Index;
+
+    for (Index = 0; Index < STAT_COUNTER_COUNT; ++Index) {
+        fprintf(Stream,
+                "\"%s\":%llu,",
+                StatJsonNames[Index],
+                (unsigned long long)Row->Counters[Index]);
+    }
+
+    fprintf(Stream, "\"latency_log2_ns\":[");
+    for (Index = 0; Index < STAT_LATENCY_BUCKETS; ++Index) {
+        fprintf(Stream,
+                "%s%llu",
+                (Index == 0) ? "" : ",",
+                (unsigned long long)Row->Latency[Index]);
+    }
+
+    fprintf(Stream, "]");
+}
+
+void
+ReportStats(
+    FILE * Stream,
+    STATS_FORMAT Format
+    )
+
+/*++
+
+Description:
+
+    This routine prints every thread's counters and their totals, followed by
+    the total latency histogram. A JSON report is one object on one line:
+
+        {"elapsed_ns":N,"threads":[{"role":R,"index":I,...},...],
+         "total":{...}}
+
+    where each thread and the total carry the counters by name, and a
+    "latency_log2_ns" array of bucket counts as described for
+    GetLatencyBucket.
+
+Arguments:
+
+    Stream - Supplies the stream to print to.
+
+    Format - Supplies the report format.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    uint64_t Elapsed;
+    int Index;
+    char Name[32];
+    STATS_TOTALS Snapshot;
+    THREAD_STATS * Stats;
+    STATS_TOTALS Totals;
+
+    if ((StatsEnabled == 0) || (Format == STATS_NONE)) {
+        return;
+    }
+
+    Elapsed = ReadClock() - StatsStartTime;
+    memset(&Totals, 0, sizeof(Totals));
+    pthread_mutex_lock(&StatsLock);
+    if (Format == STATS_JSON) {
+        fprintf(Stream,
+                "{\"elapsed_ns\":%llu,\"threads\":[",
+                (unsigned long long)Elapsed);
+
+        for (Stats = StatsList; Stats != NULL; Stats = Stats->Next) {
+            SnapshotStats(Stats, &Snapshot, &Totals);
+            fprintf(Stream,
+                    "%s{\"role\":\"%s\",\"index\":%d,",
+                    (Stats == StatsList) ? "" : ",",
+                    Stats->Role,
+                    Stats->Index);
+
+            PrintJsonObject(Stream, &Snapshot);
+            fprintf(Stream, "}");
+        }
+
+        fprintf(Stream, "],\"total\":{");
+        PrintJsonObject(Stream, &Totals);
+        fprintf(Stream, "}}\n");
+        pthread_mutex_unlock(&StatsLock);
+        fflush(Stream);
+        return;
+    }
+
+    fprintf(Stream,
+            "Statistics after %.3f s, times in ms:\n%-12s",
+            Elapsed / 1000000000.0,
+            "thread");
+
+    for (Index = 0; Index < STAT_TIME_COUNT; ++Index) {
+        fprintf(Stream, " %9s", StatTextNames[Index]);
+    }
+
+    fprintf(Stream,
+            " %9s %13s %9s\n",
+            StatTextNames[STAT_BLOCKS],
+            StatTextNames[STAT_BYTES],
+            StatTextNames[STAT_SPURIOUS_WAKEUPS]);
+
+    for (Stats = StatsList; Stats != NULL; Stats = Stats->Next) {
+        SnapshotStats(Stats, &Snapshot, &Totals);
+        snprintf(Name, sizeof(Name), "%s.%d", Stats->Role, Stats->Index);
+        PrintTextRow(Stream, Name, &Snapshot);
+    }
+
+    pthread_mutex_unlock(&StatsLock);
+    PrintTextRow(Stream, "total", &Totals);
+    fprintf(Stream, "Read to write latency, in ns:\n");
+    for (Index = 0; Index < STAT_LATENCY_BUCKETS; ++Index) {
+        if (Totals.Latency[Index] == 0) {
+            continue;
+        }
+
+        fprintf(Stream,
+                "  %15llu - %-15llu %llu\n",
+                (Index == 0) ? 0ULL : 1ULL << (Index - 1),
+                (1ULL << Index) - 1,
+                (unsigned long long)Totals.Latency[Index]);
+    }
+
+    fflush(Stream);
+}
+
+static
+void *
+StatsReporterRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine prints a report every interval until told to stop.
+
+Arguments:
+
+    Context - Unused.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    struct timespec Deadline;
+
+    (void)Context;
+    pthread_mutex_lock(&StatsLock);
+    clock_gettime(CLOCK_REALTIME, &Deadline);
+    while (ReporterStopping == 0) {
+        Deadline.tv_sec += ReporterInterval;
+        while ((ReporterStopping == 0) &&
+               (pthread_cond_timedwait(&ReporterEvent,
+                                       &StatsLock,
+                                       &Deadline) != ETIMEDOUT)) {
+
+            continue;
+        }
+
+        if (ReporterStopping != 0) {
+            break;
+        }
+
+        pthread_mutex_unlock(&StatsLock);
+        ReportStats(stderr, ReporterFormat);
+        pthread_mutex_lock(&StatsLock);
+    }
+
+    pthread_mutex_unlock(&StatsLock);
+    return NULL;
+}
+
+int
+StartStatsReporter(
+    STATS_FORMAT Format,
+    int Interval
+    )
+
+/*++
+
+Description:
+
+    This routine starts a thread that prints a report on stderr every
+    interval.
+
+Arguments:
+
+    Format - Supplies the report format.
+
+    Interval - Supplies the interval in seconds.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the thread couldn't be
+    started.
+
+--*/
+
+{
+
+    ReporterFormat = Format;
+    ReporterInterval = Interval;
+    ReporterStopping = 0;
+    return pthread_create(&ReporterThread, NULL, StatsReporterRoutine, NULL);
+}
+
+void
+StopStatsReporter(
+    void
+    )
+
+/*++
+
+Description:
+
+    This routine stops the thread started by StartStatsReporter, and waits
+    for it to exit.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    pthread_mutex_lock(&StatsLock);
+    ReporterStopping = 1;
+    pthread_cond_signal(&ReporterEvent);
+    pthread_mutex_unlock(&StatsLock);
+    pthread_join(ReporterThread, NULL);
+}
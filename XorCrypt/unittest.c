@@ -1,11 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "homework.h"
+#include "xorcrypt.h"
 
 byte NullKey[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 byte BlackWhiteKey[] = {0xff, 0x00};
@@ -86,9 +92,1389 @@ TestIterateKey(
     printf("TestIterateKey finished.\n");
 }
 
+void
+RotateKeyBits(
+    byte * Destination,
+    byte const * Key,
+    size_t KeyLength,
+    int Iteration
+    )
+{
+    size_t Bit;
+    size_t BitCount;
+    size_t Source;
+
+    //
+    // Rotate one bit at a time, straight from the definition.
+    //
+
+    BitCount = KeyLength * 8;
+    memset(Destination, 0, KeyLength);
+    for (Bit = 0; Bit < BitCount; ++Bit) {
+        Source = (Bit + Iteration) % BitCount;
+        if (Key[Source / 8] & (0x80 >> (Source % 8))) {
+            Destination[Bit / 8] |= 0x80 >> (Bit % 8);
+        }
+    }
+}
+
+void
+TestIterateKeyLengths(
+    void
+    )
+{
+    byte Expected[64];
+    int Iteration;
+    size_t Index;
+    byte Key[64];
+    size_t KeyLength;
+    byte Working[64];
+
+    printf("Test IterateKey lengths\n");
+
+    //
+    // Both forms of key iteration should match a bit at a time rotation for
+    // every key length, odd or even, across and past a full rotation.
+    //
+
+    for (KeyLength = 1; KeyLength <= 40; ++KeyLength) {
+        for (Index = 0; Index < KeyLength; ++Index) {
+            Key[Index] = rand();
+        }
+
+        for (Iteration = 0; Iteration < (KeyLength * 8) + 20; ++Iteration) {
+            RotateKeyBits(Expected, Key, KeyLength, Iteration);
+            memcpy(Working, Key, KeyLength);
+            assert(IterateKey(Working, KeyLength, Iteration) == 0);
+            assert(memcmp(Working, Expected, KeyLength) == 0);
+
+            memset(Working, 0, sizeof(Working));
+            assert(IterateKeyInto(Working, Key, KeyLength, Iteration) == 0);
+            assert(memcmp(Working, Expected, KeyLength) == 0);
+        }
+    }
+
+    printf("TestIterateKeyLengths finished.\n");
+}
+
+void
+ReferenceEncrypt(
+    byte * Block,
+    size_t BlockLength,
+    byte const * Key,
+    size_t KeyLength
+    )
+{
+    size_t Index;
+    size_t KeyIndex;
+    byte WorkingKey[128];
+
+    //
+    // This is the byte at a time algorithm used by XorCryptRef.
+    //
+
+    memcpy(WorkingKey, Key, KeyLength);
+    for (Index = 0, KeyIndex = 0; Index < BlockLength; ++Index, ++KeyIndex) {
+        if (KeyIndex == KeyLength) {
+            IterateKey(WorkingKey, KeyLength, 1);
+            KeyIndex = 0;
+        }
+
+        Block[Index] ^= WorkingKey[KeyIndex];
+    }
+}
+
+void
+TestEncrypt(
+    void
+    )
+{
+    byte Expected[4096];
+    size_t Index;
+    int Kernel;
+    int Kind;
+    byte Key[128];
+    size_t KeyLength;
+    KEY_TABLE KeyTable;
+    size_t Length;
+    size_t Offset;
+    byte Plain[4096];
+    byte Working[4096];
+
+    printf("Test Encrypt\n");
+
+    srand(1);
+    for (Index = 0; Index < sizeof(Plain); ++Index) {
+        Plain[Index] = rand();
+    }
+
+    for (KeyLength = 1; KeyLength <= 40; ++KeyLength) {
+        printf("Encrypt KeyLength %d\n", (int)KeyLength);
+        for (Index = 0; Index < KeyLength; ++Index) {
+            Key[Index] = rand();
+        }
+
+        memcpy(Expected, Plain, sizeof(Plain));
+        ReferenceEncrypt(Expected, sizeof(Expected), Key, KeyLength);
+
+        //
+        // With the table BuildKeyTable picks, a direct and a periodic table,
+        // and every kernel the processor supports, encrypting any block at
+        // its stream offset should match the reference stream at that
+        // offset.
+        //
+
+        for (Kind = 0; Kind < 3; ++Kind) {
+            if (Kind == 0) {
+                assert(BuildKeyTable(Key, KeyLength, &KeyTable) == 0);
+
+            } else if (Kind == 1) {
+                BuildDirectKeyTable(Key, KeyLength, &KeyTable);
+
+            } else {
+                assert(BuildPeriodicKeyTable(Key, KeyLength, &KeyTable) == 0);
+            }
+
+            for (Kernel = 0; Kernel < XorKernelCount; ++Kernel) {
+                if (XorKernels[Kernel].IsSupported() == 0) {
+                    continue;
+                }
+
+                KeyTable.Xor = XorKernels[Kernel].Xor;
+                for (Offset = 0; Offset < sizeof(Plain); Offset += Length) {
+                    Length = 1 + (rand() % 300);
+                    if (Offset + Length > sizeof(Plain)) {
+                        Length = sizeof(Plain) - Offset;
+                    }
+
+                    memcpy(Working, Plain + Offset, Length);
+                    assert(Encrypt(Working, Length, Offset, &KeyTable) == 0);
+                    assert(memcmp(Working, Expected + Offset, Length) == 0);
+
+                    memset(Working, 0, Length);
+                    assert(EncryptCopy(Working,
+                                       Plain + Offset,
+                                       Length,
+                                       Offset,
+                                       &KeyTable) == 0);
+
+                    assert(memcmp(Working, Expected + Offset, Length) == 0);
+                }
+            }
+
+            FreeKeyTable(&KeyTable);
+        }
+    }
+
+    printf("TestEncrypt finished.\n");
+}
+
+void
+TestXorKernels(
+    void
+    )
+{
+    byte Expected[300];
+    size_t Index;
+    int Kernel;
+    byte KeyMaterial[300];
+    size_t Length;
+    byte Plain[300];
+    size_t Start;
+    byte Working[300];
+
+    printf("Test XorKernels\n");
+
+    for (Index = 0; Index < sizeof(Plain); ++Index) {
+        Plain[Index] = rand();
+        KeyMaterial[Index] = rand();
+        Expected[Index] = Plain[Index] ^ KeyMaterial[Index];
+    }
+
+    //
+    // Every supported kernel should handle every length and alignment,
+    // including lengths shorter than its lane.
+    //
+
+    for (Kernel = 0; Kernel < XorKernelCount; ++Kernel) {
+        if (XorKernels[Kernel].IsSupported() == 0) {
+            printf("Kernel %s is not supported\n", XorKernels[Kernel].Name);
+            continue;
+        }
+
+        printf("Kernel %s\n", XorKernels[Kernel].Name);
+        for (Start = 0; Start < 64; ++Start) {
+            for (Length = 0; Start + Length <= sizeof(Plain); ++Length) {
+                memcpy(Working, Plain, sizeof(Plain));
+                XorKernels[Kernel].Xor(Working + Start,
+                                       Working + Start,
+                                       KeyMaterial + Start,
+                                       Length);
+
+                assert(memcmp(Working, Plain, Start) == 0);
+                assert(memcmp(Working + Start, Expected + Start, Length) == 0);
+                assert(memcmp(Working + Start + Length,
+                              Plain + Start + Length,
+                              sizeof(Plain) - Start - Length) == 0);
+            }
+        }
+    }
+
+    printf("TestXorKernels finished.\n");
+}
+
+void
+TestGenerateKeystream(
+    void
+    )
+{
+    KEY_TABLE DirectTable;
+    byte Expected[4096];
+    size_t Index;
+    byte IterationKey[64];
+    byte Key[64];
+    size_t KeyLength;
+    KEY_TABLE KeyTable;
+    size_t Length;
+    uint64_t Offset;
+    byte Working[4096];
+
+    static uint64_t const LargeOffsets[] = {
+        0x7fffffffULL,
+        0xfffffff0ULL,
+        0x100000000ULL * 37 + 5,
+        0x8000000000000000ULL,
+        0xffffffffffff0000ULL
+    };
+
+    static size_t const HugeKeyLengths[] = {
+        (size_t)1 << 31,
+        (size_t)1 << 32,
+        ((size_t)1 << 31) * 3,
+        SIZE_MAX
+    };
+
+    printf("Test GenerateKeystream\n");
+
+    for (KeyLength = 1; KeyLength <= 40; ++KeyLength) {
+        for (Index = 0; Index < KeyLength; ++Index) {
+            Key[Index] = rand();
+        }
+
+        //
+        // The keystream is what encrypting zeroes produces.
+        //
+
+        memset(Expected, 0, sizeof(Expected));
+        ReferenceEncrypt(Expected, sizeof(Expected), Key, KeyLength);
+        for (Offset = 0; Offset < sizeof(Expected); Offset += Length) {
+            Length = 1 + (rand() % 300);
+            if (Offset + Length > sizeof(Expected)) {
+                Length = sizeof(Expected) - Offset;
+            }
+
+            GenerateKeystream(Key, KeyLength, Offset, Working, Length);
+            assert(memcmp(Working, Expected + Offset, Length) == 0);
+        }
+
+        //
+        // Offsets past 4GB should agree with the key table and with the
+        // iterated key itself.
+        //
+
+        assert(BuildKeyTable(Key, KeyLength, &KeyTable) == 0);
+        BuildDirectKeyTable(Key, KeyLength, &DirectTable);
+        for (Index = 0;
+             Index < sizeof(LargeOffsets) / sizeof(LargeOffsets[0]);
+             ++Index) {
+
+            Offset = LargeOffsets[Index] - (LargeOffsets[Index] % KeyLength);
+            printf("Keystream KeyLength %d Offset %llx\n",
+                   (int)KeyLength,
+                   (unsigned long long)Offset);
+
+            GenerateKeystream(Key, KeyLength, Offset, Working, 1000);
+            memset(Expected, 0, 1000);
+            assert(Encrypt(Expected, 1000, Offset, &KeyTable) == 0);
+            assert(memcmp(Working, Expected, 1000) == 0);
+            memset(Expected, 0, 1000);
+            assert(Encrypt(Expected, 1000, Offset, &DirectTable) == 0);
+            assert(memcmp(Working, Expected, 1000) == 0);
+
+            assert(IterateKeyInto(IterationKey,
+                                  Key,
+                                  KeyLength,
+                                  Offset / KeyLength) == 0);
+
+            assert(memcmp(Working, IterationKey, KeyLength) == 0);
+        }
+
+        FreeKeyTable(&KeyTable);
+        FreeKeyTable(&DirectTable);
+    }
+
+    //
+    // Keys of several gigabytes, whose period overflows a size_t, get a
+    // direct table. Building one doesn't read the key.
+    //
+
+    for (Index = 0;
+         Index < sizeof(HugeKeyLengths) / sizeof(HugeKeyLengths[0]);
+         ++Index) {
+
+        assert(BuildKeyTable(Key, HugeKeyLengths[Index], &KeyTable) == 0);
+        assert(KeyTable.Key == Key);
+        assert(KeyTable.KeyLength == HugeKeyLengths[Index]);
+        assert(KeyTable.Keystream == NULL);
+        assert(KeyTable.Phases[0] == NULL);
+        FreeKeyTable(&KeyTable);
+    }
+
+    printf("TestGenerateKeystream finished.\n");
+}
+
+void
+TestParseOffset(
+    void
+    )
+{
+    uint64_t Length;
+    uint64_t Value;
+
+    printf("Test ParseOffset\n");
+
+    assert((ParseOffset("0", &Value) == 0) && (Value == 0));
+    assert((ParseOffset("65536", &Value) == 0) && (Value == 65536));
+    assert((ParseOffset("64k", &Value) == 0) && (Value == 65536));
+    assert((ParseOffset("3K", &Value) == 0) && (Value == 3072));
+    assert((ParseOffset("2m", &Value) == 0) && (Value == 2 << 20));
+    assert((ParseOffset("1G", &Value) == 0) && (Value == 1 << 30));
+    assert((ParseOffset("5t", &Value) == 0) && (Value == 5ULL << 40));
+    assert((ParseOffset("18446744073709551615", &Value) == 0) &&
+           (Value == UINT64_MAX));
+
+    assert(ParseOffset("", &Value) != 0);
+    assert(ParseOffset("-1", &Value) != 0);
+    assert(ParseOffset("k", &Value) != 0);
+    assert(ParseOffset("4kb", &Value) != 0);
+    assert(ParseOffset("4x", &Value) != 0);
+    assert(ParseOffset("16777216t", &Value) != 0);
+    assert(ParseOffset("18446744073709551616", &Value) != 0);
+
+    assert((ParseRange("4k:1m", &Value, &Length) == 0) &&
+           (Value == 4096) && (Length == 1 << 20));
+
+    assert((ParseRange("100", &Value, &Length) == 0) &&
+           (Value == 100) && (Length == UINT64_MAX));
+
+    assert(ParseRange(":5", &Value, &Length) != 0);
+    assert(ParseRange("5:", &Value, &Length) != 0);
+    assert(ParseRange("5:6:7", &Value, &Length) != 0);
+
+    printf("TestParseOffset finished.\n");
+}
+
+void
+TestLatencyBuckets(
+    void
+    )
+{
+    printf("Test GetLatencyBucket\n");
+
+    assert(GetLatencyBucket(0) == 0);
+    assert(GetLatencyBucket(1) == 1);
+    assert(GetLatencyBucket(2) == 2);
+    assert(GetLatencyBucket(3) == 2);
+    assert(GetLatencyBucket(4) == 3);
+    assert(GetLatencyBucket(1023) == 10);
+    assert(GetLatencyBucket(1024) == 11);
+    assert(GetLatencyBucket(UINT64_MAX) == STAT_LATENCY_BUCKETS - 1);
+
+    printf("TestLatencyBuckets finished.\n");
+}
+
+void
+TestStatsThreads(
+    void
+    )
+{
+    char * Found;
+    char Report[4096];
+    size_t Size;
+    FILE * Stream;
+
+    printf("Test stats threads\n");
+
+    //
+    // Threads that don't overlap still get a row each, in index order, and
+    // a thread that comes back with the same index reuses its row.
+    //
+
+    EnableStats();
+    AttachStatsThread("test", 1);
+    CountStat(STAT_BLOCKS, 1);
+    DetachStatsThread();
+    AttachStatsThread("test", 0);
+    CountStat(STAT_BLOCKS, 1);
+    DetachStatsThread();
+    AttachStatsThread("test", 1);
+    CountStat(STAT_BLOCKS, 1);
+    DetachStatsThread();
+
+    Stream = tmpfile();
+    assert(Stream != NULL);
+    ReportStats(Stream, STATS_JSON);
+    rewind(Stream);
+    Size = fread(Report, 1, sizeof(Report) - 1, Stream);
+    Report[Size] = '\0';
+    fclose(Stream);
+
+    Found = strstr(Report, "\"role\":\"test\",\"index\":0,");
+    assert(Found != NULL);
+    assert(strstr(Found, "\"blocks\":1,") != NULL);
+    Found = strstr(Found, "\"role\":\"test\",\"index\":1,");
+    assert(Found != NULL);
+    assert(strstr(Found, "\"blocks\":2,") != NULL);
+    assert(strstr(Found + 1, "\"role\":\"test\"") == NULL);
+
+    printf("TestStatsThreads finished.\n");
+}
+
+void
+TestParseCpuList(
+    void
+    )
+{
+    int * Cpus;
+    int CpuCount;
+
+    printf("Test ParseCpuList\n");
+
+    assert(ParseCpuList("3", &Cpus, &CpuCount) == 0);
+    assert((CpuCount == 1) && (Cpus[0] == 3));
+    free(Cpus);
+
+    assert(ParseCpuList("0-3,8,10-11", &Cpus, &CpuCount) == 0);
+    assert(CpuCount == 7);
+    assert((Cpus[0] == 0) && (Cpus[3] == 3) && (Cpus[4] == 8));
+    assert((Cpus[5] == 10) && (Cpus[6] == 11));
+    free(Cpus);
+
+    assert(ParseCpuList("", &Cpus, &CpuCount) != 0);
+    assert(ParseCpuList("1,", &Cpus, &CpuCount) != 0);
+    assert(ParseCpuList("3-1", &Cpus, &CpuCount) != 0);
+    assert(ParseCpuList("1-", &Cpus, &CpuCount) != 0);
+    assert(ParseCpuList("x", &Cpus, &CpuCount) != 0);
+    assert(ParseCpuList("99999", &Cpus, &CpuCount) != 0);
+
+    printf("TestParseCpuList finished.\n");
+}
+
+void
+TestLibrary(
+    void
+    )
+{
+    xc_ctx * Context;
+    byte * Expected;
+    size_t Index;
+    byte Key[37] = {0};
+    KEY_TABLE KeyTable;
+    size_t Length;
+    size_t Offset;
+    byte * Plain;
+    size_t Size;
+    unsigned int Threads;
+    byte * Working;
+
+    printf("Test libxorcrypt\n");
+
+    errno = 0;
+    assert((xc_init(Key, 0) == NULL) && (errno == EINVAL));
+
+    //
+    // The buffer is big enough for xc_process_buffer to split it.
+    //
+
+    Size = (3 * 1024 * 1024) + 1001;
+    Plain = malloc(Size);
+    Expected = malloc(Size);
+    Working = malloc(Size);
+    assert((Plain != NULL) && (Expected != NULL) && (Working != NULL));
+    for (Index = 0; Index < Size; ++Index) {
+        Plain[Index] = rand();
+    }
+
+    for (Index = 0; Index < sizeof(Key); ++Index) {
+        Key[Index] = rand();
+    }
+
+    memcpy(Expected, Plain, Size);
+    assert(BuildKeyTable(Key, sizeof(Key), &KeyTable) == 0);
+    assert(Encrypt(Expected, Size, 0, &KeyTable) == 0);
+    FreeKeyTable(&KeyTable);
+
+    Context = xc_init(Key, sizeof(Key));
+    assert(Context != NULL);
+
+    //
+    // Updates in pieces of any size should add up to the whole stream.
+    //
+
+    memset(Working, 0, Size);
+    for (Offset = 0; Offset < Size; Offset += Length) {
+        Length = rand() % 70000;
+        if (Offset + Length > Size) {
+            Length = Size - Offset;
+        }
+
+        assert(xc_tell(Context) == Offset);
+        assert(xc_update(Context, Plain + Offset, Working + Offset, Length) ==
+               0);
+    }
+
+    assert(memcmp(Working, Expected, Size) == 0);
+
+    //
+    // Seeking anywhere should pick the stream up there, in place.
+    //
+
+    for (Index = 0; Index < 100; ++Index) {
+        Offset = rand() % Size;
+        Length = rand() % (Size - Offset);
+        memcpy(Working, Plain + Offset, Length);
+        assert(xc_seek(Context, Offset) == 0);
+        assert(xc_update(Context, Working, Working, Length) == 0);
+        assert(memcmp(Working, Expected + Offset, Length) == 0);
+        assert(xc_tell(Context) == Offset + Length);
+    }
+
+    //
+    // Any thread count should produce the same output, at any offset.
+    //
+
+    for (Threads = 0; Threads <= 9; Threads += 3) {
+        printf("xc_process_buffer threads %u\n", Threads);
+        memset(Working, 0, Size);
+        assert(xc_process_buffer(Context, Plain, Working, Size, 0, Threads) ==
+               0);
+
+        assert(memcmp(Working, Expected, Size) == 0);
+
+        Offset = 4097;
+        memcpy(Working, Plain + Offset, Size - Offset);
+        assert(xc_process_buffer(Context,
+                                 Working,
+                                 Working,
+                                 Size - Offset,
+                                 Offset,
+                                 Threads) == 0);
+
+        assert(memcmp(Working, Expected + Offset, Size - Offset) == 0);
+    }
+
+    xc_free(Context);
+    free(Plain);
+    free(Expected);
+    free(Working);
+    printf("TestLibrary finished.\n");
+}
+
+static
+void *
+StressBufferPool(
+    void * Context
+    )
+{
+    byte * Buffers[4];
+    int Held;
+    int Index;
+    BUFFER_POOL * Pool;
+    int Round;
+
+    Pool = Context;
+    for (Round = 0; Round < 100000; ++Round) {
+        Held = 0;
+        for (Index = 0; Index < 4; ++Index) {
+            Buffers[Held] = TakePoolBuffer(Pool);
+            if (Buffers[Held] != NULL) {
+
+                //
+                // A buffer held by two threads at once would lose a mark.
+                //
+
+                Buffers[Held][0] = (byte)Round;
+                Buffers[Held][1] = (byte)Round;
+                Held += 1;
+            }
+        }
+
+        while (Held > 0) {
+            Held -= 1;
+            assert(Buffers[Held][0] == (byte)Round);
+            assert(Buffers[Held][1] == (byte)Round);
+            ReturnPoolBuffer(Pool, Buffers[Held]);
+        }
+    }
+
+    return NULL;
+}
+
+void
+TestBufferPool(
+    void
+    )
+{
+    byte * Buffers[16];
+    size_t Count;
+    size_t Index;
+    size_t Other;
+    size_t PageSize;
+    BUFFER_POOL Pool;
+    size_t Sizes[] = {1, 100, 4096, 65536 + 3, 3 * 1024 * 1024};
+    size_t SizeIndex;
+    pthread_t Threads[4];
+
+    printf("Test buffer pool\n");
+
+    PageSize = sysconf(_SC_PAGESIZE);
+    InitializeBufferPool(&Pool, 0, 0);
+
+    //
+    // Every buffer should be aligned, distinct, and handed out once.
+    //
+
+    for (SizeIndex = 0;
+         SizeIndex < sizeof(Sizes) / sizeof(Sizes[0]);
+         ++SizeIndex) {
+
+        Count = 16;
+        assert(PrepareBufferPool(&Pool, Sizes[SizeIndex], &Count, 16) == 0);
+        assert(Count == 16);
+        for (Index = 0; Index < Count; ++Index) {
+            Buffers[Index] = TakePoolBuffer(&Pool);
+            assert(Buffers[Index] != NULL);
+            assert(((uintptr_t)Buffers[Index] % POOL_ALIGNMENT) == 0);
+            if (Sizes[SizeIndex] >= PageSize) {
+                assert(((uintptr_t)Buffers[Index] % PageSize) == 0);
+            }
+
+            memset(Buffers[Index], (int)Index, Sizes[SizeIndex]);
+            for (Other = 0; Other < Index; ++Other) {
+                assert(Buffers[Other] != Buffers[Index]);
+                assert(Buffers[Other][Sizes[SizeIndex] - 1] == (byte)Other);
+            }
+        }
+
+        assert(TakePoolBuffer(&Pool) == NULL);
+        ReturnPoolBuffer(&Pool, Buffers[5]);
+        assert(TakePoolBuffer(&Pool) == Buffers[5]);
+        assert(TakePoolBuffer(&Pool) == NULL);
+    }
+
+    //
+    // A limit should shorten the carving, down to the minimum.
+    //
+
+    FreeBufferPool(&Pool);
+    InitializeBufferPool(&Pool, 10 * PageSize, 0);
+    Count = 16;
+    assert(PrepareBufferPool(&Pool, PageSize, &Count, 4) == 0);
+    assert(Count == 10);
+    Count = 16;
+    assert(PrepareBufferPool(&Pool, PageSize + 1, &Count, 4) == 0);
+    assert(Count == 5);
+    Count = 16;
+    assert(PrepareBufferPool(&Pool, 4 * PageSize, &Count, 4) != 0);
+    FreeBufferPool(&Pool);
+
+    //
+    // Threads taking and returning at once should never share a buffer.
+    //
+
+    InitializeBufferPool(&Pool, 0, 0);
+    Count = 10;
+    assert(PrepareBufferPool(&Pool, 64, &Count, 10) == 0);
+    for (Index = 0; Index < 4; ++Index) {
+        assert(pthread_create(&Threads[Index],
+                              NULL,
+                              StressBufferPool,
+                              &Pool) == 0);
+    }
+
+    for (Index = 0; Index < 4; ++Index) {
+        pthread_join(Threads[Index], NULL);
+    }
+
+    for (Index = 0; Index < 10; ++Index) {
+        assert(TakePoolBuffer(&Pool) != NULL);
+    }
+
+    assert(TakePoolBuffer(&Pool) == NULL);
+    FreeBufferPool(&Pool);
+    printf("TestBufferPool finished.\n");
+}
+
+void
+TestDigest(
+    void
+    )
+{
+    size_t BlockCount;
+    size_t ChunkSize;
+    byte * Cipher;
+    uint32_t Crc;
+    CRC_TABLE * CrcTable;
+    DIGEST Digest;
+    uint32_t Expected;
+    size_t Index;
+    uint32_t Input;
+    int Kernel;
+    byte Key[29];
+    KEY_TABLE KeyTable;
+    uint64_t Length;
+    size_t Lengths[64];
+    size_t Offsets[64];
+    uint32_t Output;
+    byte * Plain;
+    CRC_ROUTINE Reference;
+    size_t Size;
+    size_t Start;
+    size_t Swap;
+    byte * Working;
+
+    printf("Test digest\n");
+
+    CrcTable = malloc(sizeof(CRC_TABLE));
+    assert(CrcTable != NULL);
+    BuildCrcTable(CrcTable);
+    Size = (3 * DIGEST_CHUNK) + (5 * CRC_LANE) + 4000;
+    Plain = malloc(Size + 1);
+    Cipher = malloc(Size + 1);
+    Working = malloc(Size + 1);
+    assert((Plain != NULL) && (Cipher != NULL) && (Working != NULL));
+    for (Index = 0; Index < Size; ++Index) {
+        Plain[Index] = rand();
+    }
+
+    //
+    // Every supported kernel should give the check value, and agree with the
+    // scalar kernel, which is last, at every alignment and across the lanes.
+    //
+
+    Reference = CrcKernels[CrcKernelCount - 1].Update;
+    for (Kernel = 0; Kernel < CrcKernelCount; ++Kernel) {
+        if (CrcKernels[Kernel].IsSupported() == 0) {
+            printf("Kernel %s is not supported\n", CrcKernels[Kernel].Name);
+            continue;
+        }
+
+        printf("Kernel %s\n", CrcKernels[Kernel].Name);
+        assert(CrcKernels[Kernel].Update(CrcTable,
+                                         0,
+                                         (byte const *)"123456789",
+                                         9) == 0xe3069283);
+
+        for (Start = 0; Start < 9; ++Start) {
+            for (Index = 0; Index < 200; ++Index) {
+                Length = rand() % (Size - Start);
+                Expected = Reference(CrcTable, 0, Plain + Start, Length);
+
+                Crc = CrcKernels[Kernel].Update(CrcTable,
+                                                0,
+                                                Plain + Start,
+                                                Length);
+
+                assert(Crc == Expected);
+            }
+        }
+
+        Crc = CrcKernels[Kernel].Update(CrcTable, 0, Plain, 1000);
+        Crc = CrcKernels[Kernel].Update(CrcTable, Crc, Plain + 1000, 9000);
+        assert(Crc == UpdateCrc32c(CrcTable, 0, Plain, 10000));
+    }
+
+    //
+    // Blocks digested in any order, from any starting offset, should give
+    // the CRCs of the whole input and output, and of each chunk, whether or
+    // not the chunks line up with the blocks.
+    //
+
+    for (Index = 0; Index < sizeof(Key); ++Index) {
+        Key[Index] = rand();
+    }
+
+    assert(BuildKeyTable(Key, sizeof(Key), &KeyTable) == 0);
+    for (Start = 0; Start < 3 * 1000 * 1000 * 1000ULL; Start += 999999937) {
+        ChunkSize = (rand() % (3 * DIGEST_CHUNK)) + 1;
+        memcpy(Cipher, Plain, Size);
+        assert(Encrypt(Cipher, Size, Start, &KeyTable) == 0);
+        BlockCount = 0;
+        for (Index = 0; Index < Size; Index += Lengths[BlockCount - 1]) {
+            assert(BlockCount < 64);
+            Offsets[BlockCount] = Index;
+            Lengths[BlockCount] = (rand() % (2 * DIGEST_CHUNK)) + 1;
+            if (Lengths[BlockCount] > Size - Index) {
+                Lengths[BlockCount] = Size - Index;
+            }
+
+            BlockCount += 1;
+        }
+
+        for (Index = BlockCount - 1; Index > 0; --Index) {
+            Swap = rand() % (Index + 1);
+            Length = Offsets[Index];
+            Offsets[Index] = Offsets[Swap];
+            Offsets[Swap] = Length;
+            Length = Lengths[Index];
+            Lengths[Index] = Lengths[Swap];
+            Lengths[Swap] = Length;
+        }
+
+        assert(InitializeDigest(&Digest,
+                                CrcTable,
+                                Start,
+                                DIGEST_STREAM | DIGEST_CHUNKS,
+                                ChunkSize) == 0);
+        memcpy(Working, Plain, Size);
+        for (Index = 0; Index < BlockCount; ++Index) {
+            assert(EncryptAndDigest(&Digest,
+                                    Working + Offsets[Index],
+                                    Working + Offsets[Index],
+                                    Lengths[Index],
+                                    Start + Offsets[Index],
+                                    &KeyTable) == 0);
+        }
+
+        assert(memcmp(Working, Cipher, Size) == 0);
+        GetDigest(&Digest, &Input, &Output, &Length);
+        assert(Length == Size);
+        assert(Input == UpdateCrc32c(CrcTable, 0, Plain, Size));
+        assert(Output == UpdateCrc32c(CrcTable, 0, Cipher, Size));
+        for (Index = 0; Index * ChunkSize < Size; ++Index) {
+            Length = Size - (Index * ChunkSize);
+            if (Length > ChunkSize) {
+                Length = ChunkSize;
+            }
+
+            assert(GetChunkChecksum(&Digest, Index) ==
+                   UpdateCrc32c(CrcTable,
+                                0,
+                                Cipher + (Index * ChunkSize),
+                                Length));
+        }
+
+        FreeDigest(&Digest);
+    }
+
+    assert(InitializeDigest(&Digest, CrcTable, 12345, DIGEST_STREAM, 0) == 0);
+    GetDigest(&Digest, &Input, &Output, &Length);
+    assert((Input == 0) && (Output == 0) && (Length == 0));
+    FreeKeyTable(&KeyTable);
+    free(CrcTable);
+    free(Plain);
+    free(Cipher);
+    free(Working);
+    printf("TestDigest finished.\n");
+}
+
+void
+TestContainer(
+    void
+    )
+{
+    size_t Chunk;
+    CONTAINER Container;
+    CRC_TABLE * CrcTable;
+    DIGEST Digest;
+    byte * Extracted;
+    size_t Index;
+    FILE * Input;
+    IO_SYNCHRONIZATION_BLOCK IoSyncBlock;
+    byte Key[13];
+    KEY_TABLE KeyTable;
+    uint64_t Length;
+    OPTIONS Options;
+    FILE * Output;
+    byte * Plain;
+    BUFFER_POOL Pool;
+    size_t Size;
+    uint64_t Start;
+    byte * Working;
+    WORKER_CONTEXT WorkerContext;
+
+    printf("Test container\n");
+
+    CrcTable = malloc(sizeof(CRC_TABLE));
+    assert(CrcTable != NULL);
+    BuildCrcTable(CrcTable);
+    Size = 100 * 1000;
+    Plain = malloc(Size);
+    Working = malloc(Size);
+    Extracted = malloc(Size + 1);
+    assert((Plain != NULL) && (Working != NULL) && (Extracted != NULL));
+    for (Index = 0; Index < Size; ++Index) {
+        Plain[Index] = rand();
+    }
+
+    for (Index = 0; Index < sizeof(Key); ++Index) {
+        Key[Index] = rand();
+    }
+
+    assert(BuildKeyTable(Key, sizeof(Key), &KeyTable) == 0);
+
+    //
+    // Write a container of a stream starting part way into the keystream,
+    // encrypting it in blocks that don't line up with the chunks.
+    //
+
+    Start = 12345;
+    memset(&Container, 0, sizeof(Container));
+    Container.Table = CrcTable;
+    Container.KeyFingerprint = UpdateCrc32c(CrcTable, 0, Key, sizeof(Key));
+    Container.ChunkSize = 4096;
+    Container.StreamOffset = Start;
+    assert(InitializeDigest(&Digest,
+                            CrcTable,
+                            Start,
+                            DIGEST_CHUNKS,
+                            Container.ChunkSize) == 0);
+
+    Input = tmpfile();
+    assert(Input != NULL);
+    assert(WriteContainerHeader(&Container, Input) == 0);
+    for (Index = 0; Index < Size; Index += 3000) {
+        Length = Size - Index;
+        if (Length > 3000) {
+            Length = 3000;
+        }
+
+        assert(EncryptAndDigest(&Digest,
+                                Working + Index,
+                                Plain + Index,
+                                Length,
+                                Start + Index,
+                                &KeyTable) == 0);
+    }
+
+    assert(fwrite(Working, 1, Size, Input) == Size);
+    assert(WriteContainerIndex(&Container, &Digest, Input) == 0);
+    assert(Container.ChunkCount == (Size + 4095) / 4096);
+    assert(ftell(Input) == CONTAINER_HEADER_SIZE + Size +
+                           (Container.ChunkCount * CONTAINER_ENTRY_SIZE) +
+                           CONTAINER_TRAILER_SIZE);
+
+    FreeDigest(&Digest);
+
+    //
+    // Any range, extracted on any number of threads, should come back as
+    // the plaintext.
+    //
+
+    memset(&Options, 0, sizeof(Options));
+    memset(&IoSyncBlock, 0, sizeof(IoSyncBlock));
+    memset(&WorkerContext, 0, sizeof(WorkerContext));
+    InitializeBufferPool(&Pool, 0, 0);
+    IoSyncBlock.InputStream = Input;
+    WorkerContext.IoSyncBlock = &IoSyncBlock;
+    WorkerContext.Options = &Options;
+    WorkerContext.KeyTable = &KeyTable;
+    WorkerContext.BufferPool = &Pool;
+    WorkerContext.Container = &Container;
+    for (Chunk = 0; Chunk < 20; ++Chunk) {
+        Options.ThreadCount = (Chunk % 4) + 1;
+        Options.RangeOffset = Start + (rand() % Size);
+        Options.RangeLength = rand() % 20000;
+        if (Chunk == 0) {
+            Options.RangeOffset = Start;
+            Options.RangeLength = UINT64_MAX;
+        }
+
+        Length = Start + Size - Options.RangeOffset;
+        if (Length > Options.RangeLength) {
+            Length = Options.RangeLength;
+        }
+
+        memset(&Container, 0, sizeof(Container));
+        Container.Table = CrcTable;
+        Container.KeyFingerprint = UpdateCrc32c(CrcTable,
+                                                0,
+                                                Key,
+                                                sizeof(Key));
+
+        Output = tmpfile();
+        assert(Output != NULL);
+        IoSyncBlock.OutputStream = Output;
+        rewind(Input);
+        assert(RunExtract(&WorkerContext) == 0);
+        assert(ftell(Output) == Length);
+        rewind(Output);
+        assert(fread(Extracted, 1, Size + 1, Output) == Length);
+        assert(memcmp(Extracted,
+                      Plain + (Options.RangeOffset - Start),
+                      Length) == 0);
+
+        fclose(Output);
+    }
+
+    //
+    // A range before the stream, or a container written with another key,
+    // should be refused.
+    //
+
+    Options.RangeOffset = Start - 1;
+    Options.RangeLength = 1;
+    rewind(Input);
+    assert(RunExtract(&WorkerContext) != 0);
+    Container.KeyFingerprint += 1;
+    Options.RangeOffset = Start;
+    rewind(Input);
+    assert(RunExtract(&WorkerContext) != 0);
+
+    fclose(Input);
+    FreeBufferPool(&Pool);
+    FreeKeyTable(&KeyTable);
+    free(CrcTable);
+    free(Plain);
+    free(Working);
+    free(Extracted);
+    printf("TestContainer finished.\n");
+}
+
+void
+TestCheckpoint(
+    void
+    )
+{
+    CHECKPOINT Checkpoint;
+    char FileName[] = "/tmp/xorcrypt-checkpoint-XXXXXX";
+    int FileDescriptor;
+    IO_SYNCHRONIZATION_BLOCK IoSyncBlock;
+    byte Key[13];
+    OPTIONS Options;
+    FILE * Output;
+    byte Padding[5000];
+    WORKER_CONTEXT WorkerContext;
+
+    printf("Test checkpoint\n");
+
+    memset(Key, 0x5a, sizeof(Key));
+    memset(Padding, 0, sizeof(Padding));
+    FileDescriptor = mkstemp(FileName);
+    assert(FileDescriptor >= 0);
+    close(FileDescriptor);
+    Output = tmpfile();
+    assert(Output != NULL);
+    assert(fwrite(Padding, 1, 100, Output) == 100);
+    fflush(Output);
+
+    //
+    // A fresh run records nothing done. A failed one records how far the
+    // output was written.
+    //
+
+    memset(&Options, 0, sizeof(Options));
+    Options.RangeOffset = 1000;
+    Options.RangeLength = UINT64_MAX;
+    Options.CheckpointFileName = FileName;
+    assert(OpenCheckpoint(&Checkpoint, &Options, Key, sizeof(Key), Output) ==
+           0);
+
+    memset(&IoSyncBlock, 0, sizeof(IoSyncBlock));
+    memset(&WorkerContext, 0, sizeof(WorkerContext));
+    WorkerContext.IoSyncBlock = &IoSyncBlock;
+    IoSyncBlock.WriteOffset = 1000;
+    StartCheckpoint(&Checkpoint, &WorkerContext);
+    assert(fwrite(Padding, 1, 4096, Output) == 4096);
+    fflush(Output);
+    IoSyncBlock.WriteOffset += 4096;
+    FinishCheckpoint(&Checkpoint, 1);
+
+    //
+    // Resuming picks up after what was recorded, at the output position the
+    // first run started from.
+    //
+
+    rewind(Output);
+    Options.Resume = 1;
+    assert(OpenCheckpoint(&Checkpoint, &Options, Key, sizeof(Key), Output) ==
+           0);
+
+    assert(Options.RangeOffset == 1000 + 4096);
+    assert(Options.RangeLength == UINT64_MAX);
+    assert(lseek(fileno(Output), 0, SEEK_CUR) == 100 + 4096);
+    free(Checkpoint.TemporaryName);
+
+    //
+    // Another key, or a different range, is refused.
+    //
+
+    Options.RangeOffset = 1000;
+    Key[0] ^= 1;
+    assert(OpenCheckpoint(&Checkpoint, &Options, Key, sizeof(Key), Output) !=
+           0);
+
+    free(Checkpoint.TemporaryName);
+    Key[0] ^= 1;
+    Options.RangeOffset = 1001;
+    assert(OpenCheckpoint(&Checkpoint, &Options, Key, sizeof(Key), Output) !=
+           0);
+
+    free(Checkpoint.TemporaryName);
+
+    //
+    // A run that succeeds removes the checkpoint.
+    //
+
+    Options.RangeOffset = 1000;
+    assert(OpenCheckpoint(&Checkpoint, &Options, Key, sizeof(Key), Output) ==
+           0);
+
+    StartCheckpoint(&Checkpoint, &WorkerContext);
+    FinishCheckpoint(&Checkpoint, 0);
+    assert(access(FileName, F_OK) != 0);
+    fclose(Output);
+    printf("TestCheckpoint finished.\n");
+}
+
+void
+TestShard(
+    void
+    )
+{
+    int Count;
+    uint32_t Crc;
+    CRC_TABLE * CrcTable;
+    int Index;
+    uint64_t Length;
+    uint64_t Next;
+    uint64_t Offset;
+    byte * Plain;
+    size_t Size;
+    size_t Split;
+    uint64_t StreamLength;
+    uint64_t const StreamLengths[] = {0, 1, SHARD_ALIGNMENT - 1,
+                                      SHARD_ALIGNMENT, 3000000,
+                                      1000ULL * 1000 * 1000 * 1000 + 7};
+
+    printf("Test shard\n");
+
+    assert((ParseShard("1/1", &Index, &Count) == 0) &&
+           (Index == 1) && (Count == 1));
+
+    assert((ParseShard("3/8", &Index, &Count) == 0) &&
+           (Index == 3) && (Count == 8));
+
+    assert(ParseShard("0/8", &Index, &Count) != 0);
+    assert(ParseShard("9/8", &Index, &Count) != 0);
+    assert(ParseShard("1/", &Index, &Count) != 0);
+    assert(ParseShard("/8", &Index, &Count) != 0);
+    assert(ParseShard("1/8x", &Index, &Count) != 0);
+    assert(ParseShard("-1/8", &Index, &Count) != 0);
+
+    //
+    // The shards should cover the stream in order, each starting on an
+    // aligned offset, however many there are.
+    //
+
+    for (Index = 0;
+         Index < sizeof(StreamLengths) / sizeof(StreamLengths[0]);
+         ++Index) {
+
+        StreamLength = StreamLengths[Index];
+        for (Count = 1; Count < 40; Count += 3) {
+            Next = 0;
+            for (Split = 1; Split <= Count; ++Split) {
+                GetShardRange(Split, Count, StreamLength, &Offset, &Length);
+                assert(Offset == Next);
+                assert((Length == 0) ||
+                       ((Offset % SHARD_ALIGNMENT) == 0));
+
+                Next = Offset + Length;
+            }
+
+            assert(Next == StreamLength);
+        }
+    }
+
+    //
+    // The CRCs of pieces should combine into the CRC of the whole.
+    //
+
+    CrcTable = malloc(sizeof(CRC_TABLE));
+    assert(CrcTable != NULL);
+    BuildCrcTable(CrcTable);
+    Size = 100000;
+    Plain = malloc(Size);
+    assert(Plain != NULL);
+    for (Split = 0; Split < Size; ++Split) {
+        Plain[Split] = rand();
+    }
+
+    for (Index = 0; Index < 100; ++Index) {
+        Split = rand() % (Size + 1);
+        Crc = CombineCrc32c(CrcTable,
+                            UpdateCrc32c(CrcTable, 0, Plain, Split),
+                            UpdateCrc32c(CrcTable,
+                                         0,
+                                         Plain + Split,
+                                         Size - Split),
+                            Size - Split);
+
+        assert(Crc == UpdateCrc32c(CrcTable, 0, Plain, Size));
+    }
+
+    free(Plain);
+    free(CrcTable);
+    printf("TestShard finished.\n");
+}
+
+void
+TestDirect(
+    void
+    )
+{
+    byte * Expected;
+    POSITIONAL_ENGINE Engine;
+    size_t Index;
+    FILE * Input;
+    byte Key[13];
+    KEY_TABLE KeyTable;
+    uint64_t Length;
+    OPTIONS Options;
+    FILE * Output;
+    byte * Plain;
+    BUFFER_POOL Pool;
+    uint64_t Position;
+    byte * Read;
+    size_t Size;
+    WORKER_CONTEXT WorkerContext;
+
+    printf("Test direct\n");
+
+    //
+    // The input ends off the alignment, so the last block of a run to the
+    // end of the file has an unaligned tail.
+    //
+
+    Size = 5 * 16384 + 1000;
+    Plain = malloc(Size);
+    Expected = malloc(Size);
+    Read = malloc(Size);
+    assert((Plain != NULL) && (Expected != NULL) && (Read != NULL));
+    for (Index = 0; Index < Size; ++Index) {
+        Plain[Index] = rand();
+    }
+
+    for (Index = 0; Index < sizeof(Key); ++Index) {
+        Key[Index] = rand();
+    }
+
+    assert(BuildKeyTable(Key, sizeof(Key), &KeyTable) == 0);
+    Input = tmpfile();
+    assert(Input != NULL);
+    assert(fwrite(Plain, 1, Size, Input) == Size);
+    fflush(Input);
+
+    memset(&Options, 0, sizeof(Options));
+    memset(&WorkerContext, 0, sizeof(WorkerContext));
+    InitializeBufferPool(&Pool, 0, 0);
+    Options.BlockSize = 16384;
+    Options.Direct = 1;
+    WorkerContext.Options = &Options;
+    WorkerContext.KeyTable = &KeyTable;
+    WorkerContext.BufferPool = &Pool;
+    for (Index = 0; Index < 6; ++Index) {
+        Options.ThreadCount = (Index % 3) + 1;
+        Position = (Index / 2) * DIRECT_ALIGNMENT;
+        Length = Size - Position;
+        if ((Index % 2) != 0) {
+            Length -= 3000;
+        }
+
+        Output = tmpfile();
+        assert(Output != NULL);
+        memset(&Engine, 0, sizeof(Engine));
+        Engine.WorkerContext = &WorkerContext;
+        Engine.InputFd = fileno(Input);
+        Engine.InputPosition = Position;
+        Engine.OutputFd = fileno(Output);
+        Engine.OutputPosition = Position;
+        Engine.StreamOffset = Position;
+        Engine.Length = UINT64_MAX;
+        if ((Index % 2) != 0) {
+            Engine.Length = Length;
+        }
+
+        assert(InitializePositionalEngine(&Engine) == 0);
+
+        //
+        // Not every file system supports direct I/O.
+        //
+
+        if (EnableDirectIo(&Engine) != 0) {
+            printf("Direct I/O isn't supported here, skipping.\n");
+            FreePositionalEngine(&Engine);
+            fclose(Output);
+            break;
+        }
+
+        TransferPositional(&Engine);
+        assert(atomic_load(&Engine.EndOffset) == Length);
+        FreePositionalEngine(&Engine);
+        assert(EncryptAndDigest(NULL,
+                                Expected,
+                                Plain + Position,
+                                Length,
+                                Position,
+                                &KeyTable) == 0);
+
+        assert(pread(fileno(Output), Read, Size, Position) == Length);
+        assert(memcmp(Read, Expected, Length) == 0);
+        fclose(Output);
+    }
+
+    //
+    // A position off the alignment is refused.
+    //
+
+    memset(&Engine, 0, sizeof(Engine));
+    Engine.WorkerContext = &WorkerContext;
+    Engine.InputFd = fileno(Input);
+    Engine.OutputFd = fileno(Input);
+    Engine.InputPosition = 1000;
+    Engine.OutputPosition = 1000;
+    assert(InitializePositionalEngine(&Engine) == 0);
+    assert(EnableDirectIo(&Engine) != 0);
+    FreePositionalEngine(&Engine);
+
+    fclose(Input);
+    FreeBufferPool(&Pool);
+    FreeKeyTable(&KeyTable);
+    free(Plain);
+    free(Expected);
+    free(Read);
+    printf("TestDirect finished.\n");
+}
+
 int main(int argc, char* argv[])
 {
     TestIterateKey();
+    TestIterateKeyLengths();
+    TestXorKernels();
+    TestEncrypt();
+    TestGenerateKeystream();
+    TestParseOffset();
+    TestLatencyBuckets();
+    TestStatsThreads();
+    TestParseCpuList();
+    TestLibrary();
+    TestBufferPool();
+    TestDigest();
+    TestContainer();
+    TestCheckpoint();
+    TestShard();
+    TestDirect();
     printf("Done.\n");
     return 0;
 }
@@ -0,0 +1,789 @@
+/*++
+
+Description:
+
+    This module implements the io_uring engine. The positional engine keeps
+    one I/O in flight per thread, since each thread blocks in pread() or
+    pwrite() until its block is done. Devices with deep queues need many
+    more outstanding requests than there are threads to reach their
+    bandwidth.
+
+    Here each thread owns a submission ring and a set of block slots, and
+    keeps a read or a write in flight for every slot at once. Blocks are
+    claimed from the range just as the positional engine claims them, with an
+    atomic increment, so the threads share the range with no other
+    coordination. When a read completes, the thread encrypts the block and
+    submits its write at the same relative position in the output. When the
+    write completes, the slot claims the next block. Threads only ever block
+    waiting for completions.
+
+    Slot buffers are registered with the ring as fixed buffers, which saves
+    the kernel from mapping them on every request. If the registration is
+    refused, for instance by the locked memory limit, plain reads and writes
+    are used instead. With --direct, the requests are aligned just as the
+    positional engine aligns its own.
+
+    The rings are driven with raw system calls, so no library is needed. If
+    the kernel doesn't support io_uring, or won't allow it, the engine
+    reports that it doesn't apply, and the caller falls back to the
+    positional or stream engine.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "homework.h"
+
+#define URING_DEFAULT_DEPTH 16
+
+typedef struct _URING {
+    int Fd;
+    _Atomic unsigned int * SqTail;
+    unsigned int SqMask;
+    unsigned int * SqArray;
+    struct io_uring_sqe * Sqes;
+    _Atomic unsigned int * CqHead;
+    _Atomic unsigned int * CqTail;
+    unsigned int CqMask;
+    struct io_uring_cqe * Cqes;
+    void * SqRing;
+    size_t SqRingSize;
+    void * CqRing;
+    size_t CqRingSize;
+    size_t SqesSize;
+    unsigned int Unsubmitted;
+} URING;
+
+typedef struct _URING_SLOT {
+    byte * Buffer;
+    uint64_t Offset;
+    size_t Wanted;
+    size_t Length;
+    size_t Done;
+    uint64_t ReadTime;
+    int Writing;
+} URING_SLOT;
+
+typedef struct _URING_WORKER {
+    POSITIONAL_ENGINE * Engine;
+    KEY_TABLE const * KeyTable;
+    int Index;
+    URING Ring;
+    URING_SLOT * Slots;
+    int Depth;
+    int FixedBuffers;
+    int Exhausted;
+} URING_WORKER;
+
+static
+int
+SetupRing(
+    URING * Ring,
+    unsigned int Entries
+    )
+
+/*++
+
+Description:
+
+    This routine creates a ring and maps its queues.
+
+Arguments:
+
+    Ring - Supplies the ring to set up.
+
+    Entries - Supplies the number of submission queue entries needed.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the kernel won't provide a
+    ring. Nothing is left to clean up in the latter case.
+
+--*/
+
+{
+
+    byte * CqRing;
+    struct io_uring_params Parameters;
+    byte * SqRing;
+
+    memset(Ring, 0, sizeof(URING));
+    memset(&Parameters, 0, sizeof(Parameters));
+    Ring->Fd = syscall(__NR_io_uring_setup, Entries, &Parameters);
+    if (Ring->Fd < 0) {
+        return 1;
+    }
+
+    Ring->SqRingSize = Parameters.sq_off.array +
+                       Parameters.sq_entries * sizeof(unsigned int);
+
+    Ring->CqRingSize = Parameters.cq_off.cqes +
+                       Parameters.cq_entries * sizeof(struct io_uring_cqe);
+
+    Ring->SqesSize = Parameters.sq_entries * sizeof(struct io_uring_sqe);
+    Ring->SqRing = mmap(NULL,
+                        Ring->SqRingSize,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        Ring->Fd,
+                        IORING_OFF_SQ_RING);
+
+    Ring->CqRing = mmap(NULL,
+                        Ring->CqRingSize,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        Ring->Fd,
+                        IORING_OFF_CQ_RING);
+
+    Ring->Sqes = mmap(NULL,
+                      Ring->SqesSize,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,
+                      Ring->Fd,
+                      IORING_OFF_SQES);
+
+    if ((Ring->SqRing == MAP_FAILED) ||
+        (Ring->CqRing == MAP_FAILED) ||
+        (Ring->Sqes == MAP_FAILED)) {
+
+        if (Ring->SqRing != MAP_FAILED) {
+            munmap(Ring->SqRing, Ring->SqRingSize);
+        }
+
+        if (Ring->CqRing != MAP_FAILED) {
+            munmap(Ring->CqRing, Ring->CqRingSize);
+        }
+
+        if (Ring->Sqes != MAP_FAILED) {
+            munmap(Ring->Sqes, Ring->SqesSize);
+        }
+
+        close(Ring->Fd);
+        return 1;
+    }
+
+    SqRing = Ring->SqRing;
+    Ring->SqTail = (_Atomic unsigned int *)(SqRing + Parameters.sq_off.tail);
+    Ring->SqMask = *(unsigned int *)(SqRing + Parameters.sq_off.ring_mask);
+    Ring->SqArray = (unsigned int *)(SqRing + Parameters.sq_off.array);
+    CqRing = Ring->CqRing;
+    Ring->CqHead = (_Atomic unsigned int *)(CqRing + Parameters.cq_off.head);
+    Ring->CqTail = (_Atomic unsigned int *)(CqRing + Parameters.cq_off.tail);
+    Ring->CqMask = *(unsigned int *)(CqRing + Parameters.cq_off.ring_mask);
+    Ring->Cqes = (struct io_uring_cqe *)(CqRing + Parameters.cq_off.cqes);
+    return 0;
+}
+
+static
+void
+TeardownRing(
+    URING * Ring
+    )
+
+/*++
+
+Description:
+
+    This routine unmaps and closes a ring.
+
+Arguments:
+
+    Ring - Supplies the ring.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    munmap(Ring->Sqes, Ring->SqesSize);
+    munmap(Ring->CqRing, Ring->CqRingSize);
+    munmap(Ring->SqRing, Ring->SqRingSize);
+    close(Ring->Fd);
+}
+
+static
+void
+QueueTransfer(
+    URING_WORKER * Worker,
+    int Index
+    )
+
+/*++
+
+Description:
+
+    This routine queues the rest of a slot's current read or write. The ring
+    holds at least one entry per slot, and each slot has at most one request
+    outstanding, so there is always room.
+
+Arguments:
+
+    Worker - Supplies the thread's state.
+
+    Index - Supplies the slot index.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    POSITIONAL_ENGINE * Engine;
+    URING * Ring;
+    URING_SLOT * Slot;
+    struct io_uring_sqe * Sqe;
+    unsigned int Tail;
+
+    Engine = Worker->Engine;
+    Ring = &Worker->Ring;
+    Slot = &Worker->Slots[Index];
+    Tail = atomic_load_explicit(Ring->SqTail, memory_order_relaxed);
+    Sqe = &Ring->Sqes[Tail & Ring->SqMask];
+    memset(Sqe, 0, sizeof(struct io_uring_sqe));
+    Sqe->addr = (uintptr_t)(Slot->Buffer + Slot->Done);
+    Sqe->len = Slot->Length - Slot->Done;
+    Sqe->user_data = Index;
+    if (Slot->Writing != 0) {
+        Sqe->opcode = IORING_OP_WRITE;
+        Sqe->fd = Engine->OutputFd;
+        Sqe->off = Engine->OutputPosition + Slot->Offset + Slot->Done;
+
+    } else {
+        Sqe->opcode = IORING_OP_READ;
+        Sqe->fd = Engine->InputFd;
+        Sqe->off = Engine->InputPosition + Slot->Offset + Slot->Done;
+    }
+
+    if (Worker->FixedBuffers != 0) {
+        Sqe->opcode = (Slot->Writing != 0) ? IORING_OP_WRITE_FIXED :
+                                             IORING_OP_READ_FIXED;
+
+        Sqe->buf_index = Index;
+    }
+
+    Ring->SqArray[Tail & Ring->SqMask] = Tail & Ring->SqMask;
+    atomic_store_explicit(Ring->SqTail, Tail + 1, memory_order_release);
+    Ring->Unsubmitted += 1;
+}
+
+static
+int
+StartBlock(
+    URING_WORKER * Worker,
+    int Index
+    )
+
+/*++
+
+Description:
+
+    This routine claims the next block of the range for a slot, and queues
+    its read.
+
+Arguments:
+
+    Worker - Supplies the thread's state.
+
+    Index - Supplies the index of an idle slot.
+
+Return Value:
+
+    Returns non-zero if a read was queued, or zero if the range is exhausted.
+
+--*/
+
+{
+
+    size_t BlockSize;
+    POSITIONAL_ENGINE * Engine;
+    uint64_t Offset;
+    URING_SLOT * Slot;
+
+    if (Worker->Exhausted != 0) {
+        return 0;
+    }
+
+    Engine = Worker->Engine;
+    BlockSize = Engine->WorkerContext->Options->BlockSize;
+    Offset = atomic_fetch_add(&Engine->NextOffset, BlockSize);
+    if (Offset >= Engine->Length) {
+        Worker->Exhausted = 1;
+        return 0;
+    }
+
+    Slot = &Worker->Slots[Index];
+    Slot->Offset = Offset;
+    Slot->Wanted = BlockSize;
+    if (Slot->Wanted > Engine->Length - Offset) {
+        Slot->Wanted = Engine->Length - Offset;
+    }
+
+    //
+    // A direct read must be a whole multiple of the alignment, and the slot
+    // buffer has room for the rounded up length.
+    //
+
+    Slot->Length = Slot->Wanted;
+    if (Engine->Direct != 0) {
+        Slot->Length = (Slot->Length + DIRECT_ALIGNMENT - 1) &
+                       ~(size_t)(DIRECT_ALIGNMENT - 1);
+    }
+
+    Slot->Done = 0;
+    Slot->Writing = 0;
+    Slot->ReadTime = StartStatsTimer();
+    QueueTransfer(Worker, Index);
+    return 1;
+}
+
+static
+int
+CompleteTransfer(
+    URING_WORKER * Worker,
+    int Index,
+    int Result
+    )
+
+/*++
+
+Description:
+
+    This routine moves a slot on once its request completes. A finished read
+    is encrypted and written, a finished write makes way for the next block,
+    and a short transfer is resumed where it stopped.
+
+Arguments:
+
+    Worker - Supplies the thread's state.
+
+    Index - Supplies the slot index.
+
+    Result - Supplies the result of the request.
+
+Return Value:
+
+    Returns non-zero if the slot has another request queued, or zero if it is
+    idle.
+
+--*/
+
+{
+
+    POSITIONAL_ENGINE * Engine;
+    URING_SLOT * Slot;
+    uint64_t Start;
+
+    Engine = Worker->Engine;
+    Slot = &Worker->Slots[Index];
+    if ((Result == -EINTR) || (Result == -EAGAIN)) {
+        QueueTransfer(Worker, Index);
+        return 1;
+    }
+
+    if (Slot->Writing == 0) {
+        if (Result < 0) {
+            ErrorExit(-Result, "An error occured while reading the input\n");
+        }
+
+        //
+        // A direct read that ends off the alignment has reached the end of
+        // the file, since the next one would have to start there.
+        //
+
+        Slot->Done += Result;
+        if ((Result > 0) &&
+            (Slot->Done < Slot->Length) &&
+            ((Engine->Direct == 0) ||
+             ((Slot->Done % DIRECT_ALIGNMENT) == 0))) {
+
+            QueueTransfer(Worker, Index);
+            return 1;
+        }
+
+        //
+        // A read that comes up short has found the end of the input.
+        //
+
+        if (Slot->Done < Slot->Wanted) {
+            Worker->Exhausted = 1;
+            Slot->Wanted = Slot->Done;
+            if (Slot->Wanted == 0) {
+                return 0;
+            }
+        }
+
+        Start = StartStatsTimer();
+        if (EncryptAndDigest(Engine->WorkerContext->Digest,
+                             Slot->Buffer,
+                             Slot->Buffer,
+                             Slot->Wanted,
+                             Engine->StreamOffset + Slot->Offset,
+                             Worker->KeyTable) != 0) {
+
+            exit(1);
+        }
+
+        StopStatsTimer(STAT_ENCRYPT, Start);
+
+        Slot->Writing = 1;
+        Slot->Done = 0;
+        Slot->Length = WriteDirectTail(Engine,
+                                       Slot->Buffer,
+                                       Slot->Wanted,
+                                       Slot->Offset);
+
+        if (Slot->Length != 0) {
+            QueueTransfer(Worker, Index);
+            return 1;
+        }
+
+    } else {
+        if (Result <= 0) {
+            ErrorExit((Result < 0) ? -Result : EIO, "Stream write failed\n");
+        }
+
+        Slot->Done += Result;
+        if (Slot->Done < Slot->Length) {
+            QueueTransfer(Worker, Index);
+            return 1;
+        }
+    }
+
+    RecordStatsLatency(Slot->ReadTime, StartStatsTimer());
+    CountStat(STAT_BLOCKS, 1);
+    CountStat(STAT_BYTES, Slot->Wanted);
+    RecordPositionalEnd(Engine, Slot->Offset + Slot->Wanted);
+    return StartBlock(Worker, Index);
+}
+
+static
+void *
+UringWorkerRoutine(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine keeps every slot of a thread's ring busy until the range is
+    exhausted and the last write has completed.
+
+Arguments:
+
+    Context - Supplies the thread's state.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    struct io_uring_cqe * Cqe;
+    unsigned int Head;
+    int InFlight;
+    int Index;
+    int Result;
+    URING * Ring;
+    uint64_t Start;
+    unsigned int Tail;
+    URING_WORKER * Worker;
+
+    Worker = (URING_WORKER *)Context;
+    Ring = &Worker->Ring;
+    Worker->KeyTable = PlaceWorkerThread(Worker->Engine->WorkerContext,
+                                         Worker->Index);
+
+    AttachStatsThread("uring", Worker->Index);
+    InFlight = 0;
+    for (Index = 0; Index < Worker->Depth; ++Index) {
+        InFlight += StartBlock(Worker, Index);
+    }
+
+    while (InFlight > 0) {
+
+        //
+        // Submit whatever has been queued, and wait for at least one
+        // completion. The time spent here is charged as a stage wait.
+        //
+
+        Start = StartStatsTimer();
+        Result = syscall(__NR_io_uring_enter,
+                         Ring->Fd,
+                         Ring->Unsubmitted,
+                         1,
+                         IORING_ENTER_GETEVENTS,
+                         NULL,
+                         0);
+
+        StopStatsTimer(STAT_STAGE_WAIT, Start);
+        if (Result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            ErrorExit(errno, "Failure submitting I/O\n");
+        }
+
+        Ring->Unsubmitted -= Result;
+        Head = atomic_load_explicit(Ring->CqHead, memory_order_relaxed);
+        Tail = atomic_load_explicit(Ring->CqTail, memory_order_acquire);
+        while (Head != Tail) {
+            Cqe = &Ring->Cqes[Head & Ring->CqMask];
+            Index = Cqe->user_data;
+            Result = Cqe->res;
+            Head += 1;
+            atomic_store_explicit(Ring->CqHead, Head, memory_order_release);
+            if (CompleteTransfer(Worker, Index, Result) == 0) {
+                InFlight -= 1;
+            }
+        }
+    }
+
+    DetachStatsThread();
+    return NULL;
+}
+
+static
+int
+SetupWorker(
+    URING_WORKER * Worker,
+    POSITIONAL_ENGINE * Engine,
+    int Depth
+    )
+
+/*++
+
+Description:
+
+    This routine sets up a thread's ring and slots.
+
+Arguments:
+
+    Worker - Supplies the thread's state to set up.
+
+    Engine - Supplies the positional engine that shares out the range.
+
+    Depth - Supplies the number of slots.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero if the kernel won't provide a
+    ring.
+
+--*/
+
+{
+
+    size_t BlockSize;
+    BUFFER_POOL * BufferPool;
+    int Index;
+    struct iovec * Vectors;
+
+    Worker->Engine = Engine;
+    Worker->Depth = Depth;
+    Worker->Exhausted = 0;
+    if (SetupRing(&Worker->Ring, Depth) != 0) {
+        return 1;
+    }
+
+    BlockSize = Engine->WorkerContext->Options->BlockSize;
+    BufferPool = Engine->WorkerContext->BufferPool;
+    Worker->Slots = calloc(Depth, sizeof(URING_SLOT));
+    Vectors = calloc(Depth, sizeof(struct iovec));
+    if ((Worker->Slots == NULL) || (Vectors == NULL)) {
+        ErrorExit(errno, "Failure allocating the io_uring engine\n");
+    }
+
+    //
+    // The pool was carved with Depth buffers for every thread. Its buffers
+    // are page aligned, so they can be registered with the ring.
+    //
+
+    for (Index = 0; Index < Depth; ++Index) {
+        Worker->Slots[Index].Buffer = TakePoolBuffer(BufferPool);
+        Vectors[Index].iov_base = Worker->Slots[Index].Buffer;
+        Vectors[Index].iov_len = BlockSize;
+    }
+
+    Worker->FixedBuffers = 0;
+    if (syscall(__NR_io_uring_register,
+                Worker->Ring.Fd,
+                IORING_REGISTER_BUFFERS,
+                Vectors,
+                Depth) == 0) {
+
+        Worker->FixedBuffers = 1;
+    }
+
+    free(Vectors);
+    return 0;
+}
+
+static
+void
+TeardownWorker(
+    URING_WORKER * Worker
+    )
+
+/*++
+
+Description:
+
+    This routine frees a thread's ring and slots.
+
+Arguments:
+
+    Worker - Supplies the thread's state.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    int Index;
+
+    TeardownRing(&Worker->Ring);
+    for (Index = 0; Index < Worker->Depth; ++Index) {
+        ReturnPoolBuffer(Worker->Engine->WorkerContext->BufferPool,
+                         Worker->Slots[Index].Buffer);
+    }
+
+    free(Worker->Slots);
+}
+
+int
+RunUringEngine(
+    WORKER_CONTEXT * WorkerContext
+    )
+
+/*++
+
+Description:
+
+    This routine runs the io_uring engine, if the kernel and the streams allow
+    it.
+
+Arguments:
+
+    WorkerContext - Supplies the context describing the streams, options, and
+        key.
+
+Return Value:
+
+    Returns zero (0) once the stream has been encrypted, non-zero on failure,
+    or ENGINE_NOT_APPLICABLE if the kernel doesn't provide io_uring, or the
+    streams don't allow positional I/O. Nothing has been done to either
+    stream in the last case.
+
+--*/
+
+{
+
+    size_t BufferCount;
+    int Depth;
+    POSITIONAL_ENGINE Engine;
+    int Index;
+    int Result;
+    int ThreadCount;
+    URING_WORKER * Workers;
+    pthread_t * WorkerThreads;
+
+    Result = OpenPositionalEngine(WorkerContext, &Engine);
+    if (Result != 0) {
+        return Result;
+    }
+
+    //
+    // Set up every ring before touching the streams, so that a kernel
+    // without io_uring leaves them as they were.
+    //
+
+    Depth = WorkerContext->Options->QueueDepth;
+    if (Depth == 0) {
+        Depth = URING_DEFAULT_DEPTH;
+    }
+
+    ThreadCount = WorkerContext->Options->ThreadCount;
+    BufferCount = (size_t)ThreadCount * Depth;
+    if (PrepareBufferPool(WorkerContext->BufferPool,
+                          WorkerContext->Options->BlockSize,
+                          &BufferCount,
+                          ThreadCount) != 0) {
+
+        FreePositionalEngine(&Engine);
+        return 1;
+    }
+
+    Depth = BufferCount / ThreadCount;
+    Workers = calloc(ThreadCount, sizeof(URING_WORKER));
+    WorkerThreads = calloc(ThreadCount, sizeof(pthread_t));
+    if ((Workers == NULL) || (WorkerThreads == NULL)) {
+        ErrorExit(errno, "Failure allocating thread array.\n");
+    }
+
+    for (Index = 0; Index < ThreadCount; ++Index) {
+        Workers[Index].Index = Index;
+        if (SetupWorker(&Workers[Index], &Engine, Depth) != 0) {
+            while (Index > 0) {
+                Index -= 1;
+                TeardownWorker(&Workers[Index]);
+            }
+
+            free(WorkerThreads);
+            free(Workers);
+            FreePositionalEngine(&Engine);
+            return ENGINE_NOT_APPLICABLE;
+        }
+    }
+
+    //
+    // Run N threads, including this one.
+    //
+
+    for (Index = 1; Index < ThreadCount; ++Index) {
+        Result = pthread_create(&WorkerThreads[Index],
+                                NULL,
+                                UringWorkerRoutine,
+                                &Workers[Index]);
+
+        if (Result != 0) {
+            ErrorExit(Result, "Failed creating thread\n");
+        }
+    }
+
+    UringWorkerRoutine(&Workers[0]);
+    for (Index = 1; Index < ThreadCount; ++Index) {
+        pthread_join(WorkerThreads[Index], NULL);
+    }
+
+    for (Index = 0; Index < ThreadCount; ++Index) {
+        TeardownWorker(&Workers[Index]);
+    }
+
+    free(WorkerThreads);
+    free(Workers);
+    ClosePositionalEngine(&Engine);
+    return 0;
+}
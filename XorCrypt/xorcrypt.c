@@ -0,0 +1,1555 @@
+/*++
+
+Description:
+
+    This module is libxorcrypt, the encryption core of XorCrypt, built as a
+    static and a shared library. It holds the key iteration, the key table,
+    and the XOR kernels that every engine encrypts with, and the public
+    interface in xorcrypt.h, which lets a program encrypt memory in process
+    rather than piping it through XorCrypt.
+
+    Nothing here touches a stream, prints, or exits, and there is no global
+    state: a context owns its key table, and the kernel is chosen by asking
+    the processor each time a table is built. The XorCrypt program links this
+    module's object rather than a library, and calls the internal interface
+    declared in homework.h directly, so that its engines can give each NUMA
+    node a key table of its own.
+
+    Only the xc_ routines and GenerateKeystream are exported from the
+    libraries.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XOR_KERNELS_X86
+#endif
+
+#include "homework.h"
+#include "xorcrypt.h"
+
+//
+// ----------------------------------------------------------------- Encryption
+//
+
+//
+// Keys are rotated as one big-endian bit string: bit 7 of byte 0 is the most
+// significant bit. These helpers move eight key bytes at a time in and out of
+// a 64-bit word in that order.
+//
+
+static
+unsigned long long
+LoadBigEndian64(
+    byte const * Bytes
+    )
+{
+    unsigned long long Word;
+
+    memcpy(&Word, Bytes, sizeof(Word));
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    Word = __builtin_bswap64(Word);
+#endif
+
+    return Word;
+}
+
+static
+void
+StoreBigEndian64(
+    byte * Bytes,
+    unsigned long long Word
+    )
+{
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    Word = __builtin_bswap64(Word);
+#endif
+
+    memcpy(Bytes, &Word, sizeof(Word));
+}
+
+static
+void
+ReverseBytes(
+    byte * Bytes,
+    size_t Length
+    )
+
+/*++
+
+Description:
+
+    This routine reverses the order of a run of bytes in place, swapping a
+    word from each end at a time.
+
+Arguments:
+
+    Bytes - Supplies the bytes to reverse.
+
+    Length - Supplies the number of bytes.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    size_t Back;
+    size_t Front;
+    unsigned long long FrontWord;
+    byte Swap;
+
+    Front = 0;
+    Back = Length;
+    while (Back - Front >= 2 * sizeof(FrontWord)) {
+        Back -= sizeof(FrontWord);
+        FrontWord = LoadBigEndian64(Bytes + Front);
+        StoreBigEndian64(Bytes + Front,
+                         __builtin_bswap64(LoadBigEndian64(Bytes + Back)));
+
+        StoreBigEndian64(Bytes + Back, __builtin_bswap64(FrontWord));
+        Front += sizeof(FrontWord);
+    }
+
+    while (Back - Front >= 2) {
+        Back -= 1;
+        Swap = Bytes[Front];
+        Bytes[Front] = Bytes[Back];
+        Bytes[Back] = Swap;
+        Front += 1;
+    }
+}
+
+static
+void
+ShiftKeyBits(
+    byte * Key,
+    size_t KeyLength,
+    int Shift
+    )
+
+/*++
+
+Description:
+
+    This routine rotates a key left by fewer than eight bits in place. It works
+    front to back a 64-bit word at a time, carrying in the top bits of the byte
+    after each word. That byte hasn't been shifted yet when it is read, so no
+    scratch copy of the key is needed beyond its first byte, which the last
+    byte wraps around to.
+
+Arguments:
+
+    Key - Supplies the key to rotate.
+
+    KeyLength - Supplies the length of the key.
+
+    Shift - Supplies the number of bits, zero to seven, to rotate the key.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    byte First;
+    size_t Index;
+
+    if (Shift == 0) {
+        return;
+    }
+
+    First = Key[0];
+    for (Index = 0; Index + 8 < KeyLength; Index += 8) {
+        StoreBigEndian64(Key + Index,
+                         (LoadBigEndian64(Key + Index) << Shift) |
+                         (Key[Index + 8] >> (8 - Shift)));
+    }
+
+    for (; Index + 1 < KeyLength; ++Index) {
+        Key[Index] = (Key[Index] << Shift) | (Key[Index + 1] >> (8 - Shift));
+    }
+
+    Key[Index] = (Key[Index] << Shift) | (First >> (8 - Shift));
+}
+
+int
+IterateKey(
+    byte * Key,
+    size_t KeyLength,
+    uint64_t Iteration
+    )
+    
+/*++
+
+Description:
+
+    This routine iterates a key a given number of times. A key is iterated by
+    rotating all of its bits to the left by one bit. This routine overwrites
+    the input key, and uses no working memory besides.
+    
+Arguments:
+
+    Key - Supplies the key.
+    
+    KeyLength - Supplies the length of the key.
+    
+    Iteration - Supplies the number of bits to rotate the key to the left.
+    
+Return Value:
+
+    Returns zero (0).
+    
+--*/
+
+{
+
+    size_t Shift;
+
+    //
+    // Do a byte-wise rotation of the key. Rotating left by Shift bytes is the
+    // same as reversing the first Shift bytes, reversing the rest, then
+    // reversing the whole key.
+    //
+
+    Shift = (Iteration / 8) % KeyLength;
+    if (Shift != 0) {
+        ReverseBytes(Key, Shift);
+        ReverseBytes(Key + Shift, KeyLength - Shift);
+        ReverseBytes(Key, KeyLength);
+    }
+
+    //
+    // Do the bit-wise rotation of the key.
+    //
+
+    ShiftKeyBits(Key, KeyLength, Iteration % 8);
+    return 0;
+}
+
+int
+IterateKeyInto(
+    byte * Destination,
+    byte const * Key,
+    size_t KeyLength,
+    uint64_t Iteration
+    )
+
+/*++
+
+Description:
+
+    This routine iterates a key a given number of times like IterateKey, but
+    writes the iterated key to a separate buffer and leaves the input key
+    untouched. This saves the caller copying the key before iterating it.
+
+Arguments:
+
+    Destination - Supplies the buffer that receives the iterated key. It must
+        be KeyLength bytes long and must not overlap the key.
+
+    Key - Supplies the key.
+
+    KeyLength - Supplies the length of the key.
+
+    Iteration - Supplies the number of bits to rotate the key to the left.
+
+Return Value:
+
+    Returns zero (0).
+
+--*/
+
+{
+
+    size_t Shift;
+
+    //
+    // The byte-wise rotation falls out of copying the key in two pieces.
+    //
+
+    Shift = (Iteration / 8) % KeyLength;
+    memcpy(Destination, Key + Shift, KeyLength - Shift);
+    memcpy(Destination + KeyLength - Shift, Key, Shift);
+    ShiftKeyBits(Destination, KeyLength, Iteration % 8);
+    return 0;
+}
+
+int
+BuildKeyTable(
+    byte const * Key,
+    size_t KeyLength,
+    KEY_TABLE * KeyTable
+    )
+
+/*++
+
+Description:
+
+    This routine expands a key into the table of its bit-rotated phases. Phase
+    p holds the key rotated left by p bits, stored twice back to back, so that
+    any byte rotation of the phase is a contiguous slice of it. Keys with a
+    short enough keystream period get a periodic key table instead, and keys
+    longer than KEY_TABLE_MAXIMUM get a direct key table.
+
+Arguments:
+
+    Key - Supplies the key. If the key is longer than KEY_TABLE_MAXIMUM, it
+        must outlive the table.
+
+    KeyLength - Supplies the length of the key.
+
+    KeyTable - Supplies a pointer to the table to initialize. The table must be
+        released with FreeKeyTable().
+
+Return Value:
+
+    Returns zero (0) on success, or ENOMEM if the table can't be allocated.
+
+--*/
+
+{
+
+    byte * Memory;
+    int Phase;
+    byte * PhaseKey;
+
+    //
+    // The period is 8 * KeyLength * KeyLength, which is compared without
+    // being computed, since it overflows for keys of a few gigabytes.
+    //
+
+    if (KeyLength <= KEYSTREAM_PERIOD_MAXIMUM / 8 / KeyLength) {
+        return BuildPeriodicKeyTable(Key, KeyLength, KeyTable);
+    }
+
+    if (KeyLength > KEY_TABLE_MAXIMUM) {
+        BuildDirectKeyTable(Key, KeyLength, KeyTable);
+        return 0;
+    }
+
+    Memory = malloc(KEY_PHASE_COUNT * 2 * KeyLength);
+    if (Memory == NULL) {
+        return ENOMEM;
+    }
+
+    KeyTable->KeyLength = KeyLength;
+    for (Phase = 0; Phase < KEY_PHASE_COUNT; ++Phase) {
+        PhaseKey = Memory + (Phase * 2 * KeyLength);
+        IterateKeyInto(PhaseKey, Key, KeyLength, Phase);
+        memcpy(PhaseKey + KeyLength, PhaseKey, KeyLength);
+        KeyTable->Phases[Phase] = PhaseKey;
+    }
+
+    KeyTable->Key = NULL;
+    KeyTable->Keystream = NULL;
+    KeyTable->Xor = SelectXorKernel()->Xor;
+    return 0;
+}
+
+int
+BuildPeriodicKeyTable(
+    byte const * Key,
+    size_t KeyLength,
+    KEY_TABLE * KeyTable
+    )
+
+/*++
+
+Description:
+
+    This routine initializes a periodic key table, which holds one period of
+    the keystream followed by enough whole periods to make up a window. Any
+    window's worth of key material, starting anywhere in the first period,
+    is then one contiguous run, and the XOR kernel streams it from the first
+    level cache.
+
+Arguments:
+
+    Key - Supplies the key.
+
+    KeyLength - Supplies the length of the key. Any length works, though the
+        table grows with the square of it.
+
+    KeyTable - Supplies a pointer to the table to initialize. The table must be
+        released with FreeKeyTable().
+
+Return Value:
+
+    Returns zero (0) on success, or ENOMEM if the table can't be allocated.
+
+--*/
+
+{
+
+    size_t Offset;
+    size_t Period;
+    size_t Window;
+
+    Period = 8 * KeyLength * KeyLength;
+    Window = Period;
+    while (Window < KEYSTREAM_WINDOW_MINIMUM) {
+        Window += Period;
+    }
+
+    memset(KeyTable, 0, sizeof(KEY_TABLE));
+    KeyTable->Keystream = malloc(Period + Window);
+    if (KeyTable->Keystream == NULL) {
+        return ENOMEM;
+    }
+
+    GenerateKeystream(Key, KeyLength, 0, KeyTable->Keystream, Period);
+    for (Offset = Period; Offset < Period + Window; Offset += Period) {
+        memcpy(KeyTable->Keystream + Offset, KeyTable->Keystream, Period);
+    }
+
+    KeyTable->KeyLength = KeyLength;
+    KeyTable->Period = Period;
+    KeyTable->Window = Window;
+    KeyTable->Xor = SelectXorKernel()->Xor;
+    return 0;
+}
+
+void
+BuildDirectKeyTable(
+    byte const * Key,
+    size_t KeyLength,
+    KEY_TABLE * KeyTable
+    )
+
+/*++
+
+Description:
+
+    This routine initializes a direct key table, which refers to the key
+    rather than expanding it. Building one costs nothing whatever the key's
+    length, and a key mapped from a file is shared by every thread without
+    being read until blocks need it.
+
+Arguments:
+
+    Key - Supplies the key, which must outlive the table.
+
+    KeyLength - Supplies the length of the key.
+
+    KeyTable - Supplies a pointer to the table to initialize. The table must be
+        released with FreeKeyTable().
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    memset(KeyTable, 0, sizeof(KEY_TABLE));
+    KeyTable->KeyLength = KeyLength;
+    KeyTable->Key = Key;
+    KeyTable->Xor = SelectXorKernel()->Xor;
+}
+
+void
+FreeKeyTable(
+    KEY_TABLE * KeyTable
+    )
+
+/*++
+
+Description:
+
+    This routine releases the memory held by a key table.
+
+Arguments:
+
+    KeyTable - Supplies the table to release.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    //
+    // All phases live in one allocation, starting with phase zero. Direct and
+    // periodic tables have none.
+    //
+
+    free(KeyTable->Phases[0]);
+    free(KeyTable->Keystream);
+    memset(KeyTable, 0, sizeof(KEY_TABLE));
+}
+
+static
+void
+RotateKeyRun(
+    byte * Output,
+    byte const * Key,
+    size_t KeyLength,
+    size_t Source,
+    int Shift,
+    size_t Count
+    )
+
+/*++
+
+Description:
+
+    This routine produces a run of one key iteration's material straight from
+    the key. Each output byte is a key byte shifted left and filled from the
+    byte after it, wrapping from the last byte of the key to the first. Away
+    from the wrap, sixteen or eight bytes are shifted at a time.
+
+Arguments:
+
+    Output - Supplies the buffer that receives the key material.
+
+    Key - Supplies the original key.
+
+    KeyLength - Supplies the length of the key.
+
+    Source - Supplies the index of the key byte that the run starts from.
+
+    Shift - Supplies the number of bits, one to seven, to shift by.
+
+    Count - Supplies the number of bytes to produce.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    size_t Index;
+    size_t Next;
+    size_t Words;
+
+#if defined(__SSE2__)
+
+    __m128i HighMask;
+    __m128i Lane;
+    __m128i LeftCount;
+    __m128i LowMask;
+    __m128i RightCount;
+
+    HighMask = _mm_set1_epi8((char)(0xff << Shift));
+    LowMask = _mm_set1_epi8((char)(0xff >> (8 - Shift)));
+    LeftCount = _mm_cvtsi32_si128(Shift);
+    RightCount = _mm_cvtsi32_si128(8 - Shift);
+
+#endif
+
+    Index = 0;
+    while (Index < Count) {
+
+        //
+        // Each word needs the key byte after it, so words run up to the last
+        // byte of the key.
+        //
+
+        Words = Count - Index;
+        if (Words > KeyLength - 1 - Source) {
+            Words = KeyLength - 1 - Source;
+        }
+
+#if defined(__SSE2__)
+
+        //
+        // Whole lanes of sixteen bytes are shifted as eight 16-bit lanes,
+        // masking off the bits that cross into the neighbouring byte.
+        //
+
+        for (; Words >= sizeof(Lane); Words -= sizeof(Lane)) {
+            Lane = _mm_or_si128(
+                _mm_and_si128(
+                    _mm_sll_epi16(
+                        _mm_loadu_si128((__m128i const *)(Key + Source)),
+                        LeftCount),
+                    HighMask),
+                _mm_and_si128(
+                    _mm_srl_epi16(
+                        _mm_loadu_si128((__m128i const *)(Key + Source + 1)),
+                        RightCount),
+                    LowMask));
+
+            _mm_storeu_si128((__m128i *)(Output + Index), Lane);
+            Index += sizeof(Lane);
+            Source += sizeof(Lane);
+        }
+
+#endif
+
+        for (Words /= 8; Words > 0; --Words) {
+            StoreBigEndian64(Output + Index,
+                             (LoadBigEndian64(Key + Source) << Shift) |
+                             (Key[Source + 8] >> (8 - Shift)));
+
+            Index += 8;
+            Source += 8;
+        }
+
+        if (Index < Count) {
+            Next = (Source + 1 == KeyLength) ? 0 : Source + 1;
+            Output[Index] = (Key[Source] << Shift) | (Key[Next] >> (8 - Shift));
+            Index += 1;
+            Source = Next;
+        }
+    }
+}
+
+static
+void
+EncryptDirect(
+    byte * Destination,
+    byte const * Source,
+    size_t BlockLength,
+    uint64_t BlockOffset,
+    KEY_TABLE const * KeyTable
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts a block with a direct key table. The key material
+    for the block is produced a chunk at a time into a buffer on the stack,
+    and XORed in with the table's kernel.
+
+Arguments:
+
+    Destination - Supplies the memory that receives the encrypted block.
+
+    Source - Supplies the block of memory to encrypt. It may be the same as
+        the destination, but may not otherwise overlap it.
+
+    BlockLength - Supplies the length of the block of memory.
+
+    BlockOffset - Offset of the block in the original stream.
+
+    KeyTable - Supplies the direct key table.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    size_t Count;
+    uint64_t Iteration;
+    size_t KeyIndex;
+    size_t KeyLength;
+    byte KeyMaterial[KEYSTREAM_CHUNK];
+    size_t Start;
+
+    KeyLength = KeyTable->KeyLength;
+    Iteration = BlockOffset / KeyLength;
+    KeyIndex = BlockOffset % KeyLength;
+    while (BlockLength > 0) {
+        Count = KeyLength - KeyIndex;
+        if (Count > BlockLength) {
+            Count = BlockLength;
+        }
+
+        if (Count > sizeof(KeyMaterial)) {
+            Count = sizeof(KeyMaterial);
+        }
+
+        //
+        // Byte j of K_i is byte j + (i / 8) of the key, shifted by i % 8.
+        // Unshifted material up to the end of the key is the key itself.
+        //
+
+        Start = (((Iteration / 8) % KeyLength) + KeyIndex) % KeyLength;
+        if ((Iteration % 8) == 0) {
+            if (Count > KeyLength - Start) {
+                Count = KeyLength - Start;
+            }
+
+            KeyTable->Xor(Destination, Source, KeyTable->Key + Start, Count);
+
+        } else {
+            RotateKeyRun(KeyMaterial,
+                         KeyTable->Key,
+                         KeyLength,
+                         Start,
+                         Iteration % 8,
+                         Count);
+
+            KeyTable->Xor(Destination, Source, KeyMaterial, Count);
+        }
+        Destination += Count;
+        Source += Count;
+        BlockLength -= Count;
+        KeyIndex += Count;
+        if (KeyIndex == KeyLength) {
+            Iteration += 1;
+            KeyIndex = 0;
+        }
+    }
+}
+
+static
+void
+EncryptPeriodic(
+    byte * Destination,
+    byte const * Source,
+    size_t BlockLength,
+    uint64_t BlockOffset,
+    KEY_TABLE const * KeyTable
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts a block with a periodic key table, a window at a
+    time. A window is whole periods long, so every window of the block starts
+    at the same place in the keystream.
+
+Arguments:
+
+    Destination - Supplies the memory that receives the encrypted block.
+
+    Source - Supplies the block of memory to encrypt. It may be the same as
+        the destination, but may not otherwise overlap it.
+
+    BlockLength - Supplies the length of the block of memory.
+
+    BlockOffset - Offset of the block in the original stream.
+
+    KeyTable - Supplies the periodic key table.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    size_t Count;
+    byte const * KeyMaterial;
+
+    KeyMaterial = KeyTable->Keystream + (BlockOffset % KeyTable->Period);
+    while (BlockLength > 0) {
+        Count = KeyTable->Window;
+        if (Count > BlockLength) {
+            Count = BlockLength;
+        }
+
+        KeyTable->Xor(Destination, Source, KeyMaterial, Count);
+        Destination += Count;
+        Source += Count;
+        BlockLength -= Count;
+    }
+}
+
+int
+Encrypt(
+    byte * Block,
+    size_t BlockLength,
+    uint64_t BlockOffset,
+    KEY_TABLE const * KeyTable
+    )
+    
+/*++
+    
+Description:
+
+    This routine encrypts a block of memory with a given key.
+    
+Parameters:
+
+    Block - Supplies the block of memory to encrypt.
+    
+    BlockLength - Supplies the length of the block of memory.
+    
+    BlockOffset - Offset of the block in the original stream.
+    
+    KeyTable - Supplies the expanded key with which the block is encrypted.
+        
+Return Value:
+
+    Returns zero (0) on success, or non-zero on failure.
+
+--*/
+
+{
+
+    return EncryptCopy(Block, Block, BlockLength, BlockOffset, KeyTable);
+}
+
+int
+EncryptCopy(
+    byte * Destination,
+    byte const * Source,
+    size_t BlockLength,
+    uint64_t BlockOffset,
+    KEY_TABLE const * KeyTable
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts a block of memory with a given key, writing the
+    result to another block. This spares a copy when the source can't be
+    encrypted in place, as when it is a read-only file mapping.
+
+Parameters:
+
+    Destination - Supplies the memory that receives the encrypted block.
+
+    Source - Supplies the block of memory to encrypt. It may be the same as
+        the destination, but may not otherwise overlap it.
+
+    BlockLength - Supplies the length of the block of memory.
+
+    BlockOffset - Offset of the block in the original stream.
+
+    KeyTable - Supplies the expanded key with which the block is encrypted.
+
+Return Value:
+
+    Returns zero (0) on success, or non-zero on failure.
+
+--*/
+
+{
+    size_t Count;
+    uint64_t Iteration;
+    byte const * IterationKey;
+    size_t KeyIndex;
+    size_t KeyLength;
+
+    //
+    // Calculate the first key iteration to overlap the start of this block,
+    // and the offset into that iteration.
+    //
+
+    if (KeyTable->Keystream != NULL) {
+        EncryptPeriodic(Destination,
+                        Source,
+                        BlockLength,
+                        BlockOffset,
+                        KeyTable);
+
+        return 0;
+    }
+
+    if (KeyTable->Phases[0] == NULL) {
+        EncryptDirect(Destination, Source, BlockLength, BlockOffset, KeyTable);
+        return 0;
+    }
+
+    KeyLength = KeyTable->KeyLength;
+    Iteration = BlockOffset / KeyLength;
+    KeyIndex = BlockOffset % KeyLength;
+
+    //
+    // Encrypt one key iteration at a time. Each iteration is a contiguous
+    // slice of the key table.
+    //
+
+    while (BlockLength > 0) {
+        IterationKey = KeyTable->Phases[Iteration % KEY_PHASE_COUNT] +
+                       ((Iteration / KEY_PHASE_COUNT) % KeyLength);
+
+        Count = KeyLength - KeyIndex;
+        if (Count > BlockLength) {
+            Count = BlockLength;
+        }
+
+        KeyTable->Xor(Destination, Source, IterationKey + KeyIndex, Count);
+        Destination += Count;
+        Source += Count;
+        BlockLength -= Count;
+        Iteration += 1;
+        KeyIndex = 0;
+    }
+
+    return 0;
+}
+
+XC_API
+void
+GenerateKeystream(
+    byte const * Key,
+    size_t KeyLength,
+    uint64_t Offset,
+    byte * Output,
+    size_t Length
+    )
+
+/*++
+
+Description:
+
+    This routine produces the key material used to encrypt a range of a stream,
+    starting at an arbitrary offset. It needs nothing but the original key:
+    byte j of iteration K_i is made of the bits of two adjacent bytes of the
+    key, picked by the bit rotation i. XORing a block with the keystream at the
+    block's offset encrypts or decrypts it.
+
+Arguments:
+
+    Key - Supplies the original key.
+
+    KeyLength - Supplies the length of the key.
+
+    Offset - Supplies the stream offset of the first keystream byte.
+
+    Output - Supplies the buffer that receives the keystream.
+
+    Length - Supplies the number of keystream bytes to produce.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    size_t Index;
+    uint64_t Iteration;
+    size_t KeyIndex;
+    size_t Next;
+    int Shift;
+    size_t Source;
+
+    Iteration = Offset / KeyLength;
+    KeyIndex = Offset % KeyLength;
+    for (Index = 0; Index < Length; ++Index) {
+
+        //
+        // K_ij is byte j + (i / 8) of the key, shifted left by i % 8 bits and
+        // filled from the byte after it.
+        //
+
+        Shift = Iteration % 8;
+        Source = ((Iteration / 8) + KeyIndex) % KeyLength;
+        Next = (Source + 1 == KeyLength) ? 0 : Source + 1;
+        Output[Index] = (Key[Source] << Shift) | (Key[Next] >> (8 - Shift));
+
+        KeyIndex += 1;
+        if (KeyIndex == KeyLength) {
+            KeyIndex = 0;
+            Iteration += 1;
+        }
+    }
+}
+
+//
+// ---------------------------------------------------------------- XOR Kernels
+//
+
+static
+void
+XorScalar(
+    byte * Destination,
+    byte const * Source,
+    byte const * KeyMaterial,
+    size_t Length
+    )
+
+/*++
+
+Description:
+
+    This routine XORs a run of source bytes with a run of key material one byte
+    at a time. It is the portable fallback for the vector kernels below, and
+    finishes the tails the vector kernels leave behind.
+
+Arguments:
+
+    Destination - Supplies the memory that receives the result.
+
+    Source - Supplies the bytes to encrypt. This may be the destination, to
+        encrypt in place.
+
+    KeyMaterial - Supplies the key material to combine with the source.
+
+    Length - Supplies the number of bytes to encrypt.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    size_t Index;
+
+    for (Index = 0; Index < Length; ++Index) {
+        Destination[Index] = Source[Index] ^ KeyMaterial[Index];
+    }
+}
+
+static
+int
+IsScalarSupported(
+    void
+    )
+{
+    return 1;
+}
+
+#if defined(XOR_KERNELS_X86)
+
+//
+// The vector kernels below XOR whole 16, 32, or 64 byte lanes with unaligned
+// loads and stores, then hand the remainder to the scalar kernel. Each one is
+// compiled for its own instruction set so the rest of the program doesn't
+// require it.
+//
+
+static
+void
+XorSse2(
+    byte * Destination,
+    byte const * Source,
+    byte const * KeyMaterial,
+    size_t Length
+    )
+{
+    size_t Index;
+    __m128i Lane;
+
+    for (Index = 0; Index + sizeof(Lane) <= Length; Index += sizeof(Lane)) {
+        Lane = _mm_xor_si128(_mm_loadu_si128((__m128i const *)(Source + Index)),
+                             _mm_loadu_si128((__m128i const *)
+                                             (KeyMaterial + Index)));
+
+        _mm_storeu_si128((__m128i *)(Destination + Index), Lane);
+    }
+
+    XorScalar(Destination + Index,
+              Source + Index,
+              KeyMaterial + Index,
+              Length - Index);
+}
+
+static
+int
+IsSse2Supported(
+    void
+    )
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static
+__attribute__((target("avx2")))
+void
+XorAvx2(
+    byte * Destination,
+    byte const * Source,
+    byte const * KeyMaterial,
+    size_t Length
+    )
+{
+    size_t Index;
+    __m256i Lane;
+
+    for (Index = 0; Index + sizeof(Lane) <= Length; Index += sizeof(Lane)) {
+        Lane = _mm256_xor_si256(
+                    _mm256_loadu_si256((__m256i const *)(Source + Index)),
+                    _mm256_loadu_si256((__m256i const *)(KeyMaterial + Index)));
+
+        _mm256_storeu_si256((__m256i *)(Destination + Index), Lane);
+    }
+
+    XorScalar(Destination + Index,
+              Source + Index,
+              KeyMaterial + Index,
+              Length - Index);
+}
+
+static
+int
+IsAvx2Supported(
+    void
+    )
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static
+__attribute__((target("avx512f")))
+void
+XorAvx512(
+    byte * Destination,
+    byte const * Source,
+    byte const * KeyMaterial,
+    size_t Length
+    )
+{
+    size_t Index;
+    __m512i Lane;
+
+    for (Index = 0; Index + sizeof(Lane) <= Length; Index += sizeof(Lane)) {
+        Lane = _mm512_xor_si512(_mm512_loadu_si512(Source + Index),
+                                _mm512_loadu_si512(KeyMaterial + Index));
+
+        _mm512_storeu_si512(Destination + Index, Lane);
+    }
+
+    XorScalar(Destination + Index,
+              Source + Index,
+              KeyMaterial + Index,
+              Length - Index);
+}
+
+static
+int
+IsAvx512Supported(
+    void
+    )
+{
+    return __builtin_cpu_supports("avx512f");
+}
+
+#endif
+
+XOR_KERNEL const XorKernels[] = {
+
+#if defined(XOR_KERNELS_X86)
+
+    {"avx512", IsAvx512Supported, XorAvx512},
+    {"avx2", IsAvx2Supported, XorAvx2},
+    {"sse2", IsSse2Supported, XorSse2},
+
+#endif
+
+    {"scalar", IsScalarSupported, XorScalar}
+};
+
+int const XorKernelCount = sizeof(XorKernels) / sizeof(XorKernels[0]);
+
+XOR_KERNEL const *
+SelectXorKernel(
+    void
+    )
+
+/*++
+
+Description:
+
+    This routine selects the most preferred XOR kernel supported by the
+    processor.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Returns the selected kernel. The scalar kernel is always available.
+
+--*/
+
+{
+
+    int Index;
+
+    for (Index = 0; Index < XorKernelCount - 1; ++Index) {
+        if (XorKernels[Index].IsSupported() != 0) {
+            break;
+        }
+    }
+
+    return &XorKernels[Index];
+}
+
+//
+// ---------------------------------------------------------- Library Interface
+//
+
+//
+// A context keeps its own copy of the key, after the context itself, which
+// a direct key table refers to.
+//
+
+struct xc_ctx {
+    KEY_TABLE KeyTable;
+    uint64_t Offset;
+    byte Key[];
+};
+
+//
+// xc_process_buffer splits a buffer into slices no shorter than this, so that
+// every thread it starts has enough work to pay for starting it. Slices are
+// whole cache lines, so no two threads write to the same line.
+//
+
+#define SLICE_MINIMUM (256 * 1024)
+#define SLICE_ALIGNMENT 64
+
+typedef struct _BUFFER_SLICE {
+    KEY_TABLE const * KeyTable;
+    byte * Destination;
+    byte const * Source;
+    size_t Length;
+    uint64_t Offset;
+    pthread_t Thread;
+    int Started;
+} BUFFER_SLICE;
+
+XC_API
+xc_ctx *
+xc_init(
+    void const * Key,
+    size_t KeyLength
+    )
+
+/*++
+
+Description:
+
+    This routine creates a context for a key, positioned at the start of the
+    stream.
+
+Arguments:
+
+    Key - Supplies the key. It is copied into the context, and need not
+        outlive the call.
+
+    KeyLength - Supplies the length of the key, which must be at least one.
+
+Return Value:
+
+    Returns the context, which must be released with xc_free(), or NULL with
+    errno set to EINVAL or ENOMEM on failure.
+
+--*/
+
+{
+
+    xc_ctx * Context;
+    int Result;
+
+    if ((Key == NULL) || (KeyLength == 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    Context = malloc(sizeof(xc_ctx) + KeyLength);
+    if (Context == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memcpy(Context->Key, Key, KeyLength);
+    Result = BuildKeyTable(Context->Key, KeyLength, &Context->KeyTable);
+    if (Result != 0) {
+        free(Context);
+        errno = Result;
+        return NULL;
+    }
+
+    Context->Offset = 0;
+    return Context;
+}
+
+XC_API
+void
+xc_free(
+    xc_ctx * Context
+    )
+
+/*++
+
+Description:
+
+    This routine releases a context.
+
+Arguments:
+
+    Context - Supplies the context, or NULL.
+
+Return Value:
+
+    None.
+
+--*/
+
+{
+
+    if (Context != NULL) {
+        FreeKeyTable(&Context->KeyTable);
+        free(Context);
+    }
+}
+
+XC_API
+int
+xc_update(
+    xc_ctx * Context,
+    void const * Input,
+    void * Output,
+    size_t Length
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts the next bytes of a context's stream, and advances
+    the context past them. A stream fed through in pieces of any size comes
+    out the same as if it were encrypted whole.
+
+Arguments:
+
+    Context - Supplies the context.
+
+    Input - Supplies the bytes to encrypt.
+
+    Output - Supplies the memory that receives the encrypted bytes. It may be
+        the input, but may not otherwise overlap it.
+
+    Length - Supplies the number of bytes to encrypt.
+
+Return Value:
+
+    Returns zero (0).
+
+--*/
+
+{
+
+    EncryptCopy(Output, Input, Length, Context->Offset, &Context->KeyTable);
+    Context->Offset += Length;
+    return 0;
+}
+
+XC_API
+int
+xc_seek(
+    xc_ctx * Context,
+    uint64_t Offset
+    )
+
+/*++
+
+Description:
+
+    This routine moves a context to another offset in its stream. The key
+    material at any offset is a slice of the key table, so seeking costs
+    nothing.
+
+Arguments:
+
+    Context - Supplies the context.
+
+    Offset - Supplies the stream offset of the next byte to encrypt.
+
+Return Value:
+
+    Returns zero (0).
+
+--*/
+
+{
+
+    Context->Offset = Offset;
+    return 0;
+}
+
+XC_API
+uint64_t
+xc_tell(
+    xc_ctx const * Context
+    )
+
+/*++
+
+Description:
+
+    This routine returns a context's position in its stream.
+
+Arguments:
+
+    Context - Supplies the context.
+
+Return Value:
+
+    Returns the stream offset of the next byte to encrypt.
+
+--*/
+
+{
+
+    return Context->Offset;
+}
+
+static
+void *
+EncryptSlice(
+    void * Context
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts one slice of a buffer for xc_process_buffer.
+
+Arguments:
+
+    Context - Supplies the slice.
+
+Return Value:
+
+    NULL.
+
+--*/
+
+{
+
+    BUFFER_SLICE * Slice;
+
+    Slice = (BUFFER_SLICE *)Context;
+    EncryptCopy(Slice->Destination,
+                Slice->Source,
+                Slice->Length,
+                Slice->Offset,
+                Slice->KeyTable);
+
+    return NULL;
+}
+
+XC_API
+int
+xc_process_buffer(
+    xc_ctx const * Context,
+    void const * Input,
+    void * Output,
+    size_t Length,
+    uint64_t Offset,
+    unsigned int ThreadCount
+    )
+
+/*++
+
+Description:
+
+    This routine encrypts a buffer found at a given stream offset, splitting
+    it among several threads. The calling thread encrypts the first slice
+    while the threads it starts encrypt the rest. A slice whose thread can't
+    be started is encrypted by the calling thread too, so the routine only
+    runs short of threads, never fails.
+
+    The context is only read, so any number of threads may call this routine
+    on the same context at once.
+
+Arguments:
+
+    Context - Supplies the context. Its position is neither used nor moved.
+
+    Input - Supplies the bytes to encrypt.
+
+    Output - Supplies the memory that receives the encrypted bytes. It may be
+        the input, but may not otherwise overlap it.
+
+    Length - Supplies the number of bytes to encrypt.
+
+    Offset - Supplies the stream offset of the first byte.
+
+    ThreadCount - Supplies the most threads to use, including the calling
+        thread, or zero (0) for one per online processor.
+
+Return Value:
+
+    Returns zero (0).
+
+--*/
+
+{
+
+    size_t Index;
+    long Online;
+    size_t SliceCount;
+    size_t SliceLength;
+    BUFFER_SLICE * Slices;
+    size_t Start;
+
+    if (ThreadCount == 0) {
+        Online = sysconf(_SC_NPROCESSORS_ONLN);
+        ThreadCount = (Online > 0) ? Online : 1;
+    }
+
+    SliceCount = Length / SLICE_MINIMUM;
+    if (SliceCount > ThreadCount) {
+        SliceCount = ThreadCount;
+    }
+
+    Slices = NULL;
+    if (SliceCount > 1) {
+        Slices = calloc(SliceCount, sizeof(BUFFER_SLICE));
+    }
+
+    if (Slices == NULL) {
+        EncryptCopy(Output, Input, Length, Offset, &Context->KeyTable);
+        return 0;
+    }
+
+    SliceLength = (Length / SliceCount) & ~(size_t)(SLICE_ALIGNMENT - 1);
+    for (Index = 0; Index < SliceCount; ++Index) {
+        Start = Index * SliceLength;
+        Slices[Index].KeyTable = &Context->KeyTable;
+        Slices[Index].Destination = (byte *)Output + Start;
+        Slices[Index].Source = (byte const *)Input + Start;
+        Slices[Index].Length = SliceLength;
+        Slices[Index].Offset = Offset + Start;
+        if (Index + 1 == SliceCount) {
+            Slices[Index].Length = Length - Start;
+        }
+
+        if ((Index != 0) &&
+            (pthread_create(&Slices[Index].Thread,
+                            NULL,
+                            EncryptSlice,
+                            &Slices[Index]) == 0)) {
+
+            Slices[Index].Started = 1;
+        }
+    }
+
+    for (Index = 0; Index < SliceCount; ++Index) {
+        if (Slices[Index].Started == 0) {
+            EncryptSlice(&Slices[Index]);
+        }
+    }
+
+    for (Index = 1; Index < SliceCount; ++Index) {
+        if (Slices[Index].Started != 0) {
+            pthread_join(Slices[Index].Thread, NULL);
+        }
+    }
+
+    free(Slices);
+    return 0;
+}
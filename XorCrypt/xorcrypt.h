@@ -0,0 +1,120 @@
+/*
+    XorCrypt.h
+
+    The public interface of libxorcrypt, which encrypts and decrypts memory
+    with the XorCrypt algorithm. Encryption and decryption are the same
+    operation.
+
+    A context holds one key, expanded once, and a stream position. xc_update
+    encrypts the next bytes of the stream and advances the position, so a
+    stream may be fed in pieces of any size; xc_seek moves the position
+    anywhere in the stream in constant time. A context carries a position, so
+    only one thread may update or seek it at a time. xc_process_buffer leaves
+    the position alone, and any number of threads may call it on one context
+    at once. Distinct contexts share nothing, and the library has no global
+    state.
+
+    Functions that return int return zero (0) on success, or an errno value on
+    failure.
+*/
+
+#ifndef XORCRYPT_H
+#define XORCRYPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define XC_API __attribute__((visibility("default")))
+#else
+#define XC_API
+#endif
+
+typedef struct xc_ctx xc_ctx;
+
+//
+// Creates a context for a key of one or more bytes, positioned at the start
+// of the stream. The key is copied. Returns NULL, with errno set, on failure.
+//
+
+XC_API
+xc_ctx *
+xc_init(
+    void const * Key,
+    size_t KeyLength
+    );
+
+//
+// Releases a context.
+//
+
+XC_API
+void
+xc_free(
+    xc_ctx * Context
+    );
+
+//
+// Encrypts the next Length bytes of the stream from Input to Output, and
+// advances the position past them. The buffers may be the same, but may not
+// otherwise overlap.
+//
+
+XC_API
+int
+xc_update(
+    xc_ctx * Context,
+    void const * Input,
+    void * Output,
+    size_t Length
+    );
+
+//
+// Moves the position to the given stream offset.
+//
+
+XC_API
+int
+xc_seek(
+    xc_ctx * Context,
+    uint64_t Offset
+    );
+
+//
+// Returns the current position.
+//
+
+XC_API
+uint64_t
+xc_tell(
+    xc_ctx const * Context
+    );
+
+//
+// Encrypts Length bytes found at the given stream offset from Input to
+// Output, split among up to ThreadCount threads, or one per online processor
+// if it is zero. Buffers too small to be worth splitting are encrypted on the
+// calling thread. The buffers may be the same, but may not otherwise
+// overlap.
+//
+
+XC_API
+int
+xc_process_buffer(
+    xc_ctx const * Context,
+    void const * Input,
+    void * Output,
+    size_t Length,
+    uint64_t Offset,
+    unsigned int ThreadCount
+    );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif